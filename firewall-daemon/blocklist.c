@@ -0,0 +1,250 @@
+/*
+ * iptracking
+ * blocklist.c
+ *
+ * In-memory copy of a firewall block list.
+ *
+ */
+
+#include "blocklist.h"
+
+#include <stddef.h>
+#include <arpa/inet.h>
+
+//
+
+#define BLOCKLIST_CAPACITY_DELTA    1024
+
+/* Entries are ordered and matched on the leading fields only: */
+#define BLOCKLIST_ENTRY_KEY_LEN     (offsetof(blocklist_entry_t, addr) + sizeof(((blocklist_entry_t*)0)->addr))
+
+//
+
+static void
+__blocklist_entry_mask(
+    blocklist_entry_t   *entry
+)
+{
+    int                 n_bytes = (entry->family == 6) ? 16 : 4;
+    int                 i = entry->prefix_len / 8;
+    
+    if ( i < n_bytes ) {
+        if ( entry->prefix_len % 8 ) entry->addr[i++] &= (uint8_t)(0xFF << (8 - entry->prefix_len % 8));
+        memset(&entry->addr[i], 0, 16 - i);
+    }
+}
+
+//
+
+bool
+blocklist_entry_parse(
+    blocklist_entry_t   *entry,
+    const char          *ip_entity
+)
+{
+    char                addr_str[INET6_ADDRSTRLEN];
+    const char          *slash = strchr(ip_entity, '/');
+    size_t              addr_len = slash ? (size_t)(slash - ip_entity) : strlen(ip_entity);
+    int                 max_prefix_len;
+    
+    if ( addr_len == 0 || addr_len >= sizeof(addr_str) ) return false;
+    memcpy(addr_str, ip_entity, addr_len); addr_str[addr_len] = '\0';
+    memset(entry, 0, sizeof(*entry));
+    if ( inet_pton(AF_INET, addr_str, entry->addr) == 1 ) {
+        entry->family = 4;
+        max_prefix_len = 32;
+    } else if ( inet_pton(AF_INET6, addr_str, entry->addr) == 1 ) {
+        entry->family = 6;
+        max_prefix_len = 128;
+    } else {
+        return false;
+    }
+    if ( slash ) {
+        char            *endptr;
+        long            v = strtol(slash + 1, &endptr, 10);
+        
+        if ( (endptr == slash + 1) || *endptr || (v < 0) || (v > max_prefix_len) ) return false;
+        entry->prefix_len = v;
+    } else {
+        entry->prefix_len = max_prefix_len;
+    }
+    __blocklist_entry_mask(entry);
+    return true;
+}
+
+//
+
+const char*
+blocklist_entry_to_str(
+    const blocklist_entry_t *entry,
+    char                    *buffer
+)
+{
+    int                     af = (entry->family == 6) ? AF_INET6 : AF_INET;
+    int                     max_prefix_len = (entry->family == 6) ? 128 : 32;
+    
+    if ( ! inet_ntop(af, entry->addr, buffer, INET6_ADDRSTRLEN) ) {
+        *buffer = '\0';
+    } else if ( entry->prefix_len < max_prefix_len ) {
+        sprintf(buffer + strlen(buffer), "/%d", (int)entry->prefix_len);
+    }
+    return buffer;
+}
+
+//
+
+void
+blocklist_init(
+    blocklist_t *blocklist
+)
+{
+    blocklist->entries = NULL;
+    blocklist->n_entries = blocklist->capacity = 0;
+}
+
+//
+
+void
+blocklist_fini(
+    blocklist_t *blocklist
+)
+{
+    if ( blocklist->entries ) free((void*)blocklist->entries);
+    blocklist_init(blocklist);
+}
+
+//
+
+bool
+blocklist_push(
+    blocklist_t             *blocklist,
+    const blocklist_entry_t *entry
+)
+{
+    if ( blocklist->n_entries == blocklist->capacity ) {
+        size_t              new_capacity = blocklist->capacity + BLOCKLIST_CAPACITY_DELTA;
+        blocklist_entry_t   *new_entries = (blocklist_entry_t*)realloc(blocklist->entries, new_capacity * sizeof(blocklist_entry_t));
+        
+        if ( ! new_entries ) return false;
+        blocklist->entries = new_entries;
+        blocklist->capacity = new_capacity;
+    }
+    blocklist->entries[blocklist->n_entries++] = *entry;
+    return true;
+}
+
+//
+
+static int
+__blocklist_entry_cmp(
+    const void  *a,
+    const void  *b
+)
+{
+    return memcmp(a, b, BLOCKLIST_ENTRY_KEY_LEN);
+}
+
+//
+
+static bool
+__blocklist_entry_expires_later(
+    const blocklist_entry_t *a,
+    const blocklist_entry_t *b
+)
+{
+    if ( a->expires == 0 ) return (b->expires != 0);
+    return (b->expires != 0) && (a->expires > b->expires);
+}
+
+//
+
+void
+blocklist_finalize(
+    blocklist_t *blocklist
+)
+{
+    size_t      i, j;
+    
+    if ( blocklist->n_entries < 2 ) return;
+    qsort(blocklist->entries, blocklist->n_entries, sizeof(blocklist_entry_t), __blocklist_entry_cmp);
+    for ( i = 1, j = 0; i < blocklist->n_entries; i++ ) {
+        if ( __blocklist_entry_cmp(&blocklist->entries[j], &blocklist->entries[i]) ) {
+            blocklist->entries[++j] = blocklist->entries[i];
+        } else if ( __blocklist_entry_expires_later(&blocklist->entries[i], &blocklist->entries[j]) ) {
+            blocklist->entries[j].expires = blocklist->entries[i].expires;
+        }
+    }
+    blocklist->n_entries = j + 1;
+}
+
+//
+
+void
+blocklist_move(
+    blocklist_t *dst,
+    blocklist_t *src
+)
+{
+    blocklist_fini(dst);
+    *dst = *src;
+    blocklist_init(src);
+}
+
+//
+
+void
+blocklist_diff(
+    const blocklist_t       *from,
+    const blocklist_t       *to,
+    blocklist_diff_callback callback,
+    void                    *context,
+    blocklist_diff_counts_t *counts
+)
+{
+    size_t                  i = 0, j = 0;
+    
+    memset(counts, 0, sizeof(*counts));
+    
+    /* Removals first, so a set near its element limit has room for the
+     * additions: */
+    while ( i < from->n_entries ) {
+        int                 cmp = (j < to->n_entries) ? __blocklist_entry_cmp(&from->entries[i], &to->entries[j]) : -1;
+        
+        if ( cmp < 0 ) {
+            if ( callback(context, &from->entries[i], false) ) {
+                counts->n_removed++;
+            } else {
+                counts->n_failed++;
+            }
+            i++;
+        } else {
+            if ( cmp == 0 ) i++;
+            j++;
+        }
+    }
+    i = j = 0;
+    while ( j < to->n_entries ) {
+        int                 cmp = (i < from->n_entries) ? __blocklist_entry_cmp(&from->entries[i], &to->entries[j]) : 1;
+        
+        if ( cmp > 0 ) {
+            if ( callback(context, &to->entries[j], true) ) {
+                counts->n_added++;
+            } else {
+                counts->n_failed++;
+            }
+            j++;
+        } else {
+            if ( cmp == 0 ) {
+                if ( from->entries[i].expires != to->entries[j].expires ) {
+                    if ( callback(context, &to->entries[j], true) ) {
+                        counts->n_updated++;
+                    } else {
+                        counts->n_failed++;
+                    }
+                }
+                j++;
+            }
+            i++;
+        }
+    }
+}
@@ -0,0 +1,150 @@
+/*
+ * iptracking
+ * blocklist.h
+ *
+ * In-memory copy of a firewall block list.
+ *
+ */
+
+#ifndef __BLOCKLIST_H__
+#define __BLOCKLIST_H__
+
+#include "iptracking.h"
+
+/*!
+ * @defined BLOCKLIST_ENTITY_STRLEN
+ *
+ * Characters needed to hold the textual form of any blocklist_entry_t
+ * (an IPv6 address, a slash, a three-digit prefix, and the NUL).
+ */
+#define BLOCKLIST_ENTITY_STRLEN 50
+
+/*!
+ * @typedef blocklist_entry_t
+ *
+ * A single subnet/address in binary form.  The bits of <addr> beyond
+ * <prefix_len> are always zero, so two entries describing the same
+ * subnet have identical <family>, <prefix_len>, and <addr> fields (the
+ * entry's key).
+ *
+ * @field family        4 for IPv4, 6 for IPv6
+ * @field prefix_len    number of significant bits in <addr>
+ * @field addr          the address in network byte order (IPv4 uses
+ *                      the first four bytes)
+ * @field expires       time at which the block ends, or zero if it
+ *                      does not
+ */
+typedef struct {
+    uint8_t     family;
+    uint8_t     prefix_len;
+    uint8_t     addr[16];
+    time_t      expires;
+} blocklist_entry_t;
+
+/*!
+ * @typedef blocklist_t
+ *
+ * A set of entries kept as a sorted array without duplicates (once
+ * blocklist_finalize() has been called).
+ */
+typedef struct {
+    blocklist_entry_t   *entries;
+    size_t              n_entries;
+    size_t              capacity;
+} blocklist_t;
+
+/*!
+ * @function blocklist_entry_parse
+ *
+ * Parse the C string <ip_entity> (an IPv4 or IPv6 address with an
+ * optional /prefix) into <entry>.  Returns true if successful.
+ */
+bool blocklist_entry_parse(blocklist_entry_t *entry, const char *ip_entity);
+
+/*!
+ * @function blocklist_entry_to_str
+ *
+ * Write the textual form of <entry> to <buffer>, which must hold at
+ * least BLOCKLIST_ENTITY_STRLEN characters.  The prefix is omitted for
+ * a single address.  Returns <buffer>.
+ */
+const char* blocklist_entry_to_str(const blocklist_entry_t *entry, char *buffer);
+
+/*!
+ * @function blocklist_init
+ *
+ * Initialize <blocklist> as an empty set.
+ */
+void blocklist_init(blocklist_t *blocklist);
+
+/*!
+ * @function blocklist_fini
+ *
+ * Release the resources held by <blocklist>, leaving it empty.
+ */
+void blocklist_fini(blocklist_t *blocklist);
+
+/*!
+ * @function blocklist_push
+ *
+ * Append <entry> to <blocklist>; blocklist_finalize() must be called
+ * once all entries have been pushed.  Returns false if no memory was
+ * available.
+ */
+bool blocklist_push(blocklist_t *blocklist, const blocklist_entry_t *entry);
+
+/*!
+ * @function blocklist_finalize
+ *
+ * Sort the entries of <blocklist> by key and drop any duplicates; of
+ * two entries with the same key, the one that expires last is kept.
+ */
+void blocklist_finalize(blocklist_t *blocklist);
+
+/*!
+ * @function blocklist_move
+ *
+ * Replace the contents of <dst> with those of <src> (which is left
+ * empty).
+ */
+void blocklist_move(blocklist_t *dst, blocklist_t *src);
+
+/*!
+ * @typedef blocklist_diff_callback
+ *
+ * Called by blocklist_diff() for each <entry> that must be added or
+ * updated (<is_added> true) or removed (<is_added> false); <context> is the
+ * pointer passed to blocklist_diff().  Returns false if the change
+ * could not be made.
+ */
+typedef bool (*blocklist_diff_callback)(void *context, const blocklist_entry_t *entry, bool is_added);
+
+/*!
+ * @typedef blocklist_diff_counts_t
+ *
+ * Tallies of the work done by blocklist_diff().
+ *
+ * @field n_added       number of entries added
+ * @field n_updated     number of entries whose expiry changed
+ * @field n_removed     number of entries removed
+ * @field n_failed      number of changes the callback could not make
+ */
+typedef struct {
+    size_t      n_added;
+    size_t      n_updated;
+    size_t      n_removed;
+    size_t      n_failed;
+} blocklist_diff_counts_t;
+
+/*!
+ * @function blocklist_diff
+ *
+ * Walk the finalized sets <from> and <to> together, calling <callback>
+ * for each entry that is only in <to> (to be added), in both with a
+ * different expiry (to be updated, reported as an addition), or only in
+ * <from> (to be removed).  Removals are reported before additions.  The
+ * outcome is tallied in *<counts>.
+ */
+void blocklist_diff(const blocklist_t *from, const blocklist_t *to, blocklist_diff_callback callback, void *context, blocklist_diff_counts_t *counts);
+
+#endif /* __BLOCKLIST_H__ */
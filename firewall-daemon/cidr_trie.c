@@ -0,0 +1,329 @@
+/*
+ * iptracking
+ * cidr_trie.c
+ *
+ * Compressed radix trie of subnets/addresses used to reduce a block
+ * list to the fewest equivalent entries.
+ *
+ */
+
+#include "cidr_trie.h"
+
+//
+
+#define CIDR_TRIE_SLAB_NODES    4096
+
+typedef struct cidr_trie_slab {
+    struct cidr_trie_slab   *next;
+    cidr_trie_node_t        nodes[CIDR_TRIE_SLAB_NODES];
+} cidr_trie_slab_t;
+
+//
+
+static inline int
+__cidr_trie_bit(
+    const uint8_t   *addr,
+    int             i
+)
+{
+    return (addr[i / 8] >> (7 - (i % 8))) & 1;
+}
+
+//
+
+/*
+ * Number of leading bits (at most <max_len>) that <a> and <b> share.
+ */
+static int
+__cidr_trie_common_len(
+    const uint8_t   *a,
+    const uint8_t   *b,
+    int             max_len
+)
+{
+    int             i = 0;
+    
+    while ( i < max_len ) {
+        uint8_t     x = a[i / 8] ^ b[i / 8];
+        
+        if ( x ) {
+            i += __builtin_clz((unsigned int)x) - (8 * (sizeof(unsigned int) - 1));
+            break;
+        }
+        i += 8;
+    }
+    return (i < max_len) ? i : max_len;
+}
+
+//
+
+/*
+ * True if a block ending at <a> lasts at least as long as one ending
+ * at <b> (zero meaning never).
+ */
+static inline bool
+__cidr_trie_expires_ge(
+    time_t      a,
+    time_t      b
+)
+{
+    if ( a == 0 ) return true;
+    return (b != 0) && (a >= b);
+}
+
+//
+
+static cidr_trie_node_t*
+__cidr_trie_node_alloc(
+    cidr_trie_t     *trie
+)
+{
+    cidr_trie_slab_t    *slab = (cidr_trie_slab_t*)trie->slabs;
+    cidr_trie_node_t    *node;
+    
+    if ( ! slab || (trie->slab_used == CIDR_TRIE_SLAB_NODES) ) {
+        cidr_trie_slab_t    *new_slab = (cidr_trie_slab_t*)malloc(sizeof(cidr_trie_slab_t));
+        
+        if ( ! new_slab ) return NULL;
+        new_slab->next = slab;
+        trie->slabs = slab = new_slab;
+        trie->slab_used = 0;
+    }
+    node = &slab->nodes[trie->slab_used++];
+    memset(node, 0, sizeof(*node));
+    return node;
+}
+
+//
+
+void
+cidr_trie_init(
+    cidr_trie_t     *trie
+)
+{
+    memset(trie, 0, sizeof(*trie));
+}
+
+//
+
+void
+cidr_trie_fini(
+    cidr_trie_t     *trie
+)
+{
+    cidr_trie_slab_t    *slab = (cidr_trie_slab_t*)trie->slabs;
+    
+    while ( slab ) {
+        cidr_trie_slab_t    *next = slab->next;
+        
+        free((void*)slab);
+        slab = next;
+    }
+    cidr_trie_init(trie);
+}
+
+//
+
+bool
+cidr_trie_insert(
+    cidr_trie_t             *trie,
+    const blocklist_entry_t *entry
+)
+{
+    cidr_trie_node_t        **link = &trie->roots[(entry->family == 6) ? 1 : 0];
+    cidr_trie_node_t        *node, *new_node;
+    
+    while ( (node = *link) ) {
+        int                 node_len = node->entry.prefix_len;
+        int                 common = __cidr_trie_common_len(node->entry.addr, entry->addr,
+                                            (node_len < entry->prefix_len) ? node_len : entry->prefix_len);
+        
+        if ( common < node_len ) {
+            /* The entry is not inside this node's prefix:  it is either
+             * an ancestor of the node or they diverge at <common> bits
+             * and need a new node there to join them: */
+            if ( ! (new_node = __cidr_trie_node_alloc(trie)) ) return false;
+            if ( common == entry->prefix_len ) {
+                new_node->entry = *entry;
+                new_node->is_entry = true;
+                trie->n_entries++;
+            } else {
+                cidr_trie_node_t    *leaf = __cidr_trie_node_alloc(trie);
+                int                 i;
+                
+                if ( ! leaf ) return false;
+                leaf->entry = *entry;
+                leaf->is_entry = true;
+                trie->n_entries++;
+                
+                new_node->entry.family = entry->family;
+                new_node->entry.prefix_len = common;
+                for ( i = 0; i < common / 8; i++ ) new_node->entry.addr[i] = entry->addr[i];
+                if ( common % 8 ) new_node->entry.addr[i] = entry->addr[i] & (uint8_t)(0xFF << (8 - common % 8));
+                new_node->child[__cidr_trie_bit(entry->addr, common)] = leaf;
+            }
+            new_node->child[__cidr_trie_bit(node->entry.addr, common)] = node;
+            *link = new_node;
+            return true;
+        }
+        if ( entry->prefix_len == node_len ) {
+            if ( ! node->is_entry ) {
+                node->is_entry = true;
+                node->entry.expires = entry->expires;
+                trie->n_entries++;
+            } else if ( ! __cidr_trie_expires_ge(node->entry.expires, entry->expires) ) {
+                node->entry.expires = entry->expires;
+            }
+            return true;
+        }
+        link = &node->child[__cidr_trie_bit(entry->addr, node_len)];
+    }
+    if ( ! (new_node = __cidr_trie_node_alloc(trie)) ) return false;
+    new_node->entry = *entry;
+    new_node->is_entry = true;
+    trie->n_entries++;
+    *link = new_node;
+    return true;
+}
+
+//
+
+/*
+ * Drop entries that an enclosing entry already blocks for at least as
+ * long; <cover_expires> is the longest-lasting enclosing entry's expiry
+ * (if <is_covered>).
+ */
+static void
+__cidr_trie_drop_covered(
+    cidr_trie_t         *trie,
+    cidr_trie_node_t    *node,
+    bool                is_covered,
+    time_t              cover_expires
+)
+{
+    while ( node ) {
+        if ( node->is_entry ) {
+            if ( is_covered && __cidr_trie_expires_ge(cover_expires, node->entry.expires) ) {
+                node->is_entry = false;
+                trie->n_entries--;
+            } else {
+                is_covered = true;
+                cover_expires = node->entry.expires;
+            }
+        }
+        __cidr_trie_drop_covered(trie, node->child[0], is_covered, cover_expires);
+        node = node->child[1];
+    }
+}
+
+//
+
+/*
+ * Bottom-up, replace two sibling entries that expire together with
+ * their parent prefix.
+ */
+static void
+__cidr_trie_merge_siblings(
+    cidr_trie_t         *trie,
+    cidr_trie_node_t    *node
+)
+{
+    cidr_trie_node_t    *c0, *c1;
+    
+    if ( ! node ) return;
+    c0 = node->child[0];
+    c1 = node->child[1];
+    __cidr_trie_merge_siblings(trie, c0);
+    __cidr_trie_merge_siblings(trie, c1);
+    if ( c0 && c1 && c0->is_entry && c1->is_entry &&
+         (c0->entry.prefix_len == node->entry.prefix_len + 1) &&
+         (c1->entry.prefix_len == node->entry.prefix_len + 1) &&
+         (c0->entry.expires == c1->entry.expires) )
+    {
+        /* After __cidr_trie_drop_covered() the node itself can only be
+         * an entry that expires sooner than its children: */
+        if ( ! node->is_entry ) trie->n_entries++;
+        node->is_entry = true;
+        node->entry.expires = c0->entry.expires;
+        c0->is_entry = c1->is_entry = false;
+        trie->n_entries -= 2;
+    }
+}
+
+//
+
+void
+cidr_trie_aggregate(
+    cidr_trie_t     *trie
+)
+{
+    int             f;
+    
+    for ( f = 0; f < 2; f++ ) {
+        __cidr_trie_drop_covered(trie, trie->roots[f], false, 0);
+        __cidr_trie_merge_siblings(trie, trie->roots[f]);
+    }
+}
+
+//
+
+static bool
+__cidr_trie_collect(
+    cidr_trie_node_t    *node,
+    blocklist_t         *blocklist
+)
+{
+    while ( node ) {
+        if ( node->is_entry && ! blocklist_push(blocklist, &node->entry) ) return false;
+        if ( ! __cidr_trie_collect(node->child[0], blocklist) ) return false;
+        node = node->child[1];
+    }
+    return true;
+}
+
+//
+
+bool
+cidr_trie_to_blocklist(
+    cidr_trie_t     *trie,
+    blocklist_t     *blocklist
+)
+{
+    int             f;
+    
+    blocklist->n_entries = 0;
+    for ( f = 0; f < 2; f++ ) {
+        if ( ! __cidr_trie_collect(trie->roots[f], blocklist) ) return false;
+    }
+    blocklist_finalize(blocklist);
+    return true;
+}
+
+//
+
+bool
+blocklist_aggregate(
+    blocklist_t     *blocklist
+)
+{
+    cidr_trie_t     trie;
+    blocklist_t     aggregated;
+    size_t          i;
+    bool            ok = true;
+    
+    if ( blocklist->n_entries < 2 ) return true;
+    
+    cidr_trie_init(&trie);
+    for ( i = 0; ok && (i < blocklist->n_entries); i++ ) ok = cidr_trie_insert(&trie, &blocklist->entries[i]);
+    if ( ok ) {
+        cidr_trie_aggregate(&trie);
+        blocklist_init(&aggregated);
+        if ( (ok = cidr_trie_to_blocklist(&trie, &aggregated)) ) {
+            blocklist_move(blocklist, &aggregated);
+        } else {
+            blocklist_fini(&aggregated);
+        }
+    }
+    cidr_trie_fini(&trie);
+    return ok;
+}
@@ -0,0 +1,94 @@
+/*
+ * iptracking
+ * cidr_trie.h
+ *
+ * Compressed radix trie of subnets/addresses used to reduce a block
+ * list to the fewest equivalent entries.
+ *
+ */
+
+#ifndef __CIDR_TRIE_H__
+#define __CIDR_TRIE_H__
+
+#include "blocklist.h"
+
+/*!
+ * @typedef cidr_trie_node_t
+ *
+ * A node in the trie.  Each node's <entry> holds the prefix it
+ * represents; nodes that were only created where two prefixes diverge
+ * have <is_entry> false.  A child's prefix always extends its parent's,
+ * with the bit following the parent's prefix selecting the child.
+ */
+typedef struct cidr_trie_node {
+    struct cidr_trie_node   *child[2];
+    blocklist_entry_t       entry;
+    bool                    is_entry;
+} cidr_trie_node_t;
+
+/*!
+ * @typedef cidr_trie_t
+ *
+ * A pair of tries (IPv4 in <roots>[0], IPv6 in <roots>[1]).  Nodes are
+ * allocated from slabs that are only released by cidr_trie_fini().
+ */
+typedef struct {
+    cidr_trie_node_t    *roots[2];
+    void                *slabs;
+    size_t              slab_used;
+    size_t              n_entries;
+} cidr_trie_t;
+
+/*!
+ * @function cidr_trie_init
+ *
+ * Initialize <trie> as empty.
+ */
+void cidr_trie_init(cidr_trie_t *trie);
+
+/*!
+ * @function cidr_trie_fini
+ *
+ * Release all nodes held by <trie>, leaving it empty.
+ */
+void cidr_trie_fini(cidr_trie_t *trie);
+
+/*!
+ * @function cidr_trie_insert
+ *
+ * Add <entry> to <trie>.  If the same prefix is already present the
+ * later of the two expiry times is kept.  Returns false if no memory
+ * was available.
+ */
+bool cidr_trie_insert(cidr_trie_t *trie, const blocklist_entry_t *entry);
+
+/*!
+ * @function cidr_trie_aggregate
+ *
+ * Reduce the entries in <trie> without changing which addresses are
+ * blocked at any time:  an entry inside another entry that lasts at
+ * least as long is dropped, and two sibling entries (the halves of
+ * a prefix one bit shorter) that expire at the same time are replaced
+ * by their parent prefix, repeatedly.
+ */
+void cidr_trie_aggregate(cidr_trie_t *trie);
+
+/*!
+ * @function cidr_trie_to_blocklist
+ *
+ * Replace the contents of <blocklist> with the entries in <trie> and
+ * finalize it.  Returns false if no memory was available.
+ */
+bool cidr_trie_to_blocklist(cidr_trie_t *trie, blocklist_t *blocklist);
+
+/*!
+ * @function blocklist_aggregate
+ *
+ * Convenience function that passes the entries of <blocklist> through
+ * a cidr_trie_t and cidr_trie_aggregate(), replacing them with the
+ * result.  On failure (no memory) <blocklist> is left unchanged and
+ * false is returned.
+ */
+bool blocklist_aggregate(blocklist_t *blocklist);
+
+#endif /* __CIDR_TRIE_H__ */
@@ -95,13 +95,16 @@ static int __ipset_helper_types_loaded = 0;
     int
     ipset_helper_create(
         ipset_helper_t  *an_ipset,
-        const char      *set_name_rebuild
+        const char      *set_name_rebuild,
+        int             family,
+        bool            with_timeouts
     )
     {
-        const char*     argv[] = { "ipset", "create", set_name_rebuild, "hash:net" };
+        const char*     argv[] = { "ipset", "create", set_name_rebuild, "hash:net", "family", (family == 6) ? "inet6" : "inet", "timeout", "0" };
         int             argc = sizeof(argv) / sizeof(const char*);
         int             rc;
         
+        if ( ! with_timeouts ) argc -= 2;
         return ipset_parse_argv(an_ipset, argc, (char**)argv);
     }
     
@@ -122,6 +125,100 @@ static int __ipset_helper_types_loaded = 0;
     
     //
     
+    int
+    ipset_helper_del(
+        ipset_helper_t  *an_ipset,
+        const char      *set_name,
+        const char      *an_ip_entity
+    )
+    {
+        const char*     argv[] = { "ipset", "del", set_name, an_ip_entity, "-exist" };
+        int             argc = sizeof(argv) / sizeof(const char*);
+        
+        return ipset_parse_argv(an_ipset, argc, (char**)argv);
+    }
+    
+    //
+    
+    int
+    ipset_helper_commit(
+        ipset_helper_t  *an_ipset
+    )
+    {
+        /* Commands given as argv are sent one at a time: */
+        return 0;
+    }
+    
+    //
+    
+    static size_t
+    __ipset_helper_argv_many(
+        ipset_helper_t                  *an_ipset,
+        const char                      *set_name,
+        const char                      **entities,
+        const uint32_t                  *timeouts,
+        size_t                          n_entities,
+        const char                      *cmd,
+        ipset_helper_element_error_fn   error_fn,
+        void                            *error_context
+    )
+    {
+        size_t                          i, n_failed = 0;
+        
+        /* The argv API has no way to aggregate commands, so each
+         * element is its own request: */
+        for ( i = 0; i < n_entities; i++ ) {
+            char                        timeout_str[16];
+            const char*                 argv[] = { "ipset", cmd, set_name, entities[i], "-exist", "timeout", timeout_str };
+            int                         argc = sizeof(argv) / sizeof(const char*);
+            int                         rc;
+            
+            if ( timeouts ) {
+                snprintf(timeout_str, sizeof(timeout_str), "%u", (unsigned int)timeouts[i]);
+            } else {
+                argc -= 2;
+            }
+            rc = ipset_parse_argv(an_ipset, argc, (char**)argv);
+            
+            if ( rc != 0 ) {
+                n_failed++;
+                if ( error_fn ) error_fn(error_context, i, rc, ipset_helper_last_error_message(an_ipset));
+            }
+        }
+        return n_failed;
+    }
+    
+    //
+    
+    size_t
+    ipset_helper_add_many(
+        ipset_helper_t                  *an_ipset,
+        const char                      *set_name,
+        const char                      **entities,
+        const uint32_t                  *timeouts,
+        size_t                          n_entities,
+        ipset_helper_element_error_fn   error_fn,
+        void                            *error_context
+    )
+    {
+        return __ipset_helper_argv_many(an_ipset, set_name, entities, timeouts, n_entities, "add", error_fn, error_context);
+    }
+    
+    //
+    
+    size_t
+    ipset_helper_del_many(
+        ipset_helper_t                  *an_ipset,
+        const char                      *set_name,
+        const char                      **entities,
+        size_t                          n_entities,
+        ipset_helper_element_error_fn   error_fn,
+        void                            *error_context
+    )
+    {
+        return __ipset_helper_argv_many(an_ipset, set_name, entities, NULL, n_entities, "del", error_fn, error_context);
+    }
+    
     int
     ipset_helper_activate(
         ipset_helper_t  *an_ipset,
@@ -247,7 +344,9 @@ static int __ipset_helper_types_loaded = 0;
     int
     ipset_helper_create(
         ipset_helper_t  *an_ipset,
-        const char      *set_name_rebuild
+        const char      *set_name_rebuild,
+        int             family,
+        bool            with_timeouts
     )
     {
         int             rc = -1;
@@ -255,8 +354,16 @@ static int __ipset_helper_types_loaded = 0;
         if ( an_ipset->session ) {
             ipset_data_reset(ipset_session_data(an_ipset->session));
             rc = ipset_parse_setname(an_ipset->session, IPSET_SETNAME, set_name_rebuild);
+            if ( rc == 0 ) {
+                rc = ipset_parse_family(an_ipset->session, IPSET_OPT_FAMILY, (family == 6) ? "inet6" : "inet");
+            }
             if ( rc == 0 ) {
                 rc = ipset_parse_typename(an_ipset->session, IPSET_OPT_TYPENAME, "hash:net");
+                if ( (rc == 0) && with_timeouts ) {
+                    uint32_t    default_timeout = 0;
+                    
+                    rc = ipset_data_set(ipset_session_data(an_ipset->session), IPSET_OPT_TIMEOUT, &default_timeout);
+                }
                 if ( rc == 0 ) {
                     an_ipset->set_type = ipset_type_get(an_ipset->session, IPSET_CMD_CREATE);
                     if ( an_ipset->set_type ) {
@@ -272,28 +379,54 @@ static int __ipset_helper_types_loaded = 0;
     
     //
     
-    int
-    ipset_helper_add(
+    /*
+     * Line number given to libipset for a lone add or delete:  the same
+     * as the first element of a batch (see __ipset_helper_elem_cmd_many()),
+     * so the command aggregates until ipset_helper_commit() and any error
+     * is reported against element 1.
+     */
+#   define IPSET_HELPER_SINGLE_ELEM_LINENO 1
+    
+    /*
+     * Add or delete an element:  the set's type is looked up by name
+     * (libipset caches it) so that sets this helper did not create
+     * itself, e.g. the production set after a restart, can be changed
+     * too.  With a non-zero <lineno> the library aggregates consecutive
+     * commands on the same set until another command or a commit.
+     */
+    static int
+    __ipset_helper_elem_cmd(
         ipset_helper_t  *an_ipset,
-        const char      *set_name_rebuild,
-        const char      *an_ip_entity
+        const char      *set_name,
+        const char      *an_ip_entity,
+        const uint32_t  *timeout,
+        enum ipset_cmd  cmd,
+        uint32_t        lineno
     )
     {
         int             rc = -1;
         
         if ( an_ipset->session ) {
+            const struct ipset_type *set_type;
+            
             ipset_data_reset(ipset_session_data(an_ipset->session));
-            ipset_session_data_set(an_ipset->session, IPSET_OPT_TYPE, an_ipset->set_type);
-            rc = ipset_parse_setname(an_ipset->session, IPSET_SETNAME, set_name_rebuild);
+            rc = ipset_parse_setname(an_ipset->session, IPSET_SETNAME, set_name);
             if ( rc == 0 ) {
-                rc = ipset_parse_elem(an_ipset->session, an_ipset->set_type->last_elem_optional, an_ip_entity);
-                if ( rc == 0 ) {
+                if ( (set_type = ipset_type_get(an_ipset->session, cmd)) ) {
+                    rc = ipset_parse_elem(an_ipset->session, set_type->last_elem_optional, an_ip_entity);
+                    if ( (rc == 0) && timeout ) {
+                        rc = ipset_data_set(ipset_session_data(an_ipset->session), IPSET_OPT_TIMEOUT, timeout);
+                    }
+                    if ( rc == 0 ) {
 #   ifdef HAVE_IPSET_ENVOPT_SET
-                    ipset_envopt_set(an_ipset->session, IPSET_ENV_EXIST);
+                        ipset_envopt_set(an_ipset->session, IPSET_ENV_EXIST);
 #   else
-                    ipset_envopt_parse(an_ipset->session, IPSET_ENV_EXIST, NULL);
+                        ipset_envopt_parse(an_ipset->session, IPSET_ENV_EXIST, NULL);
 #   endif
-                    rc = ipset_cmd(an_ipset->session, IPSET_CMD_ADD, 2);
+                        rc = ipset_cmd(an_ipset->session, cmd, lineno);
+                    }
+                } else {
+                    rc = -22;
                 }
             }
         }
@@ -302,6 +435,134 @@ static int __ipset_helper_types_loaded = 0;
     
     //
     
+    int
+    ipset_helper_add(
+        ipset_helper_t  *an_ipset,
+        const char      *set_name_rebuild,
+        const char      *an_ip_entity
+    )
+    {
+        return __ipset_helper_elem_cmd(an_ipset, set_name_rebuild, an_ip_entity, NULL, IPSET_CMD_ADD, IPSET_HELPER_SINGLE_ELEM_LINENO);
+    }
+    
+    //
+    
+    int
+    ipset_helper_del(
+        ipset_helper_t  *an_ipset,
+        const char      *set_name,
+        const char      *an_ip_entity
+    )
+    {
+        return __ipset_helper_elem_cmd(an_ipset, set_name, an_ip_entity, NULL, IPSET_CMD_DEL, IPSET_HELPER_SINGLE_ELEM_LINENO);
+    }
+    
+    //
+    
+    int
+    ipset_helper_commit(
+        ipset_helper_t  *an_ipset
+    )
+    {
+        return an_ipset->session ? ipset_commit(an_ipset->session) : -1;
+    }
+    
+    //
+    
+    /*
+     * Elements are sent in batches of this many; each batch is built up
+     * by libipset exactly as `ipset restore` does (a non-zero line number
+     * per element) and flushed with a commit.  The library itself splits
+     * a batch across netlink messages as its buffer fills.
+     */
+#   define IPSET_HELPER_BATCH_SIZE 1024
+    
+    static size_t
+    __ipset_helper_elem_cmd_many(
+        ipset_helper_t                  *an_ipset,
+        const char                      *set_name,
+        const char                      **entities,
+        const uint32_t                  *timeouts,
+        size_t                          n_entities,
+        enum ipset_cmd                  cmd,
+        ipset_helper_element_error_fn   error_fn,
+        void                            *error_context
+    )
+    {
+        size_t                          base = 0, n_failed = 0;
+        
+        if ( ! an_ipset->session ) {
+            if ( error_fn ) {
+                while ( base < n_entities ) error_fn(error_context, base++, -1, "no ipset session");
+            }
+            return n_entities;
+        }
+        while ( base < n_entities ) {
+            size_t                      i, n_batch = n_entities - base;
+            int                         rc = 0;
+            
+            if ( n_batch > IPSET_HELPER_BATCH_SIZE ) n_batch = IPSET_HELPER_BATCH_SIZE;
+            for ( i = 0; (rc == 0) && (i < n_batch); i++ ) {
+                rc = __ipset_helper_elem_cmd(an_ipset, set_name, entities[base + i], timeouts ? &timeouts[base + i] : NULL, cmd, base + i + 1);
+            }
+            if ( rc == 0 ) {
+                rc = ipset_commit(an_ipset->session);
+            } else {
+                /* Send the elements still pending so the session is clear for the
+                 * replay below (any of them already handled are no-ops there): */
+                ipset_commit(an_ipset->session);
+            }
+            if ( rc != 0 ) {
+                /* The kernel stops at the first element of a message that
+                 * fails, so redo the batch an element at a time (without
+                 * aggregation) to find out exactly which ones fail; with
+                 * -exist, elements already handled are no-ops: */
+                for ( i = 0; i < n_batch; i++ ) {
+                    rc = __ipset_helper_elem_cmd(an_ipset, set_name, entities[base + i], timeouts ? &timeouts[base + i] : NULL, cmd, 0);
+                    if ( rc != 0 ) {
+                        n_failed++;
+                        if ( error_fn ) error_fn(error_context, base + i, rc, ipset_helper_last_error_message(an_ipset));
+                    }
+                }
+            }
+            base += n_batch;
+        }
+        return n_failed;
+    }
+    
+    //
+    
+    size_t
+    ipset_helper_add_many(
+        ipset_helper_t                  *an_ipset,
+        const char                      *set_name,
+        const char                      **entities,
+        const uint32_t                  *timeouts,
+        size_t                          n_entities,
+        ipset_helper_element_error_fn   error_fn,
+        void                            *error_context
+    )
+    {
+        return __ipset_helper_elem_cmd_many(an_ipset, set_name, entities, timeouts, n_entities, IPSET_CMD_ADD, error_fn, error_context);
+    }
+    
+    //
+    
+    size_t
+    ipset_helper_del_many(
+        ipset_helper_t                  *an_ipset,
+        const char                      *set_name,
+        const char                      **entities,
+        size_t                          n_entities,
+        ipset_helper_element_error_fn   error_fn,
+        void                            *error_context
+    )
+    {
+        return __ipset_helper_elem_cmd_many(an_ipset, set_name, entities, NULL, n_entities, IPSET_CMD_DEL, error_fn, error_context);
+    }
+    
+    //
+    
     int
     ipset_helper_activate(
         ipset_helper_t  *an_ipset,
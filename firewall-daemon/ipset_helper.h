@@ -78,14 +78,24 @@ ipset_helper_t* ipset_helper_init(void);
  */
 int ipset_helper_fini(ipset_helper_t *an_ipset);
 
+/*!
+ * @defined IPSET_HELPER_MAX_TIMEOUT
+ *
+ * The longest element timeout (in seconds) the kernel accepts.
+ */
+#define IPSET_HELPER_MAX_TIMEOUT 2147483
+
 /*!
  * @function ipset_helper_create
  *
- * Create a new ipset named <set_name_rebuild>.
+ * Create a new ipset named <set_name_rebuild> holding IPv4 (<family> of
+ * 4) or IPv6 (<family> of 6) subnets/addresses.  If <with_timeouts> is
+ * true the set supports per-element timeouts, with elements that are
+ * added without one being permanent.
  *
  * @return Zero on success, non-zero on failure.
  */
-int ipset_helper_create(ipset_helper_t *an_ipset, const char *set_name_rebuild);
+int ipset_helper_create(ipset_helper_t *an_ipset, const char *set_name_rebuild, int family, bool with_timeouts);
 
 /*!
  * @function ipset_helper_add
@@ -97,6 +107,68 @@ int ipset_helper_create(ipset_helper_t *an_ipset, const char *set_name_rebuild);
  */
 int ipset_helper_add(ipset_helper_t *an_ipset, const char *set_name_rebuild, const char *an_ip_entity);
 
+/*!
+ * @function ipset_helper_del
+ *
+ * Attempt to remove subnet/address represented in C string <an_ip_entity>
+ * from the <set_name> ipset.  Removing an element that is not present
+ * is not an error.
+ *
+ * @return Zero on success, non-zero on failure.
+ */
+int ipset_helper_del(ipset_helper_t *an_ipset, const char *set_name, const char *an_ip_entity);
+
+/*!
+ * @typedef ipset_helper_element_error_fn
+ *
+ * Called by <ipset_helper_add_many()> and <ipset_helper_del_many()> for
+ * each element that could not be changed:  <index> is the element's
+ * position in the array passed to the function, <rc> the error code and
+ * <message> the library's description of the error.  <context> is the
+ * pointer passed to the function.
+ */
+typedef void (*ipset_helper_element_error_fn)(void *context, size_t index, int rc, const char *message);
+
+/*!
+ * @function ipset_helper_add_many
+ *
+ * Attempt to add the <n_entities> subnets/addresses in the C string
+ * array <entities> to the <set_name> ipset.  Where the library allows it
+ * the additions are packed into as few netlink messages as possible, as
+ * `ipset restore` does.  If a batch fails its elements are retried one
+ * at a time so that <error_fn> (which may be NULL) can be called for
+ * exactly those elements that could not be added.
+ *
+ * If <timeouts> is not NULL it holds the number of seconds after which
+ * the kernel should remove each element (zero for never, at most
+ * IPSET_HELPER_MAX_TIMEOUT); the set must have been created with
+ * timeout support.  An element already present has its timeout reset.
+ *
+ * @return The number of elements that could not be added.
+ */
+size_t ipset_helper_add_many(ipset_helper_t *an_ipset, const char *set_name, const char **entities, const uint32_t *timeouts, size_t n_entities, ipset_helper_element_error_fn error_fn, void *error_context);
+
+/*!
+ * @function ipset_helper_del_many
+ *
+ * Counterpart to <ipset_helper_add_many()> that removes the elements
+ * from the <set_name> ipset.  Removing an element that is not present
+ * is not an error.
+ *
+ * @return The number of elements that could not be removed.
+ */
+size_t ipset_helper_del_many(ipset_helper_t *an_ipset, const char *set_name, const char **entities, size_t n_entities, ipset_helper_element_error_fn error_fn, void *error_context);
+
+/*!
+ * @function ipset_helper_commit
+ *
+ * Additions and removals may be held by the library so that several
+ * can be sent to the kernel at once; send any that are pending.
+ *
+ * @return Zero on success, non-zero if any of them failed.
+ */
+int ipset_helper_commit(ipset_helper_t *an_ipset);
+
 /*!
  * @function ipset_helper_activate
  *
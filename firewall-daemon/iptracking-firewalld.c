@@ -11,6 +11,8 @@
 #include "db_interface.h"
 #include "yaml_helpers.h"
 #include "ipset_helper.h"
+#include "blocklist.h"
+#include "cidr_trie.h"
 
 #include <signal.h>
 #include <sys/socket.h>
@@ -25,11 +27,23 @@ static const char *configuration_filepath_default = CONFIGURATION_FILEPATH_DEFAU
 
 static bool is_running = true;
 static uint32_t firewalld_check_interval = FIREWALLD_CHECK_INTERVAL_DEFAULT;
+static uint32_t firewalld_full_rebuild_interval = FIREWALLD_FULL_REBUILD_INTERVAL_DEFAULT;
 static const char *firewalld_ipset_name_production = FIREWALLD_IPSET_NAME_PRODUCTION_DEFAULT;
 static bool firewalld_ipset_name_production_isset = false;
 static const char *firewalld_ipset_name_rebuild = FIREWALLD_IPSET_NAME_REBUILD_DEFAULT;
 static bool firewalld_ipset_name_rebuild_isset = false;
 
+/*
+ * IPv6 subnets/addresses go into a second pair of ipsets named by
+ * appending this suffix to the production and rebuild names:
+ */
+#define FIREWALLD_IPSET_NAME_INET6_SUFFIX "_v6"
+static const char *firewalld_ipset_name_production6 = NULL;
+static const char *firewalld_ipset_name_rebuild6 = NULL;
+
+/* The kernel's limit on ipset name length (including the NUL): */
+#define FIREWALLD_IPSET_NAME_MAXLEN 32
+
 //
 
 static inline bool
@@ -101,6 +115,17 @@ config_read_yaml_file(
                                 }
                             }
                             
+                            /*
+                             * Check for the full rebuild interval:
+                             */
+                            if ( (firewall_node = yaml_helper_doc_node_at_path(&config_doc, node, "full-rebuild-interval")) ) {
+                                if ( ! yaml_helper_get_scalar_uint32_value(firewall_node, &firewalld_full_rebuild_interval) ) {
+                                    ERROR("Configuration: invalid full-rebuild-interval value: %s", yaml_helper_get_scalar_value(firewall_node));
+                                    rc = false;
+                                    break;
+                                }
+                            }
+                            
                             /*
                              * Check for the production ipset name:
                              */
@@ -195,10 +220,26 @@ config_validate(
         firewalld_ipset_name_rebuild = NULL;
         asprintf((char**)&firewalld_ipset_name_rebuild, "%s_update", firewalld_ipset_name_production);
     }
+    if ( (asprintf((char**)&firewalld_ipset_name_production6, "%s" FIREWALLD_IPSET_NAME_INET6_SUFFIX, firewalld_ipset_name_production) < 0) ||
+         (asprintf((char**)&firewalld_ipset_name_rebuild6, "%s" FIREWALLD_IPSET_NAME_INET6_SUFFIX, firewalld_ipset_name_rebuild) < 0) ) {
+        ERROR("Configuration: unable to allocate IPv6 ipset names");
+        return false;
+    }
+    if ( strlen(firewalld_ipset_name_production6) >= FIREWALLD_IPSET_NAME_MAXLEN ) {
+        ERROR("Configuration: invalid ipset-name.production value: IPv6 name '%s' is too long", firewalld_ipset_name_production6);
+        return false;
+    }
+    if ( strlen(firewalld_ipset_name_rebuild6) >= FIREWALLD_IPSET_NAME_MAXLEN ) {
+        ERROR("Configuration: invalid ipset-name.rebuild value: IPv6 name '%s' is too long", firewalld_ipset_name_rebuild6);
+        return false;
+    }
     
     INFO("                             check-interval = %lus", firewalld_check_interval);
+    INFO("                      full-rebuild-interval = %lus", firewalld_full_rebuild_interval);
     INFO("                      ipset-name.production = %s", firewalld_ipset_name_production);
     INFO("                         ipset-name.rebuild = %s", firewalld_ipset_name_rebuild);
+    INFO("               ipset-name.production (IPv6) = %s", firewalld_ipset_name_production6);
+    INFO("                  ipset-name.rebuild (IPv6) = %s", firewalld_ipset_name_rebuild6);
     
     db_summarize_to_log(event_db);
     
@@ -214,11 +255,12 @@ static struct option cli_options[] = {
                    { "quiet",                   no_argument,       0,  'q' },
                    { "config",                  required_argument, 0,  'c' },
                    { "check-interval",          required_argument, 0,  'i' },
+                   { "full-rebuild-interval",   required_argument, 0,  'f' },
                    { "ipset-name-production",   required_argument, 0,  'p' },
                    { "ipset-name-rebuild",      required_argument, 0,  'r' },
                    { NULL,                      0,                 0,   0  }
                };
-static const char *cli_options_str = "hVvqc:i:p:r:";
+static const char *cli_options_str = "hVvqc:i:f:p:r:";
 
 //
 
@@ -242,15 +284,21 @@ usage(
         "                                       at <filepath> (default: %s)\n"
         "    -i/--check-interval <int>          The maximum number of seconds the daemon will wait\n"
         "                                       between ipset updates (default: %d)\n"
+        "    -f/--full-rebuild-interval <int>   The number of seconds between full rebuilds of the\n"
+        "                                       ipset; other updates only add and remove the\n"
+        "                                       changes, zero disables (default: %d)\n"
         "    -p/--ipset-name-production <name>  The ipset name to use for the subnet/address set\n"
         "                                       referenced by filter rules (default: %s)\n"
         "    -r/--ipset-name-rebuild <name>     The ipset name to use for the subnet/address set\n"
         "                                       for updates (default: %s)\n"
+        "                                       (IPv6 subnets/addresses use a second pair of ipsets\n"
+        "                                       with \"" FIREWALLD_IPSET_NAME_INET6_SUFFIX "\" appended to these names)\n"
         "\n"
         "  database drivers:\n\n",
         exe,
         configuration_filepath_default,
         firewalld_check_interval,
+        firewalld_full_rebuild_interval,
         firewalld_ipset_name_production,
         firewalld_ipset_name_rebuild);
     while ( (driver_name = db_driver_enumerate_drivers(&driver_iter)) ) printf("    - %s\n", driver_name);
@@ -262,15 +310,367 @@ usage(
 
 //
 
+/*
+ * The ipset names are indexed by address family:  0 for IPv4, 1 for
+ * IPv6.
+ */
+#define FIREWALL_FAMILY_IDX(F)  (((F) == 6) ? 1 : 0)
+#define FIREWALL_FAMILY_COUNT   2
+
 typedef struct {
     db_ref          the_db;
     ipset_helper_t  *ipset_helper;
-    const char      *ipset_name_prod;
-    const char      *ipset_name_rebuild;
+    const char      *ipset_name_prod[FIREWALL_FAMILY_COUNT];
+    const char      *ipset_name_rebuild[FIREWALL_FAMILY_COUNT];
+    
+    /* The block list last applied to the production ipset: */
+    pthread_mutex_t ipset_lock;
+    blocklist_t     applied;
+    bool            needs_rebuild;
+    struct timespec last_rebuild;
 } firewall_notify_ctxt_t;
 
 //
 
+/*
+ * Read the block list from <eblocklist> (which may be NULL, implying
+ * an empty list) into <blocklist>.  Entities that cannot be parsed are
+ * skipped with a warning; if the enumeration itself fails, false is
+ * returned so a partial list is never applied.  The list is then reduced to the fewest
+ * subnets/addresses that block the same addresses for the same time
+ * (covered prefixes dropped, sibling prefixes merged).
+ */
+static bool
+firewall_load_blocklist(
+    db_blocklist_enum_ref   eblocklist,
+    blocklist_t             *blocklist,
+    const char              *who
+)
+{
+    const char              *ip_entity;
+    time_t                  end_date;
+    
+    if ( eblocklist ) {
+        while ( (ip_entity = db_blocklist_enum_next_expiring(eblocklist, &end_date)) ) {
+            blocklist_entry_t   entry;
+            
+            if ( ! ip_entity || ! *ip_entity ) continue;
+            if ( ! blocklist_entry_parse(&entry, ip_entity) ) {
+                WARN("%s:  invalid block list entity '%s'", who, ip_entity);
+                continue;
+            }
+            entry.expires = end_date;
+            if ( ! blocklist_push(blocklist, &entry) ) {
+                ERROR("%s:  unable to allocate block list", who);
+                return false;
+            }
+        }
+        if ( db_blocklist_enum_failed(eblocklist) ) {
+            ERROR("%s:  block list enumeration failed, leaving ipsets unchanged", who);
+            return false;
+        }
+    }
+    blocklist_finalize(blocklist);
+    if ( blocklist->n_entries > 1 ) {
+        size_t              n_loaded = blocklist->n_entries;
+        
+        if ( blocklist_aggregate(blocklist) ) {
+            DEBUG("%s:  aggregated %lu block list entries into %lu", who, (unsigned long)n_loaded, (unsigned long)blocklist->n_entries);
+        } else {
+            WARN("%s:  unable to allocate block list trie, using the block list as-is", who);
+        }
+    }
+    return true;
+}
+
+//
+
+/*
+ * A list of block list entries in the textual form the ipset helper
+ * consumes, each with the timeout after which the kernel drops it.
+ */
+typedef struct {
+    const char      **entities;
+    char            (*strs)[BLOCKLIST_ENTITY_STRLEN];
+    uint32_t        *timeouts;
+    size_t          n_entities;
+    time_t          now;
+} firewall_entity_list_t;
+
+static bool
+firewall_entity_list_init(
+    firewall_entity_list_t  *list,
+    size_t                  capacity
+)
+{
+    list->n_entities = 0;
+    list->now = time(NULL);
+    if ( capacity == 0 ) capacity = 1;
+    list->entities = (const char**)malloc(capacity * sizeof(const char*));
+    list->strs = malloc(capacity * sizeof(*list->strs));
+    list->timeouts = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    return (list->entities && list->strs && list->timeouts);
+}
+
+static void
+firewall_entity_list_fini(
+    firewall_entity_list_t  *list
+)
+{
+    if ( list->entities ) free((void*)list->entities);
+    if ( list->strs ) free((void*)list->strs);
+    if ( list->timeouts ) free((void*)list->timeouts);
+}
+
+static void
+firewall_entity_list_push(
+    firewall_entity_list_t  *list,
+    const blocklist_entry_t *entry
+)
+{
+    uint32_t                timeout = 0;
+    
+    /* Blocks that end later than the kernel can time out are added as
+     * permanent; they are removed once they leave the block list.  The
+     * timeout is padded by a check interval:  a block whose end date is
+     * extended without a notification must not lapse before the next
+     * refresh picks up the new end date, and one that does end on time
+     * is removed by that refresh anyway: */
+    if ( entry->expires ) {
+        time_t              remaining = entry->expires - list->now;
+        
+        if ( remaining < 0 ) remaining = 0;
+        remaining += firewalld_check_interval;
+        if ( remaining <= IPSET_HELPER_MAX_TIMEOUT ) timeout = remaining;
+    }
+    list->timeouts[list->n_entities] = timeout;
+    list->entities[list->n_entities] = blocklist_entry_to_str(entry, list->strs[list->n_entities]);
+    list->n_entities++;
+}
+
+//
+
+typedef struct {
+    const char              *who;
+    const char              *set_name;
+    const char              *action;
+    firewall_entity_list_t  *list;
+} firewall_ipset_error_ctxt_t;
+
+static void
+__firewall_ipset_element_error(
+    void        *context,
+    size_t      index,
+    int         rc,
+    const char  *message
+)
+{
+    firewall_ipset_error_ctxt_t *CONTEXT = (firewall_ipset_error_ctxt_t*)context;
+    
+    WARN("%s:  failed to %s '%s' in ipset '%s' (rc = %d): %s", CONTEXT->who, CONTEXT->action, CONTEXT->list->entities[index], CONTEXT->set_name, rc, message);
+}
+
+//
+
+/*
+ * Apply <list> to ipset <set_name> as one batch of additions (or
+ * removals); returns the number of elements that failed.
+ */
+static size_t
+firewall_ipset_change_many(
+    firewall_notify_ctxt_t  *CONTEXT,
+    const char              *set_name,
+    firewall_entity_list_t  *list,
+    bool                    is_added,
+    const char              *who
+)
+{
+    firewall_ipset_error_ctxt_t error_ctxt = {
+                                    .who = who,
+                                    .set_name = set_name,
+                                    .action = is_added ? "add" : "remove",
+                                    .list = list
+                                };
+    
+    if ( list->n_entities == 0 ) return 0;
+    if ( is_added ) {
+        return ipset_helper_add_many(CONTEXT->ipset_helper, set_name, list->entities, list->timeouts, list->n_entities, __firewall_ipset_element_error, &error_ctxt);
+    }
+    return ipset_helper_del_many(CONTEXT->ipset_helper, set_name, list->entities, list->n_entities, __firewall_ipset_element_error, &error_ctxt);
+}
+
+//
+
+typedef struct {
+    firewall_entity_list_t  added[FIREWALL_FAMILY_COUNT];
+    firewall_entity_list_t  removed[FIREWALL_FAMILY_COUNT];
+} firewall_diff_ctxt_t;
+
+static bool
+__firewall_diff_collect(
+    void                    *context,
+    const blocklist_entry_t *entry,
+    bool                    is_added
+)
+{
+    firewall_diff_ctxt_t    *CONTEXT = (firewall_diff_ctxt_t*)context;
+    
+    int                     f = FIREWALL_FAMILY_IDX(entry->family);
+    
+    firewall_entity_list_push(is_added ? &CONTEXT->added[f] : &CONTEXT->removed[f], entry);
+    return true;
+}
+
+//
+
+/*
+ * Populate fresh IPv4 and IPv6 rebuild ipsets with every entry in
+ * <blocklist> and swap them into production.  Both rebuild sets are
+ * complete before either swap, so the two production sets change
+ * together.
+ */
+static bool
+firewall_rebuild_ipset(
+    firewall_notify_ctxt_t  *CONTEXT,
+    const blocklist_t       *blocklist,
+    const char              *who
+)
+{
+    firewall_entity_list_t  lists[FIREWALL_FAMILY_COUNT];
+    size_t                  i, n_failed;
+    int                     f, rc;
+    bool                    ok = true;
+    
+    memset(lists, 0, sizeof(lists));
+    for ( f = 0; ok && (f < FIREWALL_FAMILY_COUNT); f++ ) ok = firewall_entity_list_init(&lists[f], blocklist->n_entries);
+    if ( ! ok ) {
+        ERROR("%s:  unable to allocate ipset element list", who);
+    } else {
+        for ( i = 0; i < blocklist->n_entries; i++ ) firewall_entity_list_push(&lists[FIREWALL_FAMILY_IDX(blocklist->entries[i].family)], &blocklist->entries[i]);
+    }
+    
+    for ( f = 0; ok && (f < FIREWALL_FAMILY_COUNT); f++ ) {
+        rc = ipset_helper_destroy(CONTEXT->ipset_helper, CONTEXT->ipset_name_rebuild[f]);
+        /* We don't care if this succeeded or not... */
+        
+        rc = ipset_helper_create(CONTEXT->ipset_helper, CONTEXT->ipset_name_rebuild[f], f ? 6 : 4, true);
+        if ( rc != 0 ) {
+            ERROR("%s:  failed to create rebuild ipset '%s' (rc = %d): %s", who, CONTEXT->ipset_name_rebuild[f], rc, ipset_helper_last_error_message(CONTEXT->ipset_helper));
+            ok = false;
+        } else {
+            DEBUG("%s:  created ipset '%s'", who, CONTEXT->ipset_name_rebuild[f]);
+            n_failed = firewall_ipset_change_many(CONTEXT, CONTEXT->ipset_name_rebuild[f], &lists[f], true, who);
+            DEBUG("%s:  added %lu entries to ipset '%s'", who, (unsigned long)(lists[f].n_entities - n_failed), CONTEXT->ipset_name_rebuild[f]);
+        }
+    }
+    for ( f = 0; ok && (f < FIREWALL_FAMILY_COUNT); f++ ) {
+        rc = ipset_helper_activate(CONTEXT->ipset_helper, CONTEXT->ipset_name_rebuild[f], CONTEXT->ipset_name_prod[f]);
+        if ( rc != 0 ) {
+            ERROR("%s:  failed to activate updated ipset '%s' (rc = %d): %s", who, CONTEXT->ipset_name_prod[f], rc, ipset_helper_last_error_message(CONTEXT->ipset_helper));
+            ok = false;
+        }
+    }
+    if ( ok ) {
+        INFO("%s:  rebuilt ipsets '%s' with %lu entries and '%s' with %lu entries", who,
+                CONTEXT->ipset_name_prod[0], (unsigned long)lists[0].n_entities,
+                CONTEXT->ipset_name_prod[1], (unsigned long)lists[1].n_entities);
+    }
+    for ( f = 0; f < FIREWALL_FAMILY_COUNT; f++ ) firewall_entity_list_fini(&lists[f]);
+    return ok;
+}
+
+//
+
+/*
+ * Bring the production ipsets in line with the block list enumerated
+ * by <eblocklist>.  Normally only the entries added to or removed from
+ * the block list since the last update are changed in the ipsets; the
+ * ipsets are rebuilt from scratch at startup, when a change fails (an
+ * ipset has drifted from what was last applied), and every
+ * full-rebuild-interval seconds.  Entries are added with a timeout
+ * matching the block's end date, so the kernel removes expired blocks
+ * without waiting for an update.
+ */
+static bool
+firewall_apply_blocklist(
+    firewall_notify_ctxt_t  *CONTEXT,
+    db_blocklist_enum_ref   eblocklist,
+    const char              *who
+)
+{
+    blocklist_t             next;
+    bool                    ok = false;
+    
+    blocklist_init(&next);
+    if ( ! firewall_load_blocklist(eblocklist, &next, who) ) {
+        blocklist_fini(&next);
+        return false;
+    }
+    
+    pthread_mutex_lock(&CONTEXT->ipset_lock);
+    if ( ! CONTEXT->needs_rebuild && firewalld_full_rebuild_interval ) {
+        struct timespec     now;
+        
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ( (now.tv_sec - CONTEXT->last_rebuild.tv_sec) >= firewalld_full_rebuild_interval ) {
+            DEBUG("%s:  full-rebuild-interval elapsed", who);
+            CONTEXT->needs_rebuild = true;
+        }
+    }
+    if ( ! CONTEXT->needs_rebuild ) {
+        firewall_diff_ctxt_t    diff;
+        blocklist_diff_counts_t counts;
+        
+        bool                    is_allocated = true;
+        int                     f;
+        
+        memset(&diff, 0, sizeof(diff));
+        for ( f = 0; is_allocated && (f < FIREWALL_FAMILY_COUNT); f++ ) {
+            is_allocated = firewall_entity_list_init(&diff.removed[f], CONTEXT->applied.n_entries) && firewall_entity_list_init(&diff.added[f], next.n_entries);
+        }
+        if ( is_allocated ) {
+            size_t              n_failed = 0;
+            
+            blocklist_diff(&CONTEXT->applied, &next, __firewall_diff_collect, &diff, &counts);
+            for ( f = 0; f < FIREWALL_FAMILY_COUNT; f++ ) {
+                n_failed += firewall_ipset_change_many(CONTEXT, CONTEXT->ipset_name_prod[f], &diff.removed[f], false, who);
+                n_failed += firewall_ipset_change_many(CONTEXT, CONTEXT->ipset_name_prod[f], &diff.added[f], true, who);
+            }
+            if ( n_failed ) {
+                WARN("%s:  ipsets '%s' and '%s' have drifted from the block list, rebuilding them", who, CONTEXT->ipset_name_prod[0], CONTEXT->ipset_name_prod[1]);
+                CONTEXT->needs_rebuild = true;
+            } else {
+                if ( counts.n_added || counts.n_updated || counts.n_removed ) {
+                    INFO("%s:  added %lu, updated %lu, and removed %lu entries in ipsets '%s' and '%s'", who, (unsigned long)counts.n_added, (unsigned long)counts.n_updated, (unsigned long)counts.n_removed, CONTEXT->ipset_name_prod[0], CONTEXT->ipset_name_prod[1]);
+                } else {
+                    DEBUG("%s:  ipsets '%s' and '%s' are up to date", who, CONTEXT->ipset_name_prod[0], CONTEXT->ipset_name_prod[1]);
+                }
+                ok = true;
+            }
+        } else {
+            ERROR("%s:  unable to allocate ipset element lists", who);
+        }
+        for ( f = 0; f < FIREWALL_FAMILY_COUNT; f++ ) {
+            firewall_entity_list_fini(&diff.removed[f]);
+            firewall_entity_list_fini(&diff.added[f]);
+        }
+    }
+    if ( CONTEXT->needs_rebuild && firewall_rebuild_ipset(CONTEXT, &next, who) ) {
+        CONTEXT->needs_rebuild = false;
+        clock_gettime(CLOCK_MONOTONIC, &CONTEXT->last_rebuild);
+        ok = true;
+    }
+    
+    /* Entries that could not be added during a rebuild are remembered
+     * as applied so they are not retried on every update: */
+    if ( ok ) blocklist_move(&CONTEXT->applied, &next);
+    pthread_mutex_unlock(&CONTEXT->ipset_lock);
+    blocklist_fini(&next);
+    return ok;
+}
+
+//
+
 static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t timer_cond = PTHREAD_COND_INITIALIZER;
 static struct timespec timer_abstime;
@@ -281,7 +681,6 @@ timer_thread_entry(
 )
 {
     firewall_notify_ctxt_t  *CONTEXT = (firewall_notify_ctxt_t*)context;
-    const char              *error_msg;
     
     INFO("Timer thread: entering runloop");
     while ( is_running ) {
@@ -290,48 +689,26 @@ timer_thread_entry(
         pthread_mutex_lock(&timer_mutex);
         rc = pthread_cond_timedwait(&timer_cond, &timer_mutex, &timer_abstime);
         if ( rc == ETIMEDOUT ) {
+            db_blocklist_enum_ref   eblocklist;
+            const char              *error_msg = NULL;
+            
             DEBUG("Timer thread: period elapsed, check for firewall updates");
             
             /* We reached the end of the wait time, check for
              * firewall updates:
              */
-            rc = ipset_helper_destroy(CONTEXT->ipset_helper, CONTEXT->ipset_name_rebuild);
-            /* We don't care if this succeeded or not... */
-            
-            rc = ipset_helper_create(CONTEXT->ipset_helper, CONTEXT->ipset_name_rebuild);
-            if ( rc == 0 ) {
-                db_blocklist_enum_ref   eblocklist = db_blocklist_enum_open(CONTEXT->the_db, &error_msg);
-                if ( eblocklist ) {
-                    const char          *ip_entity;
-                    
-                    while ( (ip_entity = db_blocklist_enum_next(eblocklist)) ) {
-                        if ( ip_entity && *ip_entity ) {
-                            rc = ipset_helper_add(CONTEXT->ipset_helper, CONTEXT->ipset_name_rebuild, ip_entity);
-                            if ( rc ) {
-                                WARN("Timer thread:  failed to add '%s' to ipset '%s' (rc = %d): %s", ip_entity, CONTEXT->ipset_name_rebuild, rc, ipset_helper_last_error_message(CONTEXT->ipset_helper));
-                            } else {
-                                DEBUG("Timer thread:  added '%s' to ipset '%s'", ip_entity, CONTEXT->ipset_name_rebuild);
-                            }
-                        }
-                    }
-                    db_blocklist_enum_close(eblocklist);
-                } else if ( error_msg ) {
-                    ERROR("Timer thread:  failed to get block list:  %s", error_msg);
-                }
-                rc = ipset_helper_activate(CONTEXT->ipset_helper, CONTEXT->ipset_name_rebuild, CONTEXT->ipset_name_prod);
-                if ( rc == 0 ) {
-                    DEBUG("Timer thread:  successful");
-                } else {
-                    ERROR("Timer thread:  failed to activate updated ipset (rc = %d): %s", rc, ipset_helper_last_error_message(CONTEXT->ipset_helper));
-                }
-                
-                /* Reset the timer: */
-                clock_gettime(CLOCK_REALTIME, &timer_abstime);
-                timer_abstime.tv_sec += firewalld_check_interval;
-                DEBUG("Timer thread:  timer thread wakeup time updated");
+            eblocklist = db_blocklist_enum_open(CONTEXT->the_db, &error_msg);
+            if ( eblocklist || ! error_msg ) {
+                if ( firewall_apply_blocklist(CONTEXT, eblocklist, "Timer thread") ) DEBUG("Timer thread:  successful");
+                if ( eblocklist ) db_blocklist_enum_close(eblocklist);
             } else {
-                ERROR("Timer thread:  failed to create rebuild ipset '%s' (rc = %d): %s", CONTEXT->ipset_name_rebuild, rc, ipset_helper_last_error_message(CONTEXT->ipset_helper));
+                ERROR("Timer thread:  failed to get block list:  %s", error_msg);
             }
+            
+            /* Reset the timer: */
+            clock_gettime(CLOCK_REALTIME, &timer_abstime);
+            timer_abstime.tv_sec += firewalld_check_interval;
+            DEBUG("Timer thread:  timer thread wakeup time updated");
         } else if ( is_running ) {
             DEBUG("Timer thread:  resuming existing timeout period");
         }
@@ -352,59 +729,31 @@ firewall_notify(
     firewall_notify_ctxt_t  *CONTEXT = (firewall_notify_ctxt_t*)context;
     int                     rc;
     
-    rc = ipset_helper_destroy(CONTEXT->ipset_helper, CONTEXT->ipset_name_rebuild);
-    /* We don't care if this succeeded or not... */
-    
-    rc = ipset_helper_create(CONTEXT->ipset_helper, CONTEXT->ipset_name_rebuild);
-    if ( rc == 0 ) {
-        /* Populate the ipset with the block list: */
-        const char      *ip_entity;
+    if ( ! eblocklist ) DEBUG("Ipset update:  ipsets '%s' and '%s' will be empty", CONTEXT->ipset_name_prod[0], CONTEXT->ipset_name_prod[1]);
+    if ( firewall_apply_blocklist(CONTEXT, eblocklist, "Ipset update") ) {
+        DEBUG("Ipset update:  successful");
         
-        DEBUG("Ipset update:  created ipset '%s'", CONTEXT->ipset_name_rebuild);
-        if ( eblocklist ) {
-            while ( (ip_entity = db_blocklist_enum_next(eblocklist)) ) {
-                if ( ip_entity && *ip_entity ) {
-                    rc = ipset_helper_add(CONTEXT->ipset_helper, CONTEXT->ipset_name_rebuild, ip_entity);
-                    if ( rc ) {
-                        WARN("Ipset update:  failed to add '%s' to ipset '%s' (rc = %d): %s", ip_entity, CONTEXT->ipset_name_rebuild, rc, ipset_helper_last_error_message(CONTEXT->ipset_helper));
-                    } else {
-                        DEBUG("Ipset update:  added '%s' to ipset '%s'", ip_entity, CONTEXT->ipset_name_rebuild);
-                    }
-                }
-            }
-        } else {
-            DEBUG("Ipset update:  ipset '%s' will be empty", CONTEXT->ipset_name_prod);
-        }
-        rc = ipset_helper_activate(CONTEXT->ipset_helper, CONTEXT->ipset_name_rebuild, CONTEXT->ipset_name_prod);
+        /* Reset the periodic check period: */
+        rc = pthread_mutex_lock(&timer_mutex);
         if ( rc == 0 ) {
-            DEBUG("Ipset update:  successful");
+            DEBUG("Ipset update:  timer thread mutex locked");
             
-            /* Reset the periodic check period: */
-            rc = pthread_mutex_lock(&timer_mutex);
-            if ( rc == 0 ) {
-                DEBUG("Ipset update:  timer thread mutex locked");
-                
-                /* Reset the timer: */
-                clock_gettime(CLOCK_REALTIME, &timer_abstime);
-                timer_abstime.tv_sec += firewalld_check_interval;
-                DEBUG("Ipset update:  timer thread wakeup time updated");
-                
-                /* Wake the timer thread so it resets its wake time: */
-                pthread_cond_broadcast(&timer_cond);
-                rc = pthread_mutex_unlock(&timer_mutex);
-                if ( rc ) {
-                    ERROR("Ipset update:  failed to unlock timer thread mutex (rc = %d)", rc);
-                } else {
-                    DEBUG("Ipset update:  timer thread mutex unlocked");
-                }
+            /* Reset the timer: */
+            clock_gettime(CLOCK_REALTIME, &timer_abstime);
+            timer_abstime.tv_sec += firewalld_check_interval;
+            DEBUG("Ipset update:  timer thread wakeup time updated");
+            
+            /* Wake the timer thread so it resets its wake time: */
+            pthread_cond_broadcast(&timer_cond);
+            rc = pthread_mutex_unlock(&timer_mutex);
+            if ( rc ) {
+                ERROR("Ipset update:  failed to unlock timer thread mutex (rc = %d)", rc);
             } else {
-                ERROR("Ipset update:  failed to acquire timer thread mutex (rc = %d)", rc);
+                DEBUG("Ipset update:  timer thread mutex unlocked");
             }
         } else {
-            ERROR("Ipset update:  failed to activate updated ipset (rc = %d): %s", rc, ipset_helper_last_error_message(CONTEXT->ipset_helper));
+            ERROR("Ipset update:  failed to acquire timer thread mutex (rc = %d)", rc);
         }
-    } else {
-        ERROR("Ipset update:  failed to create rebuild ipset '%s' (rc = %d): %s", CONTEXT->ipset_name_rebuild, rc, ipset_helper_last_error_message(CONTEXT->ipset_helper));
     }
 }
 
@@ -505,6 +854,17 @@ main(
                 firewalld_check_interval = v;
                 break;
             }
+            case 'f': {
+                char        *endp = NULL;
+                long int    v = strtol(optarg, &endp, 0);
+                
+                if ( ! (endp > optarg) || (v < 0) ) {
+                    fprintf(stderr, "ERROR:  invalid -f/--full-rebuild-interval value: '%s'", optarg);
+                    exit(EINVAL);
+                }
+                firewalld_full_rebuild_interval = v;
+                break;
+            }
             case 'p':
                 firewalld_ipset_name_production = optarg;
                 firewalld_ipset_name_production_isset = true;
@@ -536,8 +896,13 @@ main(
         firewall_thread_ctxt.ipset_helper = ipset_helper_init();
         if ( firewall_thread_ctxt.ipset_helper ) {
             firewall_thread_ctxt.the_db = the_db;
-            firewall_thread_ctxt.ipset_name_prod = firewalld_ipset_name_production;
-            firewall_thread_ctxt.ipset_name_rebuild = firewalld_ipset_name_rebuild;
+            firewall_thread_ctxt.ipset_name_prod[0] = firewalld_ipset_name_production;
+            firewall_thread_ctxt.ipset_name_prod[1] = firewalld_ipset_name_production6;
+            firewall_thread_ctxt.ipset_name_rebuild[0] = firewalld_ipset_name_rebuild;
+            firewall_thread_ctxt.ipset_name_rebuild[1] = firewalld_ipset_name_rebuild6;
+            pthread_mutex_init(&firewall_thread_ctxt.ipset_lock, NULL);
+            blocklist_init(&firewall_thread_ctxt.applied);
+            firewall_thread_ctxt.needs_rebuild = true;
             db_blocklist_async_notification_register(the_db, firewall_notify, &firewall_thread_ctxt, &error_msg);
             
             /* At this point we're ready to accept async notifications
@@ -559,8 +924,11 @@ main(
             db_close(the_db, &error_msg);
             
             /* Ensure we've dumped the rebuilt list: */
-            ipset_helper_destroy(firewall_thread_ctxt.ipset_helper, firewall_thread_ctxt.ipset_name_rebuild);
+            ipset_helper_destroy(firewall_thread_ctxt.ipset_helper, firewall_thread_ctxt.ipset_name_rebuild[0]);
+            ipset_helper_destroy(firewall_thread_ctxt.ipset_helper, firewall_thread_ctxt.ipset_name_rebuild[1]);
             ipset_helper_fini(firewall_thread_ctxt.ipset_helper);
+            blocklist_fini(&firewall_thread_ctxt.applied);
+            pthread_mutex_destroy(&firewall_thread_ctxt.ipset_lock);
         }
         db_dealloc(the_db);
     }
@@ -4,17 +4,62 @@
  *
  * CSV file database driver.
  *
+ * Records are formatted into a user-space buffer that is written to the
+ * file with a single write() once it holds buffer-size bytes, once its
+ * oldest record is flush-interval-ms milliseconds old, or when the daemon
+ * has drained its queue and calls db_flush().  The file can be rotated
+ * when it grows past a size or has been open for some number of seconds;
+ * the buffer is always written out before the file is renamed, so no
+ * events are lost across a rotation.
+ *
  */
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
+//
+
+#define DB_INSTANCE_CSVFILE_BUFFER_SIZE_DEFAULT 65536
+#define DB_INSTANCE_CSVFILE_BUFFER_SIZE_MIN 4096
+#define DB_INSTANCE_CSVFILE_FLUSH_INTERVAL_MS_DEFAULT 1000
+
+//
+
+typedef enum {
+    db_instance_csvfile_sync_none = 0,
+    db_instance_csvfile_sync_flush,
+    db_instance_csvfile_sync_rotate,
+    db_instance_csvfile_sync_max
+} db_instance_csvfile_sync_t;
+
+static const char *__db_instance_csvfile_sync_modes[] = {
+        [db_instance_csvfile_sync_none] = "none",
+        [db_instance_csvfile_sync_flush] = "flush",
+        [db_instance_csvfile_sync_rotate] = "rotate",
+        NULL
+    };
+    
 //
 
 typedef struct {
     db_instance_t       base;
     //
     const char          *filename;
-    FILE                *fptr;
+    int                 fd;
     const char          *delimiter;
     //
+    uint32_t            buffer_size;
+    int                 flush_interval_ms;
+    db_instance_csvfile_sync_t  sync_mode;
+    uint64_t            rotate_max_bytes;
+    uint32_t            rotate_interval_seconds;
+    //
+    char                *buffer;
+    size_t              buffer_capacity, buffer_len;
+    struct timespec     buffer_since;
+    uint64_t            file_bytes;
+    struct timespec     file_since;
+    //
     char                error_buffer[100];
 } db_instance_csvfile_t;
 
@@ -27,6 +72,8 @@ static void __db_instance_csvfile_summarize_to_log(db_instance_t *the_db);
 static bool __db_instance_csvfile_open(db_instance_t *the_db, const char **error_msg);
 static bool __db_instance_csvfile_close(db_instance_t *the_db, const char **error_msg);
 static bool __db_instance_csvfile_log_one_event(db_instance_t *the_db, log_data_t *the_event, const char **error_msg);
+static bool __db_instance_csvfile_log_events(db_instance_t *the_db, log_data_t *events, size_t n_events, size_t *n_logged, const char **error_msg);
+static bool __db_instance_csvfile_flush(db_instance_t *the_db, const char **error_msg);
 
 //
 
@@ -40,6 +87,8 @@ static db_driver_callbacks_t    db_driver_csvfile_callbacks = {
         .open = __db_instance_csvfile_open,
         .close = __db_instance_csvfile_close,
         .log_one_event = __db_instance_csvfile_log_one_event,
+        .log_events = __db_instance_csvfile_log_events,
+        .flush = __db_instance_csvfile_flush,
         .blocklist_enum_open = NULL,
         
         .blocklist_async_notification_toggle = NULL
@@ -47,6 +96,32 @@ static db_driver_callbacks_t    db_driver_csvfile_callbacks = {
     
 //
 
+static const char*
+__db_instance_csvfile_set_error(
+    db_instance_csvfile_t   *THE_DB,
+    int                     errnum
+)
+{
+    snprintf(THE_DB->error_buffer, sizeof(THE_DB->error_buffer), "%s", strerror(errnum));
+    return THE_DB->error_buffer;
+}
+
+//
+
+static int64_t
+__db_instance_csvfile_ms_since(
+    struct timespec *since
+)
+{
+    struct timespec now;
+    
+    /* Rotation intervals can be long enough to overflow an int's worth of milliseconds: */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000L;
+}
+
+//
+
 db_instance_t*
 __db_instance_csvfile_alloc(
     yaml_document_t *config_doc,
@@ -57,7 +132,12 @@ __db_instance_csvfile_alloc(
     yaml_node_t                     *prop_node;
     size_t                          base_bytes = sizeof(db_instance_csvfile_t);
     size_t                          extra_bytes = 0;
-    const char                      *filename = NULL, *delimiter = ",";
+    const char                      *v, *filename = NULL, *delimiter = ",";
+    uint32_t                        buffer_size = DB_INSTANCE_CSVFILE_BUFFER_SIZE_DEFAULT;
+    int                             flush_interval_ms = DB_INSTANCE_CSVFILE_FLUSH_INTERVAL_MS_DEFAULT;
+    db_instance_csvfile_sync_t      sync_mode = db_instance_csvfile_sync_none;
+    uint64_t                        rotate_max_bytes = 0;
+    uint32_t                        rotate_interval_seconds = 0;
     
     if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "delimiter")) ) {
         delimiter = yaml_helper_get_scalar_value(prop_node);
@@ -77,12 +157,70 @@ __db_instance_csvfile_alloc(
     }
     extra_bytes += strlen(filename) + 1;
     
+    /*
+     * Check for buffering and sync policy:
+     */
+    if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "buffer-size")) ) {
+        if ( ! yaml_helper_get_scalar_uint32_value(prop_node, &buffer_size) ) {
+            ERROR("Database: invalid 'buffer-size' value");
+            return NULL;
+        }
+    }
+    if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "flush-interval-ms")) ) {
+        if ( ! yaml_helper_get_scalar_int_value(prop_node, &flush_interval_ms) || (flush_interval_ms < 0) ) {
+            ERROR("Database: invalid 'flush-interval-ms' value");
+            return NULL;
+        }
+    }
+    if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "sync")) ) {
+        if ( (v = yaml_helper_get_scalar_value(prop_node)) ) {
+            while ( __db_instance_csvfile_sync_modes[sync_mode] ) {
+                if ( strcasecmp(__db_instance_csvfile_sync_modes[sync_mode], v) == 0 ) break;
+                sync_mode++;
+            }
+        }
+        if ( ! v || (sync_mode == db_instance_csvfile_sync_max) ) {
+            ERROR("Database: invalid 'sync' value");
+            return NULL;
+        }
+    }
+    
+    /*
+     * Check for rotation limits:
+     */
+    if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "rotate")) ) {
+        yaml_node_t     *val_node;
+        
+        if ( (val_node = yaml_helper_doc_node_at_path(config_doc, prop_node, "max-bytes")) ) {
+            char        *endptr;
+            
+            if ( ! (v = yaml_helper_get_scalar_value(val_node)) ||
+                 (*v == '-') || ((rotate_max_bytes = strtoull(v, &endptr, 0)), (endptr == v)) || *endptr ) {
+                ERROR("Database: invalid 'rotate.max-bytes' value");
+                return NULL;
+            }
+        }
+        if ( (val_node = yaml_helper_doc_node_at_path(config_doc, prop_node, "interval-seconds")) ) {
+            if ( ! yaml_helper_get_scalar_uint32_value(val_node, &rotate_interval_seconds) ) {
+                ERROR("Database: invalid 'rotate.interval-seconds' value");
+                return NULL;
+            }
+        }
+    }
+    
     /* Ready to allocate: */
     new_instance = (db_instance_csvfile_t*)__db_instance_alloc(
                             &db_driver_csvfile_callbacks, base_bytes + extra_bytes);
     if ( new_instance ) {
         void        *p = (void*)new_instance + base_bytes;
         
+        new_instance->fd = -1;
+        new_instance->buffer_size = buffer_size;
+        new_instance->flush_interval_ms = flush_interval_ms;
+        new_instance->sync_mode = sync_mode;
+        new_instance->rotate_max_bytes = rotate_max_bytes;
+        new_instance->rotate_interval_seconds = rotate_interval_seconds;
+        
 #define DB_INSTANCE_CSVFILE_P_INC(T,N)     { size_t dp = (sizeof(T) * (N)); p += dp; extra_bytes -= dp; }
         
         /* Setup delimiter: */
@@ -92,7 +230,7 @@ __db_instance_csvfile_alloc(
         /* Setup filename: */
         new_instance->filename = (const char*)p; DB_INSTANCE_CSVFILE_P_INC(char, strlen(filename) + 1);
         memcpy((char*)new_instance->filename, filename, strlen(filename) + 1);
-
+        
 #undef DB_INSTANCE_CSVFILE_P_INC
     }
     return (db_instance_t*)new_instance;
@@ -105,6 +243,9 @@ __db_instance_csvfile_dealloc(
     db_instance_t   *the_db
 )
 {
+    db_instance_csvfile_t   *THE_DB = (db_instance_csvfile_t*)the_db;
+    
+    if ( THE_DB->buffer ) free((void*)THE_DB->buffer);
 }
 
 //
@@ -131,6 +272,34 @@ __db_instance_csvfile_summarize_to_log(
     INFO("Database: driver_name = %s", THE_DB->base.driver_callbacks->driver_name);
     INFO("Database: filename = %s", THE_DB->filename);
     INFO("Database: delimiter = %s", THE_DB->delimiter ? THE_DB->delimiter : ",");
+    INFO("Database: buffer-size = %u", THE_DB->buffer_size);
+    INFO("Database: flush-interval-ms = %d", THE_DB->flush_interval_ms);
+    INFO("Database: sync = %s", __db_instance_csvfile_sync_modes[THE_DB->sync_mode]);
+    INFO("Database: rotate.max-bytes = %llu", (unsigned long long)THE_DB->rotate_max_bytes);
+    INFO("Database: rotate.interval-seconds = %u", THE_DB->rotate_interval_seconds);
+}
+
+//
+
+static bool
+__db_instance_csvfile_open_file(
+    db_instance_csvfile_t   *THE_DB,
+    const char              **error_msg
+)
+{
+    struct stat             finfo;
+    int                     fd;
+    
+    DEBUG("Database: connecting to file '%s'", THE_DB->filename);
+    fd = open(THE_DB->filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if ( fd < 0 ) {
+        if ( error_msg ) *error_msg = __db_instance_csvfile_set_error(THE_DB, errno);
+        return false;
+    }
+    THE_DB->fd = fd;
+    THE_DB->file_bytes = ( fstat(fd, &finfo) == 0 ) ? finfo.st_size : 0;
+    clock_gettime(CLOCK_MONOTONIC, &THE_DB->file_since);
+    return true;
 }
 
 //
@@ -144,21 +313,115 @@ __db_instance_csvfile_open(
     db_instance_csvfile_t   *THE_DB = (db_instance_csvfile_t*)the_db;
     
     if ( (THE_DB->base.options & db_options_no_pam_logging) == db_options_no_pam_logging ) {
-        DEBUG("Database: no PAM logging enabled, database is non-functional"); 
-    } else if ( ! THE_DB->fptr ) {
-        int                 rc;
+        DEBUG("Database: no PAM logging enabled, database is non-functional");
+    } else if ( THE_DB->fd < 0 ) {
+        if ( ! THE_DB->buffer ) {
+            /* Always leave room for a few records, even when buffering is off: */
+            size_t          capacity = THE_DB->buffer_size;
+            
+            if ( capacity < DB_INSTANCE_CSVFILE_BUFFER_SIZE_MIN ) capacity = DB_INSTANCE_CSVFILE_BUFFER_SIZE_MIN;
+            if ( capacity < 4 * (sizeof(log_data_t) + 6 * strlen(THE_DB->delimiter)) ) {
+                capacity = 4 * (sizeof(log_data_t) + 6 * strlen(THE_DB->delimiter));
+            }
+            if ( ! (THE_DB->buffer = (char*)malloc(capacity)) ) {
+                if ( error_msg ) *error_msg = __db_instance_csvfile_set_error(THE_DB, ENOMEM);
+                return false;
+            }
+            THE_DB->buffer_capacity = capacity;
+            THE_DB->buffer_len = 0;
+        }
+        if ( ! __db_instance_csvfile_open_file(THE_DB, error_msg) ) return false;
+        DEBUG("Database: file open, database interface ready");
+    }
+    return true;
+}
+
+//
+
+/*
+ * Rename the current file aside with a timestamp suffix and start a new
+ * one.  The old descriptor stays open until the new file is ready, so if
+ * anything goes wrong records keep going to the renamed file.
+ */
+static void
+__db_instance_csvfile_rotate(
+    db_instance_csvfile_t   *THE_DB
+)
+{
+    size_t                  filename_len = strlen(THE_DB->filename);
+    char                    *rotated = (char*)malloc(filename_len + 48);
+    int                     old_fd = THE_DB->fd;
+    
+    if ( rotated ) {
+        time_t              now = time(NULL);
+        struct tm           now_tm;
+        struct stat         finfo;
+        int                 n = 0;
+        size_t              l;
+        
+        memcpy(rotated, THE_DB->filename, filename_len);
+        l = filename_len + strftime(rotated + filename_len, 24, ".%Y%m%dT%H%M%S", localtime_r(&now, &now_tm));
+        while ( (stat(rotated, &finfo) == 0) && (n < 1000) ) snprintf(rotated + l, 16, ".%d", ++n);
         
-        DEBUG("Database: connecting to file '%s'", THE_DB->filename);
-        THE_DB->fptr = fopen(THE_DB->filename, "a");
-        if ( ! THE_DB->fptr ) {
-            if ( error_msg ) {
-                strerror_r(errno, THE_DB->error_buffer, sizeof(THE_DB->error_buffer));
-                *error_msg = THE_DB->error_buffer;
+        if ( THE_DB->sync_mode != db_instance_csvfile_sync_none ) fdatasync(old_fd);
+        if ( rename(THE_DB->filename, rotated) == 0 ) {
+            INFO("Database: rotated '%s' to '%s'", THE_DB->filename, rotated);
+            if ( __db_instance_csvfile_open_file(THE_DB, NULL) ) {
+                close(old_fd);
+            } else {
+                ERROR("Database: unable to open '%s' after rotation, continuing with '%s'", THE_DB->filename, rotated);
+                THE_DB->fd = old_fd;
+                clock_gettime(CLOCK_MONOTONIC, &THE_DB->file_since);
             }
-            return false;
+        } else {
+            ERROR("Database: unable to rotate '%s' (errno=%d)", THE_DB->filename, errno);
+            clock_gettime(CLOCK_MONOTONIC, &THE_DB->file_since);
         }
+        free((void*)rotated);
+    }
+}
+
+//
+
+/*
+ * Write the entire buffer to the file, then sync and rotate per the
+ * configured policies.  On error the unwritten portion of the buffer is
+ * retained so the next attempt picks up where this one stopped.
+ */
+static bool
+__db_instance_csvfile_write_buffer(
+    db_instance_csvfile_t   *THE_DB,
+    const char              **error_msg
+)
+{
+    size_t                  offset = 0;
+    
+    if ( THE_DB->fd < 0 ) {
+        if ( error_msg ) *error_msg = __db_instance_csvfile_set_error(THE_DB, EBADF);
+        return false;
+    }
+    while ( offset < THE_DB->buffer_len ) {
+        ssize_t             n = write(THE_DB->fd, THE_DB->buffer + offset, THE_DB->buffer_len - offset);
         
-        DEBUG("Database: file open, database interface ready");
+        if ( n < 0 ) {
+            if ( errno == EINTR ) continue;
+            if ( error_msg ) *error_msg = __db_instance_csvfile_set_error(THE_DB, errno);
+            if ( offset ) memmove(THE_DB->buffer, THE_DB->buffer + offset, THE_DB->buffer_len - offset);
+            THE_DB->buffer_len -= offset;
+            THE_DB->file_bytes += offset;
+            return false;
+        }
+        offset += n;
+    }
+    THE_DB->file_bytes += offset;
+    THE_DB->buffer_len = 0;
+    
+    if ( offset && (THE_DB->sync_mode == db_instance_csvfile_sync_flush) ) fdatasync(THE_DB->fd);
+    
+    if ( (THE_DB->rotate_max_bytes && (THE_DB->file_bytes >= THE_DB->rotate_max_bytes)) ||
+         (THE_DB->rotate_interval_seconds && (__db_instance_csvfile_ms_since(&THE_DB->file_since) / 1000 >= THE_DB->rotate_interval_seconds)) )
+    {
+        __db_instance_csvfile_rotate(THE_DB);
     }
     return true;
 }
@@ -172,30 +435,41 @@ __db_instance_csvfile_close(
 )
 {
     db_instance_csvfile_t   *THE_DB = (db_instance_csvfile_t*)the_db;
+    bool                    okay = true;
     
-    if ( THE_DB->fptr ) {
-        fclose(THE_DB->fptr);
-        THE_DB->fptr = NULL;
+    if ( THE_DB->fd >= 0 ) {
+        if ( THE_DB->buffer_len ) okay = __db_instance_csvfile_write_buffer(THE_DB, error_msg);
+        if ( THE_DB->sync_mode != db_instance_csvfile_sync_none ) fdatasync(THE_DB->fd);
+        close(THE_DB->fd);
+        THE_DB->fd = -1;
     }
-    return true;
+    return okay;
 }
 
 //
 
-bool
-__db_instance_csvfile_log_one_event(
-    db_instance_t   *the_db,
-    log_data_t      *the_event,
-    const char      **error_msg
+/*
+ * Format <the_event> onto the end of the buffer, writing the buffer out
+ * first if the record will not fit.
+ */
+static bool
+__db_instance_csvfile_append_event(
+    db_instance_csvfile_t   *THE_DB,
+    log_data_t              *the_event,
+    const char              **error_msg
 )
 {
-    db_instance_csvfile_t  *THE_DB = (db_instance_csvfile_t*)the_db;
-    bool                    okay = false;
+    int                     n_tries = 2;
+    log_data_strs_t         strs;
     
-    if ( THE_DB->fptr ) {
-        int         rc;
+    /* A text file is the one place every field has to be formatted: */
+    log_data_to_strs(the_event, &strs);
+    while ( n_tries-- ) {
+        size_t              n_avail = THE_DB->buffer_capacity - THE_DB->buffer_len;
+        int                 rc;
         
-        rc = fprintf(THE_DB->fptr, "%2$s"
+        rc = snprintf(THE_DB->buffer + THE_DB->buffer_len, n_avail,
+                                   "%2$s"
                                    "%1$s%3$s"
                                    "%1$s%4$d"
                                    "%1$s%5$s"
@@ -203,22 +477,104 @@ __db_instance_csvfile_log_one_event(
                                    "%1$s%7$s"
                                    "%1$s%8$s\n",
                 THE_DB->delimiter ? THE_DB->delimiter : ",",
-                the_event->dst_ipaddr,
-                the_event->src_ipaddr,
+                strs.dst_ipaddr,
+                strs.src_ipaddr,
                 the_event->src_port,
                 log_event_to_str(the_event->event),
                 (long int)the_event->sshd_pid,
                 the_event->uid,
-                the_event->log_date);
-        if ( rc <= 0 ) {
-            if ( error_msg ) {
-                strerror_r(rc, THE_DB->error_buffer, sizeof(THE_DB->error_buffer));
-                *error_msg = THE_DB->error_buffer;
-            }
-        } else {
-            fflush(THE_DB->fptr);
-            okay = true;
+                strs.log_date);
+        if ( rc < 0 ) {
+            if ( error_msg ) *error_msg = __db_instance_csvfile_set_error(THE_DB, errno);
+            return false;
+        }
+        if ( (size_t)rc < n_avail ) {
+            if ( THE_DB->buffer_len == 0 ) clock_gettime(CLOCK_MONOTONIC, &THE_DB->buffer_since);
+            THE_DB->buffer_len += rc;
+            return true;
         }
+        /* Didn't fit, make room and try again: */
+        if ( ! __db_instance_csvfile_write_buffer(THE_DB, error_msg) ) return false;
     }
-    return okay;
+    if ( error_msg ) *error_msg = __db_instance_csvfile_set_error(THE_DB, EMSGSIZE);
+    return false;
+}
+
+//
+
+/*
+ * Write the buffer out if it has reached its size or age limit.
+ */
+static bool
+__db_instance_csvfile_check_buffer(
+    db_instance_csvfile_t   *THE_DB,
+    const char              **error_msg
+)
+{
+    if ( THE_DB->buffer_len == 0 ) return true;
+    if ( (THE_DB->buffer_len >= THE_DB->buffer_size) ||
+         (__db_instance_csvfile_ms_since(&THE_DB->buffer_since) >= THE_DB->flush_interval_ms) )
+    {
+        return __db_instance_csvfile_write_buffer(THE_DB, error_msg);
+    }
+    return true;
+}
+
+//
+
+bool
+__db_instance_csvfile_log_one_event(
+    db_instance_t   *the_db,
+    log_data_t      *the_event,
+    const char      **error_msg
+)
+{
+    db_instance_csvfile_t  *THE_DB = (db_instance_csvfile_t*)the_db;
+    
+    if ( THE_DB->fd < 0 ) return false;
+    if ( ! __db_instance_csvfile_append_event(THE_DB, the_event, error_msg) ) return false;
+    
+    /* A write failure here leaves the record buffered for the next attempt: */
+    if ( ! __db_instance_csvfile_check_buffer(THE_DB, error_msg) ) {
+        ERROR("Database: unable to write to '%s': %s", THE_DB->filename, THE_DB->error_buffer);
+    }
+    return true;
+}
+
+//
+
+bool
+__db_instance_csvfile_log_events(
+    db_instance_t   *the_db,
+    log_data_t      *events,
+    size_t          n_events,
+    size_t          *n_logged,
+    const char      **error_msg
+)
+{
+    db_instance_csvfile_t  *THE_DB = (db_instance_csvfile_t*)the_db;
+    
+    if ( THE_DB->fd < 0 ) return false;
+    while ( *n_logged < n_events ) {
+        if ( ! __db_instance_csvfile_append_event(THE_DB, &events[*n_logged], error_msg) ) return false;
+        (*n_logged)++;
+    }
+    if ( ! __db_instance_csvfile_check_buffer(THE_DB, error_msg) ) {
+        ERROR("Database: unable to write to '%s': %s", THE_DB->filename, THE_DB->error_buffer);
+    }
+    return true;
+}
+
+//
+
+bool
+__db_instance_csvfile_flush(
+    db_instance_t   *the_db,
+    const char      **error_msg
+)
+{
+    db_instance_csvfile_t  *THE_DB = (db_instance_csvfile_t*)the_db;
+    
+    if ( (THE_DB->fd < 0) || (THE_DB->buffer_len == 0) ) return true;
+    return __db_instance_csvfile_write_buffer(THE_DB, error_msg);
 }
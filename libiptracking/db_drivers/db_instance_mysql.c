@@ -19,6 +19,57 @@ static const char   *db_mysql_log_stmt_query_str = DB_INSTANCE_MYSQL_LOG_STMT_QU
 static const int    db_mysql_log_stmt_nparams = DB_INSTANCE_MYSQL_LOG_STMT_NPARAMS;
 static const char   *db_mysql_blocklist_stmt_query_str = DB_INSTANCE_MYSQL_BLOCKLIST_STMT_QUERY_STR;
 
+/*
+ * In batch-insert mode, events are written with multi-row INSERT statements
+ * of a few fixed sizes (largest first), each prepared once per connection
+ * and cached; any remainder smaller than the smallest size goes through the
+ * log_one_event() procedure.  The whole batch is one transaction.  Rows
+ * bind the binary values directly:  inet_log_raw holds IPv4 addresses as
+ * integers (an IPv6 address is bound as NULL and so refused), and the
+ * timestamp as a MYSQL_TIME:
+ */
+#define DB_INSTANCE_MYSQL_BATCH_INSERT_PREFIX_STR "INSERT INTO iptracking.inet_log_raw " \
+                                                    "(dst_ipaddr, src_ipaddr, src_port, log_event, sshd_pid, uid, log_date) VALUES "
+#define DB_INSTANCE_MYSQL_BATCH_INSERT_ROW_STR "(?, ?, ?, ?, ?, ?, ?)"
+#define DB_INSTANCE_MYSQL_BATCH_SIZES_COUNT 3
+#define DB_INSTANCE_MYSQL_BATCH_SIZE_MAX 64
+
+static const char   *db_mysql_batch_insert_prefix_str = DB_INSTANCE_MYSQL_BATCH_INSERT_PREFIX_STR;
+static const char   *db_mysql_batch_insert_row_str = DB_INSTANCE_MYSQL_BATCH_INSERT_ROW_STR;
+static const int    db_mysql_batch_sizes[DB_INSTANCE_MYSQL_BATCH_SIZES_COUNT] = { DB_INSTANCE_MYSQL_BATCH_SIZE_MAX, 16, 4 };
+
+//
+
+typedef struct {
+    unsigned int        dst_ipaddr, src_ipaddr;
+    int                 src_port, log_event, sshd_pid;
+    unsigned long       uid_length;
+    MYSQL_TIME          log_date;
+} db_instance_mysql_batch_row_t;
+
+//
+
+static void
+__db_instance_mysql_time_init(
+    MYSQL_TIME      *mysql_time,
+    int64_t         log_time_ns
+)
+{
+    time_t          when = (time_t)(log_time_ns / 1000000000);
+    struct tm       when_tm;
+    
+    memset(mysql_time, 0, sizeof(MYSQL_TIME));
+    if ( localtime_r(&when, &when_tm) ) {
+        mysql_time->year = when_tm.tm_year + 1900;
+        mysql_time->month = when_tm.tm_mon + 1;
+        mysql_time->day = when_tm.tm_mday;
+        mysql_time->hour = when_tm.tm_hour;
+        mysql_time->minute = when_tm.tm_min;
+        mysql_time->second = when_tm.tm_sec;
+    }
+    mysql_time->time_type = MYSQL_TIMESTAMP_DATETIME;
+}
+
 //
 
 typedef struct {
@@ -30,11 +81,16 @@ typedef struct {
     const char          *db;
     unsigned int        port;
     const char          *unix_socket;
+    bool                is_batch_insert;
     //
     bool                is_connected;
     MYSQL               db_handle;
     //
     MYSQL_STMT          *log_statement;
+    //
+    MYSQL_STMT          *batch_statements[DB_INSTANCE_MYSQL_BATCH_SIZES_COUNT];
+    MYSQL_BIND          *batch_binds;
+    db_instance_mysql_batch_row_t   *batch_rows;
 } db_instance_mysql_t;
 
 //
@@ -46,6 +102,7 @@ static void __db_instance_mysql_summarize_to_log(db_instance_t *the_db);
 static bool __db_instance_mysql_open(db_instance_t *the_db, const char **error_msg);
 static bool __db_instance_mysql_close(db_instance_t *the_db, const char **error_msg);
 static bool __db_instance_mysql_log_one_event(db_instance_t *the_db, log_data_t *the_event, const char **error_msg);
+static bool __db_instance_mysql_log_events(db_instance_t *the_db, log_data_t *events, size_t n_events, size_t *n_logged, const char **error_msg);
 static struct db_blocklist_enum* __db_instance_mysql_blocklist_enum_open(db_instance_t *the_db, const char **error_msg);
 
 //
@@ -60,6 +117,8 @@ static db_driver_callbacks_t    db_driver_mysql_callbacks = {
         .open = __db_instance_mysql_open,
         .close = __db_instance_mysql_close,
         .log_one_event = __db_instance_mysql_log_one_event,
+        .log_events = __db_instance_mysql_log_events,
+        .flush = NULL,
         .blocklist_enum_open = __db_instance_mysql_blocklist_enum_open,
         
         .blocklist_async_notification_toggle = NULL
@@ -85,6 +144,7 @@ __db_instance_mysql_alloc(
     const char                  *db = NULL;
     unsigned int                port = MYSQL_PORT;
     const char                  *unix_socket = NULL;
+    bool                        is_batch_insert = false;
     
     /*
      * Check for any recognizable database connection properties items:
@@ -114,6 +174,12 @@ __db_instance_mysql_alloc(
         unix_socket = yaml_helper_get_scalar_value(prop_node);
         if ( unix_socket ) extra_bytes += strlen(unix_socket) + 1;
     }
+    if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "pamd.batch-insert")) ) {
+        if ( ! yaml_helper_get_scalar_bool_value(prop_node, &is_batch_insert) ) {
+            ERROR("Database: invalid pamd.batch-insert value");
+            return NULL;
+        }
+    }
     
     /* Ready to allocate: */
     new_instance = (db_instance_mysql_t*)__db_instance_alloc(
@@ -163,6 +229,7 @@ __db_instance_mysql_alloc(
         }
 #undef DB_INSTANCE_mysql_P_INC
         
+        new_instance->is_batch_insert = is_batch_insert;
         new_instance->is_connected = false;
     }
     return (db_instance_t*)new_instance;
@@ -175,6 +242,10 @@ __db_instance_mysql_dealloc(
     db_instance_t   *the_db
 )
 {
+    db_instance_mysql_t     *THE_DB = (db_instance_mysql_t*)the_db;
+    
+    if ( THE_DB->batch_binds ) free((void*)THE_DB->batch_binds);
+    if ( THE_DB->batch_rows ) free((void*)THE_DB->batch_rows);
 }
 
 //
@@ -205,6 +276,7 @@ __db_instance_mysql_summarize_to_log(
     INFO("Database: db = %s", THE_DB->user ? THE_DB->db : "<not-set>");
     INFO("Database: port = %u", THE_DB->port);
     INFO("Database: unix_socket = %s", THE_DB->unix_socket ? THE_DB->unix_socket : "<not-set>");
+    INFO("Database: batch-insert = %s", THE_DB->is_batch_insert ? "yes" : "no");
 }
 
 //
@@ -290,9 +362,15 @@ __db_instance_mysql_close(
     db_instance_mysql_t    *THE_DB = (db_instance_mysql_t*)the_db;
     
     if ( THE_DB->is_connected ) {
+        int                 i;
+        
         DEBUG("Database: closing connection");        
         if ( THE_DB->log_statement ) mysql_stmt_close(THE_DB->log_statement);
         THE_DB->log_statement = NULL;
+        for ( i = 0; i < DB_INSTANCE_MYSQL_BATCH_SIZES_COUNT; i++ ) {
+            if ( THE_DB->batch_statements[i] ) mysql_stmt_close(THE_DB->batch_statements[i]);
+            THE_DB->batch_statements[i] = NULL;
+        }
         mysql_close(&THE_DB->db_handle);
         THE_DB->is_connected = false;
     }
@@ -313,11 +391,15 @@ __db_instance_mysql_log_one_event(
     while ( THE_DB->is_connected ) {
         MYSQL_BIND          param_values[DB_INSTANCE_MYSQL_LOG_STMT_NPARAMS];
         unsigned long       param_lengths[DB_INSTANCE_MYSQL_LOG_STMT_NPARAMS];
-        char                src_port_str[32], sshd_pid_str[32];
+        char                dst_ipaddr[LOG_DATA_ADDR_STRLEN], src_ipaddr[LOG_DATA_ADDR_STRLEN];
+        int                 src_port = the_event->src_port, sshd_pid = the_event->sshd_pid;
+        MYSQL_TIME          log_date;
         const char          *event_str;
         
-        snprintf(src_port_str, sizeof(src_port_str), "%hu", the_event->src_port);
-        snprintf(sshd_pid_str, sizeof(sshd_pid_str), "%ld", (long int)the_event->sshd_pid);
+        /* The procedure takes addresses in textual form (for INET_ATON()): */
+        log_data_addr_to_str(the_event->dst_family, the_event->dst_addr, dst_ipaddr);
+        log_data_addr_to_str(the_event->src_family, the_event->src_addr, src_ipaddr);
+        __db_instance_mysql_time_init(&log_date, the_event->log_time_ns);
         event_str = log_event_to_str(the_event->event);
         
         // Reset the prepared statement state:
@@ -328,21 +410,26 @@ __db_instance_mysql_log_one_event(
         
         // Bind parameters to the query:
         memset(param_values, 0, sizeof(param_values));
-#define __BIND_STRING(IDX, S) \
+#define __BIND_STRING(IDX, S, L) \
         param_values[(IDX)].buffer_type = MYSQL_TYPE_STRING; \
         param_values[(IDX)].buffer = (char*)(S); \
-        param_lengths[(IDX)] = strlen((S)); \
+        param_lengths[(IDX)] = (L); \
         param_values[(IDX)].length = &param_lengths[(IDX)]; \
         param_values[(IDX)].buffer_length = param_lengths[(IDX)] + 1;
+#define __BIND_INT(IDX, V) \
+        param_values[(IDX)].buffer_type = MYSQL_TYPE_LONG; \
+        param_values[(IDX)].buffer = (char*)&(V);
         
-        __BIND_STRING(0, the_event->dst_ipaddr);
-        __BIND_STRING(1, the_event->src_ipaddr);
-        __BIND_STRING(2, src_port_str);
-        __BIND_STRING(3, event_str);
-        __BIND_STRING(4, sshd_pid_str);
-        __BIND_STRING(5, the_event->uid);
-        __BIND_STRING(6, the_event->log_date);
+        __BIND_STRING(0, dst_ipaddr, strlen(dst_ipaddr));
+        __BIND_STRING(1, src_ipaddr, strlen(src_ipaddr));
+        __BIND_INT(2, src_port);
+        __BIND_STRING(3, event_str, strlen(event_str));
+        __BIND_INT(4, sshd_pid);
+        __BIND_STRING(5, the_event->uid, the_event->uid_len);
+        param_values[6].buffer_type = MYSQL_TYPE_DATETIME;
+        param_values[6].buffer = (char*)&log_date;
         
+#undef __BIND_INT
 #undef __BIND_STRING
 
         if ( mysql_stmt_bind_param(THE_DB->log_statement, param_values) != 0 ) {
@@ -364,6 +451,196 @@ __db_instance_mysql_log_one_event(
 
 //
 
+static MYSQL_STMT*
+__db_instance_mysql_batch_statement(
+    db_instance_mysql_t     *THE_DB,
+    int                     size_idx
+)
+{
+    if ( ! THE_DB->batch_statements[size_idx] ) {
+        int                 n_rows = db_mysql_batch_sizes[size_idx];
+        size_t              prefix_len = strlen(db_mysql_batch_insert_prefix_str);
+        size_t              row_len = strlen(db_mysql_batch_insert_row_str);
+        char                *query = (char*)malloc(prefix_len + n_rows * (row_len + 1) + 1);
+        MYSQL_STMT          *stmt;
+        
+        if ( ! query ) return NULL;
+        
+        /* Build the statement text: */
+        {
+            char            *p = stpcpy(query, db_mysql_batch_insert_prefix_str);
+            int             i;
+            
+            for ( i = 0; i < n_rows; i++ ) {
+                if ( i ) *p++ = ',';
+                p = stpcpy(p, db_mysql_batch_insert_row_str);
+            }
+        }
+        if ( (stmt = mysql_stmt_init(&THE_DB->db_handle)) ) {
+            if ( mysql_stmt_prepare(stmt, query, -1) == 0 ) {
+                DEBUG("Database: prepared %d-row insert statement", n_rows);
+                THE_DB->batch_statements[size_idx] = stmt;
+            } else {
+                ERROR("Database: unable to prepare %d-row insert statement: %s", n_rows, mysql_stmt_error(stmt));
+                mysql_stmt_close(stmt);
+            }
+        }
+        free((void*)query);
+    }
+    return THE_DB->batch_statements[size_idx];
+}
+
+//
+
+static bool
+__db_instance_mysql_batch_insert(
+    db_instance_mysql_t     *THE_DB,
+    MYSQL_STMT              *stmt,
+    log_data_t              *events,
+    int                     n_rows
+)
+{
+    MYSQL_BIND              *bind = THE_DB->batch_binds;
+    int                     i;
+    
+    memset(bind, 0, n_rows * DB_INSTANCE_MYSQL_LOG_STMT_NPARAMS * sizeof(MYSQL_BIND));
+    for ( i = 0; i < n_rows; i++ ) {
+        log_data_t                      *the_event = &events[i];
+        db_instance_mysql_batch_row_t   *row = &THE_DB->batch_rows[i];
+        
+        /* An IPv4 address is the first 4 bytes, in network order: */
+        memcpy(&row->dst_ipaddr, the_event->dst_addr, sizeof(row->dst_ipaddr)); row->dst_ipaddr = ntohl(row->dst_ipaddr);
+        memcpy(&row->src_ipaddr, the_event->src_addr, sizeof(row->src_ipaddr)); row->src_ipaddr = ntohl(row->src_ipaddr);
+        row->src_port = the_event->src_port;
+        row->log_event = the_event->event;
+        row->sshd_pid = the_event->sshd_pid;
+        row->uid_length = the_event->uid_len;
+        __db_instance_mysql_time_init(&row->log_date, the_event->log_time_ns);
+        
+#define __BIND_ADDR(FAMILY, V) \
+        if ( (FAMILY) == log_addr_family_ipv4 ) { \
+            bind->buffer_type = MYSQL_TYPE_LONG; \
+            bind->buffer = (char*)&(V); \
+            bind->is_unsigned = 1; \
+        } else { \
+            bind->buffer_type = MYSQL_TYPE_NULL; \
+        } \
+        bind++;
+#define __BIND_INT(V) \
+        bind->buffer_type = MYSQL_TYPE_LONG; \
+        bind->buffer = (char*)&(V); \
+        bind++;
+        
+        __BIND_ADDR(the_event->dst_family, row->dst_ipaddr);
+        __BIND_ADDR(the_event->src_family, row->src_ipaddr);
+        __BIND_INT(row->src_port);
+        __BIND_INT(row->log_event);
+        __BIND_INT(row->sshd_pid);
+        bind->buffer_type = MYSQL_TYPE_STRING;
+        bind->buffer = (char*)the_event->uid;
+        bind->buffer_length = row->uid_length + 1;
+        bind->length = &row->uid_length;
+        bind++;
+        bind->buffer_type = MYSQL_TYPE_DATETIME;
+        bind->buffer = (char*)&row->log_date;
+        bind++;
+        
+#undef __BIND_ADDR
+#undef __BIND_INT
+    }
+    if ( mysql_stmt_bind_param(stmt, THE_DB->batch_binds) != 0 ) return false;
+    if ( mysql_stmt_execute(stmt) != 0 ) return false;
+    return (mysql_stmt_reset(stmt) == 0);
+}
+
+//
+
+static bool
+__db_instance_mysql_log_events_batch(
+    db_instance_mysql_t     *THE_DB,
+    log_data_t              *events,
+    size_t                  n_events,
+    const char              **error_msg
+)
+{
+    size_t                  n_done = 0;
+    int                     size_idx = 0;
+    
+    if ( mysql_query(&THE_DB->db_handle, "START TRANSACTION") != 0 ) {
+        if ( error_msg ) *error_msg = __db_instance_set_last_error(&THE_DB->base, mysql_error(&THE_DB->db_handle), -1);
+        return false;
+    }
+    while ( n_done < n_events ) {
+        size_t              n_left = n_events - n_done;
+        
+        /* Use the largest statement that fits the remainder: */
+        while ( (size_idx < DB_INSTANCE_MYSQL_BATCH_SIZES_COUNT) && (n_left < (size_t)db_mysql_batch_sizes[size_idx]) ) size_idx++;
+        if ( size_idx < DB_INSTANCE_MYSQL_BATCH_SIZES_COUNT ) {
+            MYSQL_STMT      *stmt = __db_instance_mysql_batch_statement(THE_DB, size_idx);
+            
+            if ( ! stmt ) {
+                if ( error_msg ) *error_msg = __db_instance_set_last_error(&THE_DB->base, "unable to prepare batch insert statement", -1);
+                break;
+            }
+            if ( ! __db_instance_mysql_batch_insert(THE_DB, stmt, &events[n_done], db_mysql_batch_sizes[size_idx]) ) {
+                if ( error_msg ) *error_msg = __db_instance_set_last_error(&THE_DB->base, mysql_stmt_error(stmt), -1);
+                break;
+            }
+            n_done += db_mysql_batch_sizes[size_idx];
+        } else {
+            if ( ! __db_instance_mysql_log_one_event(&THE_DB->base, &events[n_done], error_msg) ) break;
+            n_done++;
+        }
+    }
+    if ( (n_done == n_events) && (mysql_commit(&THE_DB->db_handle) == 0) ) return true;
+    if ( (n_done == n_events) && error_msg ) *error_msg = __db_instance_set_last_error(&THE_DB->base, mysql_error(&THE_DB->db_handle), -1);
+    mysql_rollback(&THE_DB->db_handle);
+    return false;
+}
+
+//
+
+bool
+__db_instance_mysql_log_events(
+    db_instance_t   *the_db,
+    log_data_t      *events,
+    size_t          n_events,
+    size_t          *n_logged,
+    const char      **error_msg
+)
+{
+    db_instance_mysql_t     *THE_DB = (db_instance_mysql_t*)the_db;
+    
+    if ( THE_DB->is_connected && THE_DB->is_batch_insert && (n_events > 1) ) {
+        const char          *batch_error_msg = NULL;
+        
+        if ( ! THE_DB->batch_binds ) {
+            THE_DB->batch_binds = (MYSQL_BIND*)malloc(DB_INSTANCE_MYSQL_BATCH_SIZE_MAX * DB_INSTANCE_MYSQL_LOG_STMT_NPARAMS * sizeof(MYSQL_BIND));
+            THE_DB->batch_rows = (db_instance_mysql_batch_row_t*)malloc(DB_INSTANCE_MYSQL_BATCH_SIZE_MAX * sizeof(db_instance_mysql_batch_row_t));
+        }
+        if ( THE_DB->batch_binds && THE_DB->batch_rows ) {
+            while ( *n_logged < n_events ) {
+                size_t      n_chunk = n_events - *n_logged;
+                
+                if ( ! __db_instance_mysql_log_events_batch(THE_DB, &events[*n_logged], n_chunk, &batch_error_msg) ) break;
+                DEBUG("Database: committed %lu events", (unsigned long)n_chunk);
+                *n_logged += n_chunk;
+            }
+            if ( *n_logged == n_events ) return true;
+            /* Everything was rolled back, so find the offending event(s) one at a time: */
+            WARN("Database: batch insert of %lu events failed, retrying individually: %s",
+                    (unsigned long)(n_events - *n_logged), batch_error_msg ? batch_error_msg : "unknown");
+        }
+    }
+    while ( *n_logged < n_events ) {
+        if ( ! __db_instance_mysql_log_one_event(the_db, &events[*n_logged], error_msg) ) return false;
+        (*n_logged)++;
+    }
+    return true;
+}
+
+//
+
 typedef struct {
     db_blocklist_enum_t     base;
     //
@@ -390,6 +667,10 @@ __db_instance_mysql_blocklist_enum_next(
     if ( THE_ENUM && ! THE_ENUM->is_done ) {
         rc = mysql_stmt_fetch(THE_ENUM->query);
         if ( rc == 1 || rc == MYSQL_NO_DATA ) {
+            if ( rc == 1 ) {
+                ERROR("Database:  blocklist enum:  failed to fetch block list row:  %s", mysql_stmt_error(THE_ENUM->query));
+                THE_ENUM->base.is_failed = true;
+            }
             THE_ENUM->is_done = true;
         } else {
             if ( ! THE_ENUM->bind_is_null && THE_ENUM->bind_length ) return (const char*)THE_ENUM->bind_str;
@@ -447,8 +728,10 @@ __db_instance_mysql_blocklist_enum_open(
                         if ( rc == 0 ) {
                             new_enum->query = query;
                             new_enum->is_done = false;
+                            new_enum->base.is_failed = false;
                             
                             new_enum->base.next = __db_instance_mysql_blocklist_enum_next;
+                            new_enum->base.next_expiring = NULL;
                             new_enum->base.close = __db_instance_mysql_blocklist_enum_close;
                     
                             DEBUG("Database:  blocklist enum:  opened enumerator %p", new_enum);
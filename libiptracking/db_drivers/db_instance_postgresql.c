@@ -8,18 +8,91 @@
 
 #include <libpq-fe.h>
 #include <poll.h>
+#include <endian.h>
 
 //
 
 #define DB_INSTANCE_POSTGRESQL_LOG_STMT_NAME_STR "log_one_event"
 #define DB_INSTANCE_POSTGRESQL_LOG_STMT_NPARAMS 7
-#define DB_INSTANCE_POSTGRESQL_LOG_STMT_QUERY_FORMAT "SELECT %s%slog_one_event($1, $2, $3, $4, $5, $6, $7);"
+#define DB_INSTANCE_POSTGRESQL_LOG_STMT_QUERY_FORMAT "SELECT %s%slog_one_event(host($1), host($2), $3::TEXT, $4, $5::TEXT, $6, $7::TEXT);"
 #define DB_INSTANCE_POSTGRESQL_BLOCKLIST_STMT_QUERY_FORMAT "SELECT ip_entity FROM %s%sblock_now"
 
+/*
+ * The block list with the (epoch) time at which each block ends; schemas
+ * that predate the view fall back to the query above:
+ */
+#define DB_INSTANCE_POSTGRESQL_BLOCKLIST_EXPIRING_STMT_QUERY_FORMAT "SELECT ip_entity, EXTRACT(EPOCH FROM end_date)::BIGINT FROM %s%sblock_now_with_end_date"
+
+/*
+ * The block list query runs behind a cursor inside its own transaction;
+ * the enumerator FETCHes this many rows at a time so that memory use
+ * does not grow with the size of the block list:
+ */
+#define DB_INSTANCE_POSTGRESQL_BLOCKLIST_CURSOR_NAME "iptracking_blocklist"
+#define DB_INSTANCE_POSTGRESQL_BLOCKLIST_FETCH_ROWS 5000
+#define DB_INSTANCE_POSTGRESQL_BLOCKLIST_DECLARE_QUERY_FORMAT "BEGIN; DECLARE " DB_INSTANCE_POSTGRESQL_BLOCKLIST_CURSOR_NAME " NO SCROLL CURSOR FOR %s"
+#define DB_INSTANCE_POSTGRESQL_STR_(X) #X
+#define DB_INSTANCE_POSTGRESQL_STR(X) DB_INSTANCE_POSTGRESQL_STR_(X)
+#define DB_INSTANCE_POSTGRESQL_BLOCKLIST_FETCH_QUERY "FETCH " DB_INSTANCE_POSTGRESQL_STR(DB_INSTANCE_POSTGRESQL_BLOCKLIST_FETCH_ROWS) " FROM " DB_INSTANCE_POSTGRESQL_BLOCKLIST_CURSOR_NAME
+
+/*
+ * Batches of at least this many events are sent using COPY into a
+ * per-connection staging table; the server then logs each staged event
+ * via the same log_one_event() function, so filtering, rules, and
+ * triggers behave exactly as for single events:
+ */
+#define DB_INSTANCE_POSTGRESQL_COPY_THRESHOLD_DEFAULT 16
+#define DB_INSTANCE_POSTGRESQL_STAGING_TABLE_QUERY "CREATE TEMPORARY TABLE IF NOT EXISTS iptracking_staged_events (" \
+                                                        "staged_id BIGINT GENERATED ALWAYS AS IDENTITY, " \
+                                                        "dst_ipaddr TEXT, src_ipaddr TEXT, src_port TEXT, log_event TEXT, " \
+                                                        "sshd_pid TEXT, uid TEXT, log_date TEXT" \
+                                                    ") ON COMMIT DELETE ROWS"
+#define DB_INSTANCE_POSTGRESQL_COPY_STMT_QUERY "COPY pg_temp.iptracking_staged_events " \
+                                                    "(dst_ipaddr, src_ipaddr, src_port, log_event, sshd_pid, uid, log_date) " \
+                                                    "FROM STDIN"
+/*
+ * The log_staged_events() function calls log_one_event() unqualified, so
+ * with a configured schema the search path is pointed at it for the rest
+ * of the transaction:
+ */
+#define DB_INSTANCE_POSTGRESQL_STAGED_STMT_QUERY "SELECT log_staged_events()"
+#define DB_INSTANCE_POSTGRESQL_STAGED_STMT_QUERY_FORMAT "SET LOCAL search_path TO %1$s; SELECT %1$s.log_staged_events()"
+
+/*
+ * With a pipeline depth greater than one, batches that are not sent via COPY
+ * have up to that many log_one_event() executions in flight at once:
+ */
+#define DB_INSTANCE_POSTGRESQL_PIPELINE_DEPTH_DEFAULT 0
+
+/*
+ * The log_one_event() parameters are sent in binary form with these types
+ * (the OIDs are fixed by the server's catalog); the query casts them to
+ * the TEXT arguments the function takes:
+ */
+#define DB_INSTANCE_POSTGRESQL_INT4OID 23
+#define DB_INSTANCE_POSTGRESQL_TEXTOID 25
+#define DB_INSTANCE_POSTGRESQL_INETOID 869
+#define DB_INSTANCE_POSTGRESQL_TIMESTAMPTZOID 1184
+
+static const Oid    db_postgresql_log_stmt_types[DB_INSTANCE_POSTGRESQL_LOG_STMT_NPARAMS] = {
+                            DB_INSTANCE_POSTGRESQL_INETOID, DB_INSTANCE_POSTGRESQL_INETOID,
+                            DB_INSTANCE_POSTGRESQL_INT4OID, DB_INSTANCE_POSTGRESQL_TEXTOID,
+                            DB_INSTANCE_POSTGRESQL_INT4OID, DB_INSTANCE_POSTGRESQL_TEXTOID,
+                            DB_INSTANCE_POSTGRESQL_TIMESTAMPTZOID
+                        };
+static const int    db_postgresql_log_stmt_formats[DB_INSTANCE_POSTGRESQL_LOG_STMT_NPARAMS] = { 1, 1, 1, 1, 1, 1, 1 };
+
 static const char   *db_postgresql_log_stmt_name = DB_INSTANCE_POSTGRESQL_LOG_STMT_NAME_STR;
 static const char   *db_postgresql_log_stmt_query_format = DB_INSTANCE_POSTGRESQL_LOG_STMT_QUERY_FORMAT;
 static const int    db_postgresql_log_stmt_nparams = DB_INSTANCE_POSTGRESQL_LOG_STMT_NPARAMS;
 static const char   *db_postgresql_blocklist_stmt_query_format = DB_INSTANCE_POSTGRESQL_BLOCKLIST_STMT_QUERY_FORMAT;
+static const char   *db_postgresql_blocklist_expiring_stmt_query_format = DB_INSTANCE_POSTGRESQL_BLOCKLIST_EXPIRING_STMT_QUERY_FORMAT;
+static const char   *db_postgresql_blocklist_declare_query_format = DB_INSTANCE_POSTGRESQL_BLOCKLIST_DECLARE_QUERY_FORMAT;
+static const char   *db_postgresql_blocklist_fetch_query = DB_INSTANCE_POSTGRESQL_BLOCKLIST_FETCH_QUERY;
+static const char   *db_postgresql_staging_table_query = DB_INSTANCE_POSTGRESQL_STAGING_TABLE_QUERY;
+static const char   *db_postgresql_copy_stmt_query = DB_INSTANCE_POSTGRESQL_COPY_STMT_QUERY;
+static const char   *db_postgresql_staged_stmt_query = DB_INSTANCE_POSTGRESQL_STAGED_STMT_QUERY;
+static const char   *db_postgresql_staged_stmt_query_format = DB_INSTANCE_POSTGRESQL_STAGED_STMT_QUERY_FORMAT;
 
 //
 
@@ -78,12 +151,18 @@ typedef struct {
     const char*         pam_schema;
     const char*         firewall_schema;
     const char*         firewall_notify_channel;
+    uint32_t            copy_threshold;
+    uint32_t            pipeline_depth;
     //
     pthread_t           main_thread;
     PGconn              *db_conn;
     pthread_t           async_thread;
     PGconn              *db_conn_async;
     //
+    char                *db_staged_stmt_query;
+    bool                is_copy_available;
+    bool                is_blocklist_end_date_missing;
+    //
     bool                is_notify_running;
     pthread_t           notify_thread;
 } db_instance_postgresql_t;
@@ -113,6 +192,7 @@ static void __db_instance_postgresql_summarize_to_log(db_instance_t *the_db);
 static bool __db_instance_postgresql_open(db_instance_t *the_db, const char **error_msg);
 static bool __db_instance_postgresql_close(db_instance_t *the_db, const char **error_msg);
 static bool __db_instance_postgresql_log_one_event(db_instance_t *the_db, log_data_t *the_event, const char **error_msg);
+static bool __db_instance_postgresql_log_events(db_instance_t *the_db, log_data_t *events, size_t n_events, size_t *n_logged, const char **error_msg);
 static struct db_blocklist_enum* __db_instance_postgresql_blocklist_enum_open(db_instance_t *the_db, const char **error_msg);
 static bool __db_instance_postgresql_blocklist_async_notification_toggle(struct db_instance *the_db, bool start_if_true, const char **error_msg);
 
@@ -128,6 +208,8 @@ static db_driver_callbacks_t    db_driver_postgresql_callbacks = {
         .open = __db_instance_postgresql_open,
         .close = __db_instance_postgresql_close,
         .log_one_event = __db_instance_postgresql_log_one_event,
+        .log_events = __db_instance_postgresql_log_events,
+        .flush = NULL,
         .blocklist_enum_open = __db_instance_postgresql_blocklist_enum_open,
         
         .blocklist_async_notification_toggle = __db_instance_postgresql_blocklist_async_notification_toggle
@@ -145,6 +227,8 @@ __db_instance_postgresql_alloc(
     const char* db_conn_values[DB_CONN_KEYS_COUNT];
     int         db_conn_idx = 0;
     const char  *pam_schema = NULL, *firewall_schema = NULL, *firewall_notify_channel = NULL;
+    uint32_t    copy_threshold = DB_INSTANCE_POSTGRESQL_COPY_THRESHOLD_DEFAULT;
+    uint32_t    pipeline_depth = DB_INSTANCE_POSTGRESQL_PIPELINE_DEPTH_DEFAULT;
     
     db_instance_postgresql_t    *new_instance = NULL;
     const char*                 *keys = db_conn_keys;
@@ -181,6 +265,22 @@ __db_instance_postgresql_alloc(
         }
     }
         
+    /* copy_threshold? */
+    if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "pamd.copy-threshold")) ) {
+        if ( ! yaml_helper_get_scalar_uint32_value(prop_node, &copy_threshold) ) {
+            ERROR("Database: invalid pamd.copy-threshold value");
+            return NULL;
+        }
+    }
+        
+    /* pipeline_depth? */
+    if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "pipeline-depth")) ) {
+        if ( ! yaml_helper_get_scalar_uint32_value(prop_node, &pipeline_depth) ) {
+            ERROR("Database: invalid pipeline-depth value");
+            return NULL;
+        }
+    }
+        
     /* firewall_schema? */
     if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "firewalld.schema")) ) {
         v = yaml_helper_get_scalar_value(prop_node);
@@ -212,6 +312,9 @@ __db_instance_postgresql_alloc(
         /* Initialize the thread id: */
         new_instance->main_thread = pthread_self();
         
+        new_instance->copy_threshold = copy_threshold;
+        new_instance->pipeline_depth = pipeline_depth;
+        
 #define DB_INSTANCE_POSTGRESQL_P_INC(T,N)     { size_t dp = (sizeof(T) * (N)); p += dp; extra_bytes -= dp; }
         
         /* Key and value lists setup: */
@@ -277,6 +380,9 @@ __db_instance_postgresql_dealloc(
     db_instance_t   *the_db
 )
 {
+    db_instance_postgresql_t    *THE_DB = (db_instance_postgresql_t*)the_db;
+    
+    if ( THE_DB->db_staged_stmt_query ) free((void*)THE_DB->db_staged_stmt_query);
 }
 
 //
@@ -314,11 +420,106 @@ __db_instance_postgresql_summarize_to_log(
         }
     }
     if ( THE_DB->pam_schema ) INFO("Database: pam schema = %s", THE_DB->pam_schema);
+    if ( THE_DB->copy_threshold ) {
+        INFO("Database: pam copy threshold = %lu", (unsigned long)THE_DB->copy_threshold);
+    } else {
+        INFO("Database: pam copy threshold = disabled");
+    }
+    if ( THE_DB->pipeline_depth > 1 ) {
+        INFO("Database: pipeline depth = %lu", (unsigned long)THE_DB->pipeline_depth);
+    } else {
+        INFO("Database: pipeline depth = disabled");
+    }
     if ( THE_DB->firewall_schema ) INFO("Database: firewall schema = %s", THE_DB->firewall_schema);
 }
 
 //
 
+static void
+__db_instance_postgresql_staging_setup(
+    db_instance_postgresql_t    *THE_DB
+)
+{
+    const char          *schema = (THE_DB->pam_schema && *THE_DB->pam_schema) ? 
+                                            THE_DB->pam_schema : NULL;
+    PGresult            *db_result;
+    ExecStatusType      db_rc;
+    
+    THE_DB->is_copy_available = false;
+    if ( ! THE_DB->db_staged_stmt_query ) {
+        if ( schema ) {
+            if ( asprintf(&THE_DB->db_staged_stmt_query, db_postgresql_staged_stmt_query_format, schema) < 0 ) {
+                THE_DB->db_staged_stmt_query = NULL;
+            }
+        } else {
+            THE_DB->db_staged_stmt_query = strdup(db_postgresql_staged_stmt_query);
+        }
+        if ( ! THE_DB->db_staged_stmt_query ) {
+            WARN("Database: failed to generate staged events query, bulk logging disabled");
+            return;
+        }
+    }
+    /* The staging table lives for the duration of the session: */
+    db_result = PQexec(THE_DB->db_conn, db_postgresql_staging_table_query);
+    db_rc = PQresultStatus(db_result);
+    PQclear(db_result);
+    if ( db_rc == PGRES_COMMAND_OK ) {
+        DEBUG("Database: staging table ready for bulk logging");
+        THE_DB->is_copy_available = true;
+    } else {
+        WARN("Database: unable to create staging table, bulk logging disabled: %s", PQerrorMessage(THE_DB->db_conn));
+    }
+}
+
+//
+
+/*
+ * Create the per-session state used for logging on the main connection:
+ * the prepared log_one_event() statement and (if COPY is enabled) the
+ * staging table.  Needed whenever the session is new, i.e. after
+ * connecting and after a PQreset().
+ */
+static bool
+__db_instance_postgresql_session_setup(
+    db_instance_postgresql_t    *THE_DB,
+    const char                  **error_msg
+)
+{
+    char                        *db_log_stmt_query = NULL;
+    int                         db_log_stmt_query_len;
+    const char                  *schema = (THE_DB->pam_schema && *THE_DB->pam_schema) ? 
+                                                THE_DB->pam_schema : NULL;
+    PGresult                    *db_result;
+    ExecStatusType              db_rc;
+    
+    THE_DB->is_copy_available = false;
+    
+    /* Prepare the query with the schema et al.: */
+    db_log_stmt_query_len = asprintf(&db_log_stmt_query, db_postgresql_log_stmt_query_format,
+                                        schema ? schema : "",
+                                        schema ? "." : "");
+    if ( (db_log_stmt_query_len <= 0) || ! db_log_stmt_query ) {
+        if ( error_msg ) *error_msg = "failed to generate prepared query statement";
+        return false;
+    }
+    
+    /* Send the query to the server for preparation: */
+    db_result = PQprepare(THE_DB->db_conn, db_postgresql_log_stmt_name, db_log_stmt_query,
+                        db_postgresql_log_stmt_nparams, db_postgresql_log_stmt_types);
+    db_rc = PQresultStatus(db_result);
+    PQclear(db_result);
+    free((void*)db_log_stmt_query);
+    if ( db_rc != PGRES_COMMAND_OK ) {
+        if ( error_msg ) *error_msg = __db_instance_set_last_error(&THE_DB->base, PQerrorMessage(THE_DB->db_conn), -1);
+        return false;
+    }
+    DEBUG("Database: logging query prepared");
+    if ( THE_DB->copy_threshold ) __db_instance_postgresql_staging_setup(THE_DB);
+    return true;
+}
+
+//
+
 bool
 __db_instance_postgresql_open(
     db_instance_t   *the_db,
@@ -336,36 +537,8 @@ __db_instance_postgresql_open(
         } else if ( (THE_DB->base.options & db_options_no_pam_logging) == db_options_no_pam_logging ) {
             DEBUG("Database: connection okay (thread 0x%llx / 0x%llx)", (unsigned long long)pthread_self(), (unsigned long long)THE_DB->main_thread);  
         } else {
-            char                *db_log_stmt_query = NULL;
-            int                 db_log_stmt_query_len;
-            const char          *schema = (THE_DB->pam_schema && *THE_DB->pam_schema) ? 
-                                                    THE_DB->pam_schema : NULL;
-            
             DEBUG("Database: connection okay, preparing query");    
-            /* Prepare the query with the schema et al.: */
-            db_log_stmt_query_len = asprintf(&db_log_stmt_query, db_postgresql_log_stmt_query_format,
-                                                schema ? schema : "",
-                                                schema ? "." : "");
-            if ( db_log_stmt_query_len && db_log_stmt_query ) {
-                PGresult            *db_result;
-                ExecStatusType      db_rc;
-                
-                /* Send the query to the server for preparation: */
-                db_result = PQprepare(THE_DB->db_conn, db_postgresql_log_stmt_name, db_log_stmt_query,
-                                    db_postgresql_log_stmt_nparams, NULL);
-                db_rc = PQresultStatus(db_result);
-                PQclear(db_result);
-                free((void*)db_log_stmt_query);
-                if ( db_rc == PGRES_COMMAND_OK ) {
-                    DEBUG("Database: logging query prepared");
-                } else {
-                    if ( error_msg ) *error_msg = __db_instance_set_last_error(the_db, PQerrorMessage(THE_DB->db_conn), -1);
-                    PQfinish(THE_DB->db_conn);
-                    THE_DB->db_conn = NULL;
-                    return false;
-                }
-            } else {
-                if ( error_msg ) *error_msg = "failed to generate prepared query statement";
+            if ( ! __db_instance_postgresql_session_setup(THE_DB, error_msg) ) {
                 PQfinish(THE_DB->db_conn);
                 THE_DB->db_conn = NULL;
                 return false;
@@ -394,12 +567,78 @@ __db_instance_postgresql_close(
             __db_instance_postgresql_blocklist_async_notification_toggle(the_db, false, error_msg);
         PQfinish(THE_DB->db_conn);
         THE_DB->db_conn = NULL;
+        THE_DB->is_copy_available = false;
     }
     return true;
 }
 
 //
 
+typedef struct {
+    const char*     values[DB_INSTANCE_POSTGRESQL_LOG_STMT_NPARAMS];
+    int             lengths[DB_INSTANCE_POSTGRESQL_LOG_STMT_NPARAMS];
+    uint8_t         dst_inet[20], src_inet[20];
+    uint32_t        src_port_be, sshd_pid_be;
+    uint64_t        log_date_be;
+} db_instance_postgresql_log_params_t;
+
+/*
+ * Microseconds between the Unix epoch and the PostgreSQL epoch
+ * (2000-01-01 00:00:00 UTC):
+ */
+#define DB_INSTANCE_POSTGRESQL_EPOCH_OFFSET_US INT64_C(946684800000000)
+
+/*
+ * Binary form of an inet value:  family, prefix bits, is-cidr flag,
+ * address length, then the address.  Returns the number of bytes.
+ */
+static int
+__db_instance_postgresql_inet_init(
+    uint8_t         *inet,
+    uint8_t         family,
+    const uint8_t   *addr
+)
+{
+    int             n_bytes = (family == log_addr_family_ipv6) ? 16 : 4;
+    
+    inet[0] = (family == log_addr_family_ipv6) ? 3 : 2;     /* PGSQL_AF_INET6 : PGSQL_AF_INET */
+    inet[1] = 8 * n_bytes;
+    inet[2] = 0;
+    inet[3] = n_bytes;
+    memcpy(&inet[4], addr, n_bytes);
+    return 4 + n_bytes;
+}
+
+static void
+__db_instance_postgresql_log_params_init(
+    db_instance_postgresql_log_params_t *params,
+    log_data_t                          *the_event
+)
+{
+    const char                          *event_str = log_event_to_str(the_event->event);
+    
+    params->src_port_be = htobe32((uint32_t)the_event->src_port);
+    params->sshd_pid_be = htobe32((uint32_t)the_event->sshd_pid);
+    params->log_date_be = htobe64((uint64_t)(the_event->log_time_ns / 1000 - DB_INSTANCE_POSTGRESQL_EPOCH_OFFSET_US));
+    
+    params->values[0] = (const char*)params->dst_inet;
+    params->lengths[0] = __db_instance_postgresql_inet_init(params->dst_inet, the_event->dst_family, the_event->dst_addr);
+    params->values[1] = (const char*)params->src_inet;
+    params->lengths[1] = __db_instance_postgresql_inet_init(params->src_inet, the_event->src_family, the_event->src_addr);
+    params->values[2] = (const char*)&params->src_port_be;
+    params->lengths[2] = sizeof(params->src_port_be);
+    params->values[3] = event_str;
+    params->lengths[3] = strlen(event_str);
+    params->values[4] = (const char*)&params->sshd_pid_be;
+    params->lengths[4] = sizeof(params->sshd_pid_be);
+    params->values[5] = the_event->uid;
+    params->lengths[5] = the_event->uid_len;
+    params->values[6] = (const char*)&params->log_date_be;
+    params->lengths[6] = sizeof(params->log_date_be);
+}
+
+//
+
 bool
 __db_instance_postgresql_log_one_event(
     db_instance_t   *the_db,
@@ -411,36 +650,31 @@ __db_instance_postgresql_log_one_event(
     PGconn                      *db_conn = __db_instance_postgresql_choose_conn(THE_DB);
     
     if ( db_conn ) {
-        const char*     param_values[DB_INSTANCE_POSTGRESQL_LOG_STMT_NPARAMS];
-        char            src_port_str[32], sshd_pid_str[32];
+        db_instance_postgresql_log_params_t params;
         PGresult        *db_result;
         ExecStatusType  db_rc;
         
-        snprintf(src_port_str, sizeof(src_port_str), "%hu", the_event->src_port);
-        snprintf(sshd_pid_str, sizeof(sshd_pid_str), "%ld", (long int)the_event->sshd_pid);
-        
-        param_values[0] = the_event->dst_ipaddr;
-        param_values[1] = the_event->src_ipaddr;
-        param_values[2] = src_port_str;
-        param_values[3] = log_event_to_str(the_event->event);
-        param_values[4] = sshd_pid_str;
-        param_values[5] = the_event->uid;
-        param_values[6] = the_event->log_date;
+        __db_instance_postgresql_log_params_init(&params, the_event);
         db_result = PQexecPrepared(db_conn, db_postgresql_log_stmt_name, db_postgresql_log_stmt_nparams,
-                            param_values, NULL, NULL, 0);
+                            params.values, params.lengths, db_postgresql_log_stmt_formats, 0);
         db_rc = PQresultStatus(db_result);
         PQclear(db_result);
         switch ( db_rc ) {
             case PGRES_COMMAND_OK:
             case PGRES_TUPLES_OK:
-                DEBUG("Database: logged { %s, %s, %s, %ld, %s, %hu, %s }",
-                    the_event->log_date,
-                    log_event_to_str(the_event->event),
-                    the_event->uid,
-                    (long int)the_event->sshd_pid,
-                    the_event->src_ipaddr,
-                    the_event->src_port,
-                    the_event->dst_ipaddr);
+                if ( logging_get_level() >= logging_level_debug ) {
+                    log_data_strs_t strs;
+                    
+                    log_data_to_strs(the_event, &strs);
+                    DEBUG("Database: logged { %s, %s, %s, %ld, %s, %hu, %s }",
+                        strs.log_date,
+                        log_event_to_str(the_event->event),
+                        the_event->uid,
+                        (long int)the_event->sshd_pid,
+                        strs.src_ipaddr,
+                        the_event->src_port,
+                        strs.dst_ipaddr);
+                }
                 return true;
             default: {
                 if ( error_msg ) *error_msg = __db_instance_set_last_error(the_db, PQerrorMessage(db_conn), -1);
@@ -453,15 +687,361 @@ __db_instance_postgresql_log_one_event(
 
 //
 
+/*
+ * Copy <src> to <dst> escaping the characters that are special in the
+ * text format of COPY; returns a pointer to the NUL terminator in <dst>,
+ * which must have room for twice the length of <src> plus one.
+ */
+static char*
+__db_instance_postgresql_copy_escape(
+    char        *dst,
+    const char  *src
+)
+{
+    while ( *src ) {
+        switch ( *src ) {
+            case '\\':
+                *dst++ = '\\'; *dst++ = '\\';
+                break;
+            case '\t':
+                *dst++ = '\\'; *dst++ = 't';
+                break;
+            case '\n':
+                *dst++ = '\\'; *dst++ = 'n';
+                break;
+            case '\r':
+                *dst++ = '\\'; *dst++ = 'r';
+                break;
+            default:
+                *dst++ = *src;
+                break;
+        }
+        src++;
+    }
+    *dst = '\0';
+    return dst;
+}
+
+//
+
+static bool
+__db_instance_postgresql_exec_command(
+    PGconn          *db_conn,
+    const char      *query,
+    ExecStatusType  expected_rc
+)
+{
+    PGresult        *db_result = PQexec(db_conn, query);
+    ExecStatusType  db_rc = PQresultStatus(db_result);
+    
+    PQclear(db_result);
+    return (db_rc == expected_rc);
+}
+
+//
+
+/*
+ * Write <log_time_ns> at <e> as a UTC timestamp with an explicit offset so
+ * the server does not interpret it in the session's time zone; returns the
+ * end of the string.
+ */
+static char*
+__db_instance_postgresql_copy_timestamp(
+    char        *e,
+    int64_t     log_time_ns
+)
+{
+    time_t      when = (time_t)(log_time_ns / 1000000000);
+    int64_t     usec = (log_time_ns % 1000000000) / 1000;
+    struct tm   when_tm;
+    
+    if ( usec < 0 ) {
+        when--;
+        usec += 1000000;
+    }
+    if ( ! gmtime_r(&when, &when_tm) ) return e;
+    e += strftime(e, 20, "%Y-%m-%d %H:%M:%S", &when_tm);
+    e += sprintf(e, ".%06ld+00", (long int)usec);
+    return e;
+}
+
+//
+
+static bool
+__db_instance_postgresql_log_events_copy(
+    db_instance_postgresql_t    *THE_DB,
+    PGconn                      *db_conn,
+    log_data_t                  *events,
+    size_t                      n_events,
+    const char                  **error_msg
+)
+{
+    PGresult                    *db_result;
+    bool                        ok = false;
+    
+    if ( ! __db_instance_postgresql_exec_command(db_conn, "BEGIN", PGRES_COMMAND_OK) ) {
+        if ( error_msg ) *error_msg = __db_instance_set_last_error(&THE_DB->base, PQerrorMessage(db_conn), -1);
+        return false;
+    }
+    if ( __db_instance_postgresql_exec_command(db_conn, db_postgresql_copy_stmt_query, PGRES_COPY_IN) ) {
+        /* Escaping at most doubles the uid; the other fields are formatted to known sizes: */
+        char                    line[2 * sizeof(((log_data_t*)0)->uid) + sizeof(log_data_strs_t) + 64];
+        size_t                  i;
+        int                     rc = 1;
+        
+        for ( i = 0; (rc == 1) && (i < n_events); i++ ) {
+            log_data_t          *the_event = &events[i];
+            log_data_strs_t     strs;
+            char                *e = line;
+            
+            /* The staging table is TEXT, so this path still formats each field: */
+            log_data_to_strs(the_event, &strs);
+            e = stpcpy(e, strs.dst_ipaddr); *e++ = '\t';
+            e = stpcpy(e, strs.src_ipaddr); *e++ = '\t';
+            e += sprintf(e, "%hu\t%s\t%ld\t", the_event->src_port, log_event_to_str(the_event->event),
+                        (long int)the_event->sshd_pid);
+            e = __db_instance_postgresql_copy_escape(e, the_event->uid); *e++ = '\t';
+            e = __db_instance_postgresql_copy_timestamp(e, the_event->log_time_ns); *e++ = '\n';
+            rc = PQputCopyData(db_conn, line, e - line);
+        }
+        if ( PQputCopyEnd(db_conn, (rc == 1) ? NULL : "failed to send events") == 1 ) {
+            ok = (rc == 1);
+            while ( (db_result = PQgetResult(db_conn)) ) {
+                if ( PQresultStatus(db_result) != PGRES_COMMAND_OK ) ok = false;
+                PQclear(db_result);
+            }
+        }
+        if ( ok ) {
+            /* Have the server log the staged events in order: */
+            ok = __db_instance_postgresql_exec_command(db_conn, THE_DB->db_staged_stmt_query, PGRES_TUPLES_OK)
+                    && __db_instance_postgresql_exec_command(db_conn, "COMMIT", PGRES_COMMAND_OK);
+        }
+    }
+    if ( ! ok ) {
+        if ( error_msg ) *error_msg = __db_instance_set_last_error(&THE_DB->base, PQerrorMessage(db_conn), -1);
+        __db_instance_postgresql_exec_command(db_conn, "ROLLBACK", PGRES_COMMAND_OK);
+    }
+    return ok;
+}
+
+//
+
+/*
+ * Read results from a pipeline until its sync point.  Returns true if the
+ * sync point was reached, false if the connection failed before then.
+ */
+static bool
+__db_instance_postgresql_pipeline_drain(
+    PGconn                      *db_conn
+)
+{
+    while ( PQstatus(db_conn) == CONNECTION_OK ) {
+        PGresult                *db_result = PQgetResult(db_conn);
+        
+        /* A NULL result just separates one execution's results from the next: */
+        if ( db_result ) {
+            ExecStatusType      db_rc = PQresultStatus(db_result);
+            
+            PQclear(db_result);
+            if ( db_rc == PGRES_PIPELINE_SYNC ) return true;
+        }
+    }
+    return false;
+}
+
+//
+
+/*
+ * Log <events> using pipeline mode.  All executions share the pipeline's
+ * single implicit transaction, so either every event is logged (true is
+ * returned and *<n_logged> is set) or none are; the caller can then fall
+ * back to logging the events one at a time.
+ */
+static bool
+__db_instance_postgresql_log_events_pipeline(
+    db_instance_postgresql_t    *THE_DB,
+    PGconn                      *db_conn,
+    log_data_t                  *events,
+    size_t                      n_events,
+    size_t                      *n_logged,
+    const char                  **error_msg
+)
+{
+    bool                        ok = true, is_synced = false;
+    size_t                      n_sent = 0, n_recv = 0;
+    
+    if ( ! PQenterPipelineMode(db_conn) ) {
+        if ( error_msg ) *error_msg = __db_instance_set_last_error(&THE_DB->base, PQerrorMessage(db_conn), -1);
+        return false;
+    }
+    while ( ok && (n_recv < n_events) ) {
+        /* Keep up to pipeline_depth executions in flight: */
+        while ( ok && (n_sent < n_events) && ((n_sent - n_recv) < THE_DB->pipeline_depth) ) {
+            db_instance_postgresql_log_params_t params;
+            
+            __db_instance_postgresql_log_params_init(&params, &events[n_sent]);
+            if ( PQsendQueryPrepared(db_conn, db_postgresql_log_stmt_name, db_postgresql_log_stmt_nparams,
+                        params.values, params.lengths, db_postgresql_log_stmt_formats, 0) ) {
+                n_sent++;
+            } else {
+                ok = false;
+            }
+        }
+        if ( ok ) {
+            /* The last execution is followed by the sync point that commits them all,
+             * otherwise ask the server to return what it has so far: */
+            if ( n_sent == n_events ) {
+                ok = is_synced = PQpipelineSync(db_conn);
+            } else {
+                ok = PQsendFlushRequest(db_conn) && (PQflush(db_conn) == 0);
+            }
+        }
+        while ( ok && (n_recv < n_sent) ) {
+            PGresult            *db_result;
+            
+            while ( (db_result = PQgetResult(db_conn)) ) {
+                if ( (PQresultStatus(db_result) != PGRES_COMMAND_OK) && (PQresultStatus(db_result) != PGRES_TUPLES_OK) ) {
+                    if ( ok && error_msg ) {
+                        *error_msg = __db_instance_set_last_error(&THE_DB->base, PQresultErrorMessage(db_result), -1);
+                    }
+                    ok = false;
+                }
+                PQclear(db_result);
+            }
+            n_recv++;
+        }
+    }
+    if ( ! ok && error_msg && ! *error_msg ) {
+        *error_msg = __db_instance_set_last_error(&THE_DB->base, PQerrorMessage(db_conn), -1);
+    }
+    
+    /* Everything up to the sync point must be read before pipeline mode can be
+     * left; a failed execution rolls back the whole implicit transaction: */
+    if ( ! is_synced ) is_synced = PQpipelineSync(db_conn);
+    if ( ! (is_synced && __db_instance_postgresql_pipeline_drain(db_conn) && PQexitPipelineMode(db_conn)) ) {
+        ERROR("Database: unable to exit pipeline mode, resetting connection: %s", PQerrorMessage(db_conn));
+        PQreset(db_conn);
+        
+        /* The new session lacks the prepared statement and staging table: */
+        if ( (PQstatus(db_conn) == CONNECTION_OK) && (db_conn == THE_DB->db_conn) ) {
+            const char          *setup_error_msg = NULL;
+            
+            if ( ! __db_instance_postgresql_session_setup(THE_DB, &setup_error_msg) ) {
+                ERROR("Database: unable to prepare reset connection: %s", setup_error_msg ? setup_error_msg : "unknown");
+            }
+        } else {
+            THE_DB->is_copy_available = false;
+        }
+        ok = false;
+    }
+    if ( ok ) {
+        DEBUG("Database: logged %lu events via pipeline", (unsigned long)n_events);
+        *n_logged = n_events;
+    }
+    return ok;
+}
+
+//
+
+bool
+__db_instance_postgresql_log_events(
+    db_instance_t   *the_db,
+    log_data_t      *events,
+    size_t          n_events,
+    size_t          *n_logged,
+    const char      **error_msg
+)
+{
+    db_instance_postgresql_t    *THE_DB = (db_instance_postgresql_t*)the_db;
+    bool                        did_copy_fail = false;
+    
+    if ( THE_DB->is_copy_available && THE_DB->copy_threshold && (n_events >= THE_DB->copy_threshold) ) {
+        PGconn                  *db_conn = __db_instance_postgresql_choose_conn(THE_DB);
+        const char              *copy_error_msg = NULL;
+        
+        if ( db_conn ) {
+            if ( __db_instance_postgresql_log_events_copy(THE_DB, db_conn, events, n_events, &copy_error_msg) ) {
+                DEBUG("Database: logged %lu events via COPY", (unsigned long)n_events);
+                *n_logged = n_events;
+                return true;
+            }
+            /* Everything was rolled back, so find the offending event(s) one at a time: */
+            WARN("Database: bulk logging of %lu events failed, retrying individually: %s",
+                    (unsigned long)n_events, copy_error_msg ? copy_error_msg : "unknown");
+            did_copy_fail = true;
+        }
+    }
+    if ( (THE_DB->pipeline_depth > 1) && (n_events > 1) ) {
+        PGconn                  *db_conn = __db_instance_postgresql_choose_conn(THE_DB);
+        
+        const char              *pipeline_error_msg = NULL;
+        
+        if ( db_conn && (PQpipelineStatus(db_conn) == PQ_PIPELINE_OFF) ) {
+            if ( __db_instance_postgresql_log_events_pipeline(THE_DB, db_conn, events, n_events, n_logged, &pipeline_error_msg) ) {
+                return true;
+            }
+            /* Nothing was committed, so find the offending event(s) one at a time: */
+            WARN("Database: pipelined logging of %lu events failed, retrying individually: %s",
+                    (unsigned long)n_events, pipeline_error_msg ? pipeline_error_msg : "unknown");
+        }
+    }
+    while ( *n_logged < n_events ) {
+        if ( ! __db_instance_postgresql_log_one_event(the_db, &events[*n_logged], error_msg) ) return false;
+        (*n_logged)++;
+    }
+    if ( did_copy_fail ) {
+        /* Every event was fine on its own, so the bulk path itself is broken (e.g. the
+         * schema lacks log_staged_events()); stop trying it on this connection: */
+        WARN("Database: bulk logging disabled until the next connection");
+        THE_DB->is_copy_available = false;
+    }
+    return true;
+}
+
+//
+
 typedef struct {
     db_blocklist_enum_t     base;
     //
+    PGconn                  *db_conn;
     PGresult                *query;
     int                     i, i_max;
+    bool                    is_exhausted;
 } db_instance_postgresql_blocklist_enum_t;
 
 //
 
+/*
+ * Release the current batch of rows and FETCH the next one from the
+ * cursor.  Returns false once the cursor has no more rows or on error;
+ * the latter also marks the enumeration as failed.
+ */
+static bool
+__db_instance_postgresql_blocklist_enum_fetch(
+    db_instance_postgresql_blocklist_enum_t *THE_ENUM
+)
+{
+    if ( THE_ENUM->query ) PQclear(THE_ENUM->query);
+    THE_ENUM->query = NULL;
+    THE_ENUM->i = THE_ENUM->i_max = 0;
+    if ( THE_ENUM->is_exhausted ) return false;
+    
+    THE_ENUM->query = PQexec(THE_ENUM->db_conn, db_postgresql_blocklist_fetch_query);
+    if ( THE_ENUM->query && (PQresultStatus(THE_ENUM->query) == PGRES_TUPLES_OK) ) {
+        THE_ENUM->i_max = PQntuples(THE_ENUM->query);
+        if ( THE_ENUM->i_max < DB_INSTANCE_POSTGRESQL_BLOCKLIST_FETCH_ROWS ) THE_ENUM->is_exhausted = true;
+        DEBUG("Database:  blocklist enum:  fetched %d rows for enumerator %p", THE_ENUM->i_max, THE_ENUM);
+        return (THE_ENUM->i_max > 0);
+    }
+    ERROR("Database:  blocklist enum:  failed to fetch block list rows:  %s",
+            THE_ENUM->query ? PQresultErrorMessage(THE_ENUM->query) : PQerrorMessage(THE_ENUM->db_conn));
+    THE_ENUM->is_exhausted = true;
+    THE_ENUM->base.is_failed = true;
+    return false;
+}
+
+//
+
 const char*
 __db_instance_postgresql_blocklist_enum_next(
     db_blocklist_enum_ref   the_enum
@@ -469,7 +1049,46 @@ __db_instance_postgresql_blocklist_enum_next(
 {
     db_instance_postgresql_blocklist_enum_t *THE_ENUM = (db_instance_postgresql_blocklist_enum_t*)the_enum;
     
-    return (THE_ENUM && (THE_ENUM->i < THE_ENUM->i_max)) ? PQgetvalue(THE_ENUM->query, THE_ENUM->i++, 0) : NULL;
+    if ( ! THE_ENUM ) return NULL;
+    if ( (THE_ENUM->i >= THE_ENUM->i_max) && ! __db_instance_postgresql_blocklist_enum_fetch(THE_ENUM) ) return NULL;
+    return PQgetvalue(THE_ENUM->query, THE_ENUM->i++, 0);
+}
+
+//
+
+const char*
+__db_instance_postgresql_blocklist_enum_next_expiring(
+    db_blocklist_enum_ref   the_enum,
+    time_t                  *end_date
+)
+{
+    db_instance_postgresql_blocklist_enum_t *THE_ENUM = (db_instance_postgresql_blocklist_enum_t*)the_enum;
+    
+    if ( ! THE_ENUM ) return NULL;
+    if ( (THE_ENUM->i >= THE_ENUM->i_max) && ! __db_instance_postgresql_blocklist_enum_fetch(THE_ENUM) ) return NULL;
+    if ( (PQnfields(THE_ENUM->query) > 1) && ! PQgetisnull(THE_ENUM->query, THE_ENUM->i, 1) ) {
+        *end_date = (time_t)strtoll(PQgetvalue(THE_ENUM->query, THE_ENUM->i, 1), NULL, 10);
+    }
+    return PQgetvalue(THE_ENUM->query, THE_ENUM->i++, 0);
+}
+
+//
+
+/*
+ * End the transaction holding the cursor (which closes it).
+ */
+static void
+__db_instance_postgresql_blocklist_enum_end(
+    PGconn      *db_conn
+)
+{
+    PGresult    *qres = PQexec(db_conn, "COMMIT");
+    
+    if ( ! qres || (PQresultStatus(qres) != PGRES_COMMAND_OK) ) {
+        WARN("Database:  blocklist enum:  failed to end block list transaction:  %s",
+                qres ? PQresultErrorMessage(qres) : PQerrorMessage(db_conn));
+    }
+    if ( qres ) PQclear(qres);
 }
 
 //
@@ -484,12 +1103,49 @@ __db_instance_postgresql_blocklist_enum_close(
     if ( THE_ENUM ) {
         DEBUG("Database:  blocklist enum:  close enumerator %p", THE_ENUM);
         if ( THE_ENUM->query ) PQclear(THE_ENUM->query);
+        __db_instance_postgresql_blocklist_enum_end(THE_ENUM->db_conn);
         free((void*)THE_ENUM);
     }
 }
 
 //
 
+/*
+ * Open a transaction and declare the block list cursor for the query
+ * <format> (completed with the firewall schema).  On failure the
+ * transaction is rolled back and the failed result (if any) is
+ * returned for the caller to inspect and PQclear().
+ */
+static PGresult*
+__db_instance_postgresql_blocklist_declare(
+    PGconn      *db_conn,
+    const char  *format,
+    const char  *schema,
+    bool        *is_declared
+)
+{
+    char        *select_query = NULL, *declare_query = NULL;
+    PGresult    *qres = NULL;
+    
+    *is_declared = false;
+    if ( asprintf(&select_query, format, schema ? schema : "", schema ? "." : "") > 0 ) {
+        if ( asprintf(&declare_query, db_postgresql_blocklist_declare_query_format, select_query) > 0 ) {
+            qres = PQexec(db_conn, declare_query);
+            free((void*)declare_query);
+        }
+        free((void*)select_query);
+    }
+    if ( qres && (PQresultStatus(qres) == PGRES_COMMAND_OK) ) {
+        PQclear(qres);
+        *is_declared = true;
+        return NULL;
+    }
+    PQclear(PQexec(db_conn, "ROLLBACK"));
+    return qres;
+}
+
+//
+
 struct db_blocklist_enum*
 __db_instance_postgresql_blocklist_enum_open(
     db_instance_t   *the_db,
@@ -499,47 +1155,61 @@ __db_instance_postgresql_blocklist_enum_open(
     db_instance_postgresql_t                *THE_DB = (db_instance_postgresql_t*)the_db;
     db_instance_postgresql_blocklist_enum_t *new_enum = NULL;
     PGresult                                *qres = NULL;
-    int                                     nrows;
     PGconn                                  *db_conn = __db_instance_postgresql_choose_conn(THE_DB);
     
     if ( db_conn ) {
-        char                *db_blocklist_stmt_query = NULL;
-        int                 db_blocklist_stmt_query_len;
+        bool                is_declared;
+        const char          *sqlstate;
         const char          *schema= (THE_DB->firewall_schema && *THE_DB->firewall_schema) ? 
                                                 THE_DB->firewall_schema : NULL;
-         
-        /* Prepare the query with the schema et al.: */
-        db_blocklist_stmt_query_len = asprintf(&db_blocklist_stmt_query, db_postgresql_blocklist_stmt_query_format,
-                                            schema ? schema : "",
-                                            schema ? "." : "");
-        if ( db_blocklist_stmt_query_len && db_blocklist_stmt_query ) {
-            qres = PQexec(db_conn, db_blocklist_stmt_query);
-            free((void*)db_blocklist_stmt_query);
-            if ( qres && (PQresultStatus(qres) == PGRES_TUPLES_OK) ) {
-                if ( (nrows = PQntuples(qres)) > 0 ) {
-                    new_enum = (db_instance_postgresql_blocklist_enum_t*)malloc(sizeof(db_instance_postgresql_blocklist_enum_t));
-                    if ( new_enum ) {
-                        new_enum->query = qres;
-                        new_enum->i = 0;
-                        new_enum->i_max = nrows;
-                        
-                        new_enum->base.next = __db_instance_postgresql_blocklist_enum_next;
-                        new_enum->base.close = __db_instance_postgresql_blocklist_enum_close;
-                        
-                        DEBUG("Database:  blocklist enum:  opened enumerator %p (%d rows)", new_enum, nrows);
-                    } else {
-                        ERROR("Database:  blocklist enum:  failed to allocate enumerator");
-                    }
+        
+        /* Rows are read from a cursor in batches as the enumeration
+         * proceeds rather than all at once: */
+        qres = __db_instance_postgresql_blocklist_declare(db_conn,
+                        THE_DB->is_blocklist_end_date_missing ?
+                            db_postgresql_blocklist_stmt_query_format :
+                            db_postgresql_blocklist_expiring_stmt_query_format,
+                        schema, &is_declared);
+        if ( ! is_declared && ! THE_DB->is_blocklist_end_date_missing && qres && (PQresultStatus(qres) == PGRES_FATAL_ERROR) &&
+                (sqlstate = PQresultErrorField(qres, PG_DIAG_SQLSTATE)) && (strcmp(sqlstate, "42P01") == 0) ) {
+            /* A schema without the block_now_with_end_date view (undefined
+             * table); stop asking for end dates on this instance: */
+            WARN("Database:  blocklist enum:  block list end dates unavailable, using block_now:  %s", PQresultErrorMessage(qres));
+            THE_DB->is_blocklist_end_date_missing = true;
+            PQclear(qres);
+            qres = __db_instance_postgresql_blocklist_declare(db_conn, db_postgresql_blocklist_stmt_query_format, schema, &is_declared);
+        }
+        if ( is_declared ) {
+            new_enum = (db_instance_postgresql_blocklist_enum_t*)malloc(sizeof(db_instance_postgresql_blocklist_enum_t));
+            if ( new_enum ) {
+                new_enum->db_conn = db_conn;
+                new_enum->query = NULL;
+                new_enum->is_exhausted = false;
+                new_enum->base.is_failed = false;
+                
+                new_enum->base.next = __db_instance_postgresql_blocklist_enum_next;
+                new_enum->base.next_expiring = __db_instance_postgresql_blocklist_enum_next_expiring;
+                new_enum->base.close = __db_instance_postgresql_blocklist_enum_close;
+                
+                /* An empty block list yields no enumerator; a failed fetch
+                 * yields one that reports the failure: */
+                if ( __db_instance_postgresql_blocklist_enum_fetch(new_enum) || new_enum->base.is_failed ) {
+                    DEBUG("Database:  blocklist enum:  opened enumerator %p", new_enum);
                 } else {
                     INFO("Database:  blocklist enum:  no records in block list");
+                    __db_instance_postgresql_blocklist_enum_close((db_blocklist_enum_ref)new_enum);
+                    new_enum = NULL;
                 }
-            } else if ( qres ) {
-                ERROR("Database:  blocklist enum:  failed to execute block list query:  %s", PQresultErrorMessage(qres));
             } else {
-                ERROR("Database:  blocklist enum:  failed to execute block list query:  %s", PQerrorMessage(db_conn));
+                ERROR("Database:  blocklist enum:  failed to allocate enumerator");
+                __db_instance_postgresql_blocklist_enum_end(db_conn);
             }
-            if ( ! new_enum && qres ) PQclear(qres);
+        } else if ( qres ) {
+            ERROR("Database:  blocklist enum:  failed to execute block list query:  %s", PQresultErrorMessage(qres));
+        } else {
+            ERROR("Database:  blocklist enum:  failed to execute block list query:  %s", PQerrorMessage(db_conn));
         }
+        if ( qres ) PQclear(qres);
     }
     return (struct db_blocklist_enum*)new_enum;
 }
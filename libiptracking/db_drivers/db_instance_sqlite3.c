@@ -10,12 +10,30 @@
 
 //
 
-#define DB_INSTANCE_SQLITE3_LOG_STMT_QUERY_STR "INSERT INTO inet_log (dst_ipaddr, src_ipaddr, src_port, log_event, uid, log_date) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7)"
+#define DB_INSTANCE_SQLITE3_LOG_STMT_QUERY_STR "INSERT INTO inet_log (dst_ipaddr, src_ipaddr, src_port, log_event, sshd_pid, uid, log_date) VALUES (?1, ?2, ?3, ?4, ?5, ?6, datetime(?7, 'unixepoch', 'localtime'))"
 #define DB_INSTANCE_SQLITE3_BLOCKLIST_STMT_QUERY_STR "SELECT ip_entity FROM firewall_block_now"
 
 static const char   *db_sqlite3_log_stmt_query_str = DB_INSTANCE_SQLITE3_LOG_STMT_QUERY_STR;
 static const char   *db_sqlite3_blocklist_stmt_query_str = DB_INSTANCE_SQLITE3_BLOCKLIST_STMT_QUERY_STR;
 
+/*
+ * Batches of events are inserted inside BEGIN IMMEDIATE ... COMMIT so the
+ * cost of syncing to disk is paid once per transaction rather than once per
+ * event.  A transaction is committed once it holds max-records events or
+ * has been open for max-latency-ms milliseconds:
+ */
+#define DB_INSTANCE_SQLITE3_GROUP_COMMIT_MAX_RECORDS_DEFAULT 256
+#define DB_INSTANCE_SQLITE3_GROUP_COMMIT_MAX_LATENCY_MS_DEFAULT 250
+
+//
+
+static const char *__db_instance_sqlite3_journal_modes[] = {
+        "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF", NULL
+    };
+static const char *__db_instance_sqlite3_synchronous_modes[] = {
+        "OFF", "NORMAL", "FULL", "EXTRA", NULL
+    };
+
 //
 
 typedef struct {
@@ -23,6 +41,11 @@ typedef struct {
     //
     const char          *filename;
     int                 flags;
+    const char          *journal_mode;
+    const char          *synchronous;
+    long long           mmap_size;
+    uint32_t            group_commit_max_records;
+    int                 group_commit_max_latency_ms;
     //
     sqlite3             *db_conn;
     sqlite3_stmt        *db_query;
@@ -37,6 +60,7 @@ static void __db_instance_sqlite3_summarize_to_log(db_instance_t *the_db);
 static bool __db_instance_sqlite3_open(db_instance_t *the_db, const char **error_msg);
 static bool __db_instance_sqlite3_close(db_instance_t *the_db, const char **error_msg);
 static bool __db_instance_sqlite3_log_one_event(db_instance_t *the_db, log_data_t *the_event, const char **error_msg);
+static bool __db_instance_sqlite3_log_events(db_instance_t *the_db, log_data_t *events, size_t n_events, size_t *n_logged, const char **error_msg);
 static struct db_blocklist_enum* __db_instance_sqlite3_blocklist_enum_open(db_instance_t *the_db, const char **error_msg);
 
 //
@@ -51,6 +75,8 @@ static db_driver_callbacks_t    db_driver_sqlite3_callbacks = {
         .open = __db_instance_sqlite3_open,
         .close = __db_instance_sqlite3_close,
         .log_one_event = __db_instance_sqlite3_log_one_event,
+        .log_events = __db_instance_sqlite3_log_events,
+        .flush = NULL,
         .blocklist_enum_open = __db_instance_sqlite3_blocklist_enum_open,
         
         .blocklist_async_notification_toggle = NULL
@@ -86,6 +112,23 @@ struct db_instance_sqlite3_flag {
         { NULL, 0 }
     };
 
+//
+
+static const char*
+__db_instance_sqlite3_match_keyword(
+    const char  **keywords,
+    const char  *value
+)
+{
+    while ( *keywords ) {
+        if ( strcasecmp(*keywords, value) == 0 ) return *keywords;
+        keywords++;
+    }
+    return NULL;
+}
+
+//
+
 db_instance_t*
 __db_instance_sqlite3_alloc(
     yaml_document_t *config_doc,
@@ -98,6 +141,10 @@ __db_instance_sqlite3_alloc(
     size_t                          extra_bytes = 0;
     int                             sqlite_flags = SQLITE_OPEN_READWRITE;
     const char                      *v, *filename = NULL;
+    const char                      *journal_mode = NULL, *synchronous = NULL;
+    long long                       mmap_size = -1;
+    uint32_t                        group_commit_max_records = DB_INSTANCE_SQLITE3_GROUP_COMMIT_MAX_RECORDS_DEFAULT;
+    int                             group_commit_max_latency_ms = DB_INSTANCE_SQLITE3_GROUP_COMMIT_MAX_LATENCY_MS_DEFAULT;
     bool                            had_uri = false;
     
     /*
@@ -135,6 +182,53 @@ __db_instance_sqlite3_alloc(
         }
     }
     
+    /*
+     * Check for any pragmas applied when the database is opened:
+     */
+    if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "journal-mode")) ) {
+        if ( ! (v = yaml_helper_get_scalar_value(prop_node)) ||
+             ! (journal_mode = __db_instance_sqlite3_match_keyword(__db_instance_sqlite3_journal_modes, v)) ) {
+            ERROR("Database: invalid 'journal-mode' value");
+            return NULL;
+        }
+    }
+    if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "synchronous")) ) {
+        if ( ! (v = yaml_helper_get_scalar_value(prop_node)) ||
+             ! (synchronous = __db_instance_sqlite3_match_keyword(__db_instance_sqlite3_synchronous_modes, v)) ) {
+            ERROR("Database: invalid 'synchronous' value");
+            return NULL;
+        }
+    }
+    if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "mmap-size")) ) {
+        char        *endptr;
+        
+        if ( ! (v = yaml_helper_get_scalar_value(prop_node)) ||
+             ((mmap_size = strtoll(v, &endptr, 0)) < 0) || (endptr == v) || *endptr ) {
+            ERROR("Database: invalid 'mmap-size' value");
+            return NULL;
+        }
+    }
+    
+    /*
+     * Check for group commit limits:
+     */
+    if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "group-commit")) ) {
+        yaml_node_t     *val_node;
+        
+        if ( (val_node = yaml_helper_doc_node_at_path(config_doc, prop_node, "max-records")) ) {
+            if ( ! yaml_helper_get_scalar_uint32_value(val_node, &group_commit_max_records) ) {
+                ERROR("Database: invalid 'group-commit.max-records' value");
+                return NULL;
+            }
+        }
+        if ( (val_node = yaml_helper_doc_node_at_path(config_doc, prop_node, "max-latency-ms")) ) {
+            if ( ! yaml_helper_get_scalar_int_value(val_node, &group_commit_max_latency_ms) || (group_commit_max_latency_ms < 0) ) {
+                ERROR("Database: invalid 'group-commit.max-latency-ms' value");
+                return NULL;
+            }
+        }
+    }
+    
     /* Is a uri property present? */
     if ( (prop_node = yaml_helper_doc_node_at_path(config_doc, database_node, "uri")) ) {
         if ( (v = yaml_helper_get_scalar_value(prop_node)) ) {
@@ -159,6 +253,11 @@ __db_instance_sqlite3_alloc(
         void        *p = (void*)new_instance + base_bytes;
         
         new_instance->flags = sqlite_flags;
+        new_instance->journal_mode = journal_mode;
+        new_instance->synchronous = synchronous;
+        new_instance->mmap_size = mmap_size;
+        new_instance->group_commit_max_records = group_commit_max_records;
+        new_instance->group_commit_max_latency_ms = group_commit_max_latency_ms;
         
 #define DB_INSTANCE_SQLITE3_P_INC(T,N)     { size_t dp = (sizeof(T) * (N)); p += dp; extra_bytes -= dp; }
         
@@ -204,6 +303,57 @@ __db_instance_sqlite3_summarize_to_log(
     INFO("Database: driver_name = %s", THE_DB->base.driver_callbacks->driver_name);
     INFO("Database: filename = %s", THE_DB->filename);
     INFO("Database: flags = %X", THE_DB->flags);
+    if ( THE_DB->journal_mode ) INFO("Database: journal-mode = %s", THE_DB->journal_mode);
+    if ( THE_DB->synchronous ) INFO("Database: synchronous = %s", THE_DB->synchronous);
+    if ( THE_DB->mmap_size >= 0 ) INFO("Database: mmap-size = %lld", THE_DB->mmap_size);
+    if ( THE_DB->group_commit_max_records > 1 ) {
+        INFO("Database: group-commit.max-records = %lu", (unsigned long)THE_DB->group_commit_max_records);
+        INFO("Database: group-commit.max-latency-ms = %d", THE_DB->group_commit_max_latency_ms);
+    } else {
+        INFO("Database: group-commit = disabled");
+    }
+}
+
+//
+
+static void
+__db_instance_sqlite3_exec_pragma(
+    db_instance_sqlite3_t   *THE_DB,
+    const char              *pragma
+)
+{
+    char                    *errmsg = NULL;
+    int                     rc = sqlite3_exec(THE_DB->db_conn, pragma, NULL, NULL, &errmsg);
+    
+    if ( rc == SQLITE_OK ) {
+        DEBUG("Database: %s", pragma);
+    } else {
+        WARN("Database: %s failed: %s", pragma, errmsg ? errmsg : sqlite3_errstr(rc));
+    }
+    if ( errmsg ) sqlite3_free(errmsg);
+}
+
+//
+
+static void
+__db_instance_sqlite3_apply_pragmas(
+    db_instance_sqlite3_t   *THE_DB
+)
+{
+    char                    pragma[64];
+    
+    if ( THE_DB->journal_mode ) {
+        snprintf(pragma, sizeof(pragma), "PRAGMA journal_mode=%s", THE_DB->journal_mode);
+        __db_instance_sqlite3_exec_pragma(THE_DB, pragma);
+    }
+    if ( THE_DB->synchronous ) {
+        snprintf(pragma, sizeof(pragma), "PRAGMA synchronous=%s", THE_DB->synchronous);
+        __db_instance_sqlite3_exec_pragma(THE_DB, pragma);
+    }
+    if ( THE_DB->mmap_size >= 0 ) {
+        snprintf(pragma, sizeof(pragma), "PRAGMA mmap_size=%lld", THE_DB->mmap_size);
+        __db_instance_sqlite3_exec_pragma(THE_DB, pragma);
+    }
 }
 
 //
@@ -225,6 +375,7 @@ __db_instance_sqlite3_open(
             if ( error_msg ) *error_msg = __db_instance_set_last_error(the_db, sqlite3_errstr(rc), -1);
             return false;
         }
+        __db_instance_sqlite3_apply_pragmas(THE_DB);
         
         if ( (THE_DB->base.options & db_options_no_pam_logging) == db_options_no_pam_logging ) {
             DEBUG("Database: connection okay"); 
@@ -279,14 +430,16 @@ __db_instance_sqlite3_log_one_event(
     bool                    okay = false;
     
     if ( THE_DB->db_conn && THE_DB->db_query ) {
-        /* Bind event data to the query: */
-        int                    rc  = sqlite3_bind_text(THE_DB->db_query, 1, the_event->dst_ipaddr, -1, SQLITE_STATIC);
-        if ( rc == SQLITE_OK ) rc = sqlite3_bind_text(THE_DB->db_query, 2, the_event->src_ipaddr, -1, SQLITE_STATIC);
+        /* Bind event data to the query; the timestamp goes in as an integer and the
+         * inet_log table's TEXT columns keep their original form: */
+        char                   dst_ipaddr[LOG_DATA_ADDR_STRLEN], src_ipaddr[LOG_DATA_ADDR_STRLEN];
+        int                    rc  = sqlite3_bind_text(THE_DB->db_query, 1, log_data_addr_to_str(the_event->dst_family, the_event->dst_addr, dst_ipaddr), -1, SQLITE_STATIC);
+        if ( rc == SQLITE_OK ) rc = sqlite3_bind_text(THE_DB->db_query, 2, log_data_addr_to_str(the_event->src_family, the_event->src_addr, src_ipaddr), -1, SQLITE_STATIC);
         if ( rc == SQLITE_OK ) rc = sqlite3_bind_int(THE_DB->db_query, 3, (int)the_event->src_port);
         if ( rc == SQLITE_OK ) rc = sqlite3_bind_int(THE_DB->db_query, 4, the_event->event);
         if ( rc == SQLITE_OK ) rc = sqlite3_bind_int(THE_DB->db_query, 5, (int)the_event->sshd_pid);
-        if ( rc == SQLITE_OK ) rc = sqlite3_bind_text(THE_DB->db_query, 6, the_event->uid, -1, SQLITE_STATIC);
-        if ( rc == SQLITE_OK ) rc = sqlite3_bind_text(THE_DB->db_query, 7, the_event->log_date, -1, SQLITE_STATIC);
+        if ( rc == SQLITE_OK ) rc = sqlite3_bind_text(THE_DB->db_query, 6, the_event->uid, the_event->uid_len, SQLITE_STATIC);
+        if ( rc == SQLITE_OK ) rc = sqlite3_bind_int64(THE_DB->db_query, 7, the_event->log_time_ns / 1000000000);
         
         if ( rc == SQLITE_OK ) {
             rc = sqlite3_step(THE_DB->db_query);
@@ -306,6 +459,87 @@ __db_instance_sqlite3_log_one_event(
 
 //
 
+static uint64_t
+__db_instance_sqlite3_now_ms(void)
+{
+    struct timespec     now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//
+
+static bool
+__db_instance_sqlite3_log_events_txn(
+    db_instance_sqlite3_t   *THE_DB,
+    log_data_t              *events,
+    size_t                  n_events,
+    size_t                  *n_inserted
+)
+{
+    uint64_t                t_start = __db_instance_sqlite3_now_ms();
+    
+    *n_inserted = 0;
+    if ( sqlite3_exec(THE_DB->db_conn, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK ) return false;
+    while ( *n_inserted < n_events ) {
+        if ( ! __db_instance_sqlite3_log_one_event(&THE_DB->base, &events[*n_inserted], NULL) ) break;
+        (*n_inserted)++;
+        /* Don't hold the write lock longer than the latency limit: */
+        if ( THE_DB->group_commit_max_latency_ms &&
+             ((__db_instance_sqlite3_now_ms() - t_start) >= (uint64_t)THE_DB->group_commit_max_latency_ms) ) break;
+    }
+    if ( (*n_inserted > 0) && (sqlite3_exec(THE_DB->db_conn, "COMMIT", NULL, NULL, NULL) == SQLITE_OK) ) return true;
+    
+    /* The transaction may already have been rolled back by the failing statement: */
+    if ( ! sqlite3_get_autocommit(THE_DB->db_conn) ) sqlite3_exec(THE_DB->db_conn, "ROLLBACK", NULL, NULL, NULL);
+    *n_inserted = 0;
+    return false;
+}
+
+//
+
+bool
+__db_instance_sqlite3_log_events(
+    db_instance_t   *the_db,
+    log_data_t      *events,
+    size_t          n_events,
+    size_t          *n_logged,
+    const char      **error_msg
+)
+{
+    db_instance_sqlite3_t   *THE_DB = (db_instance_sqlite3_t*)the_db;
+    
+    if ( THE_DB->db_conn && THE_DB->db_query && (THE_DB->group_commit_max_records > 1) ) {
+        while ( *n_logged < n_events ) {
+            size_t          n_chunk = n_events - *n_logged, n_inserted;
+            
+            if ( n_chunk > THE_DB->group_commit_max_records ) n_chunk = THE_DB->group_commit_max_records;
+            if ( ! __db_instance_sqlite3_log_events_txn(THE_DB, &events[*n_logged], n_chunk, &n_inserted) ) {
+                /* Nothing in the chunk was committed; log those events one at a time so that
+                 * the failing event is reported precisely: */
+                WARN("Database: group commit of %lu events failed, retrying individually: %s",
+                        (unsigned long)n_chunk, sqlite3_errmsg(THE_DB->db_conn));
+                while ( n_chunk-- ) {
+                    if ( ! __db_instance_sqlite3_log_one_event(the_db, &events[*n_logged], error_msg) ) return false;
+                    (*n_logged)++;
+                }
+            } else {
+                DEBUG("Database: committed %lu events", (unsigned long)n_inserted);
+                *n_logged += n_inserted;
+            }
+        }
+        return true;
+    }
+    while ( *n_logged < n_events ) {
+        if ( ! __db_instance_sqlite3_log_one_event(the_db, &events[*n_logged], error_msg) ) return false;
+        (*n_logged)++;
+    }
+    return true;
+}
+
+//
+
 typedef struct {
     db_blocklist_enum_t     base;
     //
@@ -335,6 +569,10 @@ __db_instance_sqlite3_blocklist_enum_next(
         if ( rc == SQLITE_ROW ) {
             result = (const char*)sqlite3_column_text(THE_ENUM->query, 0);
         } else {
+            if ( rc != SQLITE_DONE ) {
+                ERROR("Database:  blocklist enum:  failed to step block list query:  %d", rc);
+                THE_ENUM->base.is_failed = true;
+            }
             THE_ENUM->is_done = true;
         }
     }
@@ -380,8 +618,10 @@ __db_instance_sqlite3_blocklist_enum_open(
                     new_enum->query = query;
                     new_enum->is_done = false;
                     new_enum->is_first = true;
+                    new_enum->base.is_failed = false;
                     
                     new_enum->base.next = __db_instance_sqlite3_blocklist_enum_next;
+                    new_enum->base.next_expiring = NULL;
                     new_enum->base.close = __db_instance_sqlite3_blocklist_enum_close;
                     
                     DEBUG("Database:  blocklist enum:  opened enumerator %p", new_enum);
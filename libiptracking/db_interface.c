@@ -20,6 +20,8 @@ typedef void (*db_driver_summarize_to_log)(struct db_instance *the_db);
 typedef bool (*db_driver_open)(struct db_instance *the_db, const char **error_msg);
 typedef bool (*db_driver_close)(struct db_instance *the_db, const char **error_msg);
 typedef bool (*db_driver_log_one_event)(struct db_instance *the_db, log_data_t *the_event, const char **error_msg);
+typedef bool (*db_driver_log_events)(struct db_instance *the_db, log_data_t *events, size_t n_events, size_t *n_logged, const char **error_msg);
+typedef bool (*db_driver_flush)(struct db_instance *the_db, const char **error_msg);
 typedef struct db_blocklist_enum* (*db_driver_blocklist_enum_open)(struct db_instance *the_db, const char **error_msg);
 typedef bool (*db_driver_blocklist_async_notification_toggle)(struct db_instance *the_db, bool start_if_true, const char **error_msg);
 
@@ -36,6 +38,8 @@ typedef struct {
     db_driver_open                      open;
     db_driver_close                     close;
     db_driver_log_one_event             log_one_event;
+    db_driver_log_events                log_events;
+    db_driver_flush                     flush;
     db_driver_blocklist_enum_open       blocklist_enum_open;
     
     db_driver_blocklist_async_notification_toggle   blocklist_async_notification_toggle;
@@ -146,12 +150,16 @@ __db_instance_alloc(
 //
 
 typedef const char* (*db_driver_blocklist_enum_next)(db_blocklist_enum_ref the_enum);
+typedef const char* (*db_driver_blocklist_enum_next_expiring)(db_blocklist_enum_ref the_enum, time_t *end_date);
 typedef void (*db_driver_blocklist_enum_close)(db_blocklist_enum_ref the_enum);
 typedef struct db_blocklist_enum {
-    db_ref                          parent_db;
+    db_ref                                  parent_db;
     
-    db_driver_blocklist_enum_next   next;
-    db_driver_blocklist_enum_close  close;
+    db_driver_blocklist_enum_next           next;
+    db_driver_blocklist_enum_next_expiring  next_expiring;
+    db_driver_blocklist_enum_close          close;
+    
+    bool                                    is_failed;
 } db_blocklist_enum_t;
 
 //
@@ -365,6 +373,57 @@ db_log_one_event(
 
 //
 
+bool
+db_log_events(
+    db_ref      the_db,
+    log_data_t  *events,
+    size_t      n_events,
+    size_t      *n_logged,
+    const char  **error_msg
+)
+{
+    size_t      local_n_logged;
+    
+    if ( ! n_logged ) n_logged = &local_n_logged;
+    *n_logged = 0;
+    if ( the_db ) {
+        if ( DB_OPTIONS_NOTSET(the_db->options, db_options_no_pam_logging) ) {
+            if ( n_events == 0 ) return true;
+            if ( the_db->driver_callbacks->log_events ) {
+                return the_db->driver_callbacks->log_events(the_db, events, n_events, n_logged, error_msg);
+            }
+            /* No native support, log one at a time: */
+            while ( *n_logged < n_events ) {
+                if ( ! the_db->driver_callbacks->log_one_event(the_db, &events[*n_logged], error_msg) ) return false;
+                (*n_logged)++;
+            }
+            return true;
+        }
+        if ( error_msg ) *error_msg = "PAM functions not enabled on database";
+        return false;
+    }
+    if ( error_msg ) *error_msg = "Invalid database (NULL)";
+    return false;
+}
+
+//
+
+bool
+db_flush(
+    db_ref      the_db,
+    const char  **error_msg
+)
+{
+    if ( the_db ) {
+        if ( the_db->driver_callbacks->flush ) return the_db->driver_callbacks->flush(the_db, error_msg);
+        return true;
+    }
+    if ( error_msg ) *error_msg = "Invalid database (NULL)";
+    return false;
+}
+
+//
+
 db_blocklist_enum_ref
 db_blocklist_enum_open(
     db_ref      the_db,
@@ -407,6 +466,32 @@ db_blocklist_enum_next(
 
 //
 
+const char*
+db_blocklist_enum_next_expiring(
+    db_blocklist_enum_ref   the_enum,
+    time_t                  *end_date
+)
+{
+    *end_date = 0;
+    if ( the_enum ) {
+        if ( the_enum->next_expiring ) return the_enum->next_expiring(the_enum, end_date);
+        return the_enum->next(the_enum);
+    }
+    return NULL;
+}
+
+//
+
+bool
+db_blocklist_enum_failed(
+    db_blocklist_enum_ref   the_enum
+)
+{
+    return the_enum ? the_enum->is_failed : false;
+}
+
+//
+
 void
 db_blocklist_enum_close(
     db_blocklist_enum_ref   the_enum
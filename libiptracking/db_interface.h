@@ -168,6 +168,45 @@ bool db_close(db_ref the_db, const char **error_msg);
  */
 bool db_log_one_event(db_ref the_db, log_data_t *the_event, const char **error_msg);
 
+/*!
+ * @function db_log_events
+ *
+ * Attempt to add the <n_events> events in the array <events> to the
+ * database represented by the <the_db> instance.  Drivers that can
+ * submit many events at once do so; otherwise, each event is logged
+ * in turn as though by db_log_one_event().
+ *
+ * Drivers must not reorder the array:  events are logged in the order
+ * given, and on return the first *<n_logged> events in <events> have
+ * been logged.  If <n_logged> is NULL the count is not returned.
+ *
+ * If the procedure fails and error_msg is non-NULL, then
+ * *<error_msg> will be set to point to a C string containing a
+ * decription of the error and false will be returned.  In that case
+ * <events>[*<n_logged>] is the event that failed, and the events
+ * following it have not been logged and may be retried.
+ *
+ * If all events were logged, true is returned.
+ */
+bool db_log_events(db_ref the_db, log_data_t *events, size_t n_events, size_t *n_logged, const char **error_msg);
+
+/*!
+ * @function db_flush
+ *
+ * Drivers that buffer logged events (rather than committing each one
+ * as it arrives) write any pending events out to the database
+ * represented by the <the_db> instance.  Callers should use this
+ * whenever they have no more events to log for the time being.
+ *
+ * If the procedure fails and error_msg is non-NULL, then
+ * *<error_msg> will be set to point to a C string containing a
+ * decription of the error and false will be returned.  The pending
+ * events remain buffered for a later attempt.
+ *
+ * If successful (or the driver does no buffering), true is returned.
+ */
+bool db_flush(db_ref the_db, const char **error_msg);
+
 /*!
  * @typedef db_blocklist_enum_ref
  *
@@ -192,10 +231,30 @@ db_blocklist_enum_ref db_blocklist_enum_open(db_ref the_db, const char **error_m
  * @function db_blocklist_enum_next
  *
  * Return the next result from a firewall block list query.  If no more
- * results exist, NULL is returned.
+ * results exist, NULL is returned.  Drivers may read results in batches
+ * as the enumeration proceeds, so the returned string is only valid
+ * until the next call on <the_enum>.
  */
 const char* db_blocklist_enum_next(db_blocklist_enum_ref the_enum);
 
+/*!
+ * @function db_blocklist_enum_next_expiring
+ *
+ * Like db_blocklist_enum_next() but also sets *<end_date> to the time
+ * at which the block ends.  If the block does not end, or the driver
+ * cannot say when it does, *<end_date> is set to zero.
+ */
+const char* db_blocklist_enum_next_expiring(db_blocklist_enum_ref the_enum, time_t *end_date);
+
+/*!
+ * @function db_blocklist_enum_failed
+ *
+ * Returns true if the enumeration ended (NULL was returned) because of
+ * an error rather than at the end of the block list, in which case the
+ * entries already returned are not the complete list.
+ */
+bool db_blocklist_enum_failed(db_blocklist_enum_ref the_enum);
+
 /*!
  * @function db_blocklist_enum_close
  *
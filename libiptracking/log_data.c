@@ -7,50 +7,200 @@
  */
 
 #include "log_data.h"
-#include "chartest.h"
+
+#if ( defined(__x86_64__) || defined(__i386__) ) && defined(__GNUC__)
+#   define LOG_DATA_PARSE_X86
+#   include <immintrin.h>
+#endif
 
 //
 
 bool
 log_data_is_valid(
-    log_data_t  *data
+    const log_data_t    *data
 )
 {
     return ( data &&
+         (data->marker == 0) && (data->version == LOG_DATA_VERSION) &&
          (data->event >= log_event_unknown && data->event < log_event_max) &&
-         (data->dst_ipaddr[0] && memchr(data->dst_ipaddr, 0, sizeof(data->dst_ipaddr))) &&
-         (data->src_ipaddr[0] && memchr(data->src_ipaddr, 0, sizeof(data->src_ipaddr)) ) &&
-         (data->uid[0] && memchr(data->uid, 0, sizeof(data->uid))) &&
-         (data->log_date[0] && memchr(data->log_date, 0, sizeof(data->log_date))) );
+         ((data->dst_family == log_addr_family_ipv4) || (data->dst_family == log_addr_family_ipv6)) &&
+         ((data->src_family == log_addr_family_ipv4) || (data->src_family == log_addr_family_ipv6)) &&
+         (data->uid_len > 0 && data->uid_len < sizeof(data->uid)) &&
+         ! memchr(data->uid, 0, data->uid_len) && (data->uid[data->uid_len] == '\0') );
 }
 
 //
 
+log_data_strs_t*
+log_data_to_strs(
+    const log_data_t    *data,
+    log_data_strs_t     *strs
+)
+{
+    time_t              when = (time_t)(data->log_time_ns / 1000000000);
+    struct tm           when_tm;
+
+    log_data_addr_to_str(data->dst_family, data->dst_addr, strs->dst_ipaddr);
+    log_data_addr_to_str(data->src_family, data->src_addr, strs->src_ipaddr);
+    if ( ! localtime_r(&when, &when_tm) || ! strftime(strs->log_date, sizeof(strs->log_date), "%Y-%m-%d %H:%M:%S", &when_tm) ) strs->log_date[0] = '\0';
+    return strs;
+}
+
+//
+
+/*
+ * Character classes for table-driven validation of the text fields:
+ */
+enum {
+    __LOG_DATA_CC_DIGIT = 1 << 0,
+    __LOG_DATA_CC_DASH  = 1 << 1,
+    __LOG_DATA_CC_COLON = 1 << 2,
+    __LOG_DATA_CC_SPACE = 1 << 3
+};
+
+static const uint8_t __log_data_ctype[256] = {
+            ['0' ... '9'] = __LOG_DATA_CC_DIGIT,
+            ['-'] = __LOG_DATA_CC_DASH,
+            [':'] = __LOG_DATA_CC_COLON,
+            [' '] = __LOG_DATA_CC_SPACE,
+            ['\t'] = __LOG_DATA_CC_SPACE,
+            ['\r'] = __LOG_DATA_CC_SPACE,
+            ['\n'] = __LOG_DATA_CC_SPACE
+        };
+
+#define __LOG_DATA_IS(C, CLASS) ((__log_data_ctype[(uint8_t)(C)] & (CLASS)) != 0)
+
+/*
+ * The class expected at each position of a YYYY-MM-DD HH:MM:SS
+ * timestamp:
+ */
+#define __LOG_DATA_DATE_LEN     19
+
+static const uint8_t __log_data_date_template[__LOG_DATA_DATE_LEN] = {
+            __LOG_DATA_CC_DIGIT, __LOG_DATA_CC_DIGIT, __LOG_DATA_CC_DIGIT, __LOG_DATA_CC_DIGIT,
+            __LOG_DATA_CC_DASH,
+            __LOG_DATA_CC_DIGIT, __LOG_DATA_CC_DIGIT,
+            __LOG_DATA_CC_DASH,
+            __LOG_DATA_CC_DIGIT, __LOG_DATA_CC_DIGIT,
+            __LOG_DATA_CC_SPACE,
+            __LOG_DATA_CC_DIGIT, __LOG_DATA_CC_DIGIT,
+            __LOG_DATA_CC_COLON,
+            __LOG_DATA_CC_DIGIT, __LOG_DATA_CC_DIGIT,
+            __LOG_DATA_CC_COLON,
+            __LOG_DATA_CC_DIGIT, __LOG_DATA_CC_DIGIT
+        };
+
+#define __LOG_DATA_D2(P)    (10 * ((P)[0] - '0') + ((P)[1] - '0'))
+
+//
+
+/*
+ * Convert a local-time YYYY-MM-DD HH:MM:SS timestamp at the start of
+ * the <p_len> bytes at <p> to nanoseconds since the epoch.
+ *
+ * With a <context>, the start of the day is cached:  every other
+ * timestamp on the same day is then a matter of arithmetic, unless the
+ * day is not 24 hours long (a daylight saving transition) in which
+ * case each is handed to mktime().
+ */
 static bool
-__digit_chartest_callback(int c) { return (isdigit(c) != 0) ? true : false; }
-static bool
-__dash_chartest_callback(int c) { return (c == '-') ? true : false; }
-static bool
-__colon_chartest_callback(int c) { return (c == ':') ? true : false; }
+__log_data_parse_date(
+    const char                  *p,
+    size_t                      p_len,
+    log_data_parse_context_t    *context,
+    int64_t                     *log_time_ns
+)
+{
+    struct tm                   date_tm;
+    int                         year, mon, mday, hour, min, sec, i;
+    int32_t                     day_key;
+    time_t                      when;
+
+    if ( p_len < __LOG_DATA_DATE_LEN ) return false;
+    for ( i = 0; i < __LOG_DATA_DATE_LEN; i++ ) {
+        if ( ! __LOG_DATA_IS(p[i], __log_data_date_template[i]) ) return false;
+    }
+    year = 100 * __LOG_DATA_D2(p) + __LOG_DATA_D2(p + 2);
+    mon = __LOG_DATA_D2(p + 5);
+    mday = __LOG_DATA_D2(p + 8);
+    hour = __LOG_DATA_D2(p + 11);
+    min = __LOG_DATA_D2(p + 14);
+    sec = __LOG_DATA_D2(p + 17);
+    if ( mon < 1 || mon > 12 || mday < 1 || mday > 31 || hour > 23 || min > 59 || sec > 60 ) return false;
+
+    day_key = 10000 * year + 100 * mon + mday;
+    if ( context && (context->day_key != day_key) ) {
+        time_t                  day_end;
+
+        memset(&date_tm, 0, sizeof(date_tm));
+        date_tm.tm_year = year - 1900, date_tm.tm_mon = mon - 1, date_tm.tm_mday = mday;
+        date_tm.tm_isdst = -1;
+        if ( (when = mktime(&date_tm)) == (time_t)-1 ) return false;
+        memset(&date_tm, 0, sizeof(date_tm));
+        date_tm.tm_year = year - 1900, date_tm.tm_mon = mon - 1, date_tm.tm_mday = mday;
+        date_tm.tm_hour = 23, date_tm.tm_min = 59, date_tm.tm_sec = 59;
+        date_tm.tm_isdst = -1;
+        if ( (day_end = mktime(&date_tm)) == (time_t)-1 ) return false;
+        context->day_key = day_key;
+        context->day_start = when;
+        context->day_is_uniform = ((day_end - when) == 86399);
+    }
+    if ( context && context->day_is_uniform ) {
+        *log_time_ns = (context->day_start + 3600 * hour + 60 * min + sec) * 1000000000;
+        return true;
+    }
+    memset(&date_tm, 0, sizeof(date_tm));
+    date_tm.tm_year = year - 1900, date_tm.tm_mon = mon - 1, date_tm.tm_mday = mday;
+    date_tm.tm_hour = hour, date_tm.tm_min = min, date_tm.tm_sec = sec;
+    date_tm.tm_isdst = -1;
+    if ( (when = mktime(&date_tm)) == (time_t)-1 ) return false;
+    *log_time_ns = (int64_t)when * 1000000000;
+    return true;
+}
+
+//
+
 static bool
-__space_chartest_callback(int c) { return (c == ' ') ? true : false; }
-
-static chartest_sequence_t __datestr_chartest = {
-            .n_chunks = 11,
-            .chunks = {
-                { .n_char = 4, .chartest_callback = __digit_chartest_callback },
-                { .n_char = 1, .chartest_callback = __dash_chartest_callback },
-                { .n_char = 2, .chartest_callback = __digit_chartest_callback },
-                { .n_char = 1, .chartest_callback = __dash_chartest_callback },
-                { .n_char = 2, .chartest_callback = __digit_chartest_callback },
-                { .n_char = 1, .chartest_callback = __space_chartest_callback },
-                { .n_char = 2, .chartest_callback = __digit_chartest_callback },
-                { .n_char = 1, .chartest_callback = __colon_chartest_callback },
-                { .n_char = 2, .chartest_callback = __digit_chartest_callback },
-                { .n_char = 1, .chartest_callback = __colon_chartest_callback },
-                { .n_char = 2, .chartest_callback = __digit_chartest_callback },
-            }
-        };
+__log_data_import_v1(
+    log_data_t      *data
+)
+{
+    log_data_v1_t   v1;
+    size_t          uid_len;
+
+    memcpy(&v1, data, sizeof(v1));
+    if ( ! (v1.event < log_event_max) ||
+         ! memchr(v1.dst_ipaddr, 0, sizeof(v1.dst_ipaddr)) ||
+         ! memchr(v1.src_ipaddr, 0, sizeof(v1.src_ipaddr)) ||
+         ! (uid_len = strnlen(v1.uid, sizeof(v1.uid))) || (uid_len == sizeof(v1.uid)) ||
+         ! memchr(v1.log_date, 0, sizeof(v1.log_date)) ) return false;
+
+    memset(data, 0, sizeof(log_data_t));
+    data->version = LOG_DATA_VERSION;
+    if ( ! log_data_parse_addr(v1.dst_ipaddr, &data->dst_family, data->dst_addr) ) return false;
+    if ( ! log_data_parse_addr(v1.src_ipaddr, &data->src_family, data->src_addr) ) return false;
+    data->src_port = v1.src_port;
+    data->event = v1.event;
+    data->sshd_pid = v1.sshd_pid;
+    data->uid_len = uid_len;
+    memcpy(data->uid, v1.uid, uid_len);
+    if ( ! __log_data_parse_date(v1.log_date, strnlen(v1.log_date, sizeof(v1.log_date)), NULL, &data->log_time_ns) ) return false;
+    return true;
+}
+
+//
+
+bool
+log_data_import(
+    log_data_t  *data
+)
+{
+    /* A version 1 record starts with its (non-empty) server address: */
+    if ( data->marker ) return __log_data_import_v1(data);
+    return log_data_is_valid(data);
+}
+
+//
 
 bool
 log_data_parse(
@@ -61,10 +211,12 @@ log_data_parse(
 )
 {
     memset(data, 0, sizeof(log_data_t));
+    data->version = LOG_DATA_VERSION;
     while ( p && p_len ) {
         /* [dst_ipaddr],[src_ipddr],[src_port],[event],[uid],[log_date] */
         const char  *e;
         uint32_t    last_val;
+        char        field[LOG_DATA_ADDR_STRLEN];
         
         /* Drop any leading whitespace: */
         while ( p_len && *p && isspace(*p) ) p++, p_len--;
@@ -74,15 +226,17 @@ log_data_parse(
         /* dst_ipaddr */
         while ( p_len && *e && (*e != ',') ) e++, p_len--;
         if ( p_len == 0 ) break;
-        if ( (e - p) + 1 > sizeof(data->dst_ipaddr) ) break;
-        memcpy(&data->dst_ipaddr[0], p, (e - p) + 1); data->dst_ipaddr[e - p] = '\0';
+        if ( (e - p) + 1 > sizeof(field) ) break;
+        memcpy(field, p, e - p); field[e - p] = '\0';
+        if ( ! log_data_parse_addr(field, &data->dst_family, data->dst_addr) ) break;
         p = ++e, p_len--;
         
         /* src_ipaddr */
         while ( p_len && *e && (*e != ',') ) e++, p_len--;
         if ( p_len == 0 ) break;
-        if ( (e - p) + 1 > sizeof(data->src_ipaddr) ) break;
-        memcpy(&data->src_ipaddr[0], p, (e - p) + 1); data->src_ipaddr[e - p] = '\0';
+        if ( (e - p) + 1 > sizeof(field) ) break;
+        memcpy(field, p, e - p); field[e - p] = '\0';
+        if ( ! log_data_parse_addr(field, &data->src_family, data->src_addr) ) break;
         p = ++e, p_len--;
         
         /* src_port */
@@ -134,14 +288,13 @@ log_data_parse(
         while ( p_len && *e && (*e != ',') ) e++, p_len--;
         if ( p_len == 0 ) break;
         if ( (e - p) + 1 > sizeof(data->uid) ) break;
-        memcpy(&data->uid[0], p, (e - p) + 1); data->uid[e - p] = '\0';
+        memcpy(&data->uid[0], p, e - p); data->uid[e - p] = '\0';
+        data->uid_len = e - p;
         p = ++e, p_len--;
         
         /* timestamp */
-        if ( p_len == 0 ) break;
-        if ( ! chartest(&__datestr_chartest, p, p_len, &e) ) break;
-        if ( e - p + 1 > sizeof(data->log_date) ) break;
-        memcpy(&data->log_date[0], p, (e - p)); data->log_date[e - p] = '\0';
+        if ( ! __log_data_parse_date(p, p_len, NULL, &data->log_time_ns) ) break;
+        e = p + __LOG_DATA_DATE_LEN;
         
         if ( endptr ) *endptr = e;
         
@@ -149,3 +302,258 @@ log_data_parse(
     }
     return false;
 }
+
+//
+
+/*
+ * A line has exactly this many delimiters; room is left for one more
+ * so that a line with too many can be recognized:
+ */
+#define __LOG_DATA_N_DELIMS     6
+
+typedef struct {
+    const char  *at[__LOG_DATA_N_DELIMS + 1];
+    int         n;
+} __log_data_delims_t;
+
+static inline void
+__log_data_delims_add(
+    __log_data_delims_t *delims,
+    const char          *p
+)
+{
+    if ( delims->n <= __LOG_DATA_N_DELIMS ) delims->at[delims->n] = p;
+    delims->n++;
+}
+
+/*
+ * Each splitter records the delimiters at and beyond <p> and returns
+ * the position of the newline ending the line (or <e> if there is
+ * none).
+ */
+typedef const char* (*__log_data_splitter_t)(const char *p, const char *e, char delimiter, __log_data_delims_t *delims);
+
+static const char*
+__log_data_split_scalar(
+    const char          *p,
+    const char          *e,
+    char                delimiter,
+    __log_data_delims_t *delims
+)
+{
+    while ( p < e ) {
+        if ( *p == '\n' ) return p;
+        if ( *p == delimiter ) __log_data_delims_add(delims, p);
+        p++;
+    }
+    return e;
+}
+
+#ifdef LOG_DATA_PARSE_X86
+
+__attribute__((target("sse2")))
+static const char*
+__log_data_split_sse2(
+    const char          *p,
+    const char          *e,
+    char                delimiter,
+    __log_data_delims_t *delims
+)
+{
+    const __m128i       v_newline = _mm_set1_epi8('\n');
+    const __m128i       v_delimiter = _mm_set1_epi8(delimiter);
+
+    while ( e - p >= 16 ) {
+        __m128i         v = _mm_loadu_si128((const __m128i*)p);
+        uint32_t        newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, v_newline));
+        uint32_t        delims_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, v_delimiter));
+
+        /* Only the delimiters ahead of the first newline count: */
+        if ( newlines ) delims_mask &= (newlines & -newlines) - 1;
+        while ( delims_mask ) {
+            __log_data_delims_add(delims, p + __builtin_ctz(delims_mask));
+            delims_mask &= delims_mask - 1;
+        }
+        if ( newlines ) return p + __builtin_ctz(newlines);
+        p += 16;
+    }
+    return __log_data_split_scalar(p, e, delimiter, delims);
+}
+
+__attribute__((target("avx2")))
+static const char*
+__log_data_split_avx2(
+    const char          *p,
+    const char          *e,
+    char                delimiter,
+    __log_data_delims_t *delims
+)
+{
+    const __m256i       v_newline = _mm256_set1_epi8('\n');
+    const __m256i       v_delimiter = _mm256_set1_epi8(delimiter);
+
+    while ( e - p >= 32 ) {
+        __m256i         v = _mm256_loadu_si256((const __m256i*)p);
+        uint32_t        newlines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, v_newline));
+        uint32_t        delims_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, v_delimiter));
+
+        if ( newlines ) delims_mask &= (newlines & -newlines) - 1;
+        while ( delims_mask ) {
+            __log_data_delims_add(delims, p + __builtin_ctz(delims_mask));
+            delims_mask &= delims_mask - 1;
+        }
+        if ( newlines ) return p + __builtin_ctz(newlines);
+        p += 32;
+    }
+    return __log_data_split_sse2(p, e, delimiter, delims);
+}
+
+#endif
+
+static __log_data_splitter_t
+__log_data_splitter(void)
+{
+#ifdef LOG_DATA_PARSE_X86
+    if ( __builtin_cpu_supports("avx2") ) return __log_data_split_avx2;
+    if ( __builtin_cpu_supports("sse2") ) return __log_data_split_sse2;
+#endif
+    return __log_data_split_scalar;
+}
+
+//
+
+static inline bool
+__log_data_parse_uint(
+    const char  *p,
+    const char  *e,
+    uint32_t    max_val,
+    uint32_t    *value
+)
+{
+    uint64_t    v = 0;
+
+    if ( p == e || (e - p) > 10 ) return false;
+    while ( p < e ) {
+        if ( ! __LOG_DATA_IS(*p, __LOG_DATA_CC_DIGIT) ) return false;
+        v = 10 * v + (*p++ - '0');
+    }
+    if ( v > max_val ) return false;
+    *value = (uint32_t)v;
+    return true;
+}
+
+static inline bool
+__log_data_parse_addr_field(
+    const char  *p,
+    const char  *e,
+    uint8_t     *family,
+    uint8_t     addr[16]
+)
+{
+    char        field[LOG_DATA_ADDR_STRLEN];
+
+    if ( p == e || (e - p) >= sizeof(field) ) return false;
+    memcpy(field, p, e - p); field[e - p] = '\0';
+    return log_data_parse_addr(field, family, addr);
+}
+
+static inline bool
+__log_data_parse_event_field(
+    const char  *p,
+    const char  *e,
+    uint16_t    *event
+)
+{
+    uint32_t    v;
+    log_event_t i;
+
+    if ( __log_data_parse_uint(p, e, log_event_max - 1, &v) ) {
+        *event = v;
+        return true;
+    }
+    for ( i = log_event_unknown; i < log_event_max; i++ ) {
+        const char  *event_str = log_event_to_str(i);
+
+        if ( (strlen(event_str) == (e - p)) && ! memcmp(event_str, p, e - p) ) {
+            *event = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Parse the line running from <p> to <e> (its newline excluded), with
+ * its delimiters already located.
+ */
+static bool
+__log_data_parse_line(
+    log_data_parse_context_t    *context,
+    const char                  *p,
+    const char                  *e,
+    const __log_data_delims_t   *delims,
+    log_data_t                  *data
+)
+{
+    const char                  **d = (const char**)delims->at;
+    uint32_t                    v;
+
+    if ( delims->n != __LOG_DATA_N_DELIMS ) return false;
+    memset(data, 0, sizeof(log_data_t));
+    data->version = LOG_DATA_VERSION;
+    if ( ! __log_data_parse_addr_field(p, d[0], &data->dst_family, data->dst_addr) ) return false;
+    if ( ! __log_data_parse_addr_field(d[0] + 1, d[1], &data->src_family, data->src_addr) ) return false;
+    if ( ! __log_data_parse_uint(d[1] + 1, d[2], UINT16_MAX, &v) ) return false;
+    data->src_port = v;
+    if ( ! __log_data_parse_event_field(d[2] + 1, d[3], &data->event) ) return false;
+    if ( ! __log_data_parse_uint(d[3] + 1, d[4], INT32_MAX, &v) ) return false;
+    data->sshd_pid = v;
+    if ( (d[5] - d[4] - 1) < 1 || (d[5] - d[4] - 1) >= sizeof(data->uid) ) return false;
+    data->uid_len = d[5] - d[4] - 1;
+    memcpy(data->uid, d[4] + 1, data->uid_len);
+    if ( (e - d[5] - 1) != __LOG_DATA_DATE_LEN ) return false;
+    return __log_data_parse_date(d[5] + 1, __LOG_DATA_DATE_LEN, context, &data->log_time_ns);
+}
+
+//
+
+size_t
+log_data_parse_many(
+    log_data_parse_context_t    *context,
+    const char                  *p,
+    size_t                      p_len,
+    log_data_t                  *data,
+    size_t                      n_data,
+    const char                  **endptr
+)
+{
+    __log_data_splitter_t       splitter = __log_data_splitter();
+    const char                  *p_end = p + p_len;
+    size_t                      n_parsed = 0;
+
+    while ( (n_parsed < n_data) && (p < p_end) ) {
+        __log_data_delims_t     delims = { .n = 0 };
+        const char              *eol, *e;
+
+        /* Drop leading whitespace, which includes blank lines: */
+        if ( __LOG_DATA_IS(*p, __LOG_DATA_CC_SPACE) ) {
+            p++;
+            continue;
+        }
+        eol = splitter(p, p_end, context->delimiter, &delims);
+
+        /* Drop trailing whitespace (e.g. a carriage return): */
+        e = eol;
+        while ( (e > p) && __LOG_DATA_IS(*(e - 1), __LOG_DATA_CC_SPACE) ) e--;
+
+        context->n_lines++;
+        if ( __log_data_parse_line(context, p, e, &delims, &data[n_parsed]) ) {
+            n_parsed++;
+        } else {
+            context->n_invalid++;
+        }
+        p = (eol < p_end) ? eol + 1 : p_end;
+    }
+    if ( endptr ) *endptr = p;
+    return n_parsed;
+}
@@ -11,6 +11,8 @@
 
 #include "iptracking.h"
 
+#include <arpa/inet.h>
+
 /*!
  * @enum log_event
  *
@@ -68,11 +70,99 @@ log_event_t log_event_parse_str(
     return log_event_unknown;
 }
 
+/*!
+ * @enum log_addr_family
+ *
+ * Address family tags for the binary addresses in a log_data_t.
+ *
+ * @constant log_addr_family_unspec     no address
+ * @constant log_addr_family_ipv4       4-byte IPv4 address
+ * @constant log_addr_family_ipv6       16-byte IPv6 address
+ */
+typedef enum log_addr_family {
+    log_addr_family_unspec = 0,
+    log_addr_family_ipv4 = 4,
+    log_addr_family_ipv6 = 6
+} log_addr_family_t;
+
+/*!
+ * @defined LOG_DATA_VERSION
+ *
+ * Version of the log_data_t record.  Every record starts with a zero
+ * byte and its version; a version 1 record (log_data_v1_t) starts with
+ * the first character of its server address, which is never zero, so
+ * the daemon can accept both side by side.
+ */
+#define LOG_DATA_VERSION        2
+
+/*!
+ * @defined LOG_DATA_ADDR_STRLEN
+ *
+ * Size of a buffer large enough for any address in textual form.
+ */
+#define LOG_DATA_ADDR_STRLEN    46
+
+/*!
+ * @defined LOG_DATA_DATE_STRLEN
+ *
+ * Size of a buffer large enough for a timestamp in textual form:
+ * YYYY-MM-DD HH:MM:SS
+ */
+#define LOG_DATA_DATE_STRLEN    20
+
 /*!
  * @typedef log_data_t
  *
  * Data structure that holds event information.  Forced to be
- * 128 bytes in size.
+ * 128 bytes in size.  Values are binary so no field needs to be
+ * formatted by the client nor parsed by a database driver.
+ *
+ * @field marker        Always zero (see LOG_DATA_VERSION)
+ * @field version       LOG_DATA_VERSION
+ * @field dst_family    Family of the server address
+ * @field src_family    Family of the client address
+ * @field src_port      TCP/IP port from which the client connected
+ * @field event         The PAM event id
+ * @field sshd_pid      The pid of the sshd handling the connection
+ * @field uid_len       Number of bytes in uid (less than its size, so
+ *                      uid is always NUL-terminated)
+ * @field log_time_ns   The timestamp of the connection in nanoseconds
+ *                      since the Unix epoch
+ * @field dst_addr      Address of the server in network byte order (an
+ *                      IPv4 address uses the first 4 bytes)
+ * @field src_addr      Address of the client in network byte order
+ * @field uid           The user identifier used for the connection
+ */
+#if defined __GCC__ || defined __clang__
+typedef struct __attribute__((packed)) log_data {
+#else
+#pragma pack(1)
+typedef struct log_data {
+#endif
+    uint8_t     marker;
+    uint8_t     version;
+    uint8_t     dst_family;     /* from log_addr_family */
+    uint8_t     src_family;     /* from log_addr_family */
+    uint16_t    src_port;
+    uint16_t    event;          /* event id from log_event */
+    int32_t     sshd_pid;       /* pid of the sshd */
+    uint8_t     uid_len;
+    uint8_t     reserved[3];
+    int64_t     log_time_ns;    /* nanoseconds since the epoch */
+    uint8_t     dst_addr[16];
+    uint8_t     src_addr[16];
+    char        uid[72];
+    /* 24 + 16 + 16 + 72 = 128 bytes, or 4KiB = 32 of them */
+} log_data_t;
+#if ! defined __GCC__ && ! defined __clang__
+#pragma pack()
+#endif
+
+/*!
+ * @typedef log_data_v1_t
+ *
+ * The original (version 1) event record, still accepted from older
+ * clients, drop directories, and spools.  Also 128 bytes in size.
  *
  * @field dst_ipaddr    IPv4 address of the server
  * @field src_ipaddr    IPv4 address of the client
@@ -83,10 +173,10 @@ log_event_t log_event_parse_str(
  *                          YYYY-MM-DD HH:MM:SS
  */
 #if defined __GCC__ || defined __clang__
-typedef struct __attribute__((packed)) log_data {
+typedef struct __attribute__((packed)) log_data_v1 {
 #else
 #pragma pack(1)
-typedef struct log_data {
+typedef struct log_data_v1 {
 #endif
     char        dst_ipaddr[16]; /* ###.###.###.### */
     char        src_ipaddr[16]; /* ###.###.###.### */
@@ -95,20 +185,96 @@ typedef struct log_data {
     int32_t     sshd_pid;       /* pid of the sshd */
     char        uid[60];        /* various sizes */
     char        log_date[28];   /* ####-##-## ##:##:##±#### */
-    /* 64 is a good choice for uid because on 64-bit LP each struct is
-       16 + 16 + 2 + 2 + 64 + 28 = 128 bytes, or 4KiB = 32 of them */
-} log_data_t;
+} log_data_v1_t;
 #if ! defined __GCC__ && ! defined __clang__
 #pragma pack()
 #endif
 
+_Static_assert(sizeof(log_data_t) == 128, "log_data_t must be 128 bytes");
+_Static_assert(sizeof(log_data_v1_t) == sizeof(log_data_t), "log_data_v1_t must be the same size as log_data_t");
+
+/*!
+ * @function log_data_parse_addr
+ *
+ * Parse the numeric IPv4 or IPv6 address in <addr_str> into <family>
+ * and <addr>.  Returns true if successful, false otherwise.
+ */
+static inline
+bool log_data_parse_addr(
+    const char  *addr_str,
+    uint8_t     *family,
+    uint8_t     addr[16]
+)
+{
+    memset(addr, 0, 16);
+    if ( inet_pton(AF_INET, addr_str, addr) == 1 ) {
+        *family = log_addr_family_ipv4;
+        return true;
+    }
+    if ( inet_pton(AF_INET6, addr_str, addr) == 1 ) {
+        *family = log_addr_family_ipv6;
+        return true;
+    }
+    *family = log_addr_family_unspec;
+    return false;
+}
+
+/*!
+ * @function log_data_addr_to_str
+ *
+ * Write the textual form of the <family> address <addr> to <buffer>,
+ * which must hold at least LOG_DATA_ADDR_STRLEN characters.  Returns
+ * <buffer>.
+ */
+static inline
+const char* log_data_addr_to_str(
+    uint8_t         family,
+    const uint8_t   addr[16],
+    char            *buffer
+)
+{
+    int             af = (family == log_addr_family_ipv6) ? AF_INET6 : AF_INET;
+
+    if ( (family == log_addr_family_unspec) || ! inet_ntop(af, addr, buffer, LOG_DATA_ADDR_STRLEN) ) *buffer = '\0';
+    return buffer;
+}
+
+/*!
+ * @typedef log_data_strs_t
+ *
+ * Textual forms of the fields of a log_data_t that need formatting,
+ * for drivers (and log messages) that deal in text.
+ */
+typedef struct {
+    char        dst_ipaddr[LOG_DATA_ADDR_STRLEN];
+    char        src_ipaddr[LOG_DATA_ADDR_STRLEN];
+    char        log_date[LOG_DATA_DATE_STRLEN];
+} log_data_strs_t;
+
+/*!
+ * @function log_data_to_strs
+ *
+ * Fill-in <strs> from <data>; the timestamp is formatted in local
+ * time.  Returns <strs>.
+ */
+log_data_strs_t* log_data_to_strs(const log_data_t *data, log_data_strs_t *strs);
+
 /*!
  * @function log_data_is_valid
  *
  * Checks the content of <data> to ensure all fields are properly
  * filled-in.  Returns true if so, false otherwise.
  */
-bool log_data_is_valid(log_data_t *data);
+bool log_data_is_valid(const log_data_t *data);
+
+/*!
+ * @function log_data_import
+ *
+ * Bring the record received in <data> up to the current version in
+ * place:  a version 1 record is converted, a current record is left
+ * as-is.  Returns true if the result is valid, false otherwise.
+ */
+bool log_data_import(log_data_t *data);
 
 /*!
  * @function log_data_parse
@@ -123,6 +289,8 @@ bool log_data_is_valid(log_data_t *data);
  * A parsable event string looks like:
  *
  *     [dst_ipaddr],[src_ipddr],[src_port],[event],[sshd_pid],[uid],[log_date]
+ *
+ * where the log_date is local time.
  */
 bool log_data_parse(log_data_t *data, const char *p, size_t p_len, const char  **endptr);
 
@@ -137,4 +305,70 @@ bool log_data_parse_cstr(log_data_t *data, const char *cstr, const char  **endpt
     return log_data_parse(data, cstr, strlen(cstr), endptr);
 }
 
+/*!
+ * @typedef log_data_parse_context_t
+ *
+ * State carried across calls to log_data_parse_many() over the same
+ * input, e.g. one per thread working through a file.  Initialize it
+ * with log_data_parse_context_init().
+ *
+ * @field delimiter     the field separator character
+ * @field n_lines       number of non-empty lines examined
+ * @field n_invalid     number of lines that could not be parsed (and
+ *                      were skipped)
+ *
+ * The remaining fields cache the start of the last local day seen so
+ * that most timestamps need no call to mktime(); they are private.
+ */
+typedef struct {
+    char        delimiter;
+    uint64_t    n_lines;
+    uint64_t    n_invalid;
+    int32_t     day_key;
+    bool        day_is_uniform;
+    int64_t     day_start;
+} log_data_parse_context_t;
+
+/*!
+ * @function log_data_parse_context_init
+ *
+ * Prepare <context> for parsing lines whose fields are separated by
+ * <delimiter> (a comma if <delimiter> is '\0').
+ */
+static inline
+void log_data_parse_context_init(
+    log_data_parse_context_t    *context,
+    char                        delimiter
+)
+{
+    memset(context, 0, sizeof(*context));
+    context->delimiter = delimiter ? delimiter : ',';
+    context->day_key = -1;
+}
+
+/*!
+ * @function log_data_parse_many
+ *
+ * Parse consecutive newline-terminated lines from the <p_len> bytes at
+ * <p> into the array of <n_data> records at <data>, stopping when the
+ * array is full or the bytes are exhausted.  The bytes are assumed to
+ * end on a line boundary, so a final line lacking its newline is
+ * parsed as-is.  Returns the number of records filled-in.
+ *
+ * Lines have the same form as the csvfile driver writes them:
+ *
+ *     [dst_ipaddr],[src_ipddr],[src_port],[event],[sshd_pid],[uid],[log_date]
+ *
+ * with the <context> delimiter separating fields and the event given
+ * by name or number.  Blank lines are ignored; lines that do not parse
+ * are skipped and counted in <context>.
+ *
+ * If <endptr> is not NULL, *<endptr> is set to the first byte not
+ * consumed, from which a subsequent call can continue.
+ *
+ * Delimiters and newlines are located 16 or 32 bytes at a time using
+ * SSE2 or AVX2 when the processor has them.
+ */
+size_t log_data_parse_many(log_data_parse_context_t *context, const char *p, size_t p_len, log_data_t *data, size_t n_data, const char **endptr);
+
 #endif /* __LOG_DATA_H__ */
@@ -137,3 +137,33 @@ yaml_helper_get_scalar_uint32_value(
     }
     return false;
 }
+
+//
+
+bool
+yaml_helper_get_scalar_bool_value(
+    yaml_node_t *node,
+    bool        *value
+)
+{
+    if ( node->type == YAML_SCALAR_NODE ) {
+        static const char   *true_strs[] = { "true", "yes", "on", "1", NULL };
+        static const char   *false_strs[] = { "false", "no", "off", "0", NULL };
+        const char          *s = (const char*)node->data.scalar.value;
+        int                 i;
+        
+        for ( i = 0; true_strs[i]; i++ ) {
+            if ( strcasecmp(s, true_strs[i]) == 0 ) {
+                *value = true;
+                return true;
+            }
+        }
+        for ( i = 0; false_strs[i]; i++ ) {
+            if ( strcasecmp(s, false_strs[i]) == 0 ) {
+                *value = false;
+                return true;
+            }
+        }
+    }
+    return false;
+}
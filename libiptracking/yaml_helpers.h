@@ -65,4 +65,14 @@ bool yaml_helper_get_scalar_int_value(yaml_node_t *node, int *value);
  */
 bool yaml_helper_get_scalar_uint32_value(yaml_node_t *node, uint32_t *value);
 
+/*!
+ * @function yaml_helper_get_scalar_bool_value
+ *
+ * If <node> is a scalar node, attempt to parse its value as a boolean
+ * (true/false, yes/no, on/off, or 1/0, case-insensitive) and set *<value>
+ * to the parsed value and return true.  Otherwise *<value> is not
+ * modified and false is returned.
+ */
+bool yaml_helper_get_scalar_bool_value(yaml_node_t *node, bool *value);
+
 #endif /* __YAML_HELPERS_H__ */
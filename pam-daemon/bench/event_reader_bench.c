@@ -0,0 +1,266 @@
+/*
+ * iptracking
+ * event_reader_bench.c
+ *
+ * Load test of the socket event reader:  client threads deliver events
+ * to a reader with 1, 2, 4, .. acceptor threads and the rate at which
+ * the reader hands them to its callback is reported for each acceptor
+ * count.
+ *
+ */
+
+#include "iptracking.h"
+#include "logging.h"
+#include "event_reader.h"
+#include "log_client.h"
+
+#include <getopt.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+//
+
+#define BENCH_DEFAULT_EVENTS        200000
+#define BENCH_DEFAULT_CLIENTS       8
+#define BENCH_DEFAULT_MAX_ACCEPTORS 8
+#define BENCH_CLIENT_TIMEOUT_MS     5000
+#define BENCH_DRAIN_TIMEOUT_S       10
+
+//
+
+typedef struct {
+    const char          *socket_filepath;
+    socket_type_t       socket_type;
+    unsigned long       n_events;
+    _Atomic unsigned long n_sent;
+    _Atomic unsigned long n_received;
+} bench_t;
+
+//
+
+static double
+bench_now(void)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+//
+
+static bool
+bench_callback(
+    void        *context,
+    log_data_t  *data
+)
+{
+    bench_t     *B = (bench_t*)context;
+
+    atomic_fetch_add_explicit(&B->n_received, 1, memory_order_relaxed);
+    return true;
+}
+
+//
+
+static void*
+bench_reader_entry(
+    void        *context
+)
+{
+    event_reader_run((event_reader_ref)context);
+    return NULL;
+}
+
+//
+
+static void*
+bench_client_entry(
+    void        *context
+)
+{
+    bench_t             *B = (bench_t*)context;
+    log_client_ref      client = log_client_create(B->socket_filepath, B->socket_type, BENCH_CLIENT_TIMEOUT_MS);
+    log_data_t          data;
+    unsigned long       i, n_sent = 0;
+
+    if ( ! client ) return NULL;
+    for ( i = 0; i < B->n_events; i++ ) {
+        if ( log_client_fill_event(&data, "auth", "bench", (pid_t)i, "10.0.0.1 40000 10.0.0.2 22", NULL) != 0 ) break;
+        if ( log_client_send(client, &data) == 0 ) n_sent++;
+    }
+    log_client_destroy(&client);
+    atomic_fetch_add(&B->n_sent, n_sent);
+    return NULL;
+}
+
+//
+
+static bool
+bench_run(
+    event_reader_params_t   *params,
+    unsigned long           n_clients,
+    unsigned long           n_events
+)
+{
+    bench_t             B = {
+                            .socket_filepath = params->socket_filepath,
+                            .socket_type = params->socket_type,
+                            .n_events = n_events / n_clients
+                        };
+    event_reader_ref    reader;
+    pthread_t           reader_thread, *client_threads;
+    struct stat         finfo;
+    unsigned long       i, n_sent, n_received;
+    double              t0, dt, t_drain;
+
+    client_threads = (pthread_t*)calloc(n_clients, sizeof(pthread_t));
+    if ( ! client_threads ) return false;
+    atomic_init(&B.n_sent, 0);
+    atomic_init(&B.n_received, 0);
+    params->callback_context = &B;
+    unlink(params->socket_filepath);
+    if ( ! (reader = event_reader_create(params)) ) {
+        free((void*)client_threads);
+        return false;
+    }
+    pthread_create(&reader_thread, NULL, bench_reader_entry, reader);
+
+    /* Don't start the clock until the reader is listening: */
+    while ( stat(params->socket_filepath, &finfo) != 0 ) usleep(1000);
+
+    t0 = bench_now();
+    for ( i = 0; i < n_clients; i++ ) pthread_create(&client_threads[i], NULL, bench_client_entry, &B);
+    for ( i = 0; i < n_clients; i++ ) pthread_join(client_threads[i], NULL);
+    n_sent = atomic_load(&B.n_sent);
+    t_drain = bench_now() + BENCH_DRAIN_TIMEOUT_S;
+    while ( ((n_received = atomic_load(&B.n_received)) < n_sent) && (bench_now() < t_drain) ) usleep(100);
+    dt = bench_now() - t0;
+
+    event_reader_stop(reader);
+    pthread_join(reader_thread, NULL);
+    event_reader_destroy(&reader);
+    unlink(params->socket_filepath);
+    free((void*)client_threads);
+
+    printf("%-9s %-8s %9u %7lu %10lu %10lu %8.3f %12.0f\n",
+        socket_type_to_str(params->socket_type), event_reader_backend_to_str(params->backend),
+        params->n_acceptors, n_clients, n_sent, n_received, dt, (double)n_received / dt);
+    return true;
+}
+
+//
+
+static struct option cli_options[] = {
+                   { "help",            no_argument,       0,  'h' },
+                   { "backend",         required_argument, 0,  'B' },
+                   { "socket-type",     required_argument, 0,  't' },
+                   { "socket",          required_argument, 0,  's' },
+                   { "events",          required_argument, 0,  'n' },
+                   { "clients",         required_argument, 0,  'c' },
+                   { "acceptors",       required_argument, 0,  'a' },
+                   { NULL,              0,                 0,   0  }
+               };
+static const char *cli_options_str = "hB:t:s:n:c:a:";
+
+//
+
+void
+usage(
+    const char  *exe
+)
+{
+    printf(
+        "usage:\n\n"
+        "    %s {options}\n\n"
+        "  options:\n\n"
+        "    -h/--help                  Show this information\n"
+        "    -B/--backend <name>        Socket reader backend (default: %s)\n"
+        "    -t/--socket-type <name>    Socket type:  stream, seqpacket, dgram\n"
+        "                               (default: %s)\n"
+        "    -s/--socket <path>         Socket to listen on (default: a temporary path)\n"
+        "    -n/--events <int>          Events sent in each run (default: %d)\n"
+        "    -c/--clients <int>         Client threads sending events (default: %d)\n"
+        "    -a/--acceptors <int>       Measure 1, 2, 4, .. up to this many acceptor\n"
+        "                               threads (default: %d)\n"
+        "\n",
+        exe,
+        SOCKET_DEFAULT_READER_BACKEND,
+        SOCKET_DEFAULT_TYPE,
+        BENCH_DEFAULT_EVENTS,
+        BENCH_DEFAULT_CLIENTS,
+        BENCH_DEFAULT_MAX_ACCEPTORS);
+}
+
+//
+
+int
+main(
+    int             argc,
+    char* const*    argv
+)
+{
+    int                     opt_ch;
+    unsigned long           n_events = BENCH_DEFAULT_EVENTS, n_clients = BENCH_DEFAULT_CLIENTS;
+    unsigned long           max_acceptors = BENCH_DEFAULT_MAX_ACCEPTORS;
+    char                    socket_filepath[PATH_MAX];
+    event_reader_params_t   params = {
+                                .socket_filepath = socket_filepath,
+                                .backend = event_reader_backend_parse_str(SOCKET_DEFAULT_READER_BACKEND),
+                                .socket_type = socket_type_parse_str(SOCKET_DEFAULT_TYPE),
+                                .backlog = SOCKET_DEFAULT_BACKLOG,
+                                .poll_interval = 1,
+                                .max_connections = SOCKET_DEFAULT_MAX_CONNECTIONS,
+                                .connection_timeout_ms = SOCKET_DEFAULT_CONNECTION_TIMEOUT_MS,
+                                .callback = bench_callback
+                            };
+
+    snprintf(socket_filepath, sizeof(socket_filepath), "/tmp/iptracking-bench.%ld.s", (long)getpid());
+    while ( (opt_ch = getopt_long(argc, argv, cli_options_str, cli_options, NULL)) != -1 ) {
+        switch ( opt_ch ) {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            case 'B':
+                if ( (params.backend = event_reader_backend_parse_str(optarg)) == event_reader_backend_max ) {
+                    ERROR("Invalid socket reader backend: %s", optarg);
+                    exit(EINVAL);
+                }
+                break;
+            case 't':
+                if ( (params.socket_type = socket_type_parse_str(optarg)) == socket_type_max ) {
+                    ERROR("Invalid socket type: %s", optarg);
+                    exit(EINVAL);
+                }
+                break;
+            case 's':
+                snprintf(socket_filepath, sizeof(socket_filepath), "%s", optarg);
+                break;
+            case 'n':
+                n_events = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                n_clients = strtoul(optarg, NULL, 0);
+                break;
+            case 'a':
+                max_acceptors = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                exit(EINVAL);
+        }
+    }
+    if ( ! n_events || ! n_clients || ! max_acceptors ) {
+        ERROR("All counts must be positive integers (see --help)");
+        exit(EINVAL);
+    }
+
+    printf("%-9s %-8s %9s %7s %10s %10s %8s %12s\n",
+        "socket", "backend", "acceptors", "clients", "sent", "received", "seconds", "events/s");
+    for ( params.n_acceptors = 1; params.n_acceptors <= max_acceptors; params.n_acceptors <<= 1 ) {
+        if ( ! bench_run(&params, n_clients, n_events) ) {
+            ERROR("Unable to create the socket reader");
+            exit(ENOMEM);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * iptracking
+ * log_data_parse_bench.c
+ *
+ * Benchmark of the csvfile line parser used by iptracking-import:
+ * lines are parsed in batches with log_data_parse_many() and the rate
+ * is reported in lines per second.
+ *
+ */
+
+#include "iptracking.h"
+#include "logging.h"
+#include "log_data.h"
+
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+
+#define BENCH_DEFAULT_LINES         10000000
+#define BENCH_DEFAULT_BATCH         1024
+
+//
+
+static double
+bench_now(void)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+//
+
+/*
+ * Fill a buffer with <n_lines> csvfile lines like those the csvfile
+ * driver writes, all on one day so the parser's date cache applies as
+ * it would for a daily log.
+ */
+static char*
+bench_generate_lines(
+    unsigned long   n_lines,
+    size_t          *p_len
+)
+{
+    static const char   *events[] = { "auth", "open_session", "close_session" };
+    size_t              capacity = n_lines * 96, len = 0;
+    char                *p = (char*)malloc(capacity);
+    unsigned long       i;
+
+    if ( ! p ) return NULL;
+    for ( i = 0; i < n_lines; i++ ) {
+        len += snprintf(p + len, capacity - len, "10.%lu.%lu.%lu,%lu.%lu.3.4,%lu,%s,%lu,user%lu,2025-10-09 %02lu:%02lu:%02lu\n",
+                    i % 256, (i / 256) % 256, i % 251,
+                    (i * 7) % 256, (i * 13) % 256,
+                    1024 + (i * 31) % 64000,
+                    events[i % 3],
+                    1000 + (i * 17) % 4000000,
+                    i % 5000,
+                    (i / 3600) % 24, (i / 60) % 60, i % 60);
+    }
+    *p_len = len;
+    return p;
+}
+
+//
+
+static struct option cli_options[] = {
+                   { "help",            no_argument,       0,  'h' },
+                   { "lines",           required_argument, 0,  'n' },
+                   { "batch",           required_argument, 0,  'b' },
+                   { "delimiter",       required_argument, 0,  'd' },
+                   { NULL,              0,                 0,   0  }
+               };
+static const char *cli_options_str = "hn:b:d:";
+
+//
+
+void
+usage(
+    const char  *exe
+)
+{
+    printf(
+        "usage:\n\n"
+        "    %s {options} {<csvfile>}\n\n"
+        "  options:\n\n"
+        "    -h/--help                  Show this information\n"
+        "    -n/--lines <int>           Number of lines to generate when no <csvfile>\n"
+        "                               is given (default: %d)\n"
+        "    -b/--batch <int>           Records parsed per log_data_parse_many() call\n"
+        "                               (default: %d)\n"
+        "    -d/--delimiter <char>      Field delimiter in the <csvfile> (default: ,)\n"
+        "\n",
+        exe,
+        BENCH_DEFAULT_LINES,
+        BENCH_DEFAULT_BATCH);
+}
+
+//
+
+int
+main(
+    int             argc,
+    char* const*    argv
+)
+{
+    int                         opt_ch, fd = -1;
+    unsigned long               n_lines = BENCH_DEFAULT_LINES, batch = BENCH_DEFAULT_BATCH;
+    char                        delimiter = ',';
+    char                        *p_buffer;
+    const char                  *p, *e;
+    size_t                      p_len;
+    log_data_t                  *records;
+    log_data_parse_context_t    parse_context;
+    uint64_t                    n_parsed = 0;
+    double                      t0, dt;
+
+    while ( (opt_ch = getopt_long(argc, argv, cli_options_str, cli_options, NULL)) != -1 ) {
+        switch ( opt_ch ) {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            case 'n':
+                n_lines = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                batch = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                if ( strlen(optarg) != 1 || (*optarg == '\n') ) {
+                    ERROR("Invalid delimiter (must be a single character): %s", optarg);
+                    exit(EINVAL);
+                }
+                delimiter = *optarg;
+                break;
+            default:
+                exit(EINVAL);
+        }
+    }
+    if ( ! n_lines || ! batch ) {
+        ERROR("All counts must be positive integers (see --help)");
+        exit(EINVAL);
+    }
+
+    if ( optind < argc ) {
+        struct stat     finfo;
+
+        if ( (fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &finfo) != 0 || finfo.st_size == 0 ) {
+            ERROR("Unable to open csvfile %s (errno=%d)", argv[optind], errno);
+            exit(EINVAL);
+        }
+        p_len = finfo.st_size;
+        p_buffer = (char*)mmap(NULL, p_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if ( p_buffer == MAP_FAILED ) {
+            ERROR("Unable to map csvfile %s (errno=%d)", argv[optind], errno);
+            exit(errno);
+        }
+        madvise(p_buffer, p_len, MADV_SEQUENTIAL);
+        printf("csvfile %s (%lu bytes)\n", argv[optind], (unsigned long)p_len);
+    } else {
+        if ( ! (p_buffer = bench_generate_lines(n_lines, &p_len)) ) {
+            ERROR("Unable to allocate %lu lines", n_lines);
+            exit(ENOMEM);
+        }
+        printf("generated %lu lines (%lu bytes)\n", n_lines, (unsigned long)p_len);
+    }
+    if ( ! (records = (log_data_t*)malloc(batch * sizeof(log_data_t))) ) {
+        ERROR("Unable to allocate batch of %lu records", batch);
+        exit(ENOMEM);
+    }
+
+    /* Touch every page before timing so the parser doesn't pay for faults: */
+    e = p_buffer + p_len;
+    for ( p = p_buffer; p < e; p += 4096 ) n_parsed += *p;
+
+    printf("%-20s %12s %12s %10s %14s\n", "parser", "lines", "invalid", "seconds", "lines/s");
+
+    log_data_parse_context_init(&parse_context, delimiter);
+    p = p_buffer;
+    n_parsed = 0;
+    t0 = bench_now();
+    while ( p < e ) n_parsed += log_data_parse_many(&parse_context, p, e - p, records, batch, &p);
+    dt = bench_now() - t0;
+    printf("%-20s %12lu %12lu %10.3f %14.0f\n", "log_data_parse_many",
+        (unsigned long)n_parsed, (unsigned long)parse_context.n_invalid, dt, (double)n_parsed / dt);
+
+    free((void*)records);
+    if ( fd >= 0 ) {
+        munmap(p_buffer, p_len);
+        close(fd);
+    } else {
+        free((void*)p_buffer);
+    }
+    return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * iptracking
+ * log_queue_bench.c
+ *
+ * Microbenchmark of the log queue backends:  producer threads push
+ * events while a single consumer (like the database thread) pops
+ * them in batches, and the throughput is reported for each backend
+ * and producer count.
+ *
+ */
+
+#include "iptracking.h"
+#include "logging.h"
+#include "log_queue.h"
+
+#include <getopt.h>
+
+//
+
+#define BENCH_DEFAULT_EVENTS        4000000
+#define BENCH_DEFAULT_RECORDS       8192
+#define BENCH_DEFAULT_BATCH         64
+#define BENCH_DEFAULT_MAX_PRODUCERS 8
+
+//
+
+typedef struct {
+    log_queue_ref       lq;
+    unsigned long       n_events;
+    size_t              batch;
+} bench_thread_t;
+
+//
+
+static double
+bench_now(void)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+//
+
+static void*
+bench_producer_entry(
+    void        *context
+)
+{
+    bench_thread_t      *T = (bench_thread_t*)context;
+    log_data_t          data;
+    unsigned long       i;
+
+    memset(&data, 0, sizeof(data));
+    data.version = LOG_DATA_VERSION;
+    data.event = log_event_auth;
+    data.uid_len = snprintf(data.uid, sizeof(data.uid), "bench");
+    for ( i = 0; i < T->n_events; i++ ) {
+        data.sshd_pid = (pid_t)i;
+        if ( ! log_queue_push(&T->lq, &data) ) break;
+    }
+    return NULL;
+}
+
+//
+
+static void*
+bench_consumer_entry(
+    void        *context
+)
+{
+    bench_thread_t      *T = (bench_thread_t*)context;
+    log_data_t          *batch = (log_data_t*)malloc(T->batch * sizeof(log_data_t));
+    unsigned long       n_popped = 0;
+
+    while ( batch && (n_popped < T->n_events) ) {
+        size_t          n = log_queue_pop_batch(&T->lq, batch, T->batch, 0);
+
+        if ( n == 0 ) break;
+        n_popped += n;
+    }
+    if ( batch ) free((void*)batch);
+    T->n_events = n_popped;
+    return NULL;
+}
+
+//
+
+static bool
+bench_run(
+    log_queue_backend_t backend,
+    unsigned long       n_records,
+    unsigned long       n_producers,
+    unsigned long       n_events,
+    size_t              batch
+)
+{
+    log_queue_params_t  params = {
+                            .backend = backend,
+                            .records = { .min = n_records, .max = n_records, .delta = n_records },
+                            .push_wait_ms = 0,
+                            .overflow_policy = log_queue_overflow_policy_block
+                        };
+    bench_thread_t      producer, consumer;
+    pthread_t           *threads = (pthread_t*)calloc(n_producers + 1, sizeof(pthread_t));
+    unsigned long       i;
+    double              t0, dt;
+
+    if ( ! threads ) return false;
+    producer.lq = consumer.lq = log_queue_create(&params);
+    if ( ! producer.lq ) {
+        free((void*)threads);
+        return false;
+    }
+    producer.n_events = n_events / n_producers;
+    consumer.n_events = producer.n_events * n_producers;
+    consumer.batch = batch;
+
+    t0 = bench_now();
+    pthread_create(&threads[0], NULL, bench_consumer_entry, &consumer);
+    for ( i = 1; i <= n_producers; i++ ) pthread_create(&threads[i], NULL, bench_producer_entry, &producer);
+    for ( i = 0; i <= n_producers; i++ ) pthread_join(threads[i], NULL);
+    dt = bench_now() - t0;
+
+    printf("%-6s %9lu %9lu %12lu %10.3f %14.0f\n",
+        log_queue_backend_to_str(backend), n_producers, n_records,
+        consumer.n_events, dt, (double)consumer.n_events / dt);
+    log_queue_destroy(&producer.lq);
+    free((void*)threads);
+    return true;
+}
+
+//
+
+static struct option cli_options[] = {
+                   { "help",            no_argument,       0,  'h' },
+                   { "backend",         required_argument, 0,  'B' },
+                   { "events",          required_argument, 0,  'n' },
+                   { "records",         required_argument, 0,  'r' },
+                   { "batch",           required_argument, 0,  'b' },
+                   { "producers",       required_argument, 0,  'p' },
+                   { NULL,              0,                 0,   0  }
+               };
+static const char *cli_options_str = "hB:n:r:b:p:";
+
+//
+
+void
+usage(
+    const char  *exe
+)
+{
+    printf(
+        "usage:\n\n"
+        "    %s {options}\n\n"
+        "  options:\n\n"
+        "    -h/--help                  Show this information\n"
+        "    -B/--backend <name>        Only measure the named backend (pool, ring)\n"
+        "    -n/--events <int>          Events pushed in each run (default: %d)\n"
+        "    -r/--records <int>         Queue capacity in records (default: %d)\n"
+        "    -b/--batch <int>           Records popped at once by the consumer\n"
+        "                               (default: %d)\n"
+        "    -p/--producers <int>       Measure 1, 2, 4, .. up to this many producer\n"
+        "                               threads (default: %d)\n"
+        "\n",
+        exe,
+        BENCH_DEFAULT_EVENTS,
+        BENCH_DEFAULT_RECORDS,
+        BENCH_DEFAULT_BATCH,
+        BENCH_DEFAULT_MAX_PRODUCERS);
+}
+
+//
+
+int
+main(
+    int             argc,
+    char* const*    argv
+)
+{
+    int                 opt_ch;
+    log_queue_backend_t backend, only_backend = log_queue_backend_max;
+    unsigned long       n_events = BENCH_DEFAULT_EVENTS, n_records = BENCH_DEFAULT_RECORDS;
+    unsigned long       batch = BENCH_DEFAULT_BATCH, max_producers = BENCH_DEFAULT_MAX_PRODUCERS;
+    unsigned long       n_producers;
+
+    while ( (opt_ch = getopt_long(argc, argv, cli_options_str, cli_options, NULL)) != -1 ) {
+        switch ( opt_ch ) {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            case 'B':
+                if ( (only_backend = log_queue_backend_parse_str(optarg)) == log_queue_backend_max ) {
+                    ERROR("Invalid backend: %s", optarg);
+                    exit(EINVAL);
+                }
+                break;
+            case 'n':
+                n_events = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                n_records = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                batch = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                max_producers = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                exit(EINVAL);
+        }
+    }
+    if ( ! n_events || ! n_records || ! batch || ! max_producers ) {
+        ERROR("All counts must be positive integers (see --help)");
+        exit(EINVAL);
+    }
+
+    printf("%-6s %9s %9s %12s %10s %14s\n", "queue", "producers", "records", "events", "seconds", "events/s");
+    for ( backend = 0; backend < log_queue_backend_max; backend++ ) {
+        if ( (only_backend != log_queue_backend_max) && (backend != only_backend) ) continue;
+        for ( n_producers = 1; n_producers <= max_producers; n_producers <<= 1 ) {
+            if ( ! bench_run(backend, n_records, n_producers, n_events, batch) ) {
+                ERROR("Unable to create %s queue", log_queue_backend_to_str(backend));
+                exit(ENOMEM);
+            }
+        }
+    }
+    return 0;
+}
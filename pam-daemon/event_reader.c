@@ -0,0 +1,431 @@
+/*
+ * iptracking
+ * event_reader.c
+ *
+ * Socket event reader API.
+ *
+ */
+
+#include "event_reader.h"
+
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+//
+
+/*
+ * Maximum number of datagrams collected per recvmmsg():
+ */
+#define EVENT_READER_MAX_DATAGRAMS      64
+
+//
+
+/*
+ * A client connection and the event it is delivering.  Active
+ * connections are kept on a list in the order they were accepted;
+ * since every connection gets the same timeout, that is also the
+ * order in which they expire.
+ */
+typedef struct event_reader_conn {
+    struct event_reader_conn    *prev, *next;
+    int                         fd;
+    bool                        is_delivered, is_detached;
+    size_t                      nbytes;
+    uint64_t                    deadline_ms;
+    log_data_t                  data;
+} event_reader_conn_t;
+
+//
+
+/*
+ * Each acceptor thread has its own epoll instance (or io_uring) and its
+ * own share of the connections; all of them watch the same listening
+ * socket.
+ */
+typedef struct event_reader_acceptor {
+    struct event_reader         *reader;
+    unsigned int                index;
+    pthread_t                   thread;
+    bool                        is_initialized;
+    int                         epoll_fd;
+    bool                        is_accept_deferred;
+#ifdef HAVE_LIBURING
+    //
+    struct io_uring             ring;
+    struct io_uring_buf_ring    *buf_ring;
+    char                        *bufs;
+    size_t                      buf_size;
+    unsigned int                n_inflight;
+    unsigned int                n_accepts;
+    bool                        is_dgram_armed;
+    struct msghdr               dgram_msghdr;
+#endif
+    //
+    uint32_t                    n_conns, max_conns;
+    event_reader_conn_t         *conns;
+    event_reader_conn_t         *free_head;
+    event_reader_conn_t         *active_head, *active_tail;
+    //
+    struct mmsghdr              dgram_hdrs[EVENT_READER_MAX_DATAGRAMS];
+    struct iovec                dgram_iovs[EVENT_READER_MAX_DATAGRAMS];
+    log_data_t                  dgram_data[EVENT_READER_MAX_DATAGRAMS];
+} event_reader_acceptor_t;
+
+//
+
+typedef struct {
+    const char      *backend_name;
+
+    bool            (*acceptor_init)(event_reader_acceptor_t *acceptor);
+    void            (*acceptor_fini)(event_reader_acceptor_t *acceptor);
+    void*           (*acceptor_run)(void *acceptor);
+} event_reader_backend_callbacks_t;
+
+//
+
+typedef struct event_reader {
+    event_reader_params_t       params;
+    event_reader_backend_callbacks_t *backend_callbacks;
+    atomic_bool                 is_stopping, is_failed;
+    int                         wake_fd, server_fd;
+    //
+    unsigned int                n_acceptors;
+    event_reader_acceptor_t     *acceptors;
+} event_reader_t;
+
+//
+
+static uint64_t
+__event_reader_now_ms(void)
+{
+    struct timespec     now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//
+
+static void
+__event_reader_wake(
+    event_reader_t      *reader
+)
+{
+    uint64_t            one = 1;
+
+    if ( (write(reader->wake_fd, &one, sizeof(one)) < 0) && (errno != EAGAIN) ) {
+        ERROR("Event reader: unable to signal eventfd (errno=%d)", errno);
+    }
+}
+
+//
+
+void
+event_reader_stop(
+    event_reader_ref    reader
+)
+{
+    atomic_store(&reader->is_stopping, true);
+    __event_reader_wake(reader);
+}
+
+//
+
+/*
+ * Tell every acceptor that the listening socket has failed and the
+ * current event_reader_run() should return false.
+ */
+static void
+__event_reader_fail(
+    event_reader_t      *reader
+)
+{
+    atomic_store(&reader->is_failed, true);
+    __event_reader_wake(reader);
+}
+
+//
+
+static inline bool
+__event_reader_is_running(
+    event_reader_t      *reader
+)
+{
+    return ! atomic_load_explicit(&reader->is_stopping, memory_order_relaxed) &&
+           ! atomic_load_explicit(&reader->is_failed, memory_order_relaxed);
+}
+
+//
+
+static int
+__event_reader_listen(
+    event_reader_t      *reader
+)
+{
+    struct sockaddr_un  server_addr;
+    int                 server_fd, on = 1;
+
+    if ( strlen(reader->params.socket_filepath) >= sizeof(server_addr.sun_path) ) {
+        FATAL("Event reader: socket file path is too long (%d >= %d)",
+                    strlen(reader->params.socket_filepath), sizeof(server_addr.sun_path));
+    }
+
+    /* Get the socket open: */
+    if ( (server_fd = socket(AF_UNIX, socket_type_to_sock(reader->params.socket_type) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 ) {
+        ERROR("Event reader: unable to create Unix socket (errno=%d)", errno);
+        return -1;
+    }
+    DEBUG("Event reader: socket %d created", server_fd);
+    if ( setsockopt(server_fd, SOL_SOCKET,  SO_REUSEADDR, (char*)&on, sizeof(on)) < 0 ) {
+        WARN("Event reader: unable to set REUSEADDR on socket (errno=%d)", errno);
+    }
+    DEBUG("Event reader: REUSEADDR set on socket %d", server_fd);
+
+    /* Bind the socket to the file system: */
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    strncpy(server_addr.sun_path, reader->params.socket_filepath, sizeof(server_addr.sun_path));
+    if ( bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+        ERROR("Event reader: unable to bind Unix socket to file system (errno=%d)", errno);
+        close(server_fd);
+        return -1;
+    }
+    DEBUG("Event reader: socket %d bound to %s", server_fd, reader->params.socket_filepath);
+
+    /* Datagrams need no connections: */
+    if ( reader->params.socket_type == socket_type_dgram ) return server_fd;
+
+    /* Start listening for connections: */
+    if ( listen(server_fd, reader->params.backlog) == -1 ) {
+        ERROR("Event reader: unable to listen on Unix socket (errno=%d)", errno);
+        close(server_fd);
+        return -1;
+    }
+    DEBUG("Event reader: socket %d listening...", server_fd);
+    return server_fd;
+}
+
+//
+
+/*
+ * Take a connection off the free list for <client_fd> and append it to
+ * the active list with a fresh deadline.  The caller has checked that
+ * the free list is not empty.
+ */
+static event_reader_conn_t*
+__event_reader_conn_open(
+    event_reader_acceptor_t *acceptor,
+    int                     client_fd
+)
+{
+    event_reader_conn_t     *conn = acceptor->free_head;
+
+    acceptor->free_head = conn->next;
+    conn->fd = client_fd;
+    conn->is_delivered = conn->is_detached = false;
+    conn->nbytes = 0;
+    conn->deadline_ms = __event_reader_now_ms() + acceptor->reader->params.connection_timeout_ms;
+    conn->next = NULL;
+    if ( (conn->prev = acceptor->active_tail) ) acceptor->active_tail->next = conn; else acceptor->active_head = conn;
+    acceptor->active_tail = conn;
+    acceptor->n_conns++;
+    return conn;
+}
+
+//
+
+#ifdef HAVE_LIBURING
+/*
+ * Remove a connection from the active list (so it can no longer time
+ * out) without closing it, for backends that must wait for the kernel
+ * to finish with the descriptor; __event_reader_conn_close() finishes
+ * the job.
+ */
+static void
+__event_reader_conn_detach(
+    event_reader_acceptor_t *acceptor,
+    event_reader_conn_t     *conn
+)
+{
+    if ( conn->prev ) conn->prev->next = conn->next; else acceptor->active_head = conn->next;
+    if ( conn->next ) conn->next->prev = conn->prev; else acceptor->active_tail = conn->prev;
+    conn->prev = conn->next = NULL;
+    conn->is_detached = true;
+}
+#endif
+
+//
+
+static void
+__event_reader_conn_close(
+    event_reader_acceptor_t *acceptor,
+    event_reader_conn_t     *conn
+)
+{
+    /* Closing the descriptor also drops it from an epoll set: */
+    close(conn->fd);
+    conn->fd = -1;
+
+    /* Unlink from the active list and return to the free list: */
+    if ( ! conn->is_detached ) {
+        if ( conn->prev ) conn->prev->next = conn->next; else acceptor->active_head = conn->next;
+        if ( conn->next ) conn->next->prev = conn->prev; else acceptor->active_tail = conn->prev;
+    }
+    conn->prev = NULL;
+    conn->next = acceptor->free_head;
+    acceptor->free_head = conn;
+    acceptor->n_conns--;
+}
+
+//
+
+#include "event_reader_backends/event_reader_epoll.c"
+#ifdef HAVE_LIBURING
+#include "event_reader_backends/event_reader_io_uring.c"
+#endif
+
+static event_reader_backend_callbacks_t* __event_reader_backends[] = {
+        [event_reader_backend_epoll] = &event_reader_backend_epoll_callbacks,
+#ifdef HAVE_LIBURING
+        [event_reader_backend_io_uring] = &event_reader_backend_io_uring_callbacks,
+#endif
+        NULL
+    };
+
+//
+
+static void
+__event_reader_dealloc(
+    event_reader_t      *reader
+)
+{
+    unsigned int        i;
+
+    if ( reader->acceptors ) {
+        for ( i = 0; i < reader->n_acceptors; i++ ) {
+            if ( reader->acceptors[i].is_initialized ) reader->backend_callbacks->acceptor_fini(&reader->acceptors[i]);
+            if ( reader->acceptors[i].conns ) free((void*)reader->acceptors[i].conns);
+        }
+        free((void*)reader->acceptors);
+    }
+    if ( reader->wake_fd >= 0 ) close(reader->wake_fd);
+    free((void*)reader);
+}
+
+//
+
+event_reader_ref
+event_reader_create(
+    event_reader_params_t   *params
+)
+{
+    event_reader_t          *new_reader;
+    uint32_t                n_conns, i, j;
+
+    if ( ! params->callback || (params->max_connections == 0) || (params->n_acceptors == 0) ) {
+        ERROR("event_reader_create:  a callback, at least one acceptor, and at least one connection are required");
+        return NULL;
+    }
+    if ( (params->backend < 0) || (params->backend >= event_reader_backend_max) || ! __event_reader_backends[params->backend] ) {
+        ERROR("event_reader_create:  backend %s is not available", event_reader_backend_to_str(params->backend) ?: "<invalid>");
+        return NULL;
+    }
+    if ( ! (new_reader = (event_reader_t*)calloc(1, sizeof(event_reader_t))) ) return NULL;
+
+    new_reader->params = *params;
+    new_reader->backend_callbacks = __event_reader_backends[params->backend];
+    DEBUG("event_reader_create:  using %s backend", new_reader->backend_callbacks->backend_name);
+    atomic_init(&new_reader->is_stopping, false);
+    atomic_init(&new_reader->is_failed, false);
+    new_reader->server_fd = -1;
+    if ( (new_reader->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ) {
+        ERROR("event_reader_create:  unable to create eventfd (errno=%d)", errno);
+        __event_reader_dealloc(new_reader);
+        return NULL;
+    }
+
+    /* The connection limit is shared out evenly among the acceptors: */
+    new_reader->n_acceptors = params->n_acceptors;
+    n_conns = (params->max_connections + params->n_acceptors - 1) / params->n_acceptors;
+    if ( ! (new_reader->acceptors = (event_reader_acceptor_t*)calloc(params->n_acceptors, sizeof(event_reader_acceptor_t))) ) {
+        ERROR("event_reader_create:  unable to allocate %u acceptors", params->n_acceptors);
+        __event_reader_dealloc(new_reader);
+        return NULL;
+    }
+    for ( i = 0; i < params->n_acceptors; i++ ) {
+        event_reader_acceptor_t *acceptor = &new_reader->acceptors[i];
+
+        acceptor->reader = new_reader;
+        acceptor->index = i;
+        acceptor->max_conns = n_conns;
+        if ( ! (acceptor->conns = (event_reader_conn_t*)calloc(n_conns, sizeof(event_reader_conn_t))) ) {
+            ERROR("event_reader_create:  unable to allocate %lu connections", (unsigned long)n_conns);
+            __event_reader_dealloc(new_reader);
+            return NULL;
+        }
+        for ( j = n_conns; j > 0; j-- ) {
+            acceptor->conns[j - 1].fd = -1;
+            acceptor->conns[j - 1].next = acceptor->free_head;
+            acceptor->free_head = &acceptor->conns[j - 1];
+        }
+        if ( ! (acceptor->is_initialized = new_reader->backend_callbacks->acceptor_init(acceptor)) ) {
+            __event_reader_dealloc(new_reader);
+            return NULL;
+        }
+    }
+    return new_reader;
+}
+
+//
+
+void
+event_reader_destroy(
+    event_reader_ref    *reader
+)
+{
+    if ( reader && *reader ) {
+        __event_reader_dealloc(*reader);
+        *reader = NULL;
+    }
+}
+
+//
+
+bool
+event_reader_run(
+    event_reader_ref    reader
+)
+{
+    uint64_t            wakeups;
+    unsigned int        i, n_threads = 1;
+    int                 rc;
+
+    if ( atomic_load(&reader->is_stopping) ) return true;
+
+    /* Clear any failure left by a previous run: */
+    while ( read(reader->wake_fd, &wakeups, sizeof(wakeups)) > 0 );
+    atomic_store(&reader->is_failed, false);
+    if ( atomic_load(&reader->is_stopping) ) __event_reader_wake(reader);
+
+    if ( (reader->server_fd = __event_reader_listen(reader)) < 0 ) return false;
+
+    /* Acceptor 0 runs on the calling thread, the rest get threads of their own: */
+    for ( i = 1; i < reader->n_acceptors; i++, n_threads++ ) {
+        if ( (rc = pthread_create(&reader->acceptors[i].thread, NULL, reader->backend_callbacks->acceptor_run, &reader->acceptors[i])) != 0 ) {
+            WARN("Event reader: unable to start acceptor %u (errno=%d), continuing with %u", i, rc, n_threads);
+            break;
+        }
+    }
+    reader->backend_callbacks->acceptor_run(&reader->acceptors[0]);
+    for ( i = 1; i < n_threads; i++ ) pthread_join(reader->acceptors[i].thread, NULL);
+
+    shutdown(reader->server_fd, SHUT_RDWR);
+    close(reader->server_fd);
+    reader->server_fd = -1;
+    return ! atomic_load(&reader->is_failed);
+}
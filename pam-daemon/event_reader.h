@@ -0,0 +1,186 @@
+/*
+ * iptracking
+ * event_reader.h
+ *
+ * Socket event reader API.
+ *
+ */
+
+#ifndef __EVENT_READER_H__
+#define __EVENT_READER_H__
+
+#include "iptracking.h"
+#include "log_data.h"
+#include "logging.h"
+#include "socket_type.h"
+
+/*!
+ * @enum event_reader_backend
+ *
+ * The mechanisms available to wait on and read from client sockets.
+ *
+ * @constant event_reader_backend_epoll     edge-triggered epoll(7) reactor
+ *                                          with nonblocking system calls
+ * @constant event_reader_backend_io_uring  io_uring(7) multishot accept and
+ *                                          receive into provided buffers
+ *                                          (only if built with liburing)
+ */
+typedef enum event_reader_backend {
+    event_reader_backend_epoll = 0,
+    event_reader_backend_io_uring,
+    event_reader_backend_max
+} event_reader_backend_t;
+
+/*!
+ * @function event_reader_backend_to_str
+ *
+ * Return a C string representation of the <backend> or NULL if the
+ * <backend> is not valid.
+ */
+static inline
+const char* event_reader_backend_to_str(
+    event_reader_backend_t  backend
+)
+{
+    switch ( backend ) {
+        case event_reader_backend_epoll: return "epoll";
+        case event_reader_backend_io_uring: return "io_uring";
+        default: return NULL;
+    }
+    return NULL;
+}
+
+/*!
+ * @function event_reader_backend_parse_str
+ *
+ * Parse a C-string representation of a backend (in <backend_str>)
+ * and return the proper value from the event_reader_backend
+ * enumeration, or event_reader_backend_max otherwise.
+ */
+static inline
+event_reader_backend_t event_reader_backend_parse_str(
+    const char  *backend_str
+)
+{
+    if ( strcasecmp(backend_str, "epoll") == 0 ) return event_reader_backend_epoll;
+    if ( strcasecmp(backend_str, "io_uring") == 0 ) return event_reader_backend_io_uring;
+    return event_reader_backend_max;
+}
+
+/*!
+ * @typedef event_reader_callback
+ *
+ * Called by the event reader for each valid event received; <context>
+ * is the callback_context from the reader's parameters.  Returns true
+ * if the event was accepted.
+ */
+typedef bool (*event_reader_callback)(void *context, log_data_t *data);
+
+/*!
+ * @typedef event_reader_params_t
+ *
+ * Data structure used to communicate event reader behavioral
+ * options to this API.
+ *
+ * @field socket_filepath       path of the Unix socket to listen on
+ * @field backend               the mechanism used to wait on and read from
+ *                              the sockets
+ * @field socket_type           the kind of Unix socket clients send to
+ * @field backlog               listen(2) connection backlog
+ * @field poll_interval         seconds to wait for activity before checking
+ *                              whether the reader should stop; zero or less
+ *                              waits indefinitely
+ * @field n_acceptors           number of threads accepting and reading client
+ *                              connections on the shared socket
+ * @field max_connections       the most client connections held open at once,
+ *                              shared evenly among the acceptors; further
+ *                              clients wait in the listen backlog
+ * @field connection_timeout_ms milliseconds a client has to deliver a complete
+ *                              event before it is disconnected
+ * @field callback              function that receives each valid event
+ * @field callback_context      opaque pointer passed to the callback
+ */
+typedef struct {
+    const char              *socket_filepath;
+    event_reader_backend_t  backend;
+    socket_type_t           socket_type;
+    int                     backlog;
+    int                     poll_interval;
+    unsigned int            n_acceptors;
+    uint32_t                max_connections;
+    int                     connection_timeout_ms;
+    event_reader_callback   callback;
+    void                    *callback_context;
+} event_reader_params_t;
+
+/*!
+ * @typedef event_reader_ref
+ *
+ * Opaque pointer to an event_reader data structure.  All fields are
+ * internal to the implementation of this API and not visible
+ * directly to external code.
+ *
+ * The reader is an edge-triggered epoll(7) reactor:  the listening
+ * socket and every client connection are nonblocking, connections are
+ * accepted until the kernel has no more to offer, and each connection
+ * accumulates its event in its own buffer so that a slow client never
+ * holds up any other.
+ *
+ * Several acceptor threads may share the listening socket, each with
+ * its own epoll instance and connections; the socket is registered with
+ * EPOLLEXCLUSIVE so that each new connection wakes just one of them.
+ * The callback is therefore invoked concurrently from those threads.
+ *
+ * With a datagram socket there are no connections at all:  the socket
+ * itself is watched and each wakeup drains it with recvmmsg(2), many
+ * events per system call.
+ *
+ * The io_uring backend does the same work without the readiness
+ * round trip:  each acceptor posts an accept per free connection (or,
+ * for datagrams, a multishot recvmsg) and a multishot receive per
+ * client into a ring of provided buffers, then handles completions in
+ * batches with a single system call per wait.
+ */
+typedef struct event_reader * event_reader_ref;
+
+/*!
+ * @function event_reader_create
+ *
+ * Create a new event reader with the behavior dictated by <params>.
+ * The socket is not created until event_reader_run() is called.
+ *
+ * Returns NULL if any error occurs, an event_reader_ref if successful.
+ */
+event_reader_ref event_reader_create(event_reader_params_t *params);
+
+/*!
+ * @function event_reader_destroy
+ *
+ * Dispose of event reader *<reader>.
+ */
+void event_reader_destroy(event_reader_ref *reader);
+
+/*!
+ * @function event_reader_run
+ *
+ * Create the listening socket and handle client connections until
+ * event_reader_stop() is called.  The calling thread serves as the
+ * first acceptor and the rest are started (and joined) by this call.
+ * All connections and the listening socket are closed before
+ * returning.
+ *
+ * Returns true if the reader was stopped, false if the listening
+ * socket could not be created or failed (the caller may retry).
+ */
+bool event_reader_run(event_reader_ref reader);
+
+/*!
+ * @function event_reader_stop
+ *
+ * Make event_reader_run() return promptly; any later call to
+ * event_reader_run() returns immediately.  Safe to call from any
+ * thread.
+ */
+void event_reader_stop(event_reader_ref reader);
+
+#endif /* __EVENT_READER_H__ */
@@ -0,0 +1,343 @@
+/*
+ * iptracking
+ * event_reader_epoll.c
+ *
+ * Event reader backend:  an edge-triggered epoll(7) reactor per
+ * acceptor over nonblocking sockets.
+ *
+ */
+
+#include <sys/epoll.h>
+
+//
+
+/*
+ * Maximum number of readiness events collected per epoll_wait():
+ */
+#define EVENT_READER_MAX_EPOLL_EVENTS   64
+
+//
+
+static bool __event_reader_epoll_acceptor_init(event_reader_acceptor_t *acceptor);
+static void __event_reader_epoll_acceptor_fini(event_reader_acceptor_t *acceptor);
+static void* __event_reader_epoll_acceptor_run(void *context);
+
+//
+
+static event_reader_backend_callbacks_t     event_reader_backend_epoll_callbacks = {
+        .backend_name = "epoll",
+
+        .acceptor_init = __event_reader_epoll_acceptor_init,
+        .acceptor_fini = __event_reader_epoll_acceptor_fini,
+        .acceptor_run = __event_reader_epoll_acceptor_run
+    };
+
+//
+
+bool
+__event_reader_epoll_acceptor_init(
+    event_reader_acceptor_t *acceptor
+)
+{
+    struct epoll_event      ev = { .events = EPOLLIN, .data.ptr = &acceptor->reader->wake_fd };
+
+    if ( (acceptor->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+        ERROR("event_reader_create:  unable to create epoll instance (errno=%d)", errno);
+        return false;
+    }
+    /* Level-triggered, so a single write to the eventfd wakes every acceptor: */
+    if ( epoll_ctl(acceptor->epoll_fd, EPOLL_CTL_ADD, acceptor->reader->wake_fd, &ev) < 0 ) {
+        ERROR("event_reader_create:  unable to watch eventfd (errno=%d)", errno);
+        close(acceptor->epoll_fd);
+        acceptor->epoll_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+//
+
+void
+__event_reader_epoll_acceptor_fini(
+    event_reader_acceptor_t *acceptor
+)
+{
+    if ( acceptor->epoll_fd >= 0 ) close(acceptor->epoll_fd);
+    acceptor->epoll_fd = -1;
+}
+
+//
+
+/*
+ * Read as much of the connection's event as is available.  Returns
+ * true if the connection is finished with (and has been closed), false
+ * if it is still waiting on more data.
+ */
+static bool
+__event_reader_epoll_conn_read(
+    event_reader_acceptor_t *acceptor,
+    event_reader_conn_t     *conn
+)
+{
+    while ( conn->nbytes < sizeof(log_data_t) ) {
+        ssize_t         nbytes = recv(conn->fd, (char*)&conn->data + conn->nbytes, sizeof(log_data_t) - conn->nbytes, 0);
+
+        if ( nbytes > 0 ) {
+            conn->nbytes += nbytes;
+        } else if ( nbytes == 0 ) {
+            ERROR("Event reader: event was not correct byte size, discarding");
+            __event_reader_conn_close(acceptor, conn);
+            return true;
+        } else {
+            switch ( errno ) {
+                case EINTR:
+                    break;
+                case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                    return false;
+                default:
+                    ERROR("Event reader: error while reading event from client (errno=%d)", errno);
+                    __event_reader_conn_close(acceptor, conn);
+                    return true;
+            }
+        }
+    }
+    DEBUG("Event reader: read %llu bytes on fd %d", (unsigned long long)conn->nbytes, conn->fd);
+    if ( log_data_import(&conn->data) ) {
+        acceptor->reader->params.callback(acceptor->reader->params.callback_context, &conn->data);
+    } else {
+        ERROR("Event reader: invalid event read from client");
+    }
+    __event_reader_conn_close(acceptor, conn);
+    return true;
+}
+
+//
+
+/*
+ * Accept connections until the kernel has none left (as edge-triggered
+ * notification requires) or the connection limit is reached.  Returns
+ * false if the listening socket has failed.
+ */
+static bool
+__event_reader_epoll_accept(
+    event_reader_acceptor_t *acceptor
+)
+{
+    acceptor->is_accept_deferred = false;
+    while ( __event_reader_is_running(acceptor->reader) ) {
+        event_reader_conn_t *conn;
+        int                 client_fd;
+
+        if ( ! acceptor->free_head ) {
+            /* At the limit; the rest wait in the backlog until a connection closes: */
+            acceptor->is_accept_deferred = true;
+            break;
+        }
+        client_fd = accept4(acceptor->reader->server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if ( client_fd < 0 ) {
+            switch ( errno ) {
+                case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                    return true;
+                case ECONNABORTED:
+                case EINTR:
+                    /* There are okay, just keep going */
+                    continue;
+                case EMFILE:
+                case ENFILE:
+                case ENOBUFS:
+                case ENOMEM:
+                    /* Out of resources; try again once a connection closes: */
+                    WARN("Event reader: unable to accept connection (errno=%d), deferring", errno);
+                    acceptor->is_accept_deferred = true;
+                    return true;
+                default:
+                    /* All other errors are fatal: */
+                    ERROR("Event reader: non-trivial failure during accept (errno=%d)", errno);
+                    return false;
+            }
+        }
+        DEBUG("Event reader: accepted connection on fd %d", client_fd);
+
+        conn = __event_reader_conn_open(acceptor, client_fd);
+
+        /* The client usually writes as soon as it connects, so try reading before involving epoll: */
+        if ( ! __event_reader_epoll_conn_read(acceptor, conn) ) {
+            struct epoll_event  ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+
+            if ( epoll_ctl(acceptor->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0 ) {
+                ERROR("Event reader: unable to watch client connection (errno=%d)", errno);
+                __event_reader_conn_close(acceptor, conn);
+            }
+        }
+    }
+    return true;
+}
+
+//
+
+/*
+ * Receive datagrams until the kernel has none left (as edge-triggered
+ * notification requires).  Returns false if the socket has failed.
+ */
+static bool
+__event_reader_epoll_recv_datagrams(
+    event_reader_acceptor_t *acceptor
+)
+{
+    int                     n_msgs, i;
+
+    while ( __event_reader_is_running(acceptor->reader) ) {
+        /* Every message is received into its own record-sized buffer: */
+        for ( i = 0; i < EVENT_READER_MAX_DATAGRAMS; i++ ) {
+            acceptor->dgram_iovs[i].iov_base = &acceptor->dgram_data[i];
+            acceptor->dgram_iovs[i].iov_len = sizeof(log_data_t);
+            memset(&acceptor->dgram_hdrs[i].msg_hdr, 0, sizeof(struct msghdr));
+            acceptor->dgram_hdrs[i].msg_hdr.msg_iov = &acceptor->dgram_iovs[i];
+            acceptor->dgram_hdrs[i].msg_hdr.msg_iovlen = 1;
+        }
+        n_msgs = recvmmsg(acceptor->reader->server_fd, acceptor->dgram_hdrs, EVENT_READER_MAX_DATAGRAMS, MSG_DONTWAIT, NULL);
+        if ( n_msgs < 0 ) {
+            switch ( errno ) {
+                case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                    return true;
+                case EINTR:
+                    continue;
+                default:
+                    ERROR("Event reader: error while receiving datagrams (errno=%d)", errno);
+                    return false;
+            }
+        }
+        DEBUG("Event reader: received %d datagrams", n_msgs);
+        for ( i = 0; i < n_msgs; i++ ) {
+            if ( (acceptor->dgram_hdrs[i].msg_len != sizeof(log_data_t)) || (acceptor->dgram_hdrs[i].msg_hdr.msg_flags & MSG_TRUNC) ) {
+                ERROR("Event reader: event was not correct byte size, discarding");
+            } else if ( log_data_import(&acceptor->dgram_data[i]) ) {
+                acceptor->reader->params.callback(acceptor->reader->params.callback_context, &acceptor->dgram_data[i]);
+            } else {
+                ERROR("Event reader: invalid event read from client");
+            }
+        }
+    }
+    return true;
+}
+
+//
+
+/*
+ * Disconnect any clients whose deadline has passed and return the
+ * number of milliseconds until the next deadline (or -1 if none).
+ */
+static int
+__event_reader_epoll_expire(
+    event_reader_acceptor_t *acceptor
+)
+{
+    uint64_t                now = __event_reader_now_ms();
+
+    while ( acceptor->active_head && (acceptor->active_head->deadline_ms <= now) ) {
+        WARN("Event reader: client on fd %d timed out after %llu of %llu bytes",
+                acceptor->active_head->fd,
+                (unsigned long long)acceptor->active_head->nbytes,
+                (unsigned long long)sizeof(log_data_t));
+        __event_reader_conn_close(acceptor, acceptor->active_head);
+    }
+    return acceptor->active_head ? (int)(acceptor->active_head->deadline_ms - now) : -1;
+}
+
+//
+
+/*
+ * Handle readiness on the shared socket:  new connections for the
+ * connection-oriented types, events themselves for datagrams.
+ */
+static inline bool
+__event_reader_epoll_service_socket(
+    event_reader_acceptor_t *acceptor
+)
+{
+    if ( acceptor->reader->params.socket_type == socket_type_dgram ) return __event_reader_epoll_recv_datagrams(acceptor);
+    return __event_reader_epoll_accept(acceptor);
+}
+
+//
+
+/*
+ * The loop run by each acceptor until the reader is stopped or the
+ * listening socket fails.
+ */
+void*
+__event_reader_epoll_acceptor_run(
+    void    *context
+)
+{
+    event_reader_acceptor_t *acceptor = (event_reader_acceptor_t*)context;
+    event_reader_t          *reader = acceptor->reader;
+    struct epoll_event      events[EVENT_READER_MAX_EPOLL_EVENTS];
+    struct epoll_event      ev;
+
+    DEBUG("Event reader: acceptor %u running", acceptor->index);
+
+    /* Only one of the acceptors waiting on the socket is woken per connection: */
+    ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    ev.data.ptr = &reader->server_fd;
+    if ( epoll_ctl(acceptor->epoll_fd, EPOLL_CTL_ADD, reader->server_fd, &ev) < 0 ) {
+        ERROR("Event reader: unable to watch socket %d (errno=%d)", reader->server_fd, errno);
+        __event_reader_fail(reader);
+    }
+    /* Connections or datagrams may have arrived before the socket was watched: */
+    else if ( ! __event_reader_epoll_service_socket(acceptor) ) __event_reader_fail(reader);
+
+    while ( __event_reader_is_running(reader) ) {
+        int                 timeout_ms = (reader->params.poll_interval > 0) ? reader->params.poll_interval * 1000 : -1;
+        int                 next_deadline_ms = __event_reader_epoll_expire(acceptor);
+        int                 n_events, i;
+        bool                is_accept_ready = false;
+
+        if ( (next_deadline_ms >= 0) && ((timeout_ms < 0) || (next_deadline_ms < timeout_ms)) ) timeout_ms = next_deadline_ms;
+        n_events = epoll_wait(acceptor->epoll_fd, events, EVENT_READER_MAX_EPOLL_EVENTS, timeout_ms);
+        if ( n_events < 0 ) {
+            if ( errno == EINTR ) continue;
+            ERROR("Event reader: epoll_wait failed (errno=%d)", errno);
+            __event_reader_fail(reader);
+            break;
+        }
+        for ( i = 0; i < n_events; i++ ) {
+            if ( events[i].data.ptr == &reader->wake_fd ) {
+                /* Left unread so the other acceptors see it, too; the loop test will exit */
+            } else if ( events[i].data.ptr == &reader->server_fd ) {
+                if ( events[i].events & (EPOLLERR | EPOLLHUP) ) {
+                    ERROR("Event reader: socket %d failed", reader->server_fd);
+                    __event_reader_fail(reader);
+                } else {
+                    is_accept_ready = true;
+                }
+            } else {
+                event_reader_conn_t *conn = (event_reader_conn_t*)events[i].data.ptr;
+
+                /* A connection closed earlier in this batch cannot be reused until
+                 * we accept again, so any event for a free one is stale: */
+                if ( conn->fd >= 0 ) __event_reader_epoll_conn_read(acceptor, conn);
+            }
+        }
+        /* Accept after servicing clients so freed connections are available: */
+        if ( __event_reader_is_running(reader) && (is_accept_ready || (acceptor->is_accept_deferred && acceptor->free_head)) ) {
+            if ( ! __event_reader_epoll_service_socket(acceptor) ) __event_reader_fail(reader);
+        }
+    }
+
+    /* Drop any clients still connected and stop watching the socket: */
+    while ( acceptor->active_head ) __event_reader_conn_close(acceptor, acceptor->active_head);
+    epoll_ctl(acceptor->epoll_fd, EPOLL_CTL_DEL, reader->server_fd, NULL);
+    acceptor->is_accept_deferred = false;
+    DEBUG("Event reader: acceptor %u exiting", acceptor->index);
+    return NULL;
+}
@@ -0,0 +1,542 @@
+/*
+ * iptracking
+ * event_reader_io_uring.c
+ *
+ * Event reader backend:  an io_uring(7) per acceptor, with multishot
+ * accept and receive requests reading into a ring of provided
+ * buffers.
+ *
+ */
+
+#include <poll.h>
+
+//
+
+/*
+ * Submission queue depth of each acceptor's ring:
+ */
+#define EVENT_READER_IO_URING_ENTRIES   256
+
+/*
+ * Number of provided buffers per acceptor (must be a power of two):
+ */
+#define EVENT_READER_IO_URING_BUFS      256
+
+/*
+ * The provided buffer group id:
+ */
+#define EVENT_READER_IO_URING_BGID      0
+
+/*
+ * Maximum number of accepts each acceptor keeps posted at once:
+ */
+#define EVENT_READER_IO_URING_MAX_ACCEPTS   32
+
+//
+
+static bool __event_reader_io_uring_acceptor_init(event_reader_acceptor_t *acceptor);
+static void __event_reader_io_uring_acceptor_fini(event_reader_acceptor_t *acceptor);
+static void* __event_reader_io_uring_acceptor_run(void *context);
+
+//
+
+static event_reader_backend_callbacks_t     event_reader_backend_io_uring_callbacks = {
+        .backend_name = "io_uring",
+
+        .acceptor_init = __event_reader_io_uring_acceptor_init,
+        .acceptor_fini = __event_reader_io_uring_acceptor_fini,
+        .acceptor_run = __event_reader_io_uring_acceptor_run
+    };
+
+//
+
+static inline void
+__event_reader_io_uring_recycle_buf(
+    event_reader_acceptor_t *acceptor,
+    unsigned short          bid
+)
+{
+    io_uring_buf_ring_add(acceptor->buf_ring, acceptor->bufs + bid * acceptor->buf_size, acceptor->buf_size,
+            bid, io_uring_buf_ring_mask(EVENT_READER_IO_URING_BUFS), 0);
+    io_uring_buf_ring_advance(acceptor->buf_ring, 1);
+}
+
+//
+
+bool
+__event_reader_io_uring_acceptor_init(
+    event_reader_acceptor_t *acceptor
+)
+{
+    unsigned short          bid;
+    int                     rc;
+
+    if ( (rc = io_uring_queue_init(EVENT_READER_IO_URING_ENTRIES, &acceptor->ring, 0)) < 0 ) {
+        ERROR("event_reader_create:  unable to create io_uring (errno=%d)", -rc);
+        return false;
+    }
+
+    /* Stream and seqpacket buffers hold an event, datagram buffers a recvmsg header and an event: */
+    acceptor->buf_size = sizeof(log_data_t);
+    if ( acceptor->reader->params.socket_type == socket_type_dgram ) acceptor->buf_size += sizeof(struct io_uring_recvmsg_out);
+    if ( ! (acceptor->bufs = (char*)malloc(EVENT_READER_IO_URING_BUFS * acceptor->buf_size)) ) {
+        ERROR("event_reader_create:  unable to allocate io_uring buffers");
+        io_uring_queue_exit(&acceptor->ring);
+        return false;
+    }
+    if ( ! (acceptor->buf_ring = io_uring_setup_buf_ring(&acceptor->ring, EVENT_READER_IO_URING_BUFS, EVENT_READER_IO_URING_BGID, 0, &rc)) ) {
+        ERROR("event_reader_create:  unable to register io_uring buffers (errno=%d)", -rc);
+        free((void*)acceptor->bufs);
+        acceptor->bufs = NULL;
+        io_uring_queue_exit(&acceptor->ring);
+        return false;
+    }
+    for ( bid = 0; bid < EVENT_READER_IO_URING_BUFS; bid++ ) __event_reader_io_uring_recycle_buf(acceptor, bid);
+
+    /* Datagrams carry no name or control data: */
+    memset(&acceptor->dgram_msghdr, 0, sizeof(acceptor->dgram_msghdr));
+    return true;
+}
+
+//
+
+void
+__event_reader_io_uring_acceptor_fini(
+    event_reader_acceptor_t *acceptor
+)
+{
+    io_uring_free_buf_ring(&acceptor->ring, acceptor->buf_ring, EVENT_READER_IO_URING_BUFS, EVENT_READER_IO_URING_BGID);
+    io_uring_queue_exit(&acceptor->ring);
+    if ( acceptor->bufs ) free((void*)acceptor->bufs);
+    acceptor->bufs = NULL;
+}
+
+//
+
+/*
+ * Get a submission queue entry, flushing the queue to the kernel if
+ * it is full.
+ */
+static struct io_uring_sqe*
+__event_reader_io_uring_get_sqe(
+    event_reader_acceptor_t *acceptor
+)
+{
+    struct io_uring_sqe     *sqe = io_uring_get_sqe(&acceptor->ring);
+
+    if ( ! sqe ) {
+        io_uring_submit(&acceptor->ring);
+        if ( ! (sqe = io_uring_get_sqe(&acceptor->ring)) ) ERROR("Event reader: io_uring submission queue is full");
+    }
+    return sqe;
+}
+
+//
+
+/*
+ * Watch the eventfd so that event_reader_stop() interrupts the wait.
+ */
+static bool
+__event_reader_io_uring_arm_wake(
+    event_reader_acceptor_t *acceptor
+)
+{
+    struct io_uring_sqe     *sqe = __event_reader_io_uring_get_sqe(acceptor);
+
+    if ( ! sqe ) return false;
+    io_uring_prep_poll_add(sqe, acceptor->reader->wake_fd, POLLIN);
+    io_uring_sqe_set_data(sqe, &acceptor->reader->wake_fd);
+    acceptor->n_inflight++;
+    return true;
+}
+
+//
+
+/*
+ * Post accepts on the shared socket, one per free connection not
+ * already spoken for (so a burst of clients never overruns the
+ * connection limit; the rest wait in the backlog).
+ */
+static bool
+__event_reader_io_uring_arm_accepts(
+    event_reader_acceptor_t *acceptor
+)
+{
+    event_reader_t          *reader = acceptor->reader;
+
+    while ( (acceptor->n_conns + acceptor->n_accepts < acceptor->max_conns) &&
+            (acceptor->n_accepts < EVENT_READER_IO_URING_MAX_ACCEPTS) ) {
+        struct io_uring_sqe *sqe = __event_reader_io_uring_get_sqe(acceptor);
+
+        if ( ! sqe ) return false;
+        io_uring_prep_accept(sqe, reader->server_fd, NULL, NULL, SOCK_CLOEXEC);
+        io_uring_sqe_set_data(sqe, &reader->server_fd);
+        acceptor->n_accepts++;
+        acceptor->n_inflight++;
+    }
+    return true;
+}
+
+//
+
+/*
+ * Post a multishot recvmsg on the shared datagram socket.
+ */
+static bool
+__event_reader_io_uring_arm_datagrams(
+    event_reader_acceptor_t *acceptor
+)
+{
+    struct io_uring_sqe     *sqe = __event_reader_io_uring_get_sqe(acceptor);
+
+    if ( ! sqe ) return false;
+    io_uring_prep_recvmsg_multishot(sqe, acceptor->reader->server_fd, &acceptor->dgram_msghdr, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = EVENT_READER_IO_URING_BGID;
+    io_uring_sqe_set_data(sqe, &acceptor->reader->server_fd);
+    acceptor->is_dgram_armed = true;
+    acceptor->n_inflight++;
+    return true;
+}
+
+//
+
+/*
+ * Post a multishot receive on a client connection.
+ */
+static bool
+__event_reader_io_uring_arm_conn(
+    event_reader_acceptor_t *acceptor,
+    event_reader_conn_t     *conn
+)
+{
+    struct io_uring_sqe     *sqe = __event_reader_io_uring_get_sqe(acceptor);
+
+    if ( ! sqe ) return false;
+    io_uring_prep_recv_multishot(sqe, conn->fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = EVENT_READER_IO_URING_BGID;
+    io_uring_sqe_set_data(sqe, conn);
+    acceptor->n_inflight++;
+    return true;
+}
+
+//
+
+/*
+ * Cancel the request(s) tagged with <user_data>; the cancellation's
+ * own completion is untagged and ignored.
+ */
+static void
+__event_reader_io_uring_cancel(
+    event_reader_acceptor_t *acceptor,
+    void                    *user_data,
+    int                     flags
+)
+{
+    struct io_uring_sqe     *sqe = __event_reader_io_uring_get_sqe(acceptor);
+
+    if ( sqe ) {
+        io_uring_prep_cancel(sqe, user_data, flags);
+        io_uring_sqe_set_data(sqe, NULL);
+    }
+}
+
+//
+
+/*
+ * A connection is done with once its event has been delivered or it
+ * has timed out:  it stops counting against the deadline list and its
+ * receive is cancelled.  The descriptor is closed when the receive's
+ * final completion arrives.
+ */
+static void
+__event_reader_io_uring_conn_finish(
+    event_reader_acceptor_t *acceptor,
+    event_reader_conn_t     *conn,
+    bool                    is_final
+)
+{
+    __event_reader_conn_detach(acceptor, conn);
+    if ( ! is_final ) __event_reader_io_uring_cancel(acceptor, conn, 0);
+}
+
+//
+
+static void
+__event_reader_io_uring_handle_accept(
+    event_reader_acceptor_t *acceptor,
+    struct io_uring_cqe     *cqe
+)
+{
+    event_reader_t          *reader = acceptor->reader;
+
+    acceptor->n_accepts--;
+    acceptor->n_inflight--;
+    if ( cqe->res >= 0 ) {
+        event_reader_conn_t *conn;
+
+        if ( ! __event_reader_is_running(reader) ) {
+            close(cqe->res);
+            return;
+        }
+        DEBUG("Event reader: accepted connection on fd %d", cqe->res);
+
+        /* A connection was set aside when the accept was posted: */
+        conn = __event_reader_conn_open(acceptor, cqe->res);
+        if ( ! __event_reader_io_uring_arm_conn(acceptor, conn) ) __event_reader_conn_close(acceptor, conn);
+        return;
+    }
+    switch ( -cqe->res ) {
+        case ECANCELED:
+        case ECONNABORTED:
+        case EINTR:
+            /* These are okay, the accept is posted again */
+            break;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            /* Out of resources; try again once a connection closes: */
+            WARN("Event reader: unable to accept connection (errno=%d), deferring", -cqe->res);
+            acceptor->is_accept_deferred = true;
+            break;
+        default:
+            /* All other errors are fatal: */
+            ERROR("Event reader: non-trivial failure during accept (errno=%d)", -cqe->res);
+            __event_reader_fail(reader);
+            break;
+    }
+}
+
+//
+
+static void
+__event_reader_io_uring_handle_datagram(
+    event_reader_acceptor_t *acceptor,
+    struct io_uring_cqe     *cqe
+)
+{
+    event_reader_t          *reader = acceptor->reader;
+
+    if ( ! (cqe->flags & IORING_CQE_F_MORE) ) {
+        acceptor->is_dgram_armed = false;
+        acceptor->n_inflight--;
+    }
+    if ( cqe->flags & IORING_CQE_F_BUFFER ) {
+        unsigned short              bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        void                        *buf = acceptor->bufs + bid * acceptor->buf_size;
+        struct io_uring_recvmsg_out *out = io_uring_recvmsg_validate(buf, cqe->res, &acceptor->dgram_msghdr);
+
+        if ( ! out || (out->payloadlen != sizeof(log_data_t)) || (out->flags & MSG_TRUNC) ) {
+            ERROR("Event reader: event was not correct byte size, discarding");
+        } else {
+            log_data_t              *data = (log_data_t*)io_uring_recvmsg_payload(out, &acceptor->dgram_msghdr);
+
+            if ( log_data_import(data) ) {
+                reader->params.callback(reader->params.callback_context, data);
+            } else {
+                ERROR("Event reader: invalid event read from client");
+            }
+        }
+        __event_reader_io_uring_recycle_buf(acceptor, bid);
+        return;
+    }
+    switch ( -cqe->res ) {
+        case ECANCELED:
+        case EINTR:
+        case ENOBUFS:
+            /* The recvmsg is posted again once the batch has returned its buffers */
+            break;
+        default:
+            ERROR("Event reader: error while receiving datagrams (errno=%d)", -cqe->res);
+            __event_reader_fail(reader);
+            break;
+    }
+}
+
+//
+
+static void
+__event_reader_io_uring_handle_conn(
+    event_reader_acceptor_t *acceptor,
+    event_reader_conn_t     *conn,
+    struct io_uring_cqe     *cqe
+)
+{
+    event_reader_t          *reader = acceptor->reader;
+    bool                    is_final = ! (cqe->flags & IORING_CQE_F_MORE);
+
+    if ( is_final ) acceptor->n_inflight--;
+    if ( cqe->flags & IORING_CQE_F_BUFFER ) {
+        unsigned short      bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if ( ! conn->is_delivered && ! conn->is_detached ) {
+            size_t          nbytes = sizeof(log_data_t) - conn->nbytes;
+
+            if ( (size_t)cqe->res < nbytes ) nbytes = cqe->res;
+            memcpy((char*)&conn->data + conn->nbytes, acceptor->bufs + bid * acceptor->buf_size, nbytes);
+            conn->nbytes += nbytes;
+            if ( conn->nbytes == sizeof(log_data_t) ) {
+                DEBUG("Event reader: read %llu bytes on fd %d", (unsigned long long)conn->nbytes, conn->fd);
+                if ( log_data_import(&conn->data) ) {
+                    reader->params.callback(reader->params.callback_context, &conn->data);
+                } else {
+                    ERROR("Event reader: invalid event read from client");
+                }
+                conn->is_delivered = true;
+                __event_reader_io_uring_conn_finish(acceptor, conn, is_final);
+            }
+        }
+        __event_reader_io_uring_recycle_buf(acceptor, bid);
+    } else if ( ! conn->is_delivered && ! conn->is_detached ) {
+        if ( cqe->res == 0 ) {
+            ERROR("Event reader: event was not correct byte size, discarding");
+        } else if ( (cqe->res != -ENOBUFS) && (cqe->res != -ECANCELED) ) {
+            ERROR("Event reader: error while reading event from client (errno=%d)", -cqe->res);
+        }
+    }
+    if ( is_final ) {
+        /* A receive that ended early for want of buffers (or after partial data) is posted again: */
+        if ( ! conn->is_delivered && ! conn->is_detached && ((cqe->res > 0) || (cqe->res == -ENOBUFS)) &&
+             __event_reader_is_running(reader) && __event_reader_io_uring_arm_conn(acceptor, conn) ) return;
+        __event_reader_conn_close(acceptor, conn);
+        acceptor->is_accept_deferred = false;
+    }
+}
+
+//
+
+/*
+ * Cancel the receive on any clients whose deadline has passed and
+ * return the number of milliseconds until the next deadline (or -1 if
+ * none).
+ */
+static int
+__event_reader_io_uring_expire(
+    event_reader_acceptor_t *acceptor
+)
+{
+    uint64_t                now = __event_reader_now_ms();
+
+    while ( acceptor->active_head && (acceptor->active_head->deadline_ms <= now) ) {
+        WARN("Event reader: client on fd %d timed out after %llu of %llu bytes",
+                acceptor->active_head->fd,
+                (unsigned long long)acceptor->active_head->nbytes,
+                (unsigned long long)sizeof(log_data_t));
+        __event_reader_io_uring_conn_finish(acceptor, acceptor->active_head, false);
+    }
+    return acceptor->active_head ? (int)(acceptor->active_head->deadline_ms - now) : -1;
+}
+
+//
+
+/*
+ * Handle every completion currently in the queue, then mark them all
+ * seen at once.
+ */
+static void
+__event_reader_io_uring_handle_cqes(
+    event_reader_acceptor_t *acceptor
+)
+{
+    event_reader_t          *reader = acceptor->reader;
+    struct io_uring_cqe     *cqe;
+    unsigned int            head, n_cqes = 0;
+
+    io_uring_for_each_cqe(&acceptor->ring, head, cqe) {
+        void                *user_data = io_uring_cqe_get_data(cqe);
+
+        n_cqes++;
+        if ( ! user_data ) {
+            /* Completion of a cancellation */
+        } else if ( user_data == &reader->wake_fd ) {
+            /* The loop test will exit */
+            acceptor->n_inflight--;
+        } else if ( user_data == &reader->server_fd ) {
+            if ( reader->params.socket_type == socket_type_dgram ) {
+                __event_reader_io_uring_handle_datagram(acceptor, cqe);
+            } else {
+                __event_reader_io_uring_handle_accept(acceptor, cqe);
+            }
+        } else {
+            __event_reader_io_uring_handle_conn(acceptor, (event_reader_conn_t*)user_data, cqe);
+        }
+    }
+    io_uring_cq_advance(&acceptor->ring, n_cqes);
+}
+
+//
+
+/*
+ * The loop run by each acceptor until the reader is stopped or the
+ * listening socket fails.
+ */
+void*
+__event_reader_io_uring_acceptor_run(
+    void    *context
+)
+{
+    event_reader_acceptor_t *acceptor = (event_reader_acceptor_t*)context;
+    event_reader_t          *reader = acceptor->reader;
+
+    DEBUG("Event reader: acceptor %u running", acceptor->index);
+
+    acceptor->n_inflight = acceptor->n_accepts = 0;
+    acceptor->is_dgram_armed = false;
+    if ( ! __event_reader_io_uring_arm_wake(acceptor) ) __event_reader_fail(reader);
+
+    while ( __event_reader_is_running(reader) ) {
+        struct __kernel_timespec    ts, *ts_ptr = NULL;
+        struct io_uring_cqe         *cqe;
+        int                         timeout_ms = (reader->params.poll_interval > 0) ? reader->params.poll_interval * 1000 : -1;
+        int                         next_deadline_ms = __event_reader_io_uring_expire(acceptor);
+        int                         rc;
+
+        /* Keep the shared socket watched while there is room for more clients: */
+        if ( reader->params.socket_type == socket_type_dgram ) {
+            if ( ! acceptor->is_dgram_armed && ! __event_reader_io_uring_arm_datagrams(acceptor) ) {
+                __event_reader_fail(reader);
+                break;
+            }
+        } else if ( ! acceptor->is_accept_deferred && ! __event_reader_io_uring_arm_accepts(acceptor) ) {
+            __event_reader_fail(reader);
+            break;
+        }
+
+        if ( (next_deadline_ms >= 0) && ((timeout_ms < 0) || (next_deadline_ms < timeout_ms)) ) timeout_ms = next_deadline_ms;
+        if ( timeout_ms >= 0 ) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+            ts_ptr = &ts;
+        }
+        rc = io_uring_submit_and_wait_timeout(&acceptor->ring, &cqe, 1, ts_ptr, NULL);
+        if ( rc < 0 ) {
+            if ( rc == -ETIME ) {
+                /* A deferred accept gets another chance after every timeout: */
+                acceptor->is_accept_deferred = false;
+            } else if ( rc != -EINTR ) {
+                ERROR("Event reader: io_uring wait failed (errno=%d)", -rc);
+                __event_reader_fail(reader);
+                break;
+            }
+        }
+        __event_reader_io_uring_handle_cqes(acceptor);
+    }
+
+    /* Cancel everything still outstanding and wait for the ring to go quiet: */
+    __event_reader_io_uring_cancel(acceptor, NULL, IORING_ASYNC_CANCEL_ANY);
+    while ( acceptor->n_inflight > 0 ) {
+        int                 rc = io_uring_submit_and_wait(&acceptor->ring, 1);
+
+        if ( (rc < 0) && (rc != -EINTR) ) {
+            ERROR("Event reader: io_uring wait failed while stopping (errno=%d)", -rc);
+            break;
+        }
+        __event_reader_io_uring_handle_cqes(acceptor);
+    }
+    while ( acceptor->active_head ) __event_reader_conn_close(acceptor, acceptor->active_head);
+    acceptor->is_accept_deferred = false;
+    DEBUG("Event reader: acceptor %u exiting", acceptor->index);
+    return NULL;
+}
@@ -0,0 +1,843 @@
+/*
+ * iptracking
+ * iptracking-import.c
+ *
+ * Replay csvfile logs into a database.
+ *
+ */
+
+#include "iptracking.h"
+#include "logging.h"
+#include "log_data.h"
+#include "db_interface.h"
+#include "yaml_helpers.h"
+
+#include <signal.h>
+#include <libgen.h>
+#include <sys/mman.h>
+
+//
+
+static const char *configuration_filepath_default = CONFIGURATION_FILEPATH_DEFAULT;
+
+//
+
+/*
+ * Each file is divided into chunks of about this many bytes (ending on
+ * line boundaries):  a chunk is the unit of work handed to a thread.
+ * Progress within a chunk is recorded in the state file after each
+ * batch.
+ */
+#define IMPORT_CHUNK_BYTES              (16 * 1024 * 1024)
+
+#define IMPORT_DEFAULT_THREADS          4
+#define IMPORT_DEFAULT_BATCH_RECORDS    1024
+#define IMPORT_DEFAULT_MAX_ERRORS       100
+#define IMPORT_PROGRESS_INTERVAL        5
+
+#define IMPORT_STATE_SUFFIX             ".import-state"
+#define IMPORT_REJECTS_SUFFIX           ".import-rejects"
+
+static unsigned long import_threads = IMPORT_DEFAULT_THREADS;
+static unsigned long import_batch_records = IMPORT_DEFAULT_BATCH_RECORDS;
+static unsigned long import_max_errors = IMPORT_DEFAULT_MAX_ERRORS;
+static char import_delimiter = ',';
+static const char *import_state_directory = NULL;
+static bool import_restart = false;
+
+//
+
+static volatile bool is_running = true;
+
+//
+
+typedef struct {
+    const char          *filepath;
+    char                *state_filepath;
+    char                *rejects_filepath;
+    FILE                *rejects_fptr;
+    const char          *base;
+    size_t              size;
+    struct timespec     mtime;
+    size_t              n_chunks;
+    uint8_t             *chunk_done;
+    size_t              *chunk_resume;
+    size_t              next_chunk;
+    unsigned int        n_active;
+    bool                is_aborted;
+    size_t              bytes_done;
+    uint64_t            n_lines;
+    uint64_t            n_invalid;
+    uint64_t            n_logged;
+    uint64_t            n_failed;
+    pthread_mutex_t     lock;
+    pthread_cond_t      done_cond;
+} import_file_t;
+
+typedef struct {
+    import_file_t       *file;
+    db_ref              db;
+    log_data_t          *batch;
+} import_worker_t;
+
+//
+
+/*
+ * Chunk <chunk> starts at the first line beginning at or after its
+ * nominal offset; the chunk past the last starts at the end of the
+ * file.
+ */
+static size_t
+import_chunk_start(
+    import_file_t   *file,
+    size_t          chunk
+)
+{
+    size_t          offset = chunk * IMPORT_CHUNK_BYTES;
+    const char      *nl;
+
+    if ( chunk == 0 ) return 0;
+    if ( offset >= file->size ) return file->size;
+    if ( ! (nl = memchr(file->base + offset - 1, '\n', file->size - offset + 1)) ) return file->size;
+    return (nl - file->base) + 1;
+}
+
+//
+
+/*
+ * The state file records the identity of the input file, which of its
+ * chunks have been imported, and the offset at which each partially
+ * imported chunk resumes:
+ *
+ *     size <bytes>
+ *     mtime <seconds>.<nanoseconds>
+ *     chunk-bytes <bytes>
+ *     done <first chunk>-<last chunk>
+ *       :
+ *     partial <chunk> <offset>
+ *       :
+ *
+ * It is written to a temporary file and renamed into place, so a crash
+ * leaves either the old or the new state.
+ */
+static bool
+import_state_write(
+    import_file_t   *file
+)
+{
+    char            *temp_filepath = NULL;
+    FILE            *fptr;
+    size_t          i = 0;
+    bool            rc = false;
+
+    if ( asprintf(&temp_filepath, "%s.tmp", file->state_filepath) < 0 ) return false;
+    if ( (fptr = fopen(temp_filepath, "w")) ) {
+        fprintf(fptr, "# iptracking-import state for %s\n", file->filepath);
+        fprintf(fptr, "size %llu\n", (unsigned long long)file->size);
+        fprintf(fptr, "mtime %lld.%09ld\n", (long long)file->mtime.tv_sec, (long)file->mtime.tv_nsec);
+        fprintf(fptr, "chunk-bytes %llu\n", (unsigned long long)IMPORT_CHUNK_BYTES);
+        while ( i < file->n_chunks ) {
+            size_t  j;
+
+            if ( ! file->chunk_done[i] ) {
+                i++;
+                continue;
+            }
+            j = i;
+            while ( (j + 1 < file->n_chunks) && file->chunk_done[j + 1] ) j++;
+            fprintf(fptr, "done %llu-%llu\n", (unsigned long long)i, (unsigned long long)j);
+            i = j + 1;
+        }
+        for ( i = 0; i < file->n_chunks; i++ ) {
+            if ( ! file->chunk_done[i] && file->chunk_resume[i] ) {
+                fprintf(fptr, "partial %llu %llu\n", (unsigned long long)i, (unsigned long long)file->chunk_resume[i]);
+            }
+        }
+        rc = (fflush(fptr) == 0) && (fdatasync(fileno(fptr)) == 0);
+        if ( fclose(fptr) != 0 ) rc = false;
+        if ( rc && (rename(temp_filepath, file->state_filepath) < 0) ) rc = false;
+        if ( ! rc ) {
+            ERROR("Import: unable to write state file %s (errno=%d)", file->state_filepath, errno);
+            unlink(temp_filepath);
+        }
+    } else {
+        ERROR("Import: unable to create state file %s (errno=%d)", temp_filepath, errno);
+    }
+    free((void*)temp_filepath);
+    return rc;
+}
+
+//
+
+/*
+ * Mark the chunks a previous run completed.  Returns false if the state
+ * file exists but does not describe the input file as it is now.
+ */
+static bool
+import_state_read(
+    import_file_t       *file
+)
+{
+    FILE                *fptr = fopen(file->state_filepath, "r");
+    char                line[256];
+    unsigned long long  size = 0, chunk_bytes = 0, first, last, offset;
+    long long           mtime_sec = 0;
+    long                mtime_nsec = 0;
+    bool                rc = true;
+
+    if ( ! fptr ) {
+        if ( errno == ENOENT ) return true;
+        ERROR("Import: unable to open state file %s (errno=%d)", file->state_filepath, errno);
+        return false;
+    }
+    while ( rc && fgets(line, sizeof(line), fptr) ) {
+        if ( line[0] == '#' ) continue;
+        if ( sscanf(line, "size %llu", &size) == 1 ) {
+            if ( size != file->size ) rc = false;
+        }
+        else if ( sscanf(line, "mtime %lld.%ld", &mtime_sec, &mtime_nsec) == 2 ) {
+            if ( (mtime_sec != file->mtime.tv_sec) || (mtime_nsec != file->mtime.tv_nsec) ) rc = false;
+        }
+        else if ( sscanf(line, "chunk-bytes %llu", &chunk_bytes) == 1 ) {
+            if ( chunk_bytes != IMPORT_CHUNK_BYTES ) rc = false;
+        }
+        else if ( sscanf(line, "done %llu-%llu", &first, &last) == 2 ) {
+            if ( (first > last) || (last >= file->n_chunks) ) {
+                rc = false;
+            } else {
+                while ( first <= last ) file->chunk_done[first++] = 1;
+            }
+        }
+        else if ( sscanf(line, "partial %llu %llu", &first, &offset) == 2 ) {
+            if ( (first >= file->n_chunks) || (offset < import_chunk_start(file, first)) || (offset > import_chunk_start(file, first + 1)) ) {
+                rc = false;
+            } else {
+                file->chunk_resume[first] = offset;
+            }
+        }
+    }
+    fclose(fptr);
+    if ( ! rc || ! size || ! chunk_bytes ) {
+        ERROR("Import: state file %s does not match %s (remove it or use --restart)", file->state_filepath, file->filepath);
+        return false;
+    }
+    return true;
+}
+
+//
+
+/*
+ * Report an event that could not be logged and append it to the file's
+ * rejects file (in the csvfile format, so it can be imported again once
+ * the problem is fixed).  Called with the file's lock held.
+ */
+static void
+import_log_failure(
+    import_file_t   *file,
+    log_data_t      *data,
+    const char      *error_msg
+)
+{
+    log_data_strs_t strs;
+
+    log_data_to_strs(data, &strs);
+    ERROR("Import: unable to log data { %s, %s, %s, %ld, %s, %hu, %s }: %s",
+        strs.log_date,
+        log_event_to_str(data->event),
+        data->uid,
+        (long int)data->sshd_pid,
+        strs.src_ipaddr,
+        data->src_port,
+        strs.dst_ipaddr,
+        error_msg ? error_msg : "unknown");
+    if ( ! file->rejects_fptr && ! (file->rejects_fptr = fopen(file->rejects_filepath, "a")) ) {
+        ERROR("Import: unable to open rejects file %s (errno=%d)", file->rejects_filepath, errno);
+        file->is_aborted = true;
+        return;
+    }
+    if ( fprintf(file->rejects_fptr, "%2$s%1$c%3$s%1$c%4$d%1$c%5$s%1$c%6$ld%1$c%7$s%1$c%8$s\n",
+                import_delimiter,
+                strs.dst_ipaddr,
+                strs.src_ipaddr,
+                data->src_port,
+                log_event_to_str(data->event),
+                (long int)data->sshd_pid,
+                data->uid,
+                strs.log_date) < 0 )
+    {
+        ERROR("Import: unable to write rejects file %s (errno=%d)", file->rejects_filepath, errno);
+        file->is_aborted = true;
+    }
+}
+
+//
+
+void*
+import_worker_entry(
+    void    *context
+)
+{
+    import_worker_t             *WORKER = (import_worker_t*)context;
+    import_file_t               *THE_FILE = WORKER->file;
+    log_data_parse_context_t    parse_context;
+    const char                  *error_msg = NULL;
+
+    log_data_parse_context_init(&parse_context, import_delimiter);
+    while ( 1 ) {
+        size_t                  chunk, chunk_start, chunk_end, resume;
+        const char              *p, *e;
+        uint64_t                n_lines = parse_context.n_lines, n_invalid = parse_context.n_invalid;
+        uint64_t                n_logged = 0, n_failed = 0;
+        bool                    ok = true;
+
+        /* Claim the next chunk not yet imported: */
+        pthread_mutex_lock(&THE_FILE->lock);
+        while ( (THE_FILE->next_chunk < THE_FILE->n_chunks) && THE_FILE->chunk_done[THE_FILE->next_chunk] ) THE_FILE->next_chunk++;
+        if ( ! is_running || THE_FILE->is_aborted || (THE_FILE->next_chunk >= THE_FILE->n_chunks) ) {
+            pthread_mutex_unlock(&THE_FILE->lock);
+            break;
+        }
+        chunk = THE_FILE->next_chunk++;
+        resume = THE_FILE->chunk_resume[chunk];
+        pthread_mutex_unlock(&THE_FILE->lock);
+
+        chunk_start = import_chunk_start(THE_FILE, chunk);
+        chunk_end = import_chunk_start(THE_FILE, chunk + 1);
+        p = THE_FILE->base + (resume ? resume : chunk_start);
+        e = THE_FILE->base + chunk_end;
+
+        /* Stopping between batches leaves the chunk partial, resuming right after
+         * the last batch checkpointed: */
+        while ( ok && is_running && (p < e) ) {
+            const char  *batch_start = p;
+            size_t      n_batch = log_data_parse_many(&parse_context, p, e - p, WORKER->batch, import_batch_records, &p);
+            size_t      i = 0;
+            uint64_t    n_batch_logged = 0;
+
+            /* Every event in the batch is logged or rejected before it is checkpointed,
+             * so a resume never replays a logged event: */
+            while ( i < n_batch ) {
+                size_t  n = 0;
+
+                if ( db_log_events(WORKER->db, &WORKER->batch[i], n_batch - i, &n, &error_msg) ) {
+                    n_batch_logged += n_batch - i;
+                    break;
+                }
+                /* Reject the record that failed and retry the remainder: */
+                i += n, n_batch_logged += n;
+                n_failed++;
+                pthread_mutex_lock(&THE_FILE->lock);
+                import_log_failure(THE_FILE, &WORKER->batch[i++], error_msg);
+                if ( ++THE_FILE->n_failed > import_max_errors ) {
+                    if ( ! THE_FILE->is_aborted ) ERROR("Import: more than %lu events could not be logged, stopping", import_max_errors);
+                    THE_FILE->is_aborted = true;
+                }
+                pthread_mutex_unlock(&THE_FILE->lock);
+            }
+            n_logged += n_batch_logged;
+            if ( ! db_flush(WORKER->db, &error_msg) ) {
+                ERROR("Import: unable to flush logged data: %s", error_msg ? error_msg : "unknown");
+                ok = false;
+            }
+
+            pthread_mutex_lock(&THE_FILE->lock);
+            THE_FILE->n_logged += n_batch_logged;
+            if ( ok ) {
+                THE_FILE->bytes_done += p - batch_start;
+                if ( p < e ) {
+                    THE_FILE->chunk_resume[chunk] = p - THE_FILE->base;
+                } else {
+                    THE_FILE->chunk_done[chunk] = 1;
+                    THE_FILE->chunk_resume[chunk] = 0;
+                }
+                if ( (THE_FILE->rejects_fptr && (fflush(THE_FILE->rejects_fptr) != 0)) || ! import_state_write(THE_FILE) ) {
+                    THE_FILE->is_aborted = true;
+                }
+            } else {
+                THE_FILE->is_aborted = true;
+            }
+            if ( THE_FILE->is_aborted ) ok = false;
+            pthread_mutex_unlock(&THE_FILE->lock);
+        }
+
+        pthread_mutex_lock(&THE_FILE->lock);
+        THE_FILE->n_lines += parse_context.n_lines - n_lines;
+        THE_FILE->n_invalid += parse_context.n_invalid - n_invalid;
+        pthread_mutex_unlock(&THE_FILE->lock);
+        DEBUG("Import: chunk %lu of %s: %llu logged, %llu failed",
+            (unsigned long)chunk, THE_FILE->filepath, (unsigned long long)n_logged, (unsigned long long)n_failed);
+    }
+
+    pthread_mutex_lock(&THE_FILE->lock);
+    THE_FILE->n_active--;
+    pthread_cond_signal(&THE_FILE->done_cond);
+    pthread_mutex_unlock(&THE_FILE->lock);
+    return NULL;
+}
+
+//
+
+static double
+import_elapsed(
+    const struct timespec   *since
+)
+{
+    struct timespec         now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + 1e-9 * (now.tv_nsec - since->tv_nsec);
+}
+
+//
+
+/*
+ * Import the csvfile at <filepath> using the <import_threads> workers
+ * in <workers>.  Returns zero if the whole file has been imported.
+ */
+int
+import_file(
+    const char          *filepath,
+    import_worker_t     *workers
+)
+{
+    import_file_t       file;
+    struct stat         finfo;
+    struct timespec     start_time;
+    pthread_t           *threads;
+    size_t              n_done = 0, i;
+    int                 fd, rc = 0;
+
+    memset(&file, 0, sizeof(file));
+    file.filepath = filepath;
+    if ( import_state_directory ) {
+        char            *path_copy = strdup(filepath);
+
+        if ( ! path_copy ) return ENOMEM;
+        rc = asprintf(&file.state_filepath, "%s/%s" IMPORT_STATE_SUFFIX, import_state_directory, basename(path_copy));
+        if ( (rc >= 0) && (asprintf(&file.rejects_filepath, "%s/%s" IMPORT_REJECTS_SUFFIX, import_state_directory, basename(path_copy)) < 0) ) {
+            free((void*)file.state_filepath);
+            rc = -1;
+        }
+        free((void*)path_copy);
+    } else {
+        rc = asprintf(&file.state_filepath, "%s" IMPORT_STATE_SUFFIX, filepath);
+        if ( (rc >= 0) && (asprintf(&file.rejects_filepath, "%s" IMPORT_REJECTS_SUFFIX, filepath) < 0) ) {
+            free((void*)file.state_filepath);
+            rc = -1;
+        }
+    }
+    if ( rc < 0 ) return ENOMEM;
+    rc = 0;
+
+    if ( (fd = open(filepath, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &finfo) < 0 ) {
+        rc = errno;
+        ERROR("Import: unable to open %s (errno=%d)", filepath, rc);
+        if ( fd >= 0 ) close(fd);
+        free((void*)file.state_filepath);
+        free((void*)file.rejects_filepath);
+        return rc;
+    }
+    file.size = finfo.st_size;
+    file.mtime = finfo.st_mtim;
+    if ( file.size == 0 ) {
+        INFO("Import: %s is empty", filepath);
+        close(fd);
+        free((void*)file.state_filepath);
+        free((void*)file.rejects_filepath);
+        return 0;
+    }
+    file.base = (const char*)mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( file.base == MAP_FAILED ) {
+        rc = errno;
+        ERROR("Import: unable to map %s (errno=%d)", filepath, rc);
+        free((void*)file.state_filepath);
+        free((void*)file.rejects_filepath);
+        return rc;
+    }
+    file.n_chunks = (file.size + IMPORT_CHUNK_BYTES - 1) / IMPORT_CHUNK_BYTES;
+    if ( ! (file.chunk_done = (uint8_t*)calloc(file.n_chunks, sizeof(uint8_t))) ||
+         ! (file.chunk_resume = (size_t*)calloc(file.n_chunks, sizeof(size_t))) ) {
+        rc = ENOMEM;
+        goto early_exit;
+    }
+    if ( import_restart ) {
+        if ( (unlink(file.state_filepath) < 0) && (errno != ENOENT) ) {
+            rc = errno;
+            ERROR("Import: unable to remove state file %s (errno=%d)", file.state_filepath, rc);
+            goto early_exit;
+        }
+        if ( (unlink(file.rejects_filepath) < 0) && (errno != ENOENT) ) {
+            rc = errno;
+            ERROR("Import: unable to remove rejects file %s (errno=%d)", file.rejects_filepath, rc);
+            goto early_exit;
+        }
+    } else if ( ! import_state_read(&file) ) {
+        rc = EINVAL;
+        goto early_exit;
+    }
+    for ( i = 0; i < file.n_chunks; i++ ) {
+        if ( file.chunk_done[i] ) {
+            file.bytes_done += import_chunk_start(&file, i + 1) - import_chunk_start(&file, i);
+            n_done++;
+        } else if ( file.chunk_resume[i] ) {
+            file.bytes_done += file.chunk_resume[i] - import_chunk_start(&file, i);
+        }
+    }
+    if ( n_done == file.n_chunks ) {
+        INFO("Import: %s was already imported (see %s)", filepath, file.state_filepath);
+        goto early_exit;
+    }
+    if ( file.bytes_done ) INFO("Import: resuming %s with %lu of %lu chunks done", filepath, (unsigned long)n_done, (unsigned long)file.n_chunks);
+
+    /* The whole file will be read, most of it by more than one thread: */
+    posix_madvise((void*)file.base, file.size, POSIX_MADV_WILLNEED);
+
+    if ( ! (threads = (pthread_t*)calloc(import_threads, sizeof(pthread_t))) ) {
+        rc = ENOMEM;
+        goto early_exit;
+    }
+    pthread_mutex_init(&file.lock, NULL);
+    pthread_cond_init(&file.done_cond, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    pthread_mutex_lock(&file.lock);
+    for ( i = 0; i < import_threads; i++ ) {
+        int             thread_rc;
+
+        workers[i].file = &file;
+        thread_rc = pthread_create(&threads[i], NULL, import_worker_entry, (void*)&workers[i]);
+        if ( thread_rc != 0 ) {
+            ERROR("Import: unable to start thread %lu (errno=%d)", (unsigned long)i, thread_rc);
+            file.is_aborted = true;
+            break;
+        }
+        file.n_active++;
+    }
+
+    /* Report progress while the threads work: */
+    while ( file.n_active ) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += IMPORT_PROGRESS_INTERVAL;
+        if ( (pthread_cond_timedwait(&file.done_cond, &file.lock, &deadline) == ETIMEDOUT) && file.n_active ) {
+            double      dt = import_elapsed(&start_time);
+
+            INFO("Import: %s: %.1f%% done, %llu events logged (%.0f/s)",
+                filepath,
+                100.0 * file.bytes_done / file.size,
+                (unsigned long long)file.n_logged,
+                file.n_logged / dt);
+        }
+    }
+    pthread_mutex_unlock(&file.lock);
+    while ( i-- ) pthread_join(threads[i], NULL);
+    free((void*)threads);
+
+    {
+        double          dt = import_elapsed(&start_time);
+
+        INFO("Import: %s: %llu lines, %llu events logged, %llu invalid lines, %llu failed events in %.1fs (%.0f events/s)",
+            filepath,
+            (unsigned long long)file.n_lines,
+            (unsigned long long)file.n_logged,
+            (unsigned long long)file.n_invalid,
+            (unsigned long long)file.n_failed,
+            dt,
+            (dt > 0.0) ? (file.n_logged / dt) : 0.0);
+    }
+    if ( file.rejects_fptr ) {
+        fclose(file.rejects_fptr);
+        WARN("Import: events that could not be logged were written to %s", file.rejects_filepath);
+    }
+    for ( i = 0, n_done = 0; i < file.n_chunks; i++ ) if ( file.chunk_done[i] ) n_done++;
+    if ( n_done < file.n_chunks ) {
+        ERROR("Import: %s is incomplete (%lu of %lu chunks done); rerun to resume", filepath, (unsigned long)n_done, (unsigned long)file.n_chunks);
+        rc = is_running ? EIO : EINTR;
+    }
+    pthread_cond_destroy(&file.done_cond);
+    pthread_mutex_destroy(&file.lock);
+
+early_exit:
+    if ( file.chunk_done ) free((void*)file.chunk_done);
+    if ( file.chunk_resume ) free((void*)file.chunk_resume);
+    munmap((void*)file.base, file.size);
+    free((void*)file.state_filepath);
+    free((void*)file.rejects_filepath);
+    return rc;
+}
+
+//
+
+bool
+config_read_yaml_file(
+    const char  *fpath,
+    db_ref      *dbs,
+    size_t      n_dbs
+)
+{
+    bool        rc = false;
+    FILE        *fptr = fopen(fpath, "r");
+
+    if ( fptr ) {
+        yaml_parser_t   parser;
+
+        INFO("Configuration: attempting to parse file: %s", fpath);
+        if ( yaml_parser_initialize(&parser) ) {
+            yaml_document_t config_doc;
+
+            DEBUG("Configuration: parser initialized");
+            yaml_parser_set_input_file(&parser, fptr);
+            if ( yaml_parser_load(&parser, &config_doc) ) {
+                yaml_node_t *root_node = yaml_document_get_root_node(&config_doc);
+
+                DEBUG("Configuration: document loaded");
+                if ( root_node && (root_node->type == YAML_MAPPING_NODE) ) {
+                    yaml_node_t     *node;
+
+                    /*
+                     * Each thread gets its own database instance:
+                     */
+                    if ( (node = yaml_helper_doc_node_at_path(&config_doc, root_node, "database")) ) {
+                        size_t      i;
+
+                        rc = true;
+                        for ( i = 0; rc && (i < n_dbs); i++ ) {
+                            if ( ! (dbs[i] = db_alloc(NULL, &config_doc, node, db_options_no_firewall)) ) rc = false;
+                        }
+                    } else {
+                        ERROR("Configuration: lacks a database configuration");
+                    }
+                } else {
+                    errno = EINVAL;
+                    FATAL("Configuration: empty YAML document");
+                }
+            }  else {
+                errno = EINVAL;
+                FATAL("Configuration: failed to load document: (err=%d, offset=%lld) %s", parser.error, parser.problem_offset, parser.problem);
+            }
+            yaml_parser_delete(&parser);
+        } else {
+            errno = ENOMEM;
+            FATAL("Configuration: failed to initialize YAML parser");
+        }
+        fclose(fptr);
+    } else {
+        FATAL("Configuration: failed to open file: %s", fpath);
+    }
+    return rc;
+}
+
+//
+
+static struct option cli_options[] = {
+                   { "help",            no_argument,       0,  'h' },
+                   { "version",         no_argument,       0,  'V' },
+                   { "verbose",         no_argument,       0,  'v' },
+                   { "quiet",           no_argument,       0,  'q' },
+                   { "config",          required_argument, 0,  'c' },
+                   { "delimiter",       required_argument, 0,  'd' },
+                   { "threads",         required_argument, 0,  'j' },
+                   { "batch",           required_argument, 0,  'b' },
+                   { "max-errors",      required_argument, 0,  'e' },
+                   { "state-directory", required_argument, 0,  's' },
+                   { "restart",         no_argument,       0,  'r' },
+                   { NULL,              0,                 0,   0  }
+               };
+static const char *cli_options_str = "hVvqc:d:j:b:e:s:r";
+
+//
+
+void
+usage(
+    const char  *exe
+)
+{
+    db_driver_iterator_t    driver_iter = NULL;
+    const char              *driver_name;
+
+    printf(
+        "usage:\n\n"
+        "    %s {options} <csvfile> {<csvfile> ..}\n\n"
+        "  options:\n\n"
+        "    -h/--help                  Show this information\n"
+        "    -V/--version               Display program version\n"
+        "    -v/--verbose               Increase level of printing\n"
+        "    -q/--quiet                 Decrease level of printing\n"
+        "    -c/--config <filepath>     Read the database configuration from the YAML file\n"
+        "                               at <filepath> (default: %s)\n"
+        "    -d/--delimiter <char>      Field delimiter in the csvfiles (default: ,)\n"
+        "    -j/--threads <int>         Number of threads (and database connections)\n"
+        "                               (default: %d)\n"
+        "    -b/--batch <int>           Number of events handed to the database at once\n"
+        "                               (default: %d)\n"
+        "    -e/--max-errors <int>      Stop after this many events could not be logged\n"
+        "                               (default: %d)\n"
+        "    -s/--state-directory <path>\n"
+        "                               Keep the progress of each csvfile in <path> rather\n"
+        "                               than alongside the csvfile\n"
+        "    -r/--restart               Discard any progress and import from the start\n"
+        "\n"
+        "  database drivers:\n\n",
+        exe,
+        configuration_filepath_default,
+        IMPORT_DEFAULT_THREADS,
+        IMPORT_DEFAULT_BATCH_RECORDS,
+        IMPORT_DEFAULT_MAX_ERRORS);
+    while ( (driver_name = db_driver_enumerate_drivers(&driver_iter)) ) printf("    - %s\n", driver_name);
+    printf(
+        "\n"
+        "(v" IPTRACKING_VERSION_STR " built with " CC_VENDOR " %lu on " __DATE__ " " __TIME__ ")\n",
+        (unsigned long)CC_VERSION);
+}
+
+//
+
+void
+handle_termination(
+    int     signum
+)
+{
+    is_running = false;
+}
+
+//
+
+static bool
+parse_ulong_arg(
+    const char      *arg,
+    const char      *what,
+    unsigned long   min_val,
+    unsigned long   *value
+)
+{
+    char            *endptr;
+    long            ival = strtol(arg, &endptr, 0);
+
+    if ( (endptr == arg) || *endptr || (ival < (long)min_val) ) {
+        ERROR("Invalid %s value: %s", what, arg);
+        return false;
+    }
+    *value = ival;
+    return true;
+}
+
+//
+
+int
+main(
+    int             argc,
+    char* const*    argv
+)
+{
+    int             opt_ch, verbose = 0, quiet = 0, rc = 0, arg_i;
+    const char      *config_filepath = configuration_filepath_default;
+    struct sigaction signal_spec;
+    db_ref          *dbs;
+    import_worker_t *workers;
+    unsigned long   i;
+
+    /* Parse all CLI arguments: */
+    while ( (opt_ch = getopt_long(argc, argv, cli_options_str, cli_options, NULL)) != -1 ) {
+        switch ( opt_ch ) {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            case 'V':
+                printf(IPTRACKING_VERSION_STR "\n");
+                exit(0);
+            case 'v':
+                /* Set logging level based on verbose/quiet options: */
+                logging_set_level(logging_get_level() + ++verbose - quiet);
+                break;
+            case 'q':
+                /* Set logging level based on verbose/quiet options: */
+                logging_set_level(logging_get_level() + verbose - ++quiet);
+                break;
+            case 'c':
+                config_filepath = optarg;
+                break;
+            case 'd':
+                if ( strlen(optarg) != 1 || (*optarg == '\n') ) {
+                    ERROR("Invalid delimiter (must be a single character): %s", optarg);
+                    exit(EINVAL);
+                }
+                import_delimiter = *optarg;
+                break;
+            case 'j':
+                if ( ! parse_ulong_arg(optarg, "threads", 1, &import_threads) ) exit(EINVAL);
+                break;
+            case 'b':
+                if ( ! parse_ulong_arg(optarg, "batch", 1, &import_batch_records) ) exit(EINVAL);
+                break;
+            case 'e':
+                if ( ! parse_ulong_arg(optarg, "max-errors", 0, &import_max_errors) ) exit(EINVAL);
+                break;
+            case 's':
+                import_state_directory = optarg;
+                break;
+            case 'r':
+                import_restart = true;
+                break;
+            default:
+                exit(EINVAL);
+        }
+    }
+    if ( optind >= argc ) {
+        ERROR("No csvfiles to import (see --help)");
+        exit(EINVAL);
+    }
+
+    /* Load configuration, one database instance per thread: */
+    dbs = (db_ref*)calloc(import_threads, sizeof(db_ref));
+    workers = (import_worker_t*)calloc(import_threads, sizeof(import_worker_t));
+    if ( ! dbs || ! workers ) {
+        ERROR("Unable to allocate %lu threads", import_threads);
+        exit(ENOMEM);
+    }
+    if ( ! config_read_yaml_file(config_filepath, dbs, import_threads) ) exit(EINVAL);
+
+    /* Validate configuration and connect: */
+    for ( i = 0; i < import_threads; i++ ) {
+        const char  *error_msg = NULL;
+
+        if ( ! db_has_valid_configuration(dbs[i], &error_msg) ) {
+            ERROR("Configuration: database configuration is invalid: %s", error_msg ? error_msg : "unknown");
+            exit(EINVAL);
+        }
+        if ( i == 0 ) db_summarize_to_log(dbs[i]);
+        if ( ! db_open(dbs[i], &error_msg) ) {
+            ERROR("Database: unable to connect to database: %s", error_msg ? error_msg : "unknown");
+            exit(EIO);
+        }
+        workers[i].db = dbs[i];
+        if ( ! (workers[i].batch = (log_data_t*)malloc(import_batch_records * sizeof(log_data_t))) ) {
+            ERROR("Unable to allocate batch of %lu records", import_batch_records);
+            exit(ENOMEM);
+        }
+    }
+    INFO("Import: %lu threads, batches of %lu events, delimiter '%c'", import_threads, import_batch_records, import_delimiter);
+
+    /* Stop handing out chunks on a signal, so progress is saved: */
+    signal_spec.sa_handler = handle_termination;
+    sigemptyset(&signal_spec.sa_mask);
+    signal_spec.sa_flags = 0;
+    sigaction(SIGHUP, &signal_spec, NULL);
+    sigaction(SIGINT, &signal_spec, NULL);
+    sigaction(SIGTERM, &signal_spec, NULL);
+
+    for ( arg_i = optind; is_running && (arg_i < argc); arg_i++ ) {
+        int         file_rc = import_file(argv[arg_i], workers);
+
+        if ( file_rc && ! rc ) rc = file_rc;
+    }
+
+    for ( i = 0; i < import_threads; i++ ) {
+        db_close(dbs[i], NULL);
+        db_dealloc(dbs[i]);
+        free((void*)workers[i].batch);
+    }
+    free((void*)workers);
+    free((void*)dbs);
+    return rc;
+}
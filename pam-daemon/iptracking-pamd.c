@@ -9,13 +9,14 @@
 #include "iptracking.h"
 #include "logging.h"
 #include "log_queue.h"
+#include "log_spool.h"
+#include "log_drop.h"
+#include "event_reader.h"
 #include "db_interface.h"
 #include "yaml_helpers.h"
 
 #include <signal.h>
 #include <sys/socket.h>
-#include <sys/un.h>
-#include <poll.h>
 
 //
 
@@ -23,33 +24,139 @@ static const char *configuration_filepath_default = CONFIGURATION_FILEPATH_DEFAU
 
 //
 
+static const char *log_pool_backend_str = LOG_POOL_BACKEND_DEFAULT;
+static log_queue_backend_t log_pool_backend = log_queue_backend_pool;
+
+//
+
 static uint32_t log_pool_records_min = LOG_POOL_RECORDS_MIN;
 static uint32_t log_pool_records_max = LOG_POOL_RECORDS_MAX;
 static uint32_t log_pool_records_delta = LOG_POOL_RECORDS_DELTA;
 
 //
 
-static int log_pool_push_wait_seconds_min = LOG_POOL_DEFAULT_PUSH_WAIT_SECONDS_MIN;
-static int log_pool_push_wait_seconds_max = LOG_POOL_DEFAULT_PUSH_WAIT_SECONDS_MAX;
-static int log_pool_push_wait_seconds_dt_thresh = LOG_POOL_DEFAULT_PUSH_WAIT_SECONDS_DT_THRESH;
-static int log_pool_push_wait_seconds_dt = LOG_POOL_DEFAULT_PUSH_WAIT_SECONDS_DT;
+static int log_pool_push_wait_ms = LOG_POOL_DEFAULT_PUSH_WAIT_MS;
+static const char *log_pool_overflow_policy_str = NULL;
+static log_queue_overflow_policy_t log_pool_overflow_policy = log_queue_overflow_policy_block;
+
+//
+
+static uint32_t db_batch_records = DB_BATCH_DEFAULT_RECORDS;
+static int db_batch_linger_ms = DB_BATCH_DEFAULT_LINGER_MS;
+
+/* Longest wait (in seconds) between attempts to log records while the database is down: */
+#define DB_RETRY_MAX_DELAY 60
+
+//
+
+static const char *spool_directory = NULL;
+static uint32_t spool_segment_records = LOG_SPOOL_DEFAULT_SEGMENT_RECORDS;
+static uint32_t spool_max_segments = LOG_SPOOL_DEFAULT_MAX_SEGMENTS;
+
+//
+
+static const char *drop_directory = DROP_DIRECTORY_DEFAULT;
 
 //
 
 static bool is_running = true;
 static const char *socket_filepath = SOCKET_FILEPATH_DEFAULT;
+static const char *socket_type_str = SOCKET_DEFAULT_TYPE;
+static socket_type_t socket_type = socket_type_stream;
+static const char *socket_reader_backend_str = SOCKET_DEFAULT_READER_BACKEND;
+static event_reader_backend_t socket_reader_backend = event_reader_backend_epoll;
 static int socket_backlog = SOCKET_DEFAULT_BACKLOG;
 static int socket_poll_interval = SOCKET_DEFAULT_POLL_INTERVAL;
+static uint32_t socket_acceptor_threads = SOCKET_DEFAULT_ACCEPTOR_THREADS;
+static uint32_t socket_max_connections = SOCKET_DEFAULT_MAX_CONNECTIONS;
+static int socket_connection_timeout_ms = SOCKET_DEFAULT_CONNECTION_TIMEOUT_MS;
 
 //
 
 typedef struct {
-    log_queue_ref   lq;
-    db_ref          db;
+    log_queue_ref       lq;
+    log_spool_ref       spool;
+    event_reader_ref    reader;
+    db_ref              db;
 } thread_context_t;
 
 //
 
+/*
+ * Ingest the drop directory, passing each event to <callback>, and
+ * summarize the outcome.
+ */
+static void
+drop_directory_ingest(
+    log_drop_callback   callback,
+    void                *context
+)
+{
+    log_drop_counts_t   counts;
+    int                 rc = log_drop_ingest(drop_directory, callback, context, &counts);
+    
+    if ( rc ) {
+        ERROR("Drop directory: unable to ingest %s (errno=%d)", drop_directory, rc);
+    } else if ( counts.n_files || counts.n_deferred || counts.n_failed ) {
+        INFO("Drop directory: %llu events ingested from %llu files (%llu rejected, %llu partial, %llu deferred, %llu files failed)",
+                (unsigned long long)counts.n_events, (unsigned long long)counts.n_files,
+                (unsigned long long)counts.n_rejected, (unsigned long long)counts.n_invalid,
+                (unsigned long long)counts.n_deferred, (unsigned long long)counts.n_failed);
+    }
+}
+
+//
+
+/*
+ * Without a spool, events left in the drop directory are logged by the
+ * database thread itself (and flushed) before their files are removed,
+ * so an event is never held only in memory.  Only valid events are
+ * accepted (older clients leave version 1 records, which are converted).
+ */
+static log_drop_disposition_t
+db_drop_log(
+    void        *context,
+    log_data_t  *data
+)
+{
+    thread_context_t    *CONTEXT = (thread_context_t*)context;
+    const char          *error_msg = NULL;
+    
+    if ( ! log_data_import(data) ) return log_drop_rejected;
+    if ( db_log_events(CONTEXT->db, data, 1, NULL, &error_msg) && db_flush(CONTEXT->db, &error_msg) ) return log_drop_accepted;
+    WARN("Drop directory: unable to log event, leaving it for the next start: %s", error_msg ? error_msg : "unknown");
+    return log_drop_deferred;
+}
+
+//
+
+/*
+ * Log the <n_records> records at <records> to the debug log.
+ */
+static void
+db_debug_logged(
+    log_data_t          *records,
+    size_t              n_records
+)
+{
+    while ( n_records-- ) {
+        log_data_t      *data = records++;
+        log_data_strs_t strs;
+        
+        log_data_to_strs(data, &strs);
+        DEBUG("Database: logged data { %s, %s, %s, %ld, %s, %hu, %s }",
+            strs.log_date,
+            log_event_to_str(data->event),
+            data->uid,
+            (long int)data->sshd_pid,
+            strs.src_ipaddr,
+            data->src_port,
+            strs.dst_ipaddr);
+    }
+}
+
+//
+
 int
 db_runloop(
     thread_context_t    *context
@@ -57,41 +164,110 @@ db_runloop(
 {
     bool                is_connecting = true;
     const char          *error_msg = NULL;
+    unsigned int        retry_delay = 0;
+    size_t              n_kept = 0;
+    log_data_t          *batch = (log_data_t*)malloc(db_batch_records * sizeof(log_data_t));
     
+    if ( ! batch ) {
+        ERROR("Database: unable to allocate batch of %lu records", (unsigned long)db_batch_records);
+        sleep(5);
+        return ENOMEM;
+    }
     while ( is_running && ! db_open(context->db, &error_msg) ) {
         /* Try again in 5 seconds: */
         ERROR("Database: unable to connect to database, will retry: %s",
             error_msg ? error_msg : "unknown");
         sleep(5);
     }
+    if ( is_running && drop_directory && ! context->spool ) drop_directory_ingest(db_drop_log, context);
     while ( is_running ) {
-        log_data_t      data;
+        size_t          n_batch, i = 0;
+        bool            is_from_spool = false, is_debug;
         
-        /* The log_queue_pop() function will block until a record becomes available: */
-        if ( log_queue_pop(&context->lq, &data) ) {
-            if ( db_log_one_event(context->db, &data, &error_msg) ) {
-                DEBUG("Database: logged data { %s, %s, %s, %ld, %s, %hu, %s }",
-                    data.log_date,
-                    log_event_to_str(data.event),
-                    data.uid,
-                    (long int)data.sshd_pid,
-                    data.src_ipaddr,
-                    data.src_port,
-                    data.dst_ipaddr);
-            } else {
-                ERROR("Database: unable to log data { %s, %s, %s, %ld, %s, %hu, %s }: %s",
-                    data.log_date,
-                    log_event_to_str(data.event),
-                    data.uid,
-                   (long int) data.sshd_pid,
-                    data.src_ipaddr,
-                    data.src_port,
-                    data.dst_ipaddr,
-                    error_msg ? error_msg : "unknown");
+        if ( n_kept ) {
+            /* Records kept from a failed attempt go first, topped-up from the queue: */
+            n_batch = n_kept + log_queue_try_pop_batch(&context->lq, batch + n_kept, db_batch_records - n_kept);
+            n_kept = 0;
+        } else if ( context->spool && log_spool_count(context->spool) ) {
+            /* Records still in memory predate everything in the spool, so they go first: */
+            n_batch = log_queue_try_pop_batch(&context->lq, batch, db_batch_records);
+            if ( n_batch == 0 ) {
+                n_batch = log_spool_peek_batch(context->spool, batch, db_batch_records);
+                is_from_spool = true;
+                DEBUG("Database: replaying batch of %lu spooled records", (unsigned long)n_batch);
+            }
+        } else {
+            /* The log_queue_pop_batch() function will block until a record becomes available: */
+            n_batch = log_queue_pop_batch(&context->lq, batch, db_batch_records, db_batch_linger_ms);
+        }
+        if ( n_batch > 1 ) DEBUG("Database: popped batch of %lu records", (unsigned long)n_batch);
+        is_debug = (logging_get_level() >= logging_level_debug);
+        while ( i < n_batch ) {
+            size_t          n_logged = 0, i_failed;
+            bool            ok = db_log_events(context->db, &batch[i], n_batch - i, &n_logged, &error_msg);
+            char            failed_error_msg[256];
+            log_data_strs_t strs;
+            
+            /* Formatting the records is only worth it if they will be shown: */
+            if ( is_debug ) db_debug_logged(&batch[i], n_logged);
+            i += n_logged;
+            if ( ok ) {
+                retry_delay = 0;
+                continue;
+            }
+            
+            /* Try the records that follow the one that failed:  if any of them can be
+             * logged the database is reachable and the failed record itself is at fault,
+             * otherwise the database is probably down and nothing should be dropped: */
+            snprintf(failed_error_msg, sizeof(failed_error_msg), "%s", error_msg ? error_msg : "unknown");
+            i_failed = i++;
+            n_logged = 0;
+            if ( i < n_batch ) db_log_events(context->db, &batch[i], n_batch - i, &n_logged, &error_msg);
+            if ( n_logged == 0 ) {
+                i = i_failed;
+                break;
             }
+            retry_delay = 0;
+            log_data_to_strs(&batch[i_failed], &strs);
+            ERROR("Database: unable to log data { %s, %s, %s, %ld, %s, %hu, %s }: %s",
+                strs.log_date,
+                log_event_to_str(batch[i_failed].event),
+                batch[i_failed].uid,
+                (long int)batch[i_failed].sshd_pid,
+                strs.src_ipaddr,
+                batch[i_failed].src_port,
+                strs.dst_ipaddr,
+                failed_error_msg);
+            if ( is_debug ) db_debug_logged(&batch[i], n_logged);
+            i += n_logged;
+        }
+        if ( is_from_spool ) {
+            /* Only what was logged (or dropped) leaves the spool: */
+            log_spool_consume(context->spool, i);
+        } else if ( (i < n_batch) && context->spool ) {
+            /* Keep the unlogged records in the spool, in order: */
+            while ( (i < n_batch) && (log_spool_push(context->spool, &batch[i], false) == log_spool_push_ok) ) i++;
+            if ( i == n_batch ) WARN("Database: unable to log records, spooled them for retry: %s", error_msg ? error_msg : "unknown");
+        }
+        if ( i < n_batch ) {
+            if ( ! is_from_spool ) {
+                /* No room for them in the spool, so hold onto them: */
+                n_kept = n_batch - i;
+                if ( i ) memmove(batch, &batch[i], n_kept * sizeof(log_data_t));
+            }
+            retry_delay = retry_delay ? ((retry_delay < DB_RETRY_MAX_DELAY) ? 2 * retry_delay : DB_RETRY_MAX_DELAY) : 1;
+            WARN("Database: unable to log %lu records, will retry in %us: %s",
+                (unsigned long)(n_batch - i), retry_delay, error_msg ? error_msg : "unknown");
+            sleep(retry_delay);
+        }
+        
+        /* A short batch means the queue is drained, so push out anything the driver buffered: */
+        if ( (n_batch < db_batch_records) && ! db_flush(context->db, &error_msg) ) {
+            ERROR("Database: unable to flush logged data: %s", error_msg ? error_msg : "unknown");
         }
     }
     db_close(context->db, NULL);
+    free((void*)batch);
     return 0;
 }
 
@@ -111,134 +287,84 @@ db_thread_entry(
 
 //
 
+/*
+ * Spill callback for the spill-to-disk overflow policy:  append the
+ * event to the spool and make sure the database thread notices.
+ */
+bool
+event_spill(
+    void        *context,
+    log_data_t  *data
+)
+{
+    thread_context_t    *CONTEXT = (thread_context_t*)context;
+    
+    if ( log_spool_push(CONTEXT->spool, data, false) != log_spool_push_ok ) return false;
+    log_queue_interrupt_pop(&CONTEXT->lq);
+    return true;
+}
+
+//
+
+/*
+ * Hand a validated event to the database thread.  Once anything is on
+ * disk in the spool, later events follow it there so they are replayed
+ * in order; otherwise the event goes to the queue, whose overflow policy
+ * decides what happens if it is full.
+ */
+bool
+event_enqueue(
+    void        *context,
+    log_data_t  *data
+)
+{
+    thread_context_t    *CONTEXT = (thread_context_t*)context;
+    
+    if ( CONTEXT->spool && (log_spool_push(CONTEXT->spool, data, true) == log_spool_push_ok) ) {
+        log_queue_interrupt_pop(&CONTEXT->lq);
+        return true;
+    }
+    return log_queue_push(&CONTEXT->lq, data);
+}
+
+//
+
+/*
+ * With a spool, events left in the drop directory by clients that could
+ * not reach the daemon are moved to the spool before their files are
+ * removed.  Only valid events are accepted (older clients leave version
+ * 1 records, which are converted).
+ */
+log_drop_disposition_t
+event_drop_spool(
+    void        *context,
+    log_data_t  *data
+)
+{
+    thread_context_t    *CONTEXT = (thread_context_t*)context;
+    
+    if ( ! log_data_import(data) ) return log_drop_rejected;
+    if ( log_spool_push(CONTEXT->spool, data, false) != log_spool_push_ok ) return log_drop_deferred;
+    log_queue_interrupt_pop(&CONTEXT->lq);
+    return log_drop_accepted;
+}
+
+//
+
 void*
 event_thread_entry(
     void    *context
 )
 {
     thread_context_t    *CONTEXT = (thread_context_t*)context;
-    struct sockaddr_un  server_addr;
-    log_data_t          data_buffer;
-    int                 on = 1, off = 0;
     
-    if ( strlen(socket_filepath) >= sizeof(server_addr.sun_path) ) {
-        FATAL("Event reader: socket file path is too long (%d >= %d)",
-                    strlen(socket_filepath), sizeof(server_addr.sun_path));
-    }
+    /* Events dropped while the daemon was unreachable go ahead of new ones
+     * (without a spool the database thread logs them instead): */
+    if ( drop_directory && CONTEXT->spool ) drop_directory_ingest(event_drop_spool, context);
     
     while ( is_running ) {
-        int             rc, server_fd;
-        
-        /* Get the socket open: */
-        if ( (server_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ) {
-            ERROR("Event reader: unable to create Unix socket (errno=%d)", errno);
-            sleep(5);
-            continue;
-        }
-        DEBUG("Event reader: socket %d created", server_fd);
-        if ( setsockopt(server_fd, SOL_SOCKET,  SO_REUSEADDR, (char*)&on, sizeof(on)) < 0 ) {
-            WARN("Event reader: unable to set REUSEADDR on socket (errno=%d)", errno);
-        }
-        DEBUG("Event reader: REUSEADDR set on socket %d", server_fd);
-        if ( fcntl(server_fd, F_SETFL, O_NONBLOCK) < 0 ) {
-            ERROR("Event reader: unable to set O_NONBLOCK on socket (errno=%d)", errno);
-            sleep(5);
-            continue;
-        }
-        DEBUG("Event reader: O_NONBLOCK set on socket %d", server_fd);
-        
-        /* Bind the socket to the file system: */
-        memset(&server_addr, 0, sizeof(server_addr));
-        server_addr.sun_family = AF_UNIX;
-        strncpy(server_addr.sun_path, socket_filepath, sizeof(server_addr.sun_path));
-        if ( bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-            ERROR("Event reader: unable to bind Unix socket to file system (errno=%d)", errno);
-            close(server_fd);
-            sleep(5);
-            continue;
-        }
-        DEBUG("Event reader: socket %d bound to %s", server_fd, socket_filepath);
-        
-        /* Start listening for connections: */
-        if ( listen(server_fd, socket_backlog) == -1 ) {
-            ERROR("Event reader: unable to listen on Unix socket (errno=%d)", errno);
-            close(server_fd);
-            sleep(5);
-            continue;
-        }
-        DEBUG("Event reader: socket %d listening...", server_fd);
-        
-        while ( is_running && (server_fd >= 0) ) {
-            struct pollfd   server_fds;
-            int             client_fd;
-            bool            is_polling = true, is_accepting = true;
-            
-            /* Poll for connections: */
-            server_fds.fd = server_fd;
-            server_fds.events = POLLIN;
-            while ( is_running && is_polling ) {
-                switch ( poll(&server_fds, 1, socket_poll_interval) ) {
-                    case -1: {
-                        switch ( errno ) {
-                            case EINTR:
-                                break;
-                            default:
-                                DEBUG("Event reader: poll socket %d failed (errno=%d)", server_fd, errno);
-                                is_accepting = false;
-                                is_polling = false;
-                                break;
-                        }
-                    }
-                    case 0:
-                        break;
-                    default:
-                        if ( (server_fds.revents | POLLIN) == POLLIN ) {
-                            is_polling = false;
-                            DEBUG("Event reader: connection ready on socket %d", server_fd);
-                        }
-                        break;
-                }
-            }
-            if ( is_running && is_accepting ) {
-                /* Accept the connection: */
-                client_fd = accept(server_fd, NULL, NULL);
-                if ( client_fd < 0 ) {
-                    switch ( errno ) {
-                        case ECONNABORTED:
-                        case EINTR:
-                            /* There are okay, just keep going */
-                            break;
-                        default:
-                            /* All other errors are fatal: */
-                            ERROR("Event reader: non-trivial failure during accept (errno=%d)", errno);
-                            close(server_fd);
-                            server_fd = -1;
-                            break;
-                    }
-                } else {
-                    ssize_t nbytes;
-                    
-                    DEBUG("Event reader: accepted connection");
-                    nbytes = recv(client_fd, &data_buffer, sizeof(data_buffer), MSG_WAITALL);
-                    DEBUG("Event reader: read %lld bytes", (long long)nbytes);
-                    if ( nbytes == sizeof(data_buffer) ) {
-                        if ( log_data_is_valid(&data_buffer) ) {
-                            log_queue_push(&CONTEXT->lq, &data_buffer);
-                        } else {
-                            ERROR("Event reader: invalid event read from client");
-                        }
-                    } else if ( nbytes < 0 ) {
-                        ERROR("Event reader: error while reading event from client (errno=%d)", errno);
-                    } else {
-                        ERROR("Event reader: event was not correct byte size, discarding");
-                    }
-                    close(client_fd);
-                }
-            }
-            if ( ! is_accepting ) break;
-        }
-        shutdown(server_fd, SHUT_RDWR);
-        close(server_fd);
+        /* Returns false only if the socket could not be created or failed: */
+        if ( ! event_reader_run(CONTEXT->reader) ) sleep(5);
     }
     INFO("Event reader: exiting runloop");
     return NULL;
@@ -300,68 +426,169 @@ config_read_yaml_file(
                                 }
                                 socket_filepath = s;
                             }
+                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "socket-type")) ) {
+                                const char  *s = yaml_helper_get_scalar_value(pam_node);
+                                
+                                if ( ! s ) {
+                                    ERROR("Configuration: invalid socket-type value");
+                                    rc = false;
+                                    break;
+                                }
+                                socket_type_str = s;
+                            }
+                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "reader-backend")) ) {
+                                const char  *s = yaml_helper_get_scalar_value(pam_node);
+                                
+                                if ( ! s ) {
+                                    ERROR("Configuration: invalid reader-backend value");
+                                    rc = false;
+                                    break;
+                                }
+                                socket_reader_backend_str = s;
+                            }
                             /*
-                             * Check for any log-pool config items:
+                             * Check for client connection limits:
                              */
-                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "log-pool.records")) ) {
+                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "acceptor-threads")) ) {
+                                if ( ! yaml_helper_get_scalar_uint32_value(pam_node, &socket_acceptor_threads) ) {
+                                    ERROR("Configuration: invalid acceptor-threads value");
+                                    rc = false;
+                                    break;
+                                }
+                            }
+                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "max-connections")) ) {
+                                if ( ! yaml_helper_get_scalar_uint32_value(pam_node, &socket_max_connections) ) {
+                                    ERROR("Configuration: invalid max-connections value");
+                                    rc = false;
+                                    break;
+                                }
+                            }
+                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "connection-timeout-ms")) ) {
+                                if ( ! yaml_helper_get_scalar_int_value(pam_node, &socket_connection_timeout_ms) ) {
+                                    ERROR("Configuration: invalid connection-timeout-ms value");
+                                    rc = false;
+                                    break;
+                                }
+                            }
+                            /*
+                             * Check for any database batching config items:
+                             */
+                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "batch")) ) {
                                 yaml_node_t     *val_node;
                                 
-                                if ( (val_node = yaml_helper_doc_node_at_path(&config_doc, pam_node, "min")) ) {
-                                    if ( ! yaml_helper_get_scalar_uint32_value(val_node, &log_pool_records_min) ) {
-                                        ERROR("Configuration: invalid log-pool.records.min value");
+                                if ( (val_node = yaml_helper_doc_node_at_path(&config_doc, pam_node, "records")) ) {
+                                    if ( ! yaml_helper_get_scalar_uint32_value(val_node, &db_batch_records) ) {
+                                        ERROR("Configuration: invalid batch.records value");
                                         rc = false;
                                         break;
                                     }
                                 }
-                                if ( (val_node = yaml_helper_doc_node_at_path(&config_doc, pam_node, "max")) ) {
-                                    if ( ! yaml_helper_get_scalar_uint32_value(val_node, &log_pool_records_max) ) {
-                                        ERROR("Configuration: invalid log-pool.records.max value");
+                                if ( (val_node = yaml_helper_doc_node_at_path(&config_doc, pam_node, "linger-ms")) ) {
+                                    if ( ! yaml_helper_get_scalar_int_value(val_node, &db_batch_linger_ms) ) {
+                                        ERROR("Configuration: invalid batch.linger-ms value");
                                         rc = false;
                                         break;
                                     }
                                 }
-                                if ( (val_node = yaml_helper_doc_node_at_path(&config_doc, pam_node, "delta")) ) {
-                                    if ( ! yaml_helper_get_scalar_uint32_value(val_node, &log_pool_records_delta) ) {
-                                        ERROR("Configuration: invalid log-pool.records.delta value");
+                            }
+                            /*
+                             * Check for any spool config items:
+                             */
+                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "spool")) ) {
+                                yaml_node_t     *val_node;
+                                
+                                if ( (val_node = yaml_helper_doc_node_at_path(&config_doc, pam_node, "directory")) ) {
+                                    if ( ! (spool_directory = yaml_helper_get_scalar_value(val_node)) ) {
+                                        ERROR("Configuration: invalid spool.directory value");
+                                        rc = false;
+                                        break;
+                                    }
+                                }
+                                if ( (val_node = yaml_helper_doc_node_at_path(&config_doc, pam_node, "segment-records")) ) {
+                                    if ( ! yaml_helper_get_scalar_uint32_value(val_node, &spool_segment_records) ) {
+                                        ERROR("Configuration: invalid spool.segment-records value");
+                                        rc = false;
+                                        break;
+                                    }
+                                }
+                                if ( (val_node = yaml_helper_doc_node_at_path(&config_doc, pam_node, "max-segments")) ) {
+                                    if ( ! yaml_helper_get_scalar_uint32_value(val_node, &spool_max_segments) ) {
+                                        ERROR("Configuration: invalid spool.max-segments value");
                                         rc = false;
                                         break;
                                     }
                                 }
                             }
                             /*
-                             * Check for any wait time config items:
+                             * Check for the client drop directory:
                              */
-                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "log-pool.push-wait-seconds")) ) {
+                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "drop-directory")) ) {
+                                if ( ! (drop_directory = yaml_helper_get_scalar_value(pam_node)) ) {
+                                    ERROR("Configuration: invalid drop-directory value");
+                                    rc = false;
+                                    break;
+                                }
+                            }
+                            /*
+                             * Check for any log-pool config items:
+                             */
+                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "log-pool.backend")) ) {
+                                const char  *s = yaml_helper_get_scalar_value(pam_node);
+                                
+                                if ( ! s ) {
+                                    ERROR("Configuration: invalid log-pool.backend value");
+                                    rc = false;
+                                    break;
+                                }
+                                log_pool_backend_str = s;
+                            }
+                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "log-pool.records")) ) {
                                 yaml_node_t     *val_node;
                                 
                                 if ( (val_node = yaml_helper_doc_node_at_path(&config_doc, pam_node, "min")) ) {
-                                    if ( ! yaml_helper_get_scalar_int_value(val_node, &log_pool_push_wait_seconds_min) ) {
-                                        ERROR("Configuration: invalid log-pool.push-wait-seconds.min value");
+                                    if ( ! yaml_helper_get_scalar_uint32_value(val_node, &log_pool_records_min) ) {
+                                        ERROR("Configuration: invalid log-pool.records.min value");
                                         rc = false;
                                         break;
                                     }
                                 }
                                 if ( (val_node = yaml_helper_doc_node_at_path(&config_doc, pam_node, "max")) ) {
-                                    if ( ! yaml_helper_get_scalar_int_value(val_node, &log_pool_push_wait_seconds_max) ) {
-                                        ERROR("Configuration: invalid log-pool.push-wait-seconds.max value");
+                                    if ( ! yaml_helper_get_scalar_uint32_value(val_node, &log_pool_records_max) ) {
+                                        ERROR("Configuration: invalid log-pool.records.max value");
                                         rc = false;
                                         break;
                                     }
                                 }
                                 if ( (val_node = yaml_helper_doc_node_at_path(&config_doc, pam_node, "delta")) ) {
-                                    if ( ! yaml_helper_get_scalar_int_value(val_node, &log_pool_push_wait_seconds_dt) ) {
-                                        ERROR("Configuration: invalid log-pool.push-wait-seconds.delta value");
+                                    if ( ! yaml_helper_get_scalar_uint32_value(val_node, &log_pool_records_delta) ) {
+                                        ERROR("Configuration: invalid log-pool.records.delta value");
                                         rc = false;
                                         break;
                                     }
                                 }
-                                if ( (val_node = yaml_helper_doc_node_at_path(&config_doc, pam_node, "grow-threshold")) ) {
-                                    if ( ! yaml_helper_get_scalar_int_value(val_node, &log_pool_push_wait_seconds_dt_thresh) ) {
-                                        ERROR("Configuration: invalid log-pool.push-wait-seconds.grow-threshold value");
-                                        rc = false;
-                                        break;
-                                    }
+                            }
+                            /*
+                             * Check for any full-queue config items:
+                             */
+                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "log-pool.overflow-policy")) ) {
+                                const char  *s = yaml_helper_get_scalar_value(pam_node);
+                                
+                                if ( ! s ) {
+                                    ERROR("Configuration: invalid log-pool.overflow-policy value");
+                                    rc = false;
+                                    break;
                                 }
+                                log_pool_overflow_policy_str = s;
+                            }
+                            if ( (pam_node = yaml_helper_doc_node_at_path(&config_doc, node, "log-pool.push-wait-milliseconds")) ) {
+                                if ( ! yaml_helper_get_scalar_int_value(pam_node, &log_pool_push_wait_ms) ) {
+                                    ERROR("Configuration: invalid log-pool.push-wait-milliseconds value");
+                                    rc = false;
+                                    break;
+                                }
+                            }
+                            if ( yaml_helper_doc_node_at_path(&config_doc, node, "log-pool.push-wait-seconds") ) {
+                                WARN("Configuration: log-pool.push-wait-seconds is deprecated and ignored, see log-pool.push-wait-milliseconds");
                             }
                         }
                         break;
@@ -406,15 +633,89 @@ config_validate(
         return false;
     }
     
+    /* Ensure the queue backend is known: */
+    if ( (log_pool_backend = log_queue_backend_parse_str(log_pool_backend_str)) == log_queue_backend_max ) {
+        ERROR("Configuration: invalid log-pool.backend '%s'", log_pool_backend_str);
+        return false;
+    }
+    
     /* Ensure record count min ≤ max: */
     if ( (log_pool_records_max != 0) && (log_pool_records_min > log_pool_records_max) ) {
         ERROR("Configuration: log-pool.records.min > log-pool.records.max");
         return false;
     }
     
-    /* Ensure record push wait min ≤ max: */
-    if ( (log_pool_push_wait_seconds_max != 0) && (log_pool_push_wait_seconds_min > log_pool_push_wait_seconds_max) ) {
-        ERROR("Configuration: log-pool.push-wait-seconds.min > log-pool.push-wait-seconds.max");
+    /* Ensure the push wait is sane: */
+    if ( log_pool_push_wait_ms < 0 ) {
+        ERROR("Configuration: log-pool.push-wait-milliseconds cannot be negative");
+        return false;
+    }
+    
+    /* Ensure the socket type is known: */
+    if ( (socket_type = socket_type_parse_str(socket_type_str)) == socket_type_max ) {
+        ERROR("Configuration: invalid socket-type '%s'", socket_type_str);
+        return false;
+    }
+    
+    /* Ensure the reader backend is known and was built in: */
+    if ( (socket_reader_backend = event_reader_backend_parse_str(socket_reader_backend_str)) == event_reader_backend_max ) {
+        ERROR("Configuration: invalid reader-backend '%s'", socket_reader_backend_str);
+        return false;
+    }
+#ifndef HAVE_LIBURING
+    if ( socket_reader_backend == event_reader_backend_io_uring ) {
+        ERROR("Configuration: reader-backend io_uring requires a build with ENABLE_IO_URING_READER");
+        return false;
+    }
+#endif
+    
+    /* Ensure client connection limits are sane: */
+    if ( socket_acceptor_threads == 0 ) {
+        ERROR("Configuration: acceptor-threads must be at least 1");
+        return false;
+    }
+    if ( socket_max_connections < socket_acceptor_threads ) {
+        ERROR("Configuration: max-connections must be at least acceptor-threads");
+        return false;
+    }
+    if ( socket_max_connections == 0 ) {
+        ERROR("Configuration: max-connections must be at least 1");
+        return false;
+    }
+    if ( socket_connection_timeout_ms <= 0 ) {
+        ERROR("Configuration: connection-timeout-ms must be positive");
+        return false;
+    }
+    
+    /* Ensure batch parameters are sane: */
+    if ( db_batch_records == 0 ) {
+        ERROR("Configuration: batch.records must be at least 1");
+        return false;
+    }
+    if ( db_batch_linger_ms < 0 ) {
+        ERROR("Configuration: batch.linger-ms cannot be negative");
+        return false;
+    }
+    
+    /* Ensure spool parameters are sane: */
+    if ( spool_directory && ! *spool_directory ) spool_directory = NULL;
+    if ( spool_segment_records == 0 ) {
+        ERROR("Configuration: spool.segment-records must be at least 1");
+        return false;
+    }
+    
+    if ( drop_directory && ! *drop_directory ) drop_directory = NULL;
+    
+    /* Ensure the overflow policy is known; absent one, overflow goes to the spool if there is one: */
+    if ( ! log_pool_overflow_policy_str ) {
+        log_pool_overflow_policy_str = spool_directory ? "spill-to-disk" : LOG_POOL_DEFAULT_OVERFLOW_POLICY;
+    }
+    if ( (log_pool_overflow_policy = log_queue_overflow_policy_parse_str(log_pool_overflow_policy_str)) == log_queue_overflow_policy_max ) {
+        ERROR("Configuration: invalid log-pool.overflow-policy '%s'", log_pool_overflow_policy_str);
+        return false;
+    }
+    if ( (log_pool_overflow_policy == log_queue_overflow_policy_spill_to_disk) && ! spool_directory ) {
+        ERROR("Configuration: log-pool.overflow-policy spill-to-disk requires spool.directory");
         return false;
     }
     
@@ -429,17 +730,30 @@ config_validate(
     }
     
     INFO("                                socket-file = %s", socket_filepath);
+    INFO("                                socket-type = %s", socket_type_to_str(socket_type));
+    INFO("                             reader-backend = %s", event_reader_backend_to_str(socket_reader_backend));
     INFO("                                    backlog = %d", socket_backlog);
     INFO("                           polling-interval = %d", socket_poll_interval);
+    INFO("                           acceptor-threads = %lu", socket_acceptor_threads);
+    INFO("                            max-connections = %lu", socket_max_connections);
+    INFO("                      connection-timeout-ms = %dms", socket_connection_timeout_ms);
     
+    INFO("                              batch.records = %lu", db_batch_records);
+    INFO("                            batch.linger-ms = %dms", db_batch_linger_ms);
+    
+    INFO("                            spool.directory = %s", spool_directory ? spool_directory : "<disabled>");
+    INFO("                      spool.segment-records = %lu", spool_segment_records);
+    INFO("                         spool.max-segments = %lu", spool_max_segments);
+    
+    INFO("                             drop-directory = %s", drop_directory ? drop_directory : "<disabled>");
+    
+    INFO("                           log-pool.backend = %s", log_queue_backend_to_str(log_pool_backend));
     INFO("                       log-pool.records.min = %lu", log_pool_records_min);
     INFO("                       log-pool.records.max = %lu", log_pool_records_max);
     INFO("                     log-pool.records.delta = %lu", log_pool_records_delta);
     
-    INFO("             log-pool.push-wait-seconds.min = %lus", log_pool_push_wait_seconds_min);
-    INFO("             log-pool.push-wait-seconds.max = %lus", log_pool_push_wait_seconds_max);
-    INFO("           log-pool.push-wait-seconds.delta = %lus", log_pool_push_wait_seconds_dt);
-    INFO("  log-pool.push-wait-seconds.grow-threshold = %lu", log_pool_push_wait_seconds_dt_thresh);
+    INFO("                   log-pool.overflow-policy = %s", log_queue_overflow_policy_to_str(log_pool_overflow_policy));
+    INFO("            log-pool.push-wait-milliseconds = %dms", log_pool_push_wait_ms);
     
     db_summarize_to_log(event_db);
     
@@ -519,6 +833,7 @@ shutdown_thread_entry(
     pthread_cond_wait(&shutdown_cond, &shutdown_mutex);
     INFO("Shutdown: ...received signal.");
     is_running = false;
+    event_reader_stop(CONTEXT->reader);
     log_queue_interrupt_pop(&CONTEXT->lq);
     pthread_mutex_unlock(&shutdown_mutex);
     return NULL;
@@ -550,6 +865,7 @@ main(
     const char          *config_filepath = configuration_filepath_default;
     struct sigaction    signal_spec;
     log_queue_params_t  lq_params;
+    event_reader_params_t   er_params;
     
     /* Block all "other" permissions: */
     umask(007);
@@ -613,14 +929,38 @@ main(
     if ( ! config_validate(tc.db) ) exit(EINVAL);
     
     /* Initialize the log queue parameters: */
+    lq_params.backend = log_pool_backend;
     lq_params.records.min = log_pool_records_min;
     lq_params.records.max = log_pool_records_max;
     lq_params.records.delta = log_pool_records_delta;
     
-    lq_params.push_wait_seconds.min = log_pool_push_wait_seconds_min;
-    lq_params.push_wait_seconds.max = log_pool_push_wait_seconds_max;
-    lq_params.push_wait_seconds.delta = log_pool_push_wait_seconds_dt;
-    lq_params.push_wait_seconds.grow_threshold = log_pool_push_wait_seconds_dt_thresh;
+    lq_params.push_wait_ms = log_pool_push_wait_ms;
+    lq_params.overflow_policy = log_pool_overflow_policy;
+    lq_params.spill = event_spill;
+    lq_params.spill_context = &tc;
+    
+    /* Open the spool (recovering anything left by a previous run): */
+    tc.spool = NULL;
+    if ( spool_directory && ! (tc.spool = log_spool_open(spool_directory, spool_segment_records, spool_max_segments)) ) {
+        ERROR("Unable to open spool directory %s", spool_directory);
+        exit(EINVAL);
+    }
+    
+    /* Create the event reader: */
+    er_params.socket_filepath = socket_filepath;
+    er_params.backend = socket_reader_backend;
+    er_params.socket_type = socket_type;
+    er_params.backlog = socket_backlog;
+    er_params.poll_interval = socket_poll_interval;
+    er_params.n_acceptors = socket_acceptor_threads;
+    er_params.max_connections = socket_max_connections;
+    er_params.connection_timeout_ms = socket_connection_timeout_ms;
+    er_params.callback = event_enqueue;
+    er_params.callback_context = &tc;
+    if ( (tc.reader = event_reader_create(&er_params)) == NULL ) {
+        ERROR("Unable to create event reader");
+        exit(ENOMEM);
+    }
     
     /* Create the log queue: */
     if ( (tc.lq = log_queue_create(&lq_params)) == NULL ) {
@@ -648,6 +988,34 @@ main(
         pthread_join(event_thread, NULL);
         pthread_join(shutdown_thread, NULL);
         
+        /* Anything the database thread did not get to is kept for the next run: */
+        if ( tc.spool ) {
+            log_data_t  data_buffer;
+            uint64_t    n_spooled = 0;
+            
+            while ( log_queue_try_pop_batch(&tc.lq, &data_buffer, 1) ) {
+                if ( log_spool_push(tc.spool, &data_buffer, false) != log_spool_push_ok ) {
+                    ERROR("Unable to spool queued event at shutdown");
+                    break;
+                }
+                n_spooled++;
+            }
+            if ( n_spooled ) INFO("Spooled %llu queued events at shutdown", (unsigned long long)n_spooled);
+        }
+        
+        /* Report on any events the overflow policy had to act on: */
+        {
+            log_queue_overflow_counts_t overflow_counts;
+            
+            log_queue_get_overflow_counts(&tc.lq, &overflow_counts);
+            if ( overflow_counts.n_dropped_newest || overflow_counts.n_dropped_oldest || overflow_counts.n_spilled ) {
+                INFO("Queue overflow: %llu newest dropped, %llu oldest dropped, %llu spilled to disk",
+                        (unsigned long long)overflow_counts.n_dropped_newest,
+                        (unsigned long long)overflow_counts.n_dropped_oldest,
+                        (unsigned long long)overflow_counts.n_spilled);
+            }
+        }
+        
         if ( unlink(socket_filepath) < 0 ) {
             ERROR("Failed to remove socket file %s (errno=%d)", socket_filepath, errno);
         } else {
@@ -656,6 +1024,8 @@ main(
     }
     db_dealloc(tc.db);
     log_queue_destroy(&tc.lq);
+    log_spool_close(&tc.spool);
+    event_reader_destroy(&tc.reader);
     DEBUG("Terminating.");
     
     return 0;
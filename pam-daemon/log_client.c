@@ -0,0 +1,310 @@
+/*
+ * iptracking
+ * log_client.c
+ *
+ * Client side of the daemon's socket:  build an event from PAM
+ * connection information and deliver it.
+ *
+ */
+
+#include "log_client.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//
+
+/*
+ * Bounds (in milliseconds) on the wait between connection attempts;
+ * the wait starts at the minimum and doubles after each failure:
+ */
+#define LOG_CLIENT_BACKOFF_MIN_MS       5
+#define LOG_CLIENT_BACKOFF_MAX_MS       250
+
+//
+
+int
+log_client_fill_event(
+    log_data_t  *data,
+    const char  *pam_type,
+    const char  *pam_user,
+    pid_t       sshd_pid,
+    const char  *ssh_connection,
+    const char  *rhost
+)
+{
+    struct timespec now;
+    const char      *uid;
+    size_t          uid_len;
+
+    /* NUL-out the entire data structure: */
+    memset(data, 0, sizeof(log_data_t));
+    data->version = LOG_DATA_VERSION;
+
+    /* Get the timestamp ready: */
+    clock_gettime(CLOCK_REALTIME, &now);
+    data->log_time_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    /* We must have gotten values for all fields: */
+    if ( !(pam_type && *pam_type) ) return 101;
+    data->event = log_event_parse_str(pam_type);
+
+    data->sshd_pid = sshd_pid;
+
+    /* If the user is empty just use a sentinel value: */
+    uid = (pam_user && *pam_user) ? pam_user : "<<EMPTY>>";
+    uid_len = strnlen(uid, sizeof(data->uid) - 1);
+    memcpy(data->uid, uid, uid_len);
+    data->uid_len = uid_len;
+
+    if ( !(ssh_connection && *ssh_connection) ) {
+        if ( !(rhost && *rhost) ) return 102;
+        if ( ! log_data_parse_addr(rhost, &data->src_family, data->src_addr) ) return 103;
+        /* No server address, but keep the family consistent: */
+        data->dst_family = data->src_family;
+        data->src_port = 0;
+    } else {
+        const char  *p;
+        char        addr_str[LOG_DATA_ADDR_STRLEN];
+        uint16_t    port_val = 0, prev_port_val = 0;
+        int         p_len;
+
+        /* Isolate the ssh connection string fields */
+
+        /* src_ipaddr */
+        while ( *ssh_connection && isspace(*ssh_connection) ) ssh_connection++;
+        p = ssh_connection, p_len = 0;
+        while ( *ssh_connection && ! isspace(*ssh_connection) ) ssh_connection++, p_len++;
+        if ( (p_len == 0) || (p_len >= sizeof(addr_str)) ) return 104;
+        memcpy(addr_str, p, p_len); addr_str[p_len] = '\0';
+        if ( ! log_data_parse_addr(addr_str, &data->src_family, data->src_addr) ) return 104;
+
+        /* src_port */
+        while ( *ssh_connection && isspace(*ssh_connection) ) ssh_connection++;
+        while ( *ssh_connection && isdigit(*ssh_connection) ) {
+            port_val = port_val * 10 + (*ssh_connection++ - '0');
+            if ( port_val < prev_port_val ) return 105;
+        }
+        if ( !(*ssh_connection) || ! isspace(*ssh_connection) ) return 106;
+        data->src_port = port_val;
+
+        /* dst_ipaddr */
+        while ( *ssh_connection && isspace(*ssh_connection) ) ssh_connection++;
+        p = ssh_connection, p_len = 0;
+        while ( *ssh_connection && ! isspace(*ssh_connection) ) ssh_connection++, p_len++;
+        if ( (p_len == 0) || (p_len >= sizeof(addr_str)) ) return 107;
+        memcpy(addr_str, p, p_len); addr_str[p_len] = '\0';
+        if ( ! log_data_parse_addr(addr_str, &data->dst_family, data->dst_addr) ) return 107;
+    }
+    return 0;
+}
+
+//
+
+typedef struct log_client {
+    struct sockaddr_un  server_addr;
+    socket_type_t       socket_type;
+    int                 timeout_ms;
+    int                 fd;
+} log_client_t;
+
+//
+
+static uint64_t
+__log_client_now_ms(void)
+{
+    struct timespec     now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//
+
+/*
+ * Milliseconds left before <deadline_ms> (zero if it has passed), or
+ * -1 if there is no deadline.
+ */
+static int
+__log_client_remaining_ms(
+    uint64_t    deadline_ms
+)
+{
+    uint64_t    now;
+
+    if ( deadline_ms == 0 ) return -1;
+    now = __log_client_now_ms();
+    return (now < deadline_ms) ? (int)(deadline_ms - now) : 0;
+}
+
+//
+
+static void
+__log_client_close(
+    log_client_t    *client
+)
+{
+    if ( client->fd >= 0 ) close(client->fd);
+    client->fd = -1;
+}
+
+//
+
+log_client_ref
+log_client_create(
+    const char      *socket_filepath,
+    socket_type_t   socket_type,
+    int             timeout_ms
+)
+{
+    log_client_t    *new_client;
+
+    if ( ! socket_filepath || (strlen(socket_filepath) >= sizeof(new_client->server_addr.sun_path)) ) return NULL;
+    if ( (socket_type < 0) || (socket_type >= socket_type_max) ) return NULL;
+    if ( ! (new_client = (log_client_t*)calloc(1, sizeof(log_client_t))) ) return NULL;
+
+    new_client->server_addr.sun_family = AF_UNIX;
+    strncpy(new_client->server_addr.sun_path, socket_filepath, sizeof(new_client->server_addr.sun_path));
+    new_client->socket_type = socket_type;
+    new_client->timeout_ms = timeout_ms;
+    new_client->fd = -1;
+    return new_client;
+}
+
+//
+
+void
+log_client_destroy(
+    log_client_ref  *client
+)
+{
+    if ( client && *client ) {
+        __log_client_close(*client);
+        free((void*)*client);
+        *client = NULL;
+    }
+}
+
+//
+
+/*
+ * Open a nonblocking socket connected to the daemon.  A Unix socket
+ * connects at once or not at all, so there is nothing to poll() for:
+ * a full listen backlog (EAGAIN), a missing socket file (ENOENT), or
+ * no one listening (ECONNREFUSED, e.g. the daemon is restarting) are
+ * retried with exponential backoff until the deadline.  Without a
+ * deadline only the full backlog is waited out.
+ */
+static int
+__log_client_connect(
+    log_client_t    *client,
+    uint64_t        deadline_ms
+)
+{
+    int             backoff_ms = LOG_CLIENT_BACKOFF_MIN_MS;
+
+    if ( (client->fd = socket(AF_UNIX, socket_type_to_sock(client->socket_type) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ) return errno;
+    while ( connect(client->fd, (struct sockaddr*)&client->server_addr, sizeof(client->server_addr)) < 0 ) {
+        int         rc = errno, remaining_ms;
+
+        switch ( rc ) {
+            case EINTR:
+                break;
+            case ENOENT:
+            case ECONNREFUSED:
+                if ( deadline_ms == 0 ) {
+                    __log_client_close(client);
+                    return rc;
+                }
+                /* fall through */
+            case EAGAIN:
+                if ( (remaining_ms = __log_client_remaining_ms(deadline_ms)) == 0 ) {
+                    __log_client_close(client);
+                    return (rc == EAGAIN) ? ETIMEDOUT : rc;
+                }
+                if ( (remaining_ms < 0) || (remaining_ms > backoff_ms) ) remaining_ms = backoff_ms;
+                poll(NULL, 0, remaining_ms);
+                if ( (backoff_ms *= 2) > LOG_CLIENT_BACKOFF_MAX_MS ) backoff_ms = LOG_CLIENT_BACKOFF_MAX_MS;
+                break;
+            default:
+                __log_client_close(client);
+                return rc;
+        }
+    }
+    return 0;
+}
+
+//
+
+/*
+ * Write the whole event to the connected socket, waiting for room as
+ * necessary.
+ */
+static int
+__log_client_write(
+    log_client_t    *client,
+    const char      *p,
+    size_t          p_len,
+    uint64_t        deadline_ms
+)
+{
+    while ( p_len > 0 ) {
+        ssize_t         nbytes = send(client->fd, p, p_len, MSG_NOSIGNAL);
+
+        if ( nbytes >= 0 ) {
+            p += nbytes, p_len -= nbytes;
+        } else {
+            struct pollfd   pfd = { .fd = client->fd, .events = POLLOUT };
+            int             remaining_ms;
+
+            switch ( errno ) {
+                case EINTR:
+                    break;
+                case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                case ENOBUFS:
+                    if ( (remaining_ms = __log_client_remaining_ms(deadline_ms)) == 0 ) return ETIMEDOUT;
+                    if ( (poll(&pfd, 1, remaining_ms) < 0) && (errno != EINTR) ) return errno;
+                    break;
+                default:
+                    return errno;
+            }
+        }
+    }
+    return 0;
+}
+
+//
+
+int
+log_client_send(
+    log_client_ref      client,
+    const log_data_t    *data
+)
+{
+    uint64_t            deadline_ms = (client->timeout_ms > 0) ? __log_client_now_ms() + client->timeout_ms : 0;
+    int                 rc = 0, n_attempts = 2;
+
+    while ( n_attempts-- > 0 ) {
+        if ( (client->fd < 0) && (rc = __log_client_connect(client, deadline_ms)) ) return rc;
+        rc = __log_client_write(client, (const char*)data, sizeof(log_data_t), deadline_ms);
+
+        /* A datagram socket stays connected for the next event: */
+        if ( (rc == 0) && (client->socket_type == socket_type_dgram) ) return 0;
+        __log_client_close(client);
+        switch ( rc ) {
+            case ECONNREFUSED:
+            case ECONNRESET:
+            case ENOTCONN:
+            case EPIPE:
+                /* The daemon went away (or restarted) under us; try a fresh connection once: */
+                break;
+            default:
+                return rc;
+        }
+    }
+    return rc;
+}
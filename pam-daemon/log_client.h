@@ -0,0 +1,92 @@
+/*
+ * iptracking
+ * log_client.h
+ *
+ * Client side of the daemon's socket:  build an event from PAM
+ * connection information and deliver it.
+ *
+ */
+
+#ifndef __LOG_CLIENT_H__
+#define __LOG_CLIENT_H__
+
+#include "iptracking.h"
+#include "log_data.h"
+#include "socket_type.h"
+
+/*!
+ * @function log_client_fill_event
+ *
+ * Fill-in <data> for a PAM event of type <pam_type> (e.g. "auth") by
+ * user <pam_user> in sshd process <sshd_pid>.  The client and server
+ * addresses come from <ssh_connection> (the value sshd gives the
+ * SSH_CONNECTION variable) if it is present, otherwise the client
+ * address alone comes from <rhost> (the PAM_RHOST item).  Addresses
+ * may be IPv4 or IPv6.  The timestamp is the current time.
+ *
+ * Returns zero if successful, otherwise a nonzero code identifying
+ * the input at fault (the PAM callback uses these as its exit status):
+ *
+ *     101     no <pam_type>
+ *     102     neither <ssh_connection> nor <rhost>
+ *     103     <rhost> is not a numeric address
+ *     104     bad client address in <ssh_connection>
+ *     105     bad client port in <ssh_connection>
+ *     106     nothing follows the client port in <ssh_connection>
+ *     107     bad server address in <ssh_connection>
+ */
+int log_client_fill_event(log_data_t *data, const char *pam_type, const char *pam_user,
+                    pid_t sshd_pid, const char *ssh_connection, const char *rhost);
+
+/*!
+ * @typedef log_client_ref
+ *
+ * Opaque pointer to a log_client data structure.  All fields are
+ * internal to the implementation of this API and not visible
+ * directly to external code.
+ *
+ * A client holds a nonblocking socket to the daemon.  With a datagram
+ * socket the (connected) socket is kept open between events, so a
+ * long-lived caller pays for socket() and connect() once; the
+ * connection-oriented types still need a connection per event, since
+ * the daemon closes each connection once its event has arrived.  No
+ * operation ever waits beyond the client's timeout, and SIGPIPE is
+ * never raised.
+ */
+typedef struct log_client * log_client_ref;
+
+/*!
+ * @function log_client_create
+ *
+ * Create a client that delivers events to the daemon listening on a
+ * <socket_type> socket at <socket_filepath>, spending no more than
+ * <timeout_ms> milliseconds on any one event.  No socket is opened
+ * until the first event is sent.
+ *
+ * Returns NULL if any error occurs, a log_client_ref if successful.
+ */
+log_client_ref log_client_create(const char *socket_filepath, socket_type_t socket_type, int timeout_ms);
+
+/*!
+ * @function log_client_destroy
+ *
+ * Close any socket held by *<client> and dispose of it.
+ */
+void log_client_destroy(log_client_ref *client);
+
+/*!
+ * @function log_client_send
+ *
+ * Deliver the event in <data> to the daemon.
+ *
+ * While the daemon is unreachable (no socket file, or no one listening
+ * on it) connection attempts are retried with exponential backoff
+ * until the timeout expires; the caller can then fall back to a drop
+ * directory (see log_drop.h).
+ *
+ * Returns zero if successful, otherwise an errno value describing
+ * the failure (ETIMEDOUT if the timeout expired).
+ */
+int log_client_send(log_client_ref client, const log_data_t *data);
+
+#endif /* __LOG_CLIENT_H__ */
@@ -0,0 +1,187 @@
+/*
+ * iptracking
+ * log_drop.c
+ *
+ * Fallback drop directory for events the daemon could not be reached
+ * to receive.
+ *
+ */
+
+#include "log_drop.h"
+
+#include <dirent.h>
+
+//
+
+#define LOG_DROP_FILE_PREFIX        "event-"
+#define LOG_DROP_TEMP_PREFIX        ".event-"
+
+//
+
+int
+log_drop_write(
+    const char          *directory,
+    const log_data_t    *data
+)
+{
+    struct timespec     now;
+    char                *temp_path = NULL, *final_path = NULL;
+    const char          *p = (const char*)data;
+    size_t              p_len = sizeof(log_data_t);
+    int                 fd, rc = 0;
+
+    if ( asprintf(&temp_path, "%s/" LOG_DROP_TEMP_PREFIX "XXXXXX", directory) < 0 ) return ENOMEM;
+    if ( (fd = mkstemp(temp_path)) < 0 ) {
+        rc = errno;
+        free((void*)temp_path);
+        return rc;
+    }
+    while ( p_len > 0 ) {
+        ssize_t         nbytes = write(fd, p, p_len);
+
+        if ( nbytes < 0 ) {
+            if ( errno == EINTR ) continue;
+            rc = errno;
+            break;
+        }
+        p += nbytes, p_len -= nbytes;
+    }
+    if ( close(fd) && ! rc ) rc = errno;
+
+    /* Realtime nanoseconds lead the name so the files sort by age; the
+     * mkstemp() suffix keeps concurrent writers apart: */
+    if ( ! rc ) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        if ( asprintf(&final_path, "%s/" LOG_DROP_FILE_PREFIX "%020llu-%s", directory,
+                    (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec,
+                    temp_path + strlen(temp_path) - 6) < 0 ) {
+            final_path = NULL;
+            rc = ENOMEM;
+        } else if ( rename(temp_path, final_path) < 0 ) {
+            rc = errno;
+        }
+    }
+    if ( rc ) unlink(temp_path);
+    free((void*)temp_path);
+    if ( final_path ) free((void*)final_path);
+    return rc;
+}
+
+//
+
+static int
+__log_drop_name_cmp(
+    const void  *a,
+    const void  *b
+)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+//
+
+static void
+__log_drop_ingest_file(
+    int                 dir_fd,
+    const char          *name,
+    log_drop_callback   callback,
+    void                *context,
+    log_drop_counts_t   *counts
+)
+{
+    log_data_t          data;
+    size_t              nbytes = 0;
+    bool                is_deferred = false;
+    int                 fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+
+    if ( fd < 0 ) {
+        counts->n_failed++;
+        return;
+    }
+    while ( true ) {
+        ssize_t         n = read(fd, (char*)&data + nbytes, sizeof(log_data_t) - nbytes);
+
+        if ( n < 0 ) {
+            if ( errno == EINTR ) continue;
+            counts->n_failed++;
+            break;
+        }
+        if ( n == 0 ) break;
+        if ( (nbytes += n) == sizeof(log_data_t) ) {
+            switch ( callback(context, &data) ) {
+                case log_drop_accepted:
+                    counts->n_events++;
+                    break;
+                case log_drop_rejected:
+                    counts->n_rejected++;
+                    break;
+                case log_drop_deferred:
+                    is_deferred = true;
+                    break;
+            }
+            nbytes = 0;
+            if ( is_deferred ) break;
+        }
+    }
+    close(fd);
+    if ( is_deferred ) {
+        /* Leave the file for the next ingest: */
+        counts->n_deferred++;
+        return;
+    }
+    if ( nbytes ) counts->n_invalid++;
+    if ( unlinkat(dir_fd, name, 0) < 0 ) {
+        counts->n_failed++;
+    } else {
+        counts->n_files++;
+    }
+}
+
+//
+
+int
+log_drop_ingest(
+    const char          *directory,
+    log_drop_callback   callback,
+    void                *context,
+    log_drop_counts_t   *counts
+)
+{
+    DIR                 *dir;
+    struct dirent       *entry;
+    char                **names = NULL;
+    size_t              n_names = 0, max_names = 0, i;
+    int                 rc = 0;
+
+    memset(counts, 0, sizeof(*counts));
+    if ( mkdir(directory, 0770) < 0 && (errno != EEXIST) ) return errno;
+    if ( ! (dir = opendir(directory)) ) return errno;
+
+    /* Gather the names first so they can be replayed in order: */
+    while ( (entry = readdir(dir)) ) {
+        if ( strncmp(entry->d_name, LOG_DROP_FILE_PREFIX, strlen(LOG_DROP_FILE_PREFIX)) ) continue;
+        if ( n_names == max_names ) {
+            char        **new_names = (char**)realloc(names, (max_names + 64) * sizeof(char*));
+
+            if ( ! new_names ) {
+                rc = ENOMEM;
+                break;
+            }
+            names = new_names;
+            max_names += 64;
+        }
+        if ( ! (names[n_names] = strdup(entry->d_name)) ) {
+            rc = ENOMEM;
+            break;
+        }
+        n_names++;
+    }
+    if ( ! rc ) {
+        qsort(names, n_names, sizeof(char*), __log_drop_name_cmp);
+        for ( i = 0; i < n_names; i++ ) __log_drop_ingest_file(dirfd(dir), names[i], callback, context, counts);
+    }
+    for ( i = 0; i < n_names; i++ ) free((void*)names[i]);
+    if ( names ) free((void*)names);
+    closedir(dir);
+    return rc;
+}
@@ -0,0 +1,99 @@
+/*
+ * iptracking
+ * log_drop.h
+ *
+ * Fallback drop directory for events the daemon could not be reached
+ * to receive.
+ *
+ */
+
+#ifndef __LOG_DROP_H__
+#define __LOG_DROP_H__
+
+#include "iptracking.h"
+#include "log_data.h"
+
+/*
+ * A drop directory holds one file per event, each containing the raw
+ * log_data_t record.  A file is written under a hidden temporary name
+ * and renamed into place once complete, so the daemon never sees a
+ * partial record; the final names sort in the order the events were
+ * dropped.
+ */
+
+/*!
+ * @function log_drop_write
+ *
+ * Add the event in <data> to the drop directory <directory>.
+ *
+ * Returns zero if successful, otherwise an errno value describing
+ * the failure.
+ */
+int log_drop_write(const char *directory, const log_data_t *data);
+
+/*!
+ * @enum log_drop_disposition
+ *
+ * What a log_drop_callback did with a record.
+ *
+ * @constant log_drop_accepted      the event has been persisted (e.g. logged
+ *                                  or spooled), so its file can be removed
+ * @constant log_drop_rejected      the record is not valid and its file can
+ *                                  be removed
+ * @constant log_drop_deferred      the event could not be persisted right now,
+ *                                  so its file is left for a later ingest
+ */
+typedef enum log_drop_disposition {
+    log_drop_accepted = 0,
+    log_drop_rejected,
+    log_drop_deferred
+} log_drop_disposition_t;
+
+/*!
+ * @typedef log_drop_callback
+ *
+ * Called by log_drop_ingest() for each complete record found;
+ * <context> is the pointer passed to log_drop_ingest().  The callback
+ * is responsible for validating the record.  A file is only removed
+ * once the callback has accepted (or rejected) its event, so the
+ * callback must not accept an event that is merely held in memory.
+ */
+typedef log_drop_disposition_t (*log_drop_callback)(void *context, log_data_t *data);
+
+/*!
+ * @typedef log_drop_counts_t
+ *
+ * Tallies of the work done by log_drop_ingest().
+ *
+ * @field n_files       number of files ingested (and removed)
+ * @field n_events      number of events accepted by the callback
+ * @field n_rejected    number of records the callback rejected
+ * @field n_deferred    number of files left in place because the callback
+ *                      deferred their event
+ * @field n_invalid     number of partial records discarded
+ * @field n_failed      number of files that could not be read or removed
+ */
+typedef struct {
+    uint64_t    n_files;
+    uint64_t    n_events;
+    uint64_t    n_rejected;
+    uint64_t    n_deferred;
+    uint64_t    n_invalid;
+    uint64_t    n_failed;
+} log_drop_counts_t;
+
+/*!
+ * @function log_drop_ingest
+ *
+ * Pass every event in the drop directory <directory> to <callback>,
+ * oldest first, removing each file once the callback has accepted or
+ * rejected its event; a file whose event was deferred is left for the
+ * next ingest.  The directory is created if it does not exist.  The
+ * outcome is tallied in *<counts>.
+ *
+ * Returns zero if successful, otherwise an errno value describing
+ * the failure.
+ */
+int log_drop_ingest(const char *directory, log_drop_callback callback, void *context, log_drop_counts_t *counts);
+
+#endif /* __LOG_DROP_H__ */
@@ -8,193 +8,279 @@
 
 #include "log_queue.h"
 
+#include <stdatomic.h>
+
 //
 
+/*
+ * The backend and overflow policy are configured as strings, so they are
+ * filled-in from LOG_POOL_BACKEND_DEFAULT and LOG_POOL_DEFAULT_OVERFLOW_POLICY
+ * by log_queue_create():
+ */
 static log_queue_params_t __log_queue_default_params = {
+        .backend = log_queue_backend_pool,
         .records = {
             .min = LOG_POOL_RECORDS_MIN,
             .max = LOG_POOL_RECORDS_MAX,
             .delta = LOG_POOL_RECORDS_DELTA
         },
-        .push_wait_seconds = {
-            .min = LOG_POOL_DEFAULT_PUSH_WAIT_SECONDS_MIN,
-            .max = LOG_POOL_DEFAULT_PUSH_WAIT_SECONDS_MAX,
-            .delta = LOG_POOL_DEFAULT_PUSH_WAIT_SECONDS_DT,
-            .grow_threshold = LOG_POOL_DEFAULT_PUSH_WAIT_SECONDS_DT_THRESH
-        }
+        .push_wait_ms = LOG_POOL_DEFAULT_PUSH_WAIT_MS,
+        .overflow_policy = log_queue_overflow_policy_block,
+        .spill = NULL,
+        .spill_context = NULL
     };
 
 //
 
-typedef struct log_record {
-    struct log_record   *link;  /* for linking in the avail vs. used queues */
-    log_data_t          data;
-} log_record_t;
+/*
+ * Size of a cache line; fields that are written by different threads
+ * are kept this far apart to avoid false sharing:
+ */
+#define LOG_QUEUE_CACHELINE_SIZE    64
 
 //
 
-static log_record_t*
-__log_record_create(
-    uint32_t    n_records
-)
-{
-    return (log_record_t*)calloc(n_records, sizeof(log_record_t));
-}
+typedef struct log_queue* (*log_queue_backend_create)(log_queue_params_t *params);
+typedef void (*log_queue_backend_destroy)(struct log_queue *lq);
+typedef void (*log_queue_backend_summary)(struct log_queue *lq);
+typedef bool (*log_queue_backend_try_push)(struct log_queue *lq, log_data_t *data);
+typedef bool (*log_queue_backend_has_space)(struct log_queue *lq);
+typedef bool (*log_queue_backend_discard_oldest)(struct log_queue *lq);
+typedef bool (*log_queue_backend_pop)(struct log_queue *lq, log_data_t *data);
+typedef size_t (*log_queue_backend_pop_batch)(struct log_queue *lq, log_data_t *out, size_t max, int timeout_ms);
+typedef size_t (*log_queue_backend_try_pop_batch)(struct log_queue *lq, log_data_t *out, size_t max);
+typedef void (*log_queue_backend_interrupt_pop)(struct log_queue *lq);
+
+typedef struct {
+    const char                      *backend_name;
+
+    log_queue_backend_create        create;
+    log_queue_backend_destroy       destroy;
+
+    log_queue_backend_summary       summary;
+
+    log_queue_backend_try_push      try_push;
+    log_queue_backend_has_space     has_space;
+    log_queue_backend_discard_oldest    discard_oldest;
+    log_queue_backend_pop           pop;
+    log_queue_backend_pop_batch     pop_batch;
+    log_queue_backend_try_pop_batch try_pop_batch;
+    log_queue_backend_interrupt_pop interrupt_pop;
+} log_queue_backend_callbacks_t;
 
 //
 
 typedef struct log_queue {
-    log_queue_params_t      params;
-    pthread_mutex_t         lock;
-    pthread_cond_t          data_ready;
-    
-    uint32_t                n_rec_free, n_rec_used;
-    log_record_t            *free_head, *used_head, *used_tail;
-    
-    uint32_t                n_rec_pools;
-    log_record_t*           rec_pools[];
+    log_queue_backend_callbacks_t   *backend_callbacks;
+    log_queue_params_t              params;
+    pthread_mutex_t                 lock;
+    pthread_cond_t                  data_ready;
+    pthread_cond_t                  space_available;
+    _Atomic int                     n_push_waiters;
+    unsigned int                    n_interrupts;   /* protected by lock */
+    unsigned int                    n_interrupts_seen;  /* protected by lock */
+    log_queue_overflow_counts_t     overflow_counts;    /* protected by lock */
 } log_queue_t;
-  
+
 //
 
 static log_queue_t*
-__log_queue_add_pool(
-    log_queue_t     *lq,
-    uint32_t        n_records
+__log_queue_alloc(
+    log_queue_backend_callbacks_t   *backend_callbacks,
+    log_queue_params_t              *params,
+    size_t                          actual_size
 )
 {
-    log_record_t        *next_pool = __log_record_create(n_records);
-    log_queue_t         *new_queue = NULL;
-    
-    if ( next_pool ) {
-        /* Grow the queue object: */
-        size_t          new_nbytes = sizeof(log_queue_t) + 
-                                        (1 + lq->n_rec_pools) * sizeof(log_record_t*);
-        new_queue = (log_queue_t*)realloc(lq, new_nbytes);
-        if ( new_queue ) {
-            /* Add the pool to the list */
-            new_queue->rec_pools[new_queue->n_rec_pools++] = next_pool;
-            
-            /* Adjust the free count: */
-            new_queue->n_rec_free += n_records;
-            
-            /* Add records from the pool to the free queue: */
-            while ( n_records-- ) {
-                next_pool->link = new_queue->free_head;
-                new_queue->free_head = next_pool;
-                next_pool++;
-            }
-        } else {
-            free((void*)next_pool);
-        }
+    log_queue_t         *new_lq = NULL;
+
+    /* Backends may align fields to cache lines, so align the whole object: */
+    if ( posix_memalign((void**)&new_lq, LOG_QUEUE_CACHELINE_SIZE, actual_size) == 0 ) {
+        pthread_condattr_t  cond_attr;
+
+        memset(new_lq, 0, actual_size);
+        new_lq->backend_callbacks = backend_callbacks;
+        new_lq->params = *params;
+        pthread_mutex_init(&new_lq->lock, NULL);
+
+        /* Timed waits are measured against the monotonic clock: */
+        pthread_condattr_init(&cond_attr);
+        pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&new_lq->data_ready, &cond_attr);
+        pthread_cond_init(&new_lq->space_available, &cond_attr);
+        pthread_condattr_destroy(&cond_attr);
+        atomic_init(&new_lq->n_push_waiters, 0);
     }
-    return new_queue;
+    return new_lq;
 }
 
 //
 
-static log_record_t*
-__log_queue_alloc_record(
-    log_queue_t     **lq,
-    bool            *at_limit
+static void
+__log_queue_dealloc(
+    log_queue_t     *lq
 )
 {
-    log_queue_t     *LQ = *lq;
-    log_record_t    *new_rec = NULL, *lrp;
-    
-    *at_limit = false;
-    if ( LQ->n_rec_free == 0 ) {
-        uint32_t    n_records;
-        
-        if ( LQ->n_rec_pools == 0 ) {
-            n_records = LQ->params.records.min;
-        } else {
-            n_records = (LQ->n_rec_free + LQ->n_rec_used);
-            if ( LQ->params.records.max ) {
-                n_records = LQ->params.records.max - n_records;
-            } else {
-                n_records = UINT32_MAX - n_records;
-            }
-            if ( n_records == 0 ) {
-                *at_limit = true;
-                return NULL;
-            }
-            if ( n_records > LQ->params.records.delta ) n_records = LQ->params.records.delta;
-        }
-        LQ = __log_queue_add_pool(LQ, n_records);
-        if ( ! LQ ) return NULL;
-        *lq = LQ;
-    }
-        
-    /* Remove from the free queue: */
-    new_rec = LQ->free_head;
-    LQ->free_head = new_rec->link;
-    LQ->n_rec_free--;
-    
-    /* Add at the tail end of the queue: */
-    new_rec->link = NULL;
-    if ( LQ->used_tail ) {
-        LQ->used_tail->link = new_rec;
-        LQ->used_tail = new_rec;
-    } else {
-        LQ->used_head = LQ->used_tail = new_rec;
+    pthread_mutex_destroy(&lq->lock);
+    pthread_cond_destroy(&lq->data_ready);
+    pthread_cond_destroy(&lq->space_available);
+    free((void*)lq);
+}
+
+//
+
+/*
+ * Fill-in *<deadline> with the monotonic time <timeout_ms> milliseconds
+ * from now, for use with pthread_cond_timedwait() on data_ready.
+ */
+static void
+__log_queue_deadline(
+    struct timespec *deadline,
+    int             timeout_ms
+)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if ( deadline->tv_nsec >= 1000000000L ) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
     }
-    LQ->n_rec_used++;
-    return new_rec;
 }
 
 //
 
-void
-static __log_queue_dealloc_record(
-    log_queue_t     **lq,
-    log_record_t    *old_rec
+/*
+ * Wake all threads waiting on data_ready and let any batched pop that
+ * is lingering for more records know it should return now.  A batched
+ * pop that is not yet waiting returns as soon as it would wait, so an
+ * interrupt is never lost between a caller's checks and its pop.
+ */
+static void
+__log_queue_interrupt_waiters(
+    log_queue_t     *lq
 )
 {
-    log_record_t    *last_rec = NULL, *cur_rec = (*lq)->used_head;
-    
-    /* Find the record in the used list: */
-    while ( cur_rec && (cur_rec != old_rec) ) {
-        last_rec = cur_rec;
-        cur_rec = cur_rec->link;
+    pthread_mutex_lock(&lq->lock);
+    lq->n_interrupts++;
+    pthread_cond_broadcast(&lq->data_ready);
+    pthread_mutex_unlock(&lq->lock);
+}
+
+//
+
+/*
+ * Wake any pushes waiting on space_available.  Backends call this after
+ * records have been freed; if <is_locked> the caller already holds the
+ * queue's lock.  The fence pairs with the one in __log_queue_wait_for_space()
+ * so that either the waiter sees the free record or we see the waiter.
+ */
+static void
+__log_queue_wake_pushers(
+    log_queue_t     *lq,
+    bool            is_locked
+)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if ( atomic_load_explicit(&lq->n_push_waiters, memory_order_relaxed) > 0 ) {
+        if ( ! is_locked ) pthread_mutex_lock(&lq->lock);
+        pthread_cond_broadcast(&lq->space_available);
+        if ( ! is_locked ) pthread_mutex_unlock(&lq->lock);
     }
-    if ( cur_rec ) {
-        /* We found it!  Remove from the used chain: */
-        if ( last_rec ) last_rec->link = cur_rec->link;
-        
-        /* Is this record the tail of the used queue? */
-        if ( cur_rec == (*lq)->used_tail ) (*lq)->used_tail = last_rec;
-        
-        /* Is this record the head of the used queue? */
-        if ( cur_rec == (*lq)->used_head ) (*lq)->used_head = cur_rec->link;
-        
-        /* Prepend to the free chain: */
-        cur_rec->link = (*lq)->free_head;
-        (*lq)->free_head = cur_rec;
-        (*lq)->n_rec_free++, (*lq)->n_rec_used--;
+}
+
+//
+
+/*
+ * Wait up to <timeout_ms> milliseconds for the backend to report that a
+ * record is free.  With <must_wait> the backend's report is not trusted
+ * until a record has been released (e.g. it claimed room to grow but
+ * could not allocate it).  Returns false if the time ran out first.  The
+ * backend's has_space callback is always invoked with the queue's lock
+ * held.
+ */
+static bool
+__log_queue_wait_for_space(
+    log_queue_t     *lq,
+    int             timeout_ms,
+    bool            must_wait
+)
+{
+    struct timespec deadline;
+    bool            rc = true;
+
+    if ( timeout_ms <= 0 ) return false;
+
+    pthread_mutex_lock(&lq->lock);
+    atomic_fetch_add_explicit(&lq->n_push_waiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if ( must_wait || ! lq->backend_callbacks->has_space(lq) ) {
+        __log_queue_deadline(&deadline, timeout_ms);
+        do {
+            rc = (pthread_cond_timedwait(&lq->space_available, &lq->lock, &deadline) != ETIMEDOUT);
+        } while ( rc && ! lq->backend_callbacks->has_space(lq) );
     }
+    atomic_fetch_sub_explicit(&lq->n_push_waiters, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&lq->lock);
+    return rc;
+}
+
+//
+
+/*
+ * Bump one of the overflow counters, logging the first event and then
+ * every thousandth so a flood does not also flood the log.
+ */
+static void
+__log_queue_count_overflow(
+    log_queue_t     *lq,
+    uint64_t        *counter,
+    const char      *what
+)
+{
+    uint64_t        n;
+
+    pthread_mutex_lock(&lq->lock);
+    n = ++(*counter);
+    pthread_mutex_unlock(&lq->lock);
+    if ( (n == 1) || (n % 1000 == 0) ) WARN("log_queue_push:  queue is full, %s (%llu so far)", what, (unsigned long long)n);
 }
 
 //
 
+#include "log_queue_backends/log_queue_pool.c"
+#include "log_queue_backends/log_queue_ring.c"
+
+static log_queue_backend_callbacks_t* __log_queue_backends[] = {
+        [log_queue_backend_pool] = &log_queue_backend_pool_callbacks,
+        [log_queue_backend_ring] = &log_queue_backend_ring_callbacks,
+        NULL
+    };
+
+//
+
 log_queue_ref
 log_queue_create(
     log_queue_params_t  *params
 )
 {
-    log_queue_t         *new_lq = (log_queue_t*)malloc(sizeof(log_queue_t));
-    
-    if ( new_lq ) {
-        memset(new_lq, 0, sizeof(log_queue_t));
-        if ( params ) {
-            new_lq->params = *params;
-        } else {
-            new_lq->params = __log_queue_default_params;
-        }
-        pthread_mutex_init(&new_lq->lock, NULL);
-        pthread_cond_init(&new_lq->data_ready, NULL);
+    log_queue_params_t  default_params;
+
+    if ( ! params ) {
+        default_params = __log_queue_default_params;
+        default_params.backend = log_queue_backend_parse_str(LOG_POOL_BACKEND_DEFAULT);
+        default_params.overflow_policy = log_queue_overflow_policy_parse_str(LOG_POOL_DEFAULT_OVERFLOW_POLICY);
+        params = &default_params;
     }
-    return new_lq;
+    if ( (params->overflow_policy < 0) || (params->overflow_policy >= log_queue_overflow_policy_max) ) {
+        ERROR("log_queue_create:  invalid overflow policy %d", params->overflow_policy);
+        return NULL;
+    }
+    if ( (params->backend < 0) || (params->backend >= log_queue_backend_max) ) {
+        ERROR("log_queue_create:  invalid backend %d", params->backend);
+        return NULL;
+    }
+    DEBUG("log_queue_create:  using %s backend", __log_queue_backends[params->backend]->backend_name);
+    return __log_queue_backends[params->backend]->create(params);
 }
 
 //
@@ -205,15 +291,7 @@ log_queue_destroy(
 )
 {
     if ( lq && *lq ) {
-        /* Destroy all pools: */
-        while ( (*lq)->n_rec_pools > 0 ) free((void*)((*lq)->rec_pools[--(*lq)->n_rec_pools]));
-        
-        /* Destroy the lock et al.: */
-        pthread_mutex_destroy(&(*lq)->lock);
-        pthread_cond_destroy(&(*lq)->data_ready);
-        
-        /* Destroy the queue: */
-        free((void*)*lq);
+        (*lq)->backend_callbacks->destroy(*lq);
         *lq = NULL;
     }
 }
@@ -225,32 +303,7 @@ log_queue_summary(
     log_queue_ref   *lq
 )
 {
-    log_record_t    *lrp;
-    
-    pthread_mutex_lock(&(*lq)->lock);
-    printf( "log_queue@%p {\n"
-            "    n_rec = %lu / (%lu ≤ %lu ≤ %lu)\n"
-            "    n_rec_pools = %lu\n"
-            "    records = {\n",
-            *lq,
-            (unsigned long)(*lq)->n_rec_used,
-            (unsigned long)(*lq)->params.records.min,
-            (unsigned long)((*lq)->n_rec_free + (*lq)->n_rec_used),
-            (unsigned long)(*lq)->params.records.max,
-            (unsigned long)(*lq)->n_rec_pools);
-    
-    lrp = (*lq)->used_head;
-    while ( lrp ) {
-        printf("        [%s] %-15s <= %15s:%hu (%s)\n",
-            lrp->data.log_date,
-            lrp->data.dst_ipaddr,
-            lrp->data.src_ipaddr,
-            lrp->data.src_port,
-            lrp->data.uid);
-        lrp = lrp->link;
-    }
-    printf("}\n");
-    pthread_mutex_unlock(&(*lq)->lock);
+    (*lq)->backend_callbacks->summary(*lq);
 }
 
 //
@@ -261,40 +314,59 @@ log_queue_push(
     log_data_t      *data
 )
 {
-    log_record_t    *new_record = NULL;
-    bool            rc = false, at_limit;
-    int             wait_sec = (*lq)->params.push_wait_seconds.min;
-    int             n_waits = 1;
-    
-    pthread_mutex_lock(&(*lq)->lock);
-    while ( ! rc ) {
-        new_record = __log_queue_alloc_record(lq, &at_limit);
-        if ( new_record ) {
-            memcpy(&new_record->data, data, sizeof(log_data_t));
-            rc = true;
-        } else if ( at_limit ) {
-            pthread_mutex_unlock(&(*lq)->lock);
-            WARN("log_queue_push:  max records allocated, waiting %d s for records to become free...", wait_sec);
-            sleep(wait_sec);
-            if ( n_waits >= (*lq)->params.push_wait_seconds.grow_threshold ) {
-                wait_sec += (*lq)->params.push_wait_seconds.delta;
-                if ( wait_sec > (*lq)->params.push_wait_seconds.max ) wait_sec = (*lq)->params.push_wait_seconds.max;
-                n_waits = 0;
-            } else {
-                n_waits++;
+    log_queue_t     *LQ = *lq;
+    bool            must_wait = false;
+
+    if ( LQ->backend_callbacks->try_push(LQ, data) ) return true;
+
+    /* The queue is full; give it push_wait_ms to make room before the policy kicks in: */
+    if ( LQ->params.overflow_policy != log_queue_overflow_policy_block ) {
+        if ( __log_queue_wait_for_space(LQ, LQ->params.push_wait_ms, false) && LQ->backend_callbacks->try_push(LQ, data) ) return true;
+    }
+    switch ( LQ->params.overflow_policy ) {
+        case log_queue_overflow_policy_drop_newest:
+            __log_queue_count_overflow(LQ, &LQ->overflow_counts.n_dropped_newest, "dropped newest event");
+            return false;
+
+        case log_queue_overflow_policy_drop_oldest:
+            while ( LQ->backend_callbacks->discard_oldest(LQ) ) {
+                __log_queue_count_overflow(LQ, &LQ->overflow_counts.n_dropped_oldest, "dropped oldest event");
+                if ( LQ->backend_callbacks->try_push(LQ, data) ) return true;
             }
-            pthread_mutex_lock(&(*lq)->lock);
-        } else {
             break;
-        }
+
+        case log_queue_overflow_policy_spill_to_disk:
+            if ( LQ->params.spill && LQ->params.spill(LQ->params.spill_context, data) ) {
+                __log_queue_count_overflow(LQ, &LQ->overflow_counts.n_spilled, "spilled event to disk");
+                return true;
+            }
+            WARN("log_queue_push:  unable to spill event to disk, blocking instead");
+            break;
+
+        default:
+            break;
     }
-    if ( rc ) {
-        /* Let anyone watching for data to become available wake up now... */
-        pthread_cond_broadcast(&(*lq)->data_ready);
+
+    /* Block until a record frees up, complaining every push_wait_ms.  A push
+     * that fails right after the backend reported space means it could not
+     * grow, so the next wait is for a record to be released: */
+    while ( ! LQ->backend_callbacks->try_push(LQ, data) ) {
+        if ( ! (must_wait = __log_queue_wait_for_space(LQ, (LQ->params.push_wait_ms > 0) ? LQ->params.push_wait_ms : 1000, must_wait)) ) {
+            WARN("log_queue_push:  queue is full, still waiting for a free record...");
+        }
     }
-    pthread_mutex_unlock(&(*lq)->lock);
-    
-    return rc;
+    return true;
+}
+
+//
+
+bool
+log_queue_try_push(
+    log_queue_ref   *lq,
+    log_data_t      *data
+)
+{
+    return (*lq)->backend_callbacks->try_push(*lq, data);
 }
 
 //
@@ -305,21 +377,48 @@ log_queue_pop(
     log_data_t      *data
 )
 {
-    bool            rc = false;
-    
+    return (*lq)->backend_callbacks->pop(*lq, data);
+}
+
+//
+
+size_t
+log_queue_pop_batch(
+    log_queue_ref   *lq,
+    log_data_t      *out,
+    size_t          max,
+    int             timeout_ms
+)
+{
+    if ( max == 0 ) return 0;
+    if ( timeout_ms < 0 ) timeout_ms = 0;
+    return (*lq)->backend_callbacks->pop_batch(*lq, out, max, timeout_ms);
+}
+
+//
+
+size_t
+log_queue_try_pop_batch(
+    log_queue_ref   *lq,
+    log_data_t      *out,
+    size_t          max
+)
+{
+    if ( max == 0 ) return 0;
+    return (*lq)->backend_callbacks->try_pop_batch(*lq, out, max);
+}
+
+//
+
+void
+log_queue_get_overflow_counts(
+    log_queue_ref               *lq,
+    log_queue_overflow_counts_t *counts
+)
+{
     pthread_mutex_lock(&(*lq)->lock);
-    if ( ! (*lq)->used_head ) {
-        INFO("log_queue_pop:  waiting on data...");
-        pthread_cond_wait(&(*lq)->data_ready, &(*lq)->lock);
-        INFO("log_queue_pop:  ...data is ready");
-    }
-    if ( (*lq)->used_head ) {
-        memcpy(data, &(*lq)->used_head->data, sizeof(log_data_t));
-        rc = true;
-        __log_queue_dealloc_record(lq, (*lq)->used_head);
-    }
+    *counts = (*lq)->overflow_counts;
     pthread_mutex_unlock(&(*lq)->lock);
-    return rc;
 }
 
 //
@@ -329,7 +428,5 @@ log_queue_interrupt_pop(
     log_queue_ref   *lq
 )
 {
-    pthread_mutex_lock(&(*lq)->lock);
-    pthread_cond_broadcast(&(*lq)->data_ready);
-    pthread_mutex_unlock(&(*lq)->lock);
+    (*lq)->backend_callbacks->interrupt_pop(*lq);
 }
@@ -13,24 +13,170 @@
 #include "log_data.h"
 #include "logging.h"
 
+/*!
+ * @enum log_queue_backend
+ *
+ * The implementations available to back a log queue.
+ *
+ * @constant log_queue_backend_pool     mutex-protected linked lists of records
+ *                                      drawn from a growable set of pools
+ * @constant log_queue_backend_ring     lock-free bounded ring of records with a
+ *                                      fixed, power-of-two capacity
+ */
+typedef enum log_queue_backend {
+    log_queue_backend_pool = 0,
+    log_queue_backend_ring,
+    log_queue_backend_max
+} log_queue_backend_t;
+
+/*!
+ * @function log_queue_backend_to_str
+ *
+ * Return a C string representation of the <backend> or NULL if the
+ * <backend> is not valid.
+ */
+static inline
+const char* log_queue_backend_to_str(
+    log_queue_backend_t backend
+)
+{
+    switch ( backend ) {
+        case log_queue_backend_pool: return "pool";
+        case log_queue_backend_ring: return "ring";
+        default: return NULL;
+    }
+    return NULL;
+}
+
+/*!
+ * @function log_queue_backend_parse_str
+ *
+ * Parse a C-string representation of a backend (in <backend_str>) and
+ * return the proper value from the log_queue_backend enumeration, or
+ * log_queue_backend_max otherwise.
+ */
+static inline
+log_queue_backend_t log_queue_backend_parse_str(
+    const char  *backend_str
+)
+{
+    if ( strcasecmp(backend_str, "pool") == 0 ) return log_queue_backend_pool;
+    if ( strcasecmp(backend_str, "ring") == 0 ) return log_queue_backend_ring;
+    return log_queue_backend_max;
+}
+
+/*!
+ * @enum log_queue_overflow_policy
+ *
+ * What log_queue_push() does when the queue is full.
+ *
+ * @constant log_queue_overflow_policy_block            wait until a record is
+ *                                                      freed by a consumer
+ * @constant log_queue_overflow_policy_drop_newest      discard the event being
+ *                                                      pushed
+ * @constant log_queue_overflow_policy_drop_oldest      discard the oldest event
+ *                                                      in the queue to make room
+ * @constant log_queue_overflow_policy_spill_to_disk    hand the event to the
+ *                                                      spill callback
+ */
+typedef enum log_queue_overflow_policy {
+    log_queue_overflow_policy_block = 0,
+    log_queue_overflow_policy_drop_newest,
+    log_queue_overflow_policy_drop_oldest,
+    log_queue_overflow_policy_spill_to_disk,
+    log_queue_overflow_policy_max
+} log_queue_overflow_policy_t;
+
+/*!
+ * @function log_queue_overflow_policy_to_str
+ *
+ * Return a C string representation of the <policy> or NULL if the
+ * <policy> is not valid.
+ */
+static inline
+const char* log_queue_overflow_policy_to_str(
+    log_queue_overflow_policy_t policy
+)
+{
+    switch ( policy ) {
+        case log_queue_overflow_policy_block: return "block";
+        case log_queue_overflow_policy_drop_newest: return "drop-newest";
+        case log_queue_overflow_policy_drop_oldest: return "drop-oldest";
+        case log_queue_overflow_policy_spill_to_disk: return "spill-to-disk";
+        default: return NULL;
+    }
+    return NULL;
+}
+
+/*!
+ * @function log_queue_overflow_policy_parse_str
+ *
+ * Parse a C-string representation of an overflow policy (in
+ * <policy_str>) and return the proper value from the
+ * log_queue_overflow_policy enumeration, or
+ * log_queue_overflow_policy_max otherwise.
+ */
+static inline
+log_queue_overflow_policy_t log_queue_overflow_policy_parse_str(
+    const char  *policy_str
+)
+{
+    if ( strcasecmp(policy_str, "block") == 0 ) return log_queue_overflow_policy_block;
+    if ( strcasecmp(policy_str, "drop-newest") == 0 ) return log_queue_overflow_policy_drop_newest;
+    if ( strcasecmp(policy_str, "drop-oldest") == 0 ) return log_queue_overflow_policy_drop_oldest;
+    if ( strcasecmp(policy_str, "spill-to-disk") == 0 ) return log_queue_overflow_policy_spill_to_disk;
+    return log_queue_overflow_policy_max;
+}
+
+/*!
+ * @typedef log_queue_spill_callback
+ *
+ * Called by log_queue_push() under the spill-to-disk overflow policy
+ * to persist *<data> elsewhere; <context> is the spill_context from
+ * the queue's parameters.  Returns true if the event was accepted.
+ */
+typedef bool (*log_queue_spill_callback)(void *context, log_data_t *data);
+
+/*!
+ * @typedef log_queue_overflow_counts_t
+ *
+ * Running totals of the events affected by the overflow policy.
+ *
+ * @field n_dropped_newest  events discarded under drop-newest
+ * @field n_dropped_oldest  events discarded under drop-oldest
+ * @field n_spilled         events handed to the spill callback
+ */
+typedef struct {
+    uint64_t            n_dropped_newest, n_dropped_oldest, n_spilled;
+} log_queue_overflow_counts_t;
+
 /*!
  * @typedef log_queue_params_t
  *
  * Data structure used to communicate event record behavioral
  * options to this API.
  *
+ * The ring backend has a fixed capacity:  records.max (or records.min
+ * if records.max is zero) rounded up to the next power of two.  The
+ * records.delta value is not used by the ring backend.
+ *
+ * @field backend           which implementation backs the queue
  * @field records           parameters controlling the number of event records
- * @field push_wait_seconds parameters controlling the time the API waits for
- *                          a record to be allocated
+ * @field push_wait_ms      milliseconds a push to a full queue waits for a free
+ *                          record before the overflow policy is applied
+ * @field overflow_policy   what to do with an event when the queue is full
+ * @field spill             callback used by the spill-to-disk overflow policy
+ * @field spill_context     opaque pointer passed to the spill callback
  */
 typedef struct {
+    log_queue_backend_t         backend;
     struct {
-        uint32_t        min, max, delta;
+        uint32_t                min, max, delta;
     } records;
-    struct {
-        int             min, max, delta;
-        int             grow_threshold;
-    } push_wait_seconds;
+    int                         push_wait_ms;
+    log_queue_overflow_policy_t overflow_policy;
+    log_queue_spill_callback    spill;
+    void                        *spill_context;
 } log_queue_params_t;
 
 /*!
@@ -75,14 +221,28 @@ void log_queue_summary(log_queue_ref *lq);
  * Attempt to copy the contents of *<data> to an event record in
  * *<lq>.  If no unused records are available and the limit has not
  * been reached, a new set of records will be allocated and the
- * data stored immediately.  Otherwise, this call will block
- * until an unused record becomes available.
+ * data stored immediately.
  *
- * Returns true if the data were successfully added to *<lq>,
- * false otherwise.
+ * Otherwise the queue is full:  under the block policy this call
+ * waits (without polling) until a consumer frees a record.  Under
+ * the other policies the call waits at most push_wait_ms for a
+ * record, then drops *<data> (drop-newest), drops the oldest queued
+ * event in its favor (drop-oldest), or hands it to the spill callback
+ * (spill-to-disk, which falls back to blocking if the spill fails).
+ *
+ * Returns true if the data were added to *<lq> or spilled, false
+ * if they were dropped or an error occurred.
  */
 bool log_queue_push(log_queue_ref *lq, log_data_t *data);
 
+/*!
+ * @function log_queue_try_push
+ *
+ * Like log_queue_push(), but never waits:  if no record can be
+ * allocated for *<data> immediately, false is returned.
+ */
+bool log_queue_try_push(log_queue_ref *lq, log_data_t *data);
+
 /*!
  * @function log_queue_pop
  *
@@ -95,11 +255,48 @@ bool log_queue_push(log_queue_ref *lq, log_data_t *data);
  */
 bool log_queue_pop(log_queue_ref *lq, log_data_t *data);
 
+/*!
+ * @function log_queue_pop_batch
+ *
+ * Attempt to copy the contents of up to <max> event records in *<lq>
+ * to the array <out>.  If no records are available this call will
+ * block until one has been added.  Once at least one record has been
+ * copied, if fewer than <max> were available the call lingers for up
+ * to <timeout_ms> milliseconds for more records to arrive; a
+ * <timeout_ms> of zero returns immediately with whatever was
+ * available.
+ *
+ * Records are copied to <out> in the order they were pushed.
+ *
+ * Returns the number of records copied to <out>, which is zero if
+ * the call was interrupted before any records were available.
+ */
+size_t log_queue_pop_batch(log_queue_ref *lq, log_data_t *out, size_t max, int timeout_ms);
+
+/*!
+ * @function log_queue_try_pop_batch
+ *
+ * Like log_queue_pop_batch(), but never waits:  copies whatever
+ * records (up to <max>) are available right now.
+ *
+ * Returns the number of records copied to <out>, possibly zero.
+ */
+size_t log_queue_try_pop_batch(log_queue_ref *lq, log_data_t *out, size_t max);
+
 /*!
  * @function log_queue_interrupt_pop
  *
- * Used to interrupt the log_queue_pop() function.
+ * Used to interrupt the log_queue_pop() and log_queue_pop_batch()
+ * functions.  If no log_queue_pop_batch() is waiting, the next one
+ * to wait returns immediately instead.
  */
 void log_queue_interrupt_pop(log_queue_ref *lq);
 
+/*!
+ * @function log_queue_get_overflow_counts
+ *
+ * Copy the running overflow-policy totals for *<lq> to *<counts>.
+ */
+void log_queue_get_overflow_counts(log_queue_ref *lq, log_queue_overflow_counts_t *counts);
+
 #endif /* __LOG_QUEUE_H__ */
@@ -0,0 +1,410 @@
+/*
+ * iptracking
+ * log_queue_pool.c
+ *
+ * Event-logging queue backend:  linked lists of records drawn
+ * from a growable set of pools, all protected by a single mutex.
+ *
+ */
+
+//
+
+typedef struct log_record {
+    struct log_record   *link;  /* for linking in the avail vs. used queues */
+    log_data_t          data;
+} log_record_t;
+
+//
+
+static log_record_t*
+__log_record_create(
+    uint32_t    n_records
+)
+{
+    return (log_record_t*)calloc(n_records, sizeof(log_record_t));
+}
+
+//
+
+typedef struct {
+    log_queue_t             base;
+    //
+    uint32_t                n_rec_free, n_rec_used;
+    log_record_t            *free_head, *used_head, *used_tail;
+    //
+    uint32_t                n_rec_pools;
+    log_record_t*           *rec_pools;
+} log_queue_pool_t;
+
+//
+
+static log_queue_t* __log_queue_pool_create(log_queue_params_t *params);
+static void __log_queue_pool_destroy(log_queue_t *lq);
+static void __log_queue_pool_summary(log_queue_t *lq);
+static bool __log_queue_pool_try_push(log_queue_t *lq, log_data_t *data);
+static bool __log_queue_pool_has_space(log_queue_t *lq);
+static bool __log_queue_pool_discard_oldest(log_queue_t *lq);
+static bool __log_queue_pool_pop(log_queue_t *lq, log_data_t *data);
+static size_t __log_queue_pool_pop_batch(log_queue_t *lq, log_data_t *out, size_t max, int timeout_ms);
+static size_t __log_queue_pool_try_pop_batch(log_queue_t *lq, log_data_t *out, size_t max);
+static void __log_queue_pool_interrupt_pop(log_queue_t *lq);
+
+//
+
+static log_queue_backend_callbacks_t    log_queue_backend_pool_callbacks = {
+        .backend_name = "pool",
+
+        .create = __log_queue_pool_create,
+        .destroy = __log_queue_pool_destroy,
+        .summary = __log_queue_pool_summary,
+        .try_push = __log_queue_pool_try_push,
+        .has_space = __log_queue_pool_has_space,
+        .discard_oldest = __log_queue_pool_discard_oldest,
+        .pop = __log_queue_pool_pop,
+        .pop_batch = __log_queue_pool_pop_batch,
+        .try_pop_batch = __log_queue_pool_try_pop_batch,
+        .interrupt_pop = __log_queue_pool_interrupt_pop
+    };
+
+//
+
+static bool
+__log_queue_pool_add_pool(
+    log_queue_pool_t    *lq,
+    uint32_t            n_records
+)
+{
+    log_record_t        *next_pool = __log_record_create(n_records);
+
+    if ( next_pool ) {
+        /* Grow the list of pools (never the queue object itself, since
+         * the lock and condition variable cannot move while in use): */
+        log_record_t*   *new_pools = (log_record_t**)realloc(lq->rec_pools,
+                                            (1 + lq->n_rec_pools) * sizeof(log_record_t*));
+        if ( new_pools ) {
+            /* Add the pool to the list */
+            lq->rec_pools = new_pools;
+            lq->rec_pools[lq->n_rec_pools++] = next_pool;
+
+            /* Adjust the free count: */
+            lq->n_rec_free += n_records;
+
+            /* Add records from the pool to the free queue: */
+            while ( n_records-- ) {
+                next_pool->link = lq->free_head;
+                lq->free_head = next_pool;
+                next_pool++;
+            }
+            return true;
+        }
+        free((void*)next_pool);
+    }
+    return false;
+}
+
+//
+
+static log_record_t*
+__log_queue_pool_alloc_record(
+    log_queue_pool_t    *lq,
+    bool                *at_limit
+)
+{
+    log_record_t        *new_rec = NULL;
+
+    *at_limit = false;
+    if ( lq->n_rec_free == 0 ) {
+        uint32_t        n_records;
+
+        if ( lq->n_rec_pools == 0 ) {
+            n_records = lq->base.params.records.min;
+        } else {
+            n_records = (lq->n_rec_free + lq->n_rec_used);
+            if ( lq->base.params.records.max ) {
+                n_records = lq->base.params.records.max - n_records;
+            } else {
+                n_records = UINT32_MAX - n_records;
+            }
+            if ( n_records == 0 ) {
+                *at_limit = true;
+                return NULL;
+            }
+            if ( n_records > lq->base.params.records.delta ) n_records = lq->base.params.records.delta;
+        }
+        if ( ! __log_queue_pool_add_pool(lq, n_records) ) return NULL;
+    }
+
+    /* Remove from the free queue: */
+    new_rec = lq->free_head;
+    lq->free_head = new_rec->link;
+    lq->n_rec_free--;
+
+    /* Add at the tail end of the queue: */
+    new_rec->link = NULL;
+    if ( lq->used_tail ) {
+        lq->used_tail->link = new_rec;
+        lq->used_tail = new_rec;
+    } else {
+        lq->used_head = lq->used_tail = new_rec;
+    }
+    lq->n_rec_used++;
+    return new_rec;
+}
+
+//
+
+static void
+__log_queue_pool_dealloc_head_record(
+    log_queue_pool_t    *lq
+)
+{
+    log_record_t        *old_rec = lq->used_head;
+
+    if ( old_rec ) {
+        /* Records are only ever consumed from the head of the used queue: */
+        if ( ! (lq->used_head = old_rec->link) ) lq->used_tail = NULL;
+
+        /* Prepend to the free chain: */
+        old_rec->link = lq->free_head;
+        lq->free_head = old_rec;
+        lq->n_rec_free++, lq->n_rec_used--;
+
+        /* Let anyone waiting to push know a record is free: */
+        __log_queue_wake_pushers(&lq->base, true);
+    }
+}
+
+//
+
+log_queue_t*
+__log_queue_pool_create(
+    log_queue_params_t  *params
+)
+{
+    return __log_queue_alloc(&log_queue_backend_pool_callbacks, params, sizeof(log_queue_pool_t));
+}
+
+//
+
+void
+__log_queue_pool_destroy(
+    log_queue_t     *lq
+)
+{
+    log_queue_pool_t    *LQ = (log_queue_pool_t*)lq;
+
+    /* Destroy all pools: */
+    while ( LQ->n_rec_pools > 0 ) free((void*)LQ->rec_pools[--LQ->n_rec_pools]);
+    if ( LQ->rec_pools ) free((void*)LQ->rec_pools);
+
+    __log_queue_dealloc(lq);
+}
+
+//
+
+void
+__log_queue_pool_summary(
+    log_queue_t     *lq
+)
+{
+    log_queue_pool_t    *LQ = (log_queue_pool_t*)lq;
+    log_record_t        *lrp;
+    log_data_strs_t     strs;
+
+    pthread_mutex_lock(&LQ->base.lock);
+    printf( "log_queue@%p {\n"
+            "    backend = pool\n"
+            "    n_rec = %lu / (%lu ≤ %lu ≤ %lu)\n"
+            "    n_rec_pools = %lu\n"
+            "    records = {\n",
+            LQ,
+            (unsigned long)LQ->n_rec_used,
+            (unsigned long)LQ->base.params.records.min,
+            (unsigned long)(LQ->n_rec_free + LQ->n_rec_used),
+            (unsigned long)LQ->base.params.records.max,
+            (unsigned long)LQ->n_rec_pools);
+
+    lrp = LQ->used_head;
+    while ( lrp ) {
+        log_data_to_strs(&lrp->data, &strs);
+        printf("        [%s] %-15s <= %15s:%hu (%s)\n",
+            strs.log_date,
+            strs.dst_ipaddr,
+            strs.src_ipaddr,
+            lrp->data.src_port,
+            lrp->data.uid);
+        lrp = lrp->link;
+    }
+    printf("}\n");
+    pthread_mutex_unlock(&LQ->base.lock);
+}
+
+//
+
+bool
+__log_queue_pool_try_push(
+    log_queue_t     *lq,
+    log_data_t      *data
+)
+{
+    log_queue_pool_t    *LQ = (log_queue_pool_t*)lq;
+    log_record_t        *new_record;
+    bool                at_limit;
+
+    pthread_mutex_lock(&LQ->base.lock);
+    if ( (new_record = __log_queue_pool_alloc_record(LQ, &at_limit)) ) {
+        memcpy(&new_record->data, data, sizeof(log_data_t));
+
+        /* Let anyone watching for data to become available wake up now... */
+        pthread_cond_broadcast(&LQ->base.data_ready);
+    }
+    pthread_mutex_unlock(&LQ->base.lock);
+    return (new_record != NULL);
+}
+
+//
+
+bool
+__log_queue_pool_has_space(
+    log_queue_t     *lq
+)
+{
+    log_queue_pool_t    *LQ = (log_queue_pool_t*)lq;
+
+    /* Called with the lock held: */
+    return (LQ->n_rec_free > 0) || (LQ->base.params.records.max == 0) ||
+           (LQ->n_rec_free + LQ->n_rec_used < LQ->base.params.records.max);
+}
+
+//
+
+bool
+__log_queue_pool_discard_oldest(
+    log_queue_t     *lq
+)
+{
+    log_queue_pool_t    *LQ = (log_queue_pool_t*)lq;
+    bool                rc = false;
+
+    pthread_mutex_lock(&LQ->base.lock);
+    if ( LQ->used_head ) {
+        __log_queue_pool_dealloc_head_record(LQ);
+        rc = true;
+    }
+    pthread_mutex_unlock(&LQ->base.lock);
+    return rc;
+}
+
+//
+
+bool
+__log_queue_pool_pop(
+    log_queue_t     *lq,
+    log_data_t      *data
+)
+{
+    log_queue_pool_t    *LQ = (log_queue_pool_t*)lq;
+    bool                rc = false;
+
+    pthread_mutex_lock(&LQ->base.lock);
+    if ( ! LQ->used_head ) {
+        INFO("log_queue_pop:  waiting on data...");
+        pthread_cond_wait(&LQ->base.data_ready, &LQ->base.lock);
+        INFO("log_queue_pop:  ...data is ready");
+    }
+    if ( LQ->used_head ) {
+        memcpy(data, &LQ->used_head->data, sizeof(log_data_t));
+        rc = true;
+        __log_queue_pool_dealloc_head_record(LQ);
+    }
+    pthread_mutex_unlock(&LQ->base.lock);
+    return rc;
+}
+
+//
+
+static size_t
+__log_queue_pool_drain(
+    log_queue_pool_t    *LQ,
+    log_data_t          *out,
+    size_t              max
+)
+{
+    size_t              n = 0;
+
+    while ( (n < max) && LQ->used_head ) {
+        memcpy(&out[n++], &LQ->used_head->data, sizeof(log_data_t));
+        __log_queue_pool_dealloc_head_record(LQ);
+    }
+    return n;
+}
+
+//
+
+size_t
+__log_queue_pool_pop_batch(
+    log_queue_t     *lq,
+    log_data_t      *out,
+    size_t          max,
+    int             timeout_ms
+)
+{
+    log_queue_pool_t    *LQ = (log_queue_pool_t*)lq;
+    unsigned int        n_interrupts;
+    size_t              n;
+
+    pthread_mutex_lock(&LQ->base.lock);
+    n_interrupts = LQ->base.n_interrupts_seen;
+    if ( ! LQ->used_head ) {
+        INFO("log_queue_pop_batch:  waiting on data...");
+        while ( ! LQ->used_head && (n_interrupts == LQ->base.n_interrupts) ) {
+            pthread_cond_wait(&LQ->base.data_ready, &LQ->base.lock);
+        }
+        INFO("log_queue_pop_batch:  ...data is ready");
+    }
+    n = __log_queue_pool_drain(LQ, out, max);
+    if ( (n > 0) && (n < max) && (timeout_ms > 0) ) {
+        struct timespec deadline;
+
+        /* Linger for more records until the batch fills or time runs out: */
+        __log_queue_deadline(&deadline, timeout_ms);
+        while ( (n < max) && (n_interrupts == LQ->base.n_interrupts) ) {
+            if ( pthread_cond_timedwait(&LQ->base.data_ready, &LQ->base.lock, &deadline) == ETIMEDOUT ) {
+                n += __log_queue_pool_drain(LQ, out + n, max - n);
+                break;
+            }
+            n += __log_queue_pool_drain(LQ, out + n, max - n);
+        }
+    }
+    LQ->base.n_interrupts_seen = LQ->base.n_interrupts;
+    pthread_mutex_unlock(&LQ->base.lock);
+    return n;
+}
+
+//
+
+size_t
+__log_queue_pool_try_pop_batch(
+    log_queue_t     *lq,
+    log_data_t      *out,
+    size_t          max
+)
+{
+    log_queue_pool_t    *LQ = (log_queue_pool_t*)lq;
+    size_t              n;
+
+    pthread_mutex_lock(&LQ->base.lock);
+    n = __log_queue_pool_drain(LQ, out, max);
+    pthread_mutex_unlock(&LQ->base.lock);
+    return n;
+}
+
+//
+
+void
+__log_queue_pool_interrupt_pop(
+    log_queue_t     *lq
+)
+{
+    __log_queue_interrupt_waiters(lq);
+}
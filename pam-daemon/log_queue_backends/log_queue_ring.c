@@ -0,0 +1,409 @@
+/*
+ * iptracking
+ * log_queue_ring.c
+ *
+ * Event-logging queue backend:  bounded multi-producer, multi-consumer
+ * ring of records.  Each slot carries a sequence number that tells
+ * producers and consumers whether it is ready to be written or read,
+ * so push and pop only contend on an atomic compare-and-swap of the
+ * tail or head index.  The mutex and condition variable in the base
+ * object are only used to park consumers when the ring is empty.
+ *
+ */
+
+#include <stdatomic.h>
+
+//
+
+/*
+ * Each slot starts on its own cache line (and the size is padded out to
+ * a whole number of them) so a producer filling one slot does not false
+ * share with a consumer draining its neighbour:
+ */
+typedef struct {
+    _Alignas(LOG_QUEUE_CACHELINE_SIZE) _Atomic size_t   sequence;
+    log_data_t                                          data;
+} log_queue_ring_slot_t;
+
+//
+
+typedef struct {
+    log_queue_t             base;
+    //
+    size_t                  capacity, mask;
+    log_queue_ring_slot_t   *slots;
+    //
+    _Atomic int             n_pop_waiters;
+    //
+    _Alignas(LOG_QUEUE_CACHELINE_SIZE) _Atomic size_t   head;   /* next slot to pop */
+    _Alignas(LOG_QUEUE_CACHELINE_SIZE) _Atomic size_t   tail;   /* next slot to push */
+} log_queue_ring_t;
+
+//
+
+static log_queue_t* __log_queue_ring_create(log_queue_params_t *params);
+static void __log_queue_ring_destroy(log_queue_t *lq);
+static void __log_queue_ring_summary(log_queue_t *lq);
+static bool __log_queue_ring_try_push_and_wake(log_queue_t *lq, log_data_t *data);
+static bool __log_queue_ring_has_space(log_queue_t *lq);
+static bool __log_queue_ring_discard_oldest(log_queue_t *lq);
+static bool __log_queue_ring_pop(log_queue_t *lq, log_data_t *data);
+static size_t __log_queue_ring_pop_batch(log_queue_t *lq, log_data_t *out, size_t max, int timeout_ms);
+static size_t __log_queue_ring_try_pop_batch(log_queue_t *lq, log_data_t *out, size_t max);
+static void __log_queue_ring_interrupt_pop(log_queue_t *lq);
+
+//
+
+static log_queue_backend_callbacks_t    log_queue_backend_ring_callbacks = {
+        .backend_name = "ring",
+
+        .create = __log_queue_ring_create,
+        .destroy = __log_queue_ring_destroy,
+        .summary = __log_queue_ring_summary,
+        .try_push = __log_queue_ring_try_push_and_wake,
+        .has_space = __log_queue_ring_has_space,
+        .discard_oldest = __log_queue_ring_discard_oldest,
+        .pop = __log_queue_ring_pop,
+        .pop_batch = __log_queue_ring_pop_batch,
+        .try_pop_batch = __log_queue_ring_try_pop_batch,
+        .interrupt_pop = __log_queue_ring_interrupt_pop
+    };
+
+//
+
+static bool
+__log_queue_ring_try_push(
+    log_queue_ring_t    *LQ,
+    log_data_t          *data
+)
+{
+    log_queue_ring_slot_t   *slot;
+    size_t                  pos = atomic_load_explicit(&LQ->tail, memory_order_relaxed);
+
+    while ( 1 ) {
+        size_t              seq;
+        intptr_t            dif;
+
+        slot = &LQ->slots[pos & LQ->mask];
+        seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        dif = (intptr_t)seq - (intptr_t)pos;
+        if ( dif == 0 ) {
+            /* Slot is free for this lap, try to claim it: */
+            if ( atomic_compare_exchange_weak_explicit(&LQ->tail, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed) ) break;
+        } else if ( dif < 0 ) {
+            /* Slot still holds a record from the previous lap, ring is full: */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&LQ->tail, memory_order_relaxed);
+        }
+    }
+    memcpy(&slot->data, data, sizeof(log_data_t));
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+//
+
+static bool
+__log_queue_ring_try_pop(
+    log_queue_ring_t    *LQ,
+    log_data_t          *data
+)
+{
+    log_queue_ring_slot_t   *slot;
+    size_t                  pos = atomic_load_explicit(&LQ->head, memory_order_relaxed);
+
+    while ( 1 ) {
+        size_t              seq;
+        intptr_t            dif;
+
+        slot = &LQ->slots[pos & LQ->mask];
+        seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if ( dif == 0 ) {
+            /* Slot holds a record for this lap, try to claim it: */
+            if ( atomic_compare_exchange_weak_explicit(&LQ->head, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed) ) break;
+        } else if ( dif < 0 ) {
+            /* Slot has not been written yet, ring is empty: */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&LQ->head, memory_order_relaxed);
+        }
+    }
+    memcpy(data, &slot->data, sizeof(log_data_t));
+    atomic_store_explicit(&slot->sequence, pos + LQ->mask + 1, memory_order_release);
+    return true;
+}
+
+//
+
+log_queue_t*
+__log_queue_ring_create(
+    log_queue_params_t  *params
+)
+{
+    log_queue_ring_t    *new_lq;
+    size_t              capacity = 1, n_records;
+
+    n_records = params->records.max ? params->records.max : params->records.min;
+    if ( n_records == 0 ) {
+        ERROR("log_queue_create:  ring backend requires a non-zero record count");
+        return NULL;
+    }
+    while ( capacity < n_records ) capacity <<= 1;
+
+    new_lq = (log_queue_ring_t*)__log_queue_alloc(&log_queue_backend_ring_callbacks, params, sizeof(log_queue_ring_t));
+    if ( new_lq ) {
+        if ( posix_memalign((void**)&new_lq->slots, LOG_QUEUE_CACHELINE_SIZE, capacity * sizeof(log_queue_ring_slot_t)) != 0 ) {
+            __log_queue_dealloc((log_queue_t*)new_lq);
+            return NULL;
+        }
+        memset(new_lq->slots, 0, capacity * sizeof(log_queue_ring_slot_t));
+        new_lq->capacity = capacity;
+        new_lq->mask = capacity - 1;
+        while ( capacity-- ) atomic_init(&new_lq->slots[capacity].sequence, capacity);
+        atomic_init(&new_lq->head, 0);
+        atomic_init(&new_lq->tail, 0);
+        atomic_init(&new_lq->n_pop_waiters, 0);
+        DEBUG("log_queue_create:  ring capacity %lu records", (unsigned long)new_lq->capacity);
+    }
+    return (log_queue_t*)new_lq;
+}
+
+//
+
+void
+__log_queue_ring_destroy(
+    log_queue_t     *lq
+)
+{
+    log_queue_ring_t    *LQ = (log_queue_ring_t*)lq;
+
+    if ( LQ->slots ) free((void*)LQ->slots);
+    __log_queue_dealloc(lq);
+}
+
+//
+
+void
+__log_queue_ring_summary(
+    log_queue_t     *lq
+)
+{
+    log_queue_ring_t    *LQ = (log_queue_ring_t*)lq;
+    size_t              head = atomic_load(&LQ->head);
+    size_t              tail = atomic_load(&LQ->tail);
+
+    /* The ring is not locked, so this is only a snapshot: */
+    printf( "log_queue@%p {\n"
+            "    backend = ring\n"
+            "    n_rec = %lu / %lu\n"
+            "    head = %lu, tail = %lu\n"
+            "    n_pop_waiters = %d\n"
+            "    records = {\n",
+            LQ,
+            (unsigned long)(tail - head),
+            (unsigned long)LQ->capacity,
+            (unsigned long)head, (unsigned long)tail,
+            atomic_load(&LQ->n_pop_waiters));
+    while ( head != tail ) {
+        log_data_t      *data = &LQ->slots[head & LQ->mask].data;
+        log_data_strs_t strs;
+
+        log_data_to_strs(data, &strs);
+        printf("        [%s] %-15s <= %15s:%hu (%s)\n",
+            strs.log_date,
+            strs.dst_ipaddr,
+            strs.src_ipaddr,
+            data->src_port,
+            data->uid);
+        head++;
+    }
+    printf("}\n");
+}
+
+//
+
+static void
+__log_queue_ring_wake(
+    log_queue_ring_t    *LQ
+)
+{
+    /* Only take the lock if a consumer is (or is about to be) parked; the
+     * fence pairs with the one in __log_queue_ring_pop() so that either the
+     * consumer sees the new record or we see the consumer: */
+    atomic_thread_fence(memory_order_seq_cst);
+    if ( atomic_load_explicit(&LQ->n_pop_waiters, memory_order_relaxed) > 0 ) {
+        pthread_mutex_lock(&LQ->base.lock);
+        pthread_cond_broadcast(&LQ->base.data_ready);
+        pthread_mutex_unlock(&LQ->base.lock);
+    }
+}
+
+//
+
+bool
+__log_queue_ring_try_push_and_wake(
+    log_queue_t     *lq,
+    log_data_t      *data
+)
+{
+    log_queue_ring_t    *LQ = (log_queue_ring_t*)lq;
+
+    if ( ! __log_queue_ring_try_push(LQ, data) ) return false;
+    __log_queue_ring_wake(LQ);
+    return true;
+}
+
+//
+
+bool
+__log_queue_ring_has_space(
+    log_queue_t     *lq
+)
+{
+    log_queue_ring_t    *LQ = (log_queue_ring_t*)lq;
+    size_t              pos = atomic_load_explicit(&LQ->tail, memory_order_relaxed);
+
+    /* The slot at the tail is free once its sequence has caught up to this lap: */
+    return atomic_load_explicit(&LQ->slots[pos & LQ->mask].sequence, memory_order_acquire) == pos;
+}
+
+//
+
+bool
+__log_queue_ring_discard_oldest(
+    log_queue_t     *lq
+)
+{
+    log_queue_ring_t    *LQ = (log_queue_ring_t*)lq;
+    log_data_t          discard;
+
+    if ( ! __log_queue_ring_try_pop(LQ, &discard) ) return false;
+    __log_queue_wake_pushers(lq, false);
+    return true;
+}
+
+//
+
+bool
+__log_queue_ring_pop(
+    log_queue_t     *lq,
+    log_data_t      *data
+)
+{
+    log_queue_ring_t    *LQ = (log_queue_ring_t*)lq;
+    bool                rc;
+
+    if ( __log_queue_ring_try_pop(LQ, data) ) {
+        __log_queue_wake_pushers(lq, false);
+        return true;
+    }
+
+    pthread_mutex_lock(&LQ->base.lock);
+    atomic_fetch_add_explicit(&LQ->n_pop_waiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    rc = __log_queue_ring_try_pop(LQ, data);
+    if ( ! rc ) {
+        INFO("log_queue_pop:  waiting on data...");
+        pthread_cond_wait(&LQ->base.data_ready, &LQ->base.lock);
+        INFO("log_queue_pop:  ...data is ready");
+        rc = __log_queue_ring_try_pop(LQ, data);
+    }
+    atomic_fetch_sub_explicit(&LQ->n_pop_waiters, 1, memory_order_relaxed);
+    if ( rc ) __log_queue_wake_pushers(lq, true);
+    pthread_mutex_unlock(&LQ->base.lock);
+    return rc;
+}
+
+//
+
+static size_t
+__log_queue_ring_drain(
+    log_queue_ring_t    *LQ,
+    log_data_t          *out,
+    size_t              max
+)
+{
+    size_t              n = 0;
+
+    while ( (n < max) && __log_queue_ring_try_pop(LQ, &out[n]) ) n++;
+    return n;
+}
+
+//
+
+size_t
+__log_queue_ring_pop_batch(
+    log_queue_t     *lq,
+    log_data_t      *out,
+    size_t          max,
+    int             timeout_ms
+)
+{
+    log_queue_ring_t    *LQ = (log_queue_ring_t*)lq;
+    unsigned int        n_interrupts;
+    struct timespec     deadline;
+    bool                has_deadline = false;
+    size_t              n = __log_queue_ring_drain(LQ, out, max);
+
+    if ( (n == max) || ((n > 0) && (timeout_ms == 0)) ) {
+        __log_queue_wake_pushers(lq, false);
+        return n;
+    }
+
+    /* Park until the batch fills, time runs out, or we're interrupted: */
+    pthread_mutex_lock(&LQ->base.lock);
+    n_interrupts = LQ->base.n_interrupts_seen;
+    atomic_fetch_add_explicit(&LQ->n_pop_waiters, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    while ( 1 ) {
+        n += __log_queue_ring_drain(LQ, out + n, max - n);
+        if ( (n == max) || (n_interrupts != LQ->base.n_interrupts) ) break;
+        if ( n == 0 ) {
+            pthread_cond_wait(&LQ->base.data_ready, &LQ->base.lock);
+        } else {
+            if ( timeout_ms == 0 ) break;
+            if ( ! has_deadline ) {
+                __log_queue_deadline(&deadline, timeout_ms);
+                has_deadline = true;
+            }
+            if ( pthread_cond_timedwait(&LQ->base.data_ready, &LQ->base.lock, &deadline) == ETIMEDOUT ) {
+                n += __log_queue_ring_drain(LQ, out + n, max - n);
+                break;
+            }
+        }
+    }
+    atomic_fetch_sub_explicit(&LQ->n_pop_waiters, 1, memory_order_relaxed);
+    LQ->base.n_interrupts_seen = LQ->base.n_interrupts;
+    if ( n > 0 ) __log_queue_wake_pushers(lq, true);
+    pthread_mutex_unlock(&LQ->base.lock);
+    return n;
+}
+
+//
+
+size_t
+__log_queue_ring_try_pop_batch(
+    log_queue_t     *lq,
+    log_data_t      *out,
+    size_t          max
+)
+{
+    size_t              n = __log_queue_ring_drain((log_queue_ring_t*)lq, out, max);
+
+    if ( n > 0 ) __log_queue_wake_pushers(lq, false);
+    return n;
+}
+
+//
+
+void
+__log_queue_ring_interrupt_pop(
+    log_queue_t     *lq
+)
+{
+    __log_queue_interrupt_waiters(lq);
+}
@@ -0,0 +1,541 @@
+/*
+ * iptracking
+ * log_spool.c
+ *
+ * Persistent on-disk event spool API.
+ *
+ */
+
+#include "log_spool.h"
+
+#include <stddef.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+//
+
+#define LOG_SPOOL_SEGMENT_MAGIC         0x53505449  /* "ITPS" little-endian */
+#define LOG_SPOOL_SEGMENT_VERSION       1
+#define LOG_SPOOL_SEGMENT_PREFIX        "segment."
+#define LOG_SPOOL_RECORD_MARKER         0x4c4f4721  /* written after the data and CRC */
+
+//
+
+/*
+ * Segment file header.  Everything up to header_crc is fixed when the
+ * segment is created; n_consumed is updated as records are replayed.
+ */
+typedef struct {
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            record_size;
+    uint32_t            capacity;
+    uint32_t            reserved;
+    uint64_t            sequence;
+    uint32_t            header_crc;
+    uint32_t            n_consumed;
+    uint8_t             pad[32];
+} log_spool_segment_header_t;
+
+typedef struct {
+    uint32_t            marker;
+    uint32_t            crc;
+    log_data_t          data;
+} log_spool_record_t;
+
+//
+
+typedef struct log_spool_segment {
+    struct log_spool_segment    *link;
+    uint64_t                    sequence;
+    size_t                      map_size;
+    log_spool_segment_header_t  *header;
+    log_spool_record_t          *records;
+    uint32_t                    capacity, n_written;
+} log_spool_segment_t;
+
+//
+
+typedef struct log_spool {
+    pthread_mutex_t             lock;
+    const char                  *directory;
+    uint32_t                    segment_records, max_segments;
+    //
+    uint32_t                    n_segments;
+    log_spool_segment_t         *head, *tail;
+    uint64_t                    next_sequence;
+    uint64_t                    n_records;
+} log_spool_t;
+
+//
+
+static uint32_t __log_spool_crc_table[256];
+
+static void
+__log_spool_crc_init(void)
+{
+    uint32_t            i, j, c;
+
+    for ( i = 0; i < 256; i++ ) {
+        c = i;
+        for ( j = 0; j < 8; j++ ) c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        __log_spool_crc_table[i] = c;
+    }
+}
+
+static pthread_once_t __log_spool_crc_once = PTHREAD_ONCE_INIT;
+
+//
+
+static uint32_t
+__log_spool_crc32(
+    const void      *buffer,
+    size_t          length
+)
+{
+    const uint8_t   *p = (const uint8_t*)buffer;
+    uint32_t        c = 0xFFFFFFFF;
+
+    while ( length-- ) c = __log_spool_crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFF;
+}
+
+//
+
+static char*
+__log_spool_segment_path(
+    log_spool_t     *spool,
+    uint64_t        sequence
+)
+{
+    char            *path = NULL;
+
+    if ( asprintf(&path, "%s/" LOG_SPOOL_SEGMENT_PREFIX "%016llx", spool->directory, (unsigned long long)sequence) < 0 ) return NULL;
+    return path;
+}
+
+//
+
+static size_t
+__log_spool_segment_map_size(
+    uint32_t        capacity
+)
+{
+    return sizeof(log_spool_segment_header_t) + (size_t)capacity * sizeof(log_spool_record_t);
+}
+
+//
+
+static void
+__log_spool_segment_free(
+    log_spool_segment_t *segment
+)
+{
+    if ( segment->header ) munmap((void*)segment->header, segment->map_size);
+    free((void*)segment);
+}
+
+//
+
+/*
+ * Map segment <sequence>; if <create> is true the file must not exist
+ * and is created and initialized, otherwise the existing file's header
+ * is validated and its valid records counted.
+ */
+static log_spool_segment_t*
+__log_spool_segment_map(
+    log_spool_t     *spool,
+    uint64_t        sequence,
+    bool            create
+)
+{
+    log_spool_segment_t *segment = NULL;
+    char                *path = __log_spool_segment_path(spool, sequence);
+    int                 fd = -1;
+    void                *base = MAP_FAILED;
+    size_t              map_size;
+
+    if ( ! path ) return NULL;
+
+    if ( create ) {
+        map_size = __log_spool_segment_map_size(spool->segment_records);
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if ( fd < 0 ) {
+            ERROR("log_spool:  unable to create segment %s (errno=%d)", path, errno);
+            goto early_exit;
+        }
+        /* Reserve the blocks now rather than risk SIGBUS on a full disk later: */
+        if ( (errno = posix_fallocate(fd, 0, map_size)) != 0 ) {
+            ERROR("log_spool:  unable to allocate segment %s (errno=%d)", path, errno);
+            goto early_exit;
+        }
+    } else {
+        struct stat     finfo;
+
+        fd = open(path, O_RDWR | O_CLOEXEC);
+        if ( fd < 0 ) {
+            ERROR("log_spool:  unable to open segment %s (errno=%d)", path, errno);
+            goto early_exit;
+        }
+        if ( (fstat(fd, &finfo) != 0) || (finfo.st_size < sizeof(log_spool_segment_header_t)) ) {
+            ERROR("log_spool:  segment %s is truncated", path);
+            goto early_exit;
+        }
+        map_size = finfo.st_size;
+    }
+    base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if ( base == MAP_FAILED ) {
+        ERROR("log_spool:  unable to map segment %s (errno=%d)", path, errno);
+        goto early_exit;
+    }
+
+    segment = (log_spool_segment_t*)calloc(1, sizeof(log_spool_segment_t));
+    if ( ! segment ) goto early_exit;
+    segment->sequence = sequence;
+    segment->map_size = map_size;
+    segment->header = (log_spool_segment_header_t*)base;
+    segment->records = (log_spool_record_t*)(segment->header + 1);
+    base = MAP_FAILED;
+
+    if ( create ) {
+        segment->header->magic = LOG_SPOOL_SEGMENT_MAGIC;
+        segment->header->version = LOG_SPOOL_SEGMENT_VERSION;
+        segment->header->record_size = sizeof(log_spool_record_t);
+        segment->header->capacity = spool->segment_records;
+        segment->header->sequence = sequence;
+        segment->header->header_crc = __log_spool_crc32(segment->header, offsetof(log_spool_segment_header_t, header_crc));
+        segment->header->n_consumed = 0;
+        segment->capacity = spool->segment_records;
+    } else {
+        log_spool_segment_header_t  *header = segment->header;
+
+        if ( (header->magic != LOG_SPOOL_SEGMENT_MAGIC) ||
+             (header->version != LOG_SPOOL_SEGMENT_VERSION) ||
+             (header->record_size != sizeof(log_spool_record_t)) ||
+             (header->sequence != sequence) ||
+             (header->header_crc != __log_spool_crc32(header, offsetof(log_spool_segment_header_t, header_crc))) ||
+             (map_size < __log_spool_segment_map_size(header->capacity)) )
+        {
+            ERROR("log_spool:  segment %s has an invalid header", path);
+            __log_spool_segment_free(segment);
+            segment = NULL;
+            goto early_exit;
+        }
+        /* Records are written in order, so the valid ones form a prefix: */
+        while ( segment->n_written < header->capacity ) {
+            log_spool_record_t      *record = &segment->records[segment->n_written];
+
+            if ( (record->marker != LOG_SPOOL_RECORD_MARKER) ||
+                 (record->crc != __log_spool_crc32(&record->data, sizeof(log_data_t))) ) break;
+            segment->n_written++;
+        }
+        if ( segment->n_written < header->capacity ) {
+            log_spool_record_t      *record = &segment->records[segment->n_written];
+
+            if ( record->marker || record->crc ) WARN("log_spool:  discarding torn record %u in segment %s", segment->n_written, path);
+        }
+        if ( header->n_consumed > segment->n_written ) header->n_consumed = segment->n_written;
+    }
+
+early_exit:
+    if ( base != MAP_FAILED ) munmap(base, map_size);
+    if ( fd >= 0 ) close(fd);
+    if ( create && ! segment ) unlink(path);
+    free((void*)path);
+    return segment;
+}
+
+//
+
+static void
+__log_spool_segment_retire(
+    log_spool_t         *spool,
+    log_spool_segment_t *segment
+)
+{
+    char                *path = __log_spool_segment_path(spool, segment->sequence);
+
+    DEBUG("log_spool:  retiring segment %016llx", (unsigned long long)segment->sequence);
+    if ( path ) {
+        if ( unlink(path) != 0 ) ERROR("log_spool:  unable to remove segment %s (errno=%d)", path, errno);
+        free((void*)path);
+    }
+    __log_spool_segment_free(segment);
+}
+
+//
+
+/*
+ * Append <segment> to the spool's list of segments.
+ */
+static void
+__log_spool_segment_link(
+    log_spool_t         *spool,
+    log_spool_segment_t *segment
+)
+{
+    if ( spool->tail ) {
+        spool->tail->link = segment;
+    } else {
+        spool->head = segment;
+    }
+    spool->tail = segment;
+    spool->n_segments++;
+    spool->n_records += segment->n_written - segment->header->n_consumed;
+    if ( segment->sequence >= spool->next_sequence ) spool->next_sequence = segment->sequence + 1;
+}
+
+//
+
+static int
+__log_spool_sequence_cmp(
+    const void      *a,
+    const void      *b
+)
+{
+    uint64_t        A = *(const uint64_t*)a, B = *(const uint64_t*)b;
+
+    return (A < B) ? -1 : ((A > B) ? 1 : 0);
+}
+
+//
+
+static bool
+__log_spool_recover(
+    log_spool_t     *spool
+)
+{
+    DIR             *dir = opendir(spool->directory);
+    struct dirent   *entry;
+    uint64_t        *sequences = NULL;
+    size_t          n_sequences = 0, n_alloc = 0, i;
+
+    if ( ! dir ) {
+        ERROR("log_spool:  unable to open directory %s (errno=%d)", spool->directory, errno);
+        return false;
+    }
+    while ( (entry = readdir(dir)) ) {
+        const char  *s = entry->d_name;
+        char        *endptr;
+        uint64_t    sequence;
+
+        if ( strncmp(s, LOG_SPOOL_SEGMENT_PREFIX, strlen(LOG_SPOOL_SEGMENT_PREFIX)) != 0 ) continue;
+        s += strlen(LOG_SPOOL_SEGMENT_PREFIX);
+        sequence = strtoull(s, &endptr, 16);
+        if ( (endptr == s) || *endptr ) continue;
+        if ( n_sequences == n_alloc ) {
+            uint64_t    *new_sequences = (uint64_t*)realloc(sequences, (n_alloc + 32) * sizeof(uint64_t));
+
+            if ( ! new_sequences ) {
+                closedir(dir);
+                free((void*)sequences);
+                return false;
+            }
+            sequences = new_sequences;
+            n_alloc += 32;
+        }
+        sequences[n_sequences++] = sequence;
+    }
+    closedir(dir);
+
+    /* Replay order is segment creation order: */
+    qsort(sequences, n_sequences, sizeof(uint64_t), __log_spool_sequence_cmp);
+    for ( i = 0; i < n_sequences; i++ ) {
+        log_spool_segment_t *segment = __log_spool_segment_map(spool, sequences[i], false);
+
+        if ( ! segment ) {
+            /* Leave it in place for someone to inspect, but never reuse its name: */
+            if ( sequences[i] >= spool->next_sequence ) spool->next_sequence = sequences[i] + 1;
+            continue;
+        }
+        if ( segment->header->n_consumed == segment->n_written ) {
+            __log_spool_segment_retire(spool, segment);
+            if ( sequences[i] >= spool->next_sequence ) spool->next_sequence = sequences[i] + 1;
+        } else {
+            /* Never append to a recovered segment: */
+            segment->capacity = segment->n_written;
+            __log_spool_segment_link(spool, segment);
+        }
+    }
+    free((void*)sequences);
+    return true;
+}
+
+//
+
+log_spool_ref
+log_spool_open(
+    const char  *directory,
+    uint32_t    segment_records,
+    uint32_t    max_segments
+)
+{
+    log_spool_t *new_spool;
+    size_t      directory_len = strlen(directory);
+
+    if ( segment_records == 0 ) {
+        ERROR("log_spool_open:  segment record count must be non-zero");
+        return NULL;
+    }
+    if ( (mkdir(directory, 0700) != 0) && (errno != EEXIST) ) {
+        ERROR("log_spool_open:  unable to create directory %s (errno=%d)", directory, errno);
+        return NULL;
+    }
+    pthread_once(&__log_spool_crc_once, __log_spool_crc_init);
+
+    new_spool = (log_spool_t*)calloc(1, sizeof(log_spool_t) + directory_len + 1);
+    if ( new_spool ) {
+        new_spool->directory = (const char*)(new_spool + 1);
+        memcpy((char*)new_spool->directory, directory, directory_len + 1);
+        new_spool->segment_records = segment_records;
+        new_spool->max_segments = max_segments;
+        pthread_mutex_init(&new_spool->lock, NULL);
+        if ( ! __log_spool_recover(new_spool) ) {
+            log_spool_close(&new_spool);
+            return NULL;
+        }
+        INFO("log_spool_open:  %s holds %llu unconsumed records in %u segments",
+                directory, (unsigned long long)new_spool->n_records, new_spool->n_segments);
+    }
+    return new_spool;
+}
+
+//
+
+void
+log_spool_close(
+    log_spool_ref   *spool
+)
+{
+    if ( spool && *spool ) {
+        log_spool_t         *SPOOL = *spool;
+
+        while ( SPOOL->head ) {
+            log_spool_segment_t *segment = SPOOL->head;
+
+            SPOOL->head = segment->link;
+            msync((void*)segment->header, segment->map_size, MS_SYNC);
+            __log_spool_segment_free(segment);
+        }
+        pthread_mutex_destroy(&SPOOL->lock);
+        free((void*)SPOOL);
+        *spool = NULL;
+    }
+}
+
+//
+
+uint64_t
+log_spool_count(
+    log_spool_ref   spool
+)
+{
+    uint64_t        n_records;
+
+    pthread_mutex_lock(&spool->lock);
+    n_records = spool->n_records;
+    pthread_mutex_unlock(&spool->lock);
+    return n_records;
+}
+
+//
+
+log_spool_push_result_t
+log_spool_push(
+    log_spool_ref   spool,
+    log_data_t      *data,
+    bool            only_if_nonempty
+)
+{
+    log_spool_push_result_t rc = log_spool_push_ok;
+
+    pthread_mutex_lock(&spool->lock);
+    if ( only_if_nonempty && (spool->n_records == 0) ) {
+        rc = log_spool_push_is_empty;
+    } else {
+        log_spool_segment_t *segment = spool->tail;
+
+        if ( ! segment || (segment->n_written == segment->capacity) ) {
+            if ( spool->max_segments && (spool->n_segments >= spool->max_segments) ) {
+                rc = log_spool_push_is_full;
+            } else if ( (segment = __log_spool_segment_map(spool, spool->next_sequence, true)) ) {
+                DEBUG("log_spool_push:  started segment %016llx", (unsigned long long)segment->sequence);
+                __log_spool_segment_link(spool, segment);
+            } else {
+                rc = log_spool_push_error;
+            }
+        }
+        if ( rc == log_spool_push_ok ) {
+            log_spool_record_t  *record = &segment->records[segment->n_written++];
+
+            memcpy(&record->data, data, sizeof(log_data_t));
+            record->crc = __log_spool_crc32(&record->data, sizeof(log_data_t));
+            record->marker = LOG_SPOOL_RECORD_MARKER;
+            spool->n_records++;
+
+            /* Start writeback of a full segment now rather than at close: */
+            if ( segment->n_written == segment->capacity ) msync((void*)segment->header, segment->map_size, MS_ASYNC);
+        }
+    }
+    pthread_mutex_unlock(&spool->lock);
+    return rc;
+}
+
+//
+
+size_t
+log_spool_peek_batch(
+    log_spool_ref   spool,
+    log_data_t      *out,
+    size_t          max
+)
+{
+    log_spool_segment_t *segment;
+    size_t              n = 0;
+
+    pthread_mutex_lock(&spool->lock);
+    segment = spool->head;
+    while ( segment && (n < max) ) {
+        uint32_t        i = segment->header->n_consumed;
+
+        while ( (i < segment->n_written) && (n < max) ) {
+            memcpy(&out[n], &segment->records[i++].data, sizeof(log_data_t));
+            /* Spools written before the version 2 record hold version 1 records (already validated): */
+            if ( out[n].marker ) log_data_import(&out[n]);
+            n++;
+        }
+        segment = segment->link;
+    }
+    pthread_mutex_unlock(&spool->lock);
+    return n;
+}
+
+//
+
+void
+log_spool_consume(
+    log_spool_ref   spool,
+    size_t          n_records
+)
+{
+    pthread_mutex_lock(&spool->lock);
+    while ( spool->head && (n_records > 0) ) {
+        log_spool_segment_t *segment = spool->head;
+        uint32_t            n = segment->n_written - segment->header->n_consumed;
+
+        if ( n > n_records ) n = n_records;
+        segment->header->n_consumed += n;
+        spool->n_records -= n;
+        n_records -= n;
+
+        /* A segment that can take no more records is done once it has been replayed: */
+        if ( (segment->header->n_consumed == segment->n_written) && (segment->n_written == segment->capacity) ) {
+            if ( ! (spool->head = segment->link) ) spool->tail = NULL;
+            spool->n_segments--;
+            __log_spool_segment_retire(spool, segment);
+        } else if ( n == 0 ) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&spool->lock);
+}
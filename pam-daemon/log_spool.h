@@ -0,0 +1,115 @@
+/*
+ * iptracking
+ * log_spool.h
+ *
+ * Persistent on-disk event spool API.
+ *
+ */
+
+#ifndef __LOG_SPOOL_H__
+#define __LOG_SPOOL_H__
+
+#include "iptracking.h"
+#include "log_data.h"
+#include "logging.h"
+
+/*!
+ * @typedef log_spool_ref
+ *
+ * Opaque pointer to a log_spool data structure.  All fields are
+ * internal to the implementation of this API and not visible
+ * directly to external code.
+ *
+ * A spool is a directory of fixed-size segment files, each of which
+ * is memory-mapped and holds a header followed by an array of event
+ * records.  Each record carries a CRC-32 of its data so that a record
+ * torn by a crash is detected (and discarded) when the spool is
+ * reopened.  Records are replayed in the order they were pushed; once
+ * every record in a segment has been consumed the segment file is
+ * removed.
+ *
+ * All functions are safe to call from multiple threads.
+ */
+typedef struct log_spool * log_spool_ref;
+
+/*!
+ * @enum log_spool_push_result
+ *
+ * Outcome of a log_spool_push() call.
+ *
+ * @constant log_spool_push_ok          the record was added to the spool
+ * @constant log_spool_push_is_empty    the spool was empty and the caller
+ *                                      asked that the record only be added
+ *                                      to a non-empty spool
+ * @constant log_spool_push_is_full     the spool has reached its maximum
+ *                                      number of segments
+ * @constant log_spool_push_error       a new segment could not be created
+ */
+typedef enum log_spool_push_result {
+    log_spool_push_ok = 0,
+    log_spool_push_is_empty,
+    log_spool_push_is_full,
+    log_spool_push_error
+} log_spool_push_result_t;
+
+/*!
+ * @function log_spool_open
+ *
+ * Open (creating if necessary) the spool in <directory>.  Each segment
+ * file holds <segment_records> records and at most <max_segments>
+ * segments will exist at once; a <max_segments> of zero implies no
+ * limit.  Any records left in the spool by a previous run are
+ * recovered and will be replayed first.
+ *
+ * Returns NULL if any error occurs, a log_spool_ref if successful.
+ */
+log_spool_ref log_spool_open(const char *directory, uint32_t segment_records, uint32_t max_segments);
+
+/*!
+ * @function log_spool_close
+ *
+ * Flush *<spool> to disk and dispose of it; unconsumed records remain
+ * in the spool directory for the next log_spool_open().
+ */
+void log_spool_close(log_spool_ref *spool);
+
+/*!
+ * @function log_spool_count
+ *
+ * Returns the number of records in <spool> that have not yet been
+ * consumed.
+ */
+uint64_t log_spool_count(log_spool_ref spool);
+
+/*!
+ * @function log_spool_push
+ *
+ * Append a copy of *<data> to <spool>.  If <only_if_nonempty> is true
+ * and <spool> holds no unconsumed records, nothing is added and
+ * log_spool_push_is_empty is returned; the check and the append happen
+ * atomically, so callers can use this to keep newer events behind
+ * records already in the spool.
+ */
+log_spool_push_result_t log_spool_push(log_spool_ref spool, log_data_t *data, bool only_if_nonempty);
+
+/*!
+ * @function log_spool_peek_batch
+ *
+ * Copy up to <max> of the oldest unconsumed records in <spool> to the
+ * array <out> without consuming them.  Version 1 records left by an
+ * older daemon are converted to the current version.
+ *
+ * Returns the number of records copied to <out>.
+ */
+size_t log_spool_peek_batch(log_spool_ref spool, log_data_t *out, size_t max);
+
+/*!
+ * @function log_spool_consume
+ *
+ * Mark the <n_records> oldest unconsumed records in <spool> as
+ * consumed, typically after a log_spool_peek_batch() of at least that
+ * many records has been handled.
+ */
+void log_spool_consume(log_spool_ref spool, size_t n_records);
+
+#endif /* __LOG_SPOOL_H__ */
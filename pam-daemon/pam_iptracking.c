@@ -0,0 +1,237 @@
+/*
+ * iptracking
+ * pam_iptracking.c
+ *
+ * PAM module that sends events straight to the daemon, without the
+ * fork and exec of pam_exec.so and the callback program.
+ *
+ * Arguments (all optional):
+ *
+ *     socket=<path>            socket file the daemon is monitoring
+ *     socket-type=<type>       stream, seqpacket, or dgram
+ *     timeout=<ms>             milliseconds allowed per event
+ *     drop-directory=<path>    where to leave events the daemon could
+ *                              not be reached to receive
+ *     debug                    log each event delivered
+ *
+ */
+
+#include "iptracking.h"
+#include "log_client.h"
+#include "log_drop.h"
+
+#include <syslog.h>
+#include <security/pam_modules.h>
+#include <security/pam_ext.h>
+
+//
+
+/*
+ * Name under which the client is cached on the PAM handle:
+ */
+#define PAM_IPTRACKING_CLIENT_KEY       "pam_iptracking.client"
+
+//
+
+typedef struct {
+    const char      *socket_filepath;
+    socket_type_t   socket_type;
+    int             timeout_ms;
+    const char      *drop_directory;
+    bool            is_debug;
+} pam_iptracking_options_t;
+
+//
+
+static bool
+__pam_iptracking_parse_options(
+    pam_handle_t                *pamh,
+    int                         argc,
+    const char                  **argv,
+    pam_iptracking_options_t    *options
+)
+{
+    options->socket_filepath = SOCKET_FILEPATH_DEFAULT;
+    options->socket_type = socket_type_parse_str(SOCKET_DEFAULT_TYPE);
+    options->timeout_ms = PAM_MODULE_DEFAULT_TIMEOUT_MS;
+    options->drop_directory = DROP_DIRECTORY_DEFAULT;
+    options->is_debug = false;
+
+    while ( argc-- > 0 ) {
+        const char  *arg = *argv++;
+
+        if ( strncmp(arg, "socket=", 7) == 0 ) {
+            options->socket_filepath = arg + 7;
+        } else if ( strncmp(arg, "socket-type=", 12) == 0 ) {
+            if ( (options->socket_type = socket_type_parse_str(arg + 12)) == socket_type_max ) {
+                pam_syslog(pamh, LOG_ERR, "invalid socket type: %s", arg + 12);
+                return false;
+            }
+        } else if ( strncmp(arg, "timeout=", 8) == 0 ) {
+            char    *endptr;
+            long    i = strtol(arg + 8, &endptr, 0);
+
+            if ( (endptr == arg + 8) || *endptr ) {
+                pam_syslog(pamh, LOG_ERR, "invalid timeout: %s", arg + 8);
+                return false;
+            }
+            if ( i < 0 ) i = 0;
+            else if ( i > INT_MAX ) i = INT_MAX;
+            options->timeout_ms = i;
+        } else if ( strncmp(arg, "drop-directory=", 15) == 0 ) {
+            options->drop_directory = arg + 15;
+        } else if ( strcmp(arg, "debug") == 0 ) {
+            options->is_debug = true;
+        } else {
+            pam_syslog(pamh, LOG_ERR, "unknown option: %s", arg);
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+
+static void
+__pam_iptracking_client_cleanup(
+    pam_handle_t    *pamh,
+    void            *data,
+    int             error_status
+)
+{
+    log_client_ref  client = (log_client_ref)data;
+
+    log_client_destroy(&client);
+}
+
+//
+
+/*
+ * The client (and its socket) lives on the PAM handle, so the auth,
+ * open_session, and close_session events of one login share it.
+ */
+static log_client_ref
+__pam_iptracking_get_client(
+    pam_handle_t                *pamh,
+    pam_iptracking_options_t    *options
+)
+{
+    const void                  *cached = NULL;
+    log_client_ref              client;
+
+    if ( (pam_get_data(pamh, PAM_IPTRACKING_CLIENT_KEY, &cached) == PAM_SUCCESS) && cached ) return (log_client_ref)cached;
+    if ( ! (client = log_client_create(options->socket_filepath, options->socket_type, options->timeout_ms)) ) {
+        pam_syslog(pamh, LOG_ERR, "unable to create client for socket %s", options->socket_filepath);
+        return NULL;
+    }
+    if ( pam_set_data(pamh, PAM_IPTRACKING_CLIENT_KEY, client, __pam_iptracking_client_cleanup) != PAM_SUCCESS ) {
+        /* Still usable for this one event: */
+        pam_syslog(pamh, LOG_WARNING, "unable to cache client on PAM handle");
+    }
+    return client;
+}
+
+//
+
+/*
+ * Build and send the event.  Failures are logged but never affect the
+ * outcome of the PAM stack.
+ */
+static int
+__pam_iptracking_log_event(
+    pam_handle_t    *pamh,
+    const char      *pam_type,
+    int             argc,
+    const char      **argv
+)
+{
+    pam_iptracking_options_t    options;
+    log_client_ref              client;
+    log_data_t                  data;
+    const void                  *item;
+    const char                  *pam_user = NULL, *rhost = NULL, *ssh_connection;
+    int                         rc;
+
+    if ( ! __pam_iptracking_parse_options(pamh, argc, argv, &options) ) return PAM_IGNORE;
+
+    if ( pam_get_item(pamh, PAM_USER, &item) == PAM_SUCCESS ) pam_user = (const char*)item;
+    if ( pam_get_item(pamh, PAM_RHOST, &item) == PAM_SUCCESS ) rhost = (const char*)item;
+    if ( ! (ssh_connection = pam_getenv(pamh, "SSH_CONNECTION")) ) ssh_connection = getenv("SSH_CONNECTION");
+
+    /* The module runs inside sshd itself: */
+    if ( (rc = log_client_fill_event(&data, pam_type, pam_user, getpid(), ssh_connection, rhost)) ) {
+        pam_syslog(pamh, LOG_ERR, "unable to build %s event (code %d)", pam_type, rc);
+        return PAM_IGNORE;
+    }
+    if ( ! (client = __pam_iptracking_get_client(pamh, &options)) ) return PAM_IGNORE;
+    if ( (rc = log_client_send(client, &data)) ) {
+        if ( ! *options.drop_directory ) {
+            pam_syslog(pamh, LOG_ERR, "unable to send %s event to %s (errno=%d)", pam_type, options.socket_filepath, rc);
+        } else if ( (rc = log_drop_write(options.drop_directory, &data)) ) {
+            pam_syslog(pamh, LOG_ERR, "unable to send %s event to %s or drop it in %s (errno=%d)", pam_type, options.socket_filepath, options.drop_directory, rc);
+        } else {
+            pam_syslog(pamh, LOG_WARNING, "dropped %s event in %s, daemon unreachable", pam_type, options.drop_directory);
+        }
+    } else if ( options.is_debug ) {
+        char            src_ipaddr[LOG_DATA_ADDR_STRLEN];
+
+        pam_syslog(pamh, LOG_DEBUG, "sent %s event for %s from %s", pam_type, data.uid,
+                log_data_addr_to_str(data.src_family, data.src_addr, src_ipaddr));
+    }
+
+    /* Without a cache the client was only good for this event: */
+    if ( pam_get_data(pamh, PAM_IPTRACKING_CLIENT_KEY, &item) != PAM_SUCCESS ) log_client_destroy(&client);
+    return PAM_IGNORE;
+}
+
+//
+
+PAM_EXTERN int
+pam_sm_authenticate(
+    pam_handle_t    *pamh,
+    int             flags,
+    int             argc,
+    const char      **argv
+)
+{
+    return __pam_iptracking_log_event(pamh, "auth", argc, argv);
+}
+
+//
+
+PAM_EXTERN int
+pam_sm_setcred(
+    pam_handle_t    *pamh,
+    int             flags,
+    int             argc,
+    const char      **argv
+)
+{
+    return PAM_IGNORE;
+}
+
+//
+
+PAM_EXTERN int
+pam_sm_open_session(
+    pam_handle_t    *pamh,
+    int             flags,
+    int             argc,
+    const char      **argv
+)
+{
+    return __pam_iptracking_log_event(pamh, "open_session", argc, argv);
+}
+
+//
+
+PAM_EXTERN int
+pam_sm_close_session(
+    pam_handle_t    *pamh,
+    int             flags,
+    int             argc,
+    const char      **argv
+)
+{
+    return __pam_iptracking_log_event(pamh, "close_session", argc, argv);
+}
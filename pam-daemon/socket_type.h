@@ -0,0 +1,93 @@
+/*
+ * iptracking
+ * socket_type.h
+ *
+ * Socket types shared by the daemon and the PAM callback.
+ *
+ */
+
+#ifndef __SOCKET_TYPE_H__
+#define __SOCKET_TYPE_H__
+
+#include "iptracking.h"
+
+#include <sys/socket.h>
+
+/*!
+ * @enum socket_type
+ *
+ * The kinds of Unix socket over which the PAM callback can deliver
+ * events to the daemon.  Every event is exactly sizeof(log_data_t)
+ * bytes, so the message-oriented types need no further framing.
+ *
+ * @constant socket_type_stream     SOCK_STREAM:  connect, send, and close
+ *                                  per event
+ * @constant socket_type_seqpacket  SOCK_SEQPACKET:  connect, send, and
+ *                                  close per event, but each event
+ *                                  arrives as a single message
+ * @constant socket_type_dgram      SOCK_DGRAM:  one sendto() per event,
+ *                                  no connection at all
+ */
+typedef enum socket_type {
+    socket_type_stream = 0,
+    socket_type_seqpacket,
+    socket_type_dgram,
+    socket_type_max
+} socket_type_t;
+
+/*!
+ * @function socket_type_to_str
+ *
+ * Return a C string representation of the <type> or NULL if the
+ * <type> is not valid.
+ */
+static inline
+const char* socket_type_to_str(
+    socket_type_t   type
+)
+{
+    switch ( type ) {
+        case socket_type_stream: return "stream";
+        case socket_type_seqpacket: return "seqpacket";
+        case socket_type_dgram: return "dgram";
+        default: return NULL;
+    }
+    return NULL;
+}
+
+/*!
+ * @function socket_type_parse_str
+ *
+ * Parse a C-string representation of a socket type (in <type_str>)
+ * and return the proper value from the socket_type enumeration, or
+ * socket_type_max otherwise.
+ */
+static inline
+socket_type_t socket_type_parse_str(
+    const char  *type_str
+)
+{
+    if ( strcasecmp(type_str, "stream") == 0 ) return socket_type_stream;
+    if ( strcasecmp(type_str, "seqpacket") == 0 ) return socket_type_seqpacket;
+    if ( strcasecmp(type_str, "dgram") == 0 ) return socket_type_dgram;
+    return socket_type_max;
+}
+
+/*!
+ * @function socket_type_to_sock
+ *
+ * Return the SOCK_* constant for socket(2) corresponding to <type>.
+ */
+static inline
+int socket_type_to_sock(
+    socket_type_t   type
+)
+{
+    switch ( type ) {
+        case socket_type_seqpacket: return SOCK_SEQPACKET;
+        case socket_type_dgram: return SOCK_DGRAM;
+        default: return SOCK_STREAM;
+    }
+}
+
+#endif /* __SOCKET_TYPE_H__ */